@@ -0,0 +1,219 @@
+#include "blkdev.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <assert.h>
+
+/* sparse images of more than 2^32 blocks (2.5 TiB), so block numbers
+ * past either 32-bit limit get used; only the blocks written take space
+ */
+#define BIG (5LL << 30)
+
+struct blkdev *new_image(char *path, blkno_t nblks){
+	FILE *fp = fopen(path, "w");
+	assert(fp != NULL);
+	assert(ftruncate(fileno(fp), nblks * BLOCK_SIZE) == 0);
+	fclose(fp);
+	return image_create(path);
+}
+
+/* blocks hold "seq:lba" */
+void fill(struct blkdev *dev, blkno_t lba, int len, int seq){
+	char buf[64*BLOCK_SIZE];
+	assert(len <= 64);
+	memset(buf, 0, sizeof(buf));
+	for (int i = 0; i < len; i++)
+		sprintf(&buf[i*BLOCK_SIZE], "%d:%lld", seq, lba + i);
+	if (blkdev_write(dev, lba, len, buf) != SUCCESS) {
+		printf("Write at %lld failed!\n", lba);
+		exit(1);
+	}
+}
+
+void check(struct blkdev *dev, blkno_t lba, int len, int seq){
+	char buf[64*BLOCK_SIZE], expect[BLOCK_SIZE];
+	assert(len <= 64);
+	if (blkdev_read(dev, lba, len, buf) != SUCCESS) {
+		printf("Read at %lld failed!\n", lba);
+		exit(1);
+	}
+	for (int i = 0; i < len; i++) {
+		memset(expect, 0, BLOCK_SIZE);
+		if (seq != 0)
+			sprintf(expect, "%d:%lld", seq, lba + i);
+		if (memcmp(&buf[i*BLOCK_SIZE], expect, BLOCK_SIZE) != 0) {
+			printf("Block %lld doesn't match: %s, expected %s\n",
+			       lba + i, &buf[i*BLOCK_SIZE], expect);
+			exit(1);
+		}
+	}
+}
+
+/* places where an int or unsigned block number would wrap */
+blkno_t spots[] = {0, INT_MAX - 20, 1LL << 31, 3LL << 30, (1LL << 32) - 7, 1LL << 32};
+
+void image_tests(void){
+	struct blkdev *d = new_image("bigvol-img", BIG);
+	char buf[BLOCK_SIZE];
+	assert(blkdev_num_blocks(d) == BIG);
+	for (int i = 0; i < 6; i++)
+		fill(d, spots[i], 40, 1);
+	fill(d, BIG - 10, 10, 1);
+	for (int i = 0; i < 6; i++)
+		check(d, spots[i], 40, 1);
+	check(d, BIG - 10, 10, 1);
+	assert(blkdev_read(d, BIG - 1, 2, buf) == E_BADADDR);
+	assert(blkdev_read(d, LLONG_MAX, 1, buf) == E_BADADDR);
+	assert(blkdev_write(d, -1, 1, buf) == E_BADADDR);
+	assert(blkdev_discard(d, 1, LLONG_MAX) == E_BADADDR);
+
+	/* discard and next_data at the far end */
+	assert(blkdev_discard(d, BIG - 10, 5) == SUCCESS);
+	check(d, BIG - 10, 5, 0);
+	check(d, BIG - 5, 5, 1);
+	blkno_t next = blkdev_next_data(d, (1LL << 32) + 64);
+	assert(next >= (1LL << 32) + 64 && next <= BIG - 5);
+	assert(blkdev_next_data(d, BIG) == BIG);
+
+	/* copy between images, far from the start of both */
+	struct blkdev *e = new_image("bigvol-img2", BIG);
+	assert(blkdev_copy(e, (1LL << 32) + 100, d, (1LL << 32) - 7, 40) == SUCCESS);
+	assert(blkdev_read(e, (1LL << 32) + 100, 1, buf) == SUCCESS &&
+	       strcmp(buf, "1:4294967289") == 0);
+	assert(blkdev_copy(e, BIG - 1, d, 0, 2) == E_BADADDR);
+	blkdev_close(e);
+	blkdev_close(d);
+	unlink("bigvol-img2");
+	printf("large image test passed\n");
+}
+
+void raid0_tests(void){
+	char *names[] = {"bigvol-s0", "bigvol-s1"};
+	struct blkdev *disks[2];
+	for (int i = 0; i < 2; i++)
+		disks[i] = new_image(names[i], BIG);
+	struct blkdev *vol = raid0_create(2, disks, 16);
+	assert(vol != NULL && blkdev_num_blocks(vol) == 2 * BIG);
+	blkno_t lbas[] = {(1LL << 32) + 8, (1LL << 33) - 30, 2 * BIG - 40};
+	for (int i = 0; i < 3; i++)
+		fill(vol, lbas[i], 40, 2);
+	for (int i = 0; i < 3; i++)
+		check(vol, lbas[i], 40, 2);
+
+	/* volume block 2^32 + 8 is unit 2^28 of the stripe: disk 0, lba 2^31 + 8 */
+	char buf[BLOCK_SIZE];
+	assert(blkdev_read(disks[0], (1LL << 31) + 8, 1, buf) == SUCCESS);
+	assert(strcmp(buf, "2:4294967304") == 0);
+	assert(blkdev_read(vol, 2 * BIG - 1, 2, buf) == E_BADADDR);
+	blkdev_close(vol);
+	for (int i = 0; i < 2; i++)
+		unlink(names[i]);
+	printf("large raid0 test passed\n");
+}
+
+void mirror_tests(void){
+	char *names[] = {"bigvol-m0", "bigvol-m1"};
+	struct blkdev *disks[2];
+	for (int i = 0; i < 2; i++)
+		disks[i] = new_image(names[i], BIG);
+	struct blkdev *vol = mirror_create(disks);
+	assert(vol != NULL && blkdev_num_blocks(vol) == BIG);
+	for (int i = 0; i < 6; i++)
+		fill(vol, spots[i], 40, 3);
+	image_fail(disks[0]);
+	for (int i = 0; i < 6; i++)
+		check(vol, spots[i], 40, 3);
+	blkdev_close(vol);
+	for (int i = 0; i < 2; i++)
+		unlink(names[i]);
+	printf("large mirror test passed\n");
+}
+
+void raid4_tests(void){
+	char *names[] = {"bigvol-r0", "bigvol-r1", "bigvol-r2", "bigvol-r3", "bigvol-r4"};
+	struct blkdev *disks[5];
+	for (int i = 0; i < 5; i++)
+		disks[i] = new_image(names[i], BIG + 1);
+	assert(raid_format(RAID_RAID4, 5, disks, 16) == SUCCESS);
+	for (int i = 0; i < 5; i++)
+		blkdev_close(disks[i]);
+
+	/* the superblock holds a member size past 2^32 */
+	struct blkdev *cands[5];
+	struct raid_info info;
+	for (int i = 0; i < 5; i++)
+		cands[i] = image_create(names[4 - i]);
+	memset(&info, 0, sizeof(info));
+	struct blkdev *vol = raid_assemble(cands, 5, &info);
+	assert(vol != NULL && info.failed == -1);
+	blkno_t nb = blkdev_num_blocks(vol);
+	assert(nb == 4 * BIG);
+
+	blkno_t lbas[] = {(1LL << 31) - 20, (1LL << 32) + 33, (1LL << 34) + 5, nb - 64};
+	for (int i = 0; i < 4; i++)
+		fill(vol, lbas[i], 64, 4);
+	assert(blkdev_discard(vol, nb - 64, 32) == SUCCESS);
+	check(vol, nb - 64, 32, 0);
+
+	/* a rebuild of member 1 that stopped near the end: the rows past
+	 * it are written around member 1 until replacing it with itself
+	 * finishes the rebuild
+	 */
+	struct blkdev *members[5];
+	assert(vol->ops->members(vol, members, 5) == 5);
+	raid4_set_failed(vol, 1, BIG - 4096);
+	fill(vol, nb - 32, 32, 5);
+	assert(raid4_replace(vol, 1, members[1]) == SUCCESS);
+
+	/* degraded reads rebuild the strips from parity, using member 1 */
+	image_fail(info.members[0]);
+	for (int i = 0; i < 3; i++)
+		check(vol, lbas[i], 64, 4);
+	check(vol, nb - 32, 32, 5);
+	blkdev_close(vol);
+	for (int i = 0; i < 5; i++)
+		unlink(names[i]);
+	printf("large raid4 test passed\n");
+}
+
+/* a device too big to be striped without overflowing the volume size */
+blkno_t huge_num_blocks(struct blkdev *dev){
+	return LLONG_MAX / 2;
+}
+
+void huge_close(struct blkdev *dev){
+	free(dev);
+}
+
+struct blkdev_ops huge_ops = {
+	.num_blocks = huge_num_blocks,
+	.close = huge_close,
+	.type = "huge"
+};
+
+void overflow_tests(void){
+	struct blkdev *disks[3];
+	for (int i = 0; i < 3; i++) {
+		disks[i] = calloc(1, sizeof(struct blkdev));
+		disks[i]->ops = &huge_ops;
+	}
+	assert(raid0_create(3, disks, 16) == NULL);
+	struct blkdev *four[4] = {disks[0], disks[1], disks[2], disks[2]};
+	assert(raid4_create(4, four, 16) == NULL);
+	for (int i = 0; i < 3; i++)
+		blkdev_close(disks[i]);
+	printf("volume size overflow test passed\n");
+}
+
+int main(){
+	image_tests();
+	raid0_tests();
+	mirror_tests();
+	raid4_tests();
+	overflow_tests();
+	unlink("bigvol-img");
+	printf("large volume test passed\n");
+	return 0;
+}
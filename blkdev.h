@@ -8,36 +8,111 @@
 #ifndef __BLKDEV_H__
 #define __BLKDEV_H__
 
-#define BLOCK_SIZE 512   /* 512-byte unit for all blkdev addressing in HW3 */
+#define BLOCK_SIZE 512   /* default block size, and the smallest a device may have */
+#define BLKDEV_MAX_BLOCK_SIZE 65536
+
+/* Block numbers and device sizes, in blocks. An int would overflow at
+ * 2^31 blocks (1 TiB). The number of blocks in one read or write stays
+ * an int, since it has to fit in the caller's buffer.
+ */
+typedef long long blkno_t;
+
+/* I/O statistics kept by blkdev_read and blkdev_write for every device.
+ * Latencies go in a log-linear histogram: BLKDEV_HIST_SUB buckets for
+ * each power of two nanoseconds.
+ */
+#define BLKDEV_HIST_SUB      4
+#define BLKDEV_HIST_BUCKETS  (40 * BLKDEV_HIST_SUB)
+
+enum {BLKDEV_READ = 0, BLKDEV_WRITE = 1};
+
+struct blkdev_iostats {
+    long long ops[2];           /* indexed by BLKDEV_READ / BLKDEV_WRITE */
+    long long blocks[2];
+    long long errors[2];
+    long long ns[2];            /* total latency */
+    long long hist[2][BLKDEV_HIST_BUCKETS];
+};
 
 /* A device 'interface' that all RAID implementations will use. An implementation will assign
  * functions to the fields of 'ops', and assign an implementation-specific object to 'private'.
+ * Devices must be allocated zeroed (calloc) so that 'stats' starts out empty.
  */
 struct blkdev {
     struct blkdev_ops *ops;
     void *private;
+    struct blkdev_iostats stats;
+    struct blkdev_sched *sched; /* priority scheduler, or NULL (image.c) */
 };
 
 struct blkdev_ops {
     /* Returns the total number of blocks in the device */
-    int  (*num_blocks)(struct blkdev *dev);
+    blkno_t (*num_blocks)(struct blkdev *dev);
 
     /* Similar to read() of a file descriptor, but reads from a device.
      *   first_blk: first block number to read
      *   num_blks: number of blocks to read
      *   buf: destination buffer to put read bytes
      */
-    int  (*read)(struct blkdev * dev, int first_blk, int num_blks, void *buf);
+    int  (*read)(struct blkdev * dev, blkno_t first_blk, int num_blks, void *buf);
 
     /* Similar to write() of a file descriptor, but writes to a device.
      *   first_blk: first block number to write
      *   num_blks: number of blocks to write
      *   buf: source buffer where data will come from
      */
-    int  (*write)(struct blkdev * dev, int first_blk, int num_blks, void *buf);
+    int  (*write)(struct blkdev * dev, blkno_t first_blk, int num_blks, void *buf);
 
     /* Close a device */
     void (*close)(struct blkdev *dev);
+
+    /* Optional: store up to 'max' underlying devices in 'out' and return
+     * how many there are; failed members are skipped.
+     */
+    int  (*members)(struct blkdev *dev, struct blkdev **out, int max);
+
+    /* Device type, for reports */
+    const char *type;
+
+    /* Optional: the blocks are no longer in use, and read as zeros
+     * from now on (image files punch a hole). blkdev_discard writes
+     * zeros to devices without it.
+     */
+    int  (*discard)(struct blkdev *dev, blkno_t first_blk, blkno_t num_blks);
+
+    /* Optional: the first block at or after 'first_blk' that may hold
+     * data, or num_blocks if there is none; blocks before it have
+     * never been written or were discarded. Without it every block may
+     * hold data.
+     */
+    blkno_t (*next_data)(struct blkdev *dev, blkno_t first_blk);
+
+    /* Optional: copy 'num_blks' blocks starting at 'src_blk' of 'src',
+     * a device of the same type, to 'first_blk' of this one, without
+     * passing the data through the caller (image files use
+     * copy_file_range). E_UNAVAIL if either device fails. blkdev_copy
+     * reads and writes through a buffer for devices without it.
+     */
+    int  (*copy)(struct blkdev *dev, blkno_t first_blk, struct blkdev *src,
+                 blkno_t src_blk, blkno_t num_blks);
+
+    /* Optional: bytes per block, a power of two from BLOCK_SIZE to
+     * BLKDEV_MAX_BLOCK_SIZE; BLOCK_SIZE without it. Block numbers,
+     * counts and buffers are all in units of this size.
+     */
+    int  (*block_size)(struct blkdev *dev);
+
+    /* Optional: make every write that has completed durable (image
+     * files fdatasync). Without it blkdev_flush flushes the members,
+     * and a device with none has nothing to flush.
+     */
+    int  (*flush)(struct blkdev *dev);
+
+    /* Optional: a write that is durable when it returns (image files
+     * use RWF_DSYNC); blkdev_write_fua writes and then flushes devices
+     * without it. Only this write is made durable.
+     */
+    int  (*write_fua)(struct blkdev *dev, blkno_t first_blk, int num_blks, void *buf);
 };
 
 /* Constants that are returned by the blkdev_ops functions.
@@ -46,19 +121,67 @@ struct blkdev_ops {
  *     maximum block in the device
  *   E_UNAVAIL - if the device could not be read or written. This error means the device has failed.
  *   E_SIZE - an image is not large enough to be used in the RAID device.
+ *   E_CORRUPT - a block read back doesn't match its checksum (see
+ *     integrity_create). The device still works, and the data read is
+ *     returned as it is; a RAID volume repairs it from the other members.
  */
-enum {SUCCESS = 0, E_BADADDR = -1, E_UNAVAIL = -2, E_SIZE = -3};
+enum {SUCCESS = 0, E_BADADDR = -1, E_UNAVAIL = -2, E_SIZE = -3, E_CORRUPT = -4};
 
 /* Create a 'raw' image from a given file */
 extern struct blkdev *image_create(char *path);
+/* ... with blocks of 'block_size' bytes rather than BLOCK_SIZE */
+extern struct blkdev *image_create_bs(char *path, int block_size);
 /* Cause the image to be in a failed state */
 extern void image_fail(struct blkdev *);
+/* fdatasync calls made for an image's flushes, which concurrent
+ * flushes share (group commit)
+ */
+extern long long image_syncs(struct blkdev *);
+
+/* Create a zero-filled in-memory device of the given number of blocks */
+extern struct blkdev *ramdisk_create(blkno_t nblocks);
+/* ... with blocks of 'block_size' bytes rather than BLOCK_SIZE */
+extern struct blkdev *ramdisk_create_bs(blkno_t nblocks, int block_size);
+/* Cause a RAM disk to be in a failed state, like image_fail */
+extern void ramdisk_fail(struct blkdev *);
+
+/* Service time model for a RAM disk: an access latency drawn from
+ * 'dist', plus 'tail_us' on 'tail_pct' percent of requests, plus the
+ * transfer time at 'mbps' (MB/s, 0 for unlimited). Transfers on one
+ * device queue behind each other.
+ */
+enum {RAMDISK_NONE = 0, RAMDISK_FIXED, RAMDISK_UNIFORM, RAMDISK_EXP};
+
+struct ramdisk_model {
+    int dist;
+    int lat_us;                 /* fixed value, or mean */
+    int jitter_us;              /* RAMDISK_UNIFORM: lat_us +/- jitter_us */
+    double tail_pct;
+    int tail_us;
+    int mbps;
+    unsigned int seed;
+};
+extern void ramdisk_set_model(struct blkdev *, struct ramdisk_model *);
 
 /* Create a mirror RAID device out of the given blkdev array */
 extern struct blkdev *mirror_create(struct blkdev *[2]);
 /* Replace a device in a mirror */
 extern int mirror_replace(struct blkdev *, int, struct blkdev *);
 
+/* Hedged reads: a read that takes longer than a member's threshold is
+ * also served from the other mirror side or from raid4 parity, and
+ * the first answer wins. The threshold is 'pct' percent of the
+ * member's recent 95th percentile latency, but at least 'min_us'.
+ */
+struct hedge_opts {
+    int enable;
+    int min_us;                 /* lower bound on the threshold */
+    int pct;                    /* percent of p95 (default 100) */
+};
+extern void mirror_set_hedge(struct blkdev *, struct hedge_opts *);
+/* reads that were hedged, and how many of those the hedge won */
+extern void mirror_hedge_stats(struct blkdev *, long long *, long long *);
+
 /* Create a raid0 device */
 extern struct blkdev *raid0_create(int, struct blkdev **, int);
 
@@ -67,18 +190,289 @@ extern struct blkdev *raid4_create(int, struct blkdev **, int);
 
 /* Replace a disk in a raid4 device */
 extern int raid4_replace(struct blkdev *, int, struct blkdev *);
+
+/* Grow a raid0 or raid4 device onto more disks: 'disks' is the new
+ * array of N disks, starting with the ones the device has (for raid4
+ * the old parity disk becomes a data disk and the last new disk holds
+ * parity). The data is restriped in the calling thread, at background
+ * priority, while the device stays in use; it has its new size when
+ * this returns. Once started, the new disks belong to the device even
+ * if the reshape fails. Given the array it has, continues a reshape.
+ * A degraded raid4 device has to be repaired first (E_UNAVAIL).
+ */
+extern int raid0_reshape(struct blkdev *, int N, struct blkdev **disks);
+extern int raid4_reshape(struct blkdev *, int N, struct blkdev **disks);
+/* Start a device part way through a reshape from prev_N disks, with
+ * 'pos' volume blocks moved and (backup) the next row in the backup area.
+ */
+extern void raid0_set_reshape(struct blkdev *, int prev_N, blkno_t pos, int backup);
+extern void raid4_set_reshape(struct blkdev *, int prev_N, blkno_t pos, int backup);
+/* Attach a parity journal device to a raid4 device, replaying it */
+extern int raid4_set_journal(struct blkdev *, struct blkdev *);
+/* Hedged reads for a raid4 device (see struct hedge_opts) */
+extern void raid4_set_hedge(struct blkdev *, struct hedge_opts *);
+extern void raid4_hedge_stats(struct blkdev *, long long *, long long *);
+
+/* Background parity scrub of a raid4 device */
+struct raid4_scrub_opts {
+    int rows_per_chunk;         /* rows verified per step (default 64) */
+    int max_kbps;               /* bandwidth cap in KB/s, 0 for none */
+    int idle_ms;                /* pause while foreground I/O is this recent */
+    int repair;                 /* rewrite parity that does not match, and
+                                 * strips that fail their checksums */
+    const char *checkpoint;     /* file for saving/resuming progress, or NULL */
+};
+struct raid4_scrub_status {
+    int running;
+    int error;
+    long long rows_done;
+    long long nrows;
+    long long mismatches;
+    long long repaired;
+    long long bytes;
+};
+struct raid4_scrub;
+extern struct raid4_scrub *raid4_scrub_start(struct blkdev *, struct raid4_scrub_opts *);
+extern void raid4_scrub_status(struct raid4_scrub *, struct raid4_scrub_status *);
+/* Stop (or with 'wait' set, finish) a scrub and free it. A volume runs
+ * one scrub at a time (raid4_scrub_start returns NULL otherwise), and
+ * closing the volume stops its scrub before the members and journal
+ * are closed; the handle must still be freed with raid4_scrub_stop.
+ */
+extern int raid4_scrub_stop(struct raid4_scrub *, int wait);
+
+/* Hot spares: a pool of idle disks shared by mirror and raid4 devices.
+ * When a member fails, the device takes the smallest spare that fits
+ * and rebuilds onto it in the background (the failed disk is closed).
+ * The pool must outlive the devices using it; destroying it closes the
+ * spares left. spare_pool_add fails with E_SIZE when the pool is full.
+ */
+struct spare_pool;
+extern struct spare_pool *spare_pool_create(void);
+extern int spare_pool_add(struct spare_pool *, struct blkdev *disk);
+extern int spare_pool_count(struct spare_pool *);
+extern void spare_pool_destroy(struct spare_pool *);
+/* Draw spares from a pool (NULL for none); a member already missing
+ * is replaced at once.
+ */
+extern void mirror_set_spares(struct blkdev *, struct spare_pool *);
+extern void raid4_set_spares(struct blkdev *, struct spare_pool *);
+/* Wait for a rebuild onto a spare; returns how the last one went */
+extern int mirror_spare_wait(struct blkdev *);
+extern int raid4_spare_wait(struct blkdev *);
+/* How a spare of at least min_blks blocks is put in place of failed
+ * member 'i', instead of mirror_replace or raid4_replace (see
+ * raid_set_spares): it takes the disk (SUCCESS, or E_UNAVAIL if the
+ * rebuild failed) and closes the disk it replaced, or returns E_SIZE
+ * and leaves the disk alone.
+ */
+typedef int (*raid_replace_fn)(struct blkdev *vol, int i, struct blkdev *newdisk);
+extern void mirror_set_spares_fn(struct blkdev *, struct spare_pool *, raid_replace_fn, blkno_t min_blks);
+extern void raid4_set_spares_fn(struct blkdev *, struct spare_pool *, raid_replace_fn, blkno_t min_blks);
+
+/* Create a declustered parity (draid) device: stripes of 'width'
+ * strips of 'unit' blocks (width-1 data, then parity) and spare space,
+ * spread over N > width disks. A failed member is rebuilt into the
+ * spare space of all the others at once by draid_rebuild, after which
+ * the device survives another failure; draid_replace copies it on to
+ * a new disk.
+ */
+extern struct blkdev *draid_create(int N, struct blkdev **disks, int width, int unit);
+extern int draid_rebuild(struct blkdev *);
+/* Replace disk 'i' of a draid device; the old disk goes back to the caller */
+extern int draid_replace(struct blkdev *, int i, struct blkdev *newdisk);
+
+/* State changes of a volume, for whoever keeps its metadata: a member
+ * failed (member -1: the whole volume), a replacement has been rebuilt
+ * up to member block 'mark', it is done, or the volume is closing.
+ * A reshape onto 'member' disks has moved 'mark' volume blocks (and
+ * must not go on until that is recorded), has the row at 'mark' in its
+ * backup area, or is done.
+ */
+enum {RAID_EV_FAILED = 0, RAID_EV_REBUILD, RAID_EV_REBUILT, RAID_EV_CLOSE,
+      RAID_EV_RESHAPE, RAID_EV_RESHAPE_BACKUP, RAID_EV_RESHAPED};
+typedef void (*raid_notify_fn)(void *arg, int event, int member, blkno_t mark);
+extern void mirror_set_notify(struct blkdev *, raid_notify_fn, void *);
+extern void raid0_set_notify(struct blkdev *, raid_notify_fn, void *);
+extern void raid4_set_notify(struct blkdev *, raid_notify_fn, void *);
+/* Start a volume with member 'i' missing, or (rebuilt > 0) part way
+ * through being rebuilt; replacing it with itself finishes the rebuild.
+ */
+extern void mirror_set_failed(struct blkdev *, int i, blkno_t rebuilt);
+extern void raid4_set_failed(struct blkdev *, int i, blkno_t rebuilt);
+
+/* Superblocks (superblock.c): raid_format writes one to the last block
+ * of each member, and raid_assemble brings the volume up again from
+ * any set of candidate devices, in any order. Members whose superblock
+ * is older than the others' are left out as stale.
+ */
+enum {RAID_MIRROR = 1, RAID_RAID0, RAID_RAID4};
+#define RAID_MAX_MEMBERS 64
+
+struct raid_info {
+    int level, ndisks, unit;
+    int block_size;
+    unsigned long long uuid;
+    unsigned long long generation;
+    int failed;                 /* member missing or being rebuilt, or -1 */
+    blkno_t rebuilt;            /* how far its rebuild got (member blocks) */
+    int dirty;                  /* not closed cleanly: raid4 parity may be stale */
+    int reshape_from;           /* members before an unfinished reshape, or 0 */
+    blkno_t reshape_pos;        /* volume blocks it has moved */
+    struct blkdev *members[RAID_MAX_MEMBERS]; /* candidate used, or NULL */
+};
+extern int raid_format(int level, int n, struct blkdev **disks, int unit);
+/* Brings up the array of the newest superblock, or the array whose
+ * uuid is already in info->uuid. Candidates not listed in
+ * info->members are left to the caller.
+ */
+extern struct blkdev *raid_assemble(struct blkdev **cands, int n, struct raid_info *info);
+/* Replace member 'i' of an assembled volume, or with newdisk == NULL
+ * finish the rebuild it was assembled with. The old disk is handed
+ * back to the caller.
+ */
+extern int raid_replace(struct blkdev *vol, int i, struct blkdev *newdisk);
+/* Rebuild an assembled mirror or raid4 volume onto spares from 'pool'
+ * when a member fails; the spares get superblocks as members.
+ */
+extern int raid_set_spares(struct blkdev *vol, struct spare_pool *pool);
+/* Add 'n' disks to an assembled raid0 or raid4 volume and restripe it
+ * onto them (see raid4_reshape), or with n == 0 finish the reshape it
+ * was assembled with.
+ */
+extern int raid_reshape(struct blkdev *vol, int n, struct blkdev **newdisks);
+
+/* Create a write-back cache on a fast device in front of a volume */
+extern struct blkdev *cache_create(struct blkdev *ssd, struct blkdev *backing, int stripe);
+/* Write all dirty cached blocks back to the volume */
+extern int cache_flush(struct blkdev *);
+
+/* Create a log-structured device on a parity volume with the given full stripe */
+extern struct blkdev *logdev_create(struct blkdev *vol, int stripe);
+/* Write the open segment and a checkpoint of the log device */
+extern int logdev_sync(struct blkdev *);
+
+/* Keep a CRC32C of every block of 'disk' in a metadata region at its
+ * end, and check it on reads (E_CORRUPT if a block doesn't match).
+ * The device is a little smaller than the disk, and closes it.
+ */
+extern struct blkdev *integrity_create(struct blkdev *disk);
+/* blocks of an integrity device found corrupt so far */
+extern long long integrity_errors(struct blkdev *);
+/* CRC32C of 'len' bytes, continuing from 'crc' (0 to start) */
+extern unsigned int crc32c(unsigned int crc, const void *buf, int len);
+
+/* Store a volume LZ4-compressed in chunks of 'chunk_blks' blocks (8 if
+ * 0), so fewer bytes go to its members. Incompressible chunks are
+ * stored as they are. The device is a little smaller than the volume,
+ * and closes it. A volume already compressed with another chunk size
+ * is refused (NULL), not reformatted.
+ */
+extern struct blkdev *compress_create(struct blkdev *vol, int chunk_blks);
+struct compress_stats {
+    long long chunks;           /* chunks written */
+    long long raw_chunks;       /* ... stored uncompressed */
+    long long zero_chunks;      /* ... of zeros, stored as nothing */
+    long long bytes_in;         /* bytes of chunks written */
+    long long bytes_out;        /* bytes of blocks written for them */
+};
+extern void compress_stats(struct blkdev *, struct compress_stats *);
+
+/* Record every request to a device in a trace file (see trace.h) */
+extern struct blkdev *trace_create(struct blkdev *dev, char *path);
+
+/* Request queue in front of a device: concurrent requests are merged
+ * and sorted by LBA, with deadlines so none waits too long. Fields
+ * left at 0 take the default shown.
+ */
+struct elevator_opts {
+    int max_blocks;             /* largest merged request (256) */
+    int read_expire_ms;         /* read deadline (500) */
+    int write_expire_ms;        /* write deadline (5000) */
+    int fifo_batch;             /* requests sent in LBA order per batch (16) */
+    int writes_starved;         /* read batches allowed ahead of writes (2) */
+    int nr_dispatch;            /* dispatcher threads (1) */
+};
+struct elevator_stats {
+    long long requests;         /* queued by callers */
+    long long dispatched;       /* sent to the device */
+    long long merged;           /* sent as part of another request */
+    long long expired;          /* batches started for a missed deadline */
+};
+extern struct blkdev *elevator_create(struct blkdev *dev, struct elevator_opts *opts);
+extern void elevator_stats(struct blkdev *dev, struct elevator_stats *st);
     
 /* The following operations should be used to operate on any blkdev device, whether
  * it be a raw image or one of the RAID devices (mirror, raid0, raid4).
  */
 
 /* Write to a blkdev device */
-extern int blkdev_read(struct blkdev * dev, int first_blk, int num_blks, void *buf);
+extern int blkdev_read(struct blkdev * dev, blkno_t first_blk, int num_blks, void *buf);
 /* Read from a blkdev device */
-extern int blkdev_write(struct blkdev * dev, int first_blk, int num_blks, void *buf);
+extern int blkdev_write(struct blkdev * dev, blkno_t first_blk, int num_blks, void *buf);
+/* Make completed writes durable (see blkdev_ops) */
+extern int blkdev_flush(struct blkdev * dev);
+/* Write, returning once the blocks are durable */
+extern int blkdev_write_fua(struct blkdev * dev, blkno_t first_blk, int num_blks, void *buf);
 /* Number of blocks in a blkdev device */
-extern int blkdev_num_blocks(struct blkdev * dev);
+extern blkno_t blkdev_num_blocks(struct blkdev * dev);
 /* Close a blkdev device */
 extern void blkdev_close(struct blkdev * dev);
+/* Discard blocks of a blkdev device (see blkdev_ops) */
+extern int blkdev_discard(struct blkdev * dev, blkno_t first_blk, blkno_t num_blks);
+/* First block at or after 'first_blk' that may hold data */
+extern blkno_t blkdev_next_data(struct blkdev * dev, blkno_t first_blk);
+/* Copy blocks from one device to another (see blkdev_ops); E_SIZE if
+ * their block sizes differ
+ */
+extern int blkdev_copy(struct blkdev * dst, blkno_t first_blk, struct blkdev * src,
+                       blkno_t src_blk, blkno_t num_blks);
+/* Bytes per block of a blkdev device */
+extern int blkdev_block_size(struct blkdev * dev);
+/* Whether 'size' is a valid block size */
+extern int blkdev_block_size_ok(int size);
+/* The block size 'n' devices share, or 0 if they differ. Layers built
+ * on several devices use this to check them when they are created.
+ */
+extern int blkdev_common_block_size(struct blkdev **devs, int n);
+
+/* Walk a device and everything under it, calling 'fn' with a snapshot
+ * of each device's statistics. 'depth' is 0 for 'dev' itself.
+ */
+typedef void (*blkdev_stats_fn)(struct blkdev *dev, int depth,
+                                struct blkdev_iostats *st, void *arg);
+extern void blkdev_stats(struct blkdev *dev, blkdev_stats_fn fn, void *arg);
+/* Latency (ns) below which 'pct' percent of the ops in a direction fell */
+extern long long blkdev_stats_percentile(struct blkdev_iostats *st, int dir, double pct);
+/* Print a table of the device tree's statistics */
+extern void blkdev_stats_print(struct blkdev *dev);
+/* Zero the statistics of a device tree */
+extern void blkdev_stats_reset(struct blkdev *dev);
+
+/* Priority classes. Requests take the class of the thread issuing
+ * them; rebuilds and scrubs run as BLKDEV_PRIO_BG. A device with a
+ * scheduler passes foreground requests straight through, limits
+ * background ones to min_kbps while foreground requests are using it
+ * and to max_kbps (0 for no limit) once it has been free of them for
+ * idle_ms, and holds idle-class requests until it is idle.
+ */
+enum {BLKDEV_PRIO_FG = 0, BLKDEV_PRIO_BG, BLKDEV_PRIO_IDLE};
+
+struct blkdev_prio_opts {
+    int min_kbps;               /* background floor under load */
+    int max_kbps;               /* background cap when idle, 0 for none */
+    int idle_ms;                /* quiet time before the device is idle */
+};
+/* set the calling thread's class, returning the old one */
+extern int blkdev_set_prio(int prio);
+extern int blkdev_get_prio(void);
+/* give every device at the bottom of 'dev's tree a scheduler with
+ * these limits (may be changed at any time; NULL lifts the limits)
+ */
+extern void blkdev_set_sched(struct blkdev *dev, struct blkdev_prio_opts *opts);
+/* copy out the limits of a device, or of the first device under it
+ * that has a scheduler; returns 0 if there is none
+ */
+extern int blkdev_get_sched(struct blkdev *dev, struct blkdev_prio_opts *opts);
 
 #endif
@@ -0,0 +1,194 @@
+#include "blkdev.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+
+#define BS 4096
+
+struct blkdev *new_image(char *path, int nblks, int bsize){
+	FILE *fp = fopen(path, "w");
+	assert(fp != NULL);
+	assert(ftruncate(fileno(fp), (off_t)nblks * bsize) == 0);
+	fclose(fp);
+	return image_create_bs(path, bsize);
+}
+
+/* every byte of a block holds its lba + seq, so a block read at the
+ * wrong size or offset doesn't match
+ */
+void fill(struct blkdev *dev, blkno_t lba, int len, int seq){
+	int bsize = blkdev_block_size(dev);
+	char *buf = malloc(len * bsize);
+	for (int i = 0; i < len; i++)
+		memset(&buf[i*bsize], (int)(lba + i + seq), bsize);
+	if (blkdev_write(dev, lba, len, buf) != SUCCESS) {
+		printf("Write at %lld failed!\n", lba);
+		exit(1);
+	}
+	free(buf);
+}
+
+void check(struct blkdev *dev, blkno_t lba, int len, int seq){
+	int bsize = blkdev_block_size(dev);
+	char *buf = malloc(len * bsize), *expect = malloc(bsize);
+	if (blkdev_read(dev, lba, len, buf) != SUCCESS) {
+		printf("Read at %lld failed!\n", lba);
+		exit(1);
+	}
+	for (int i = 0; i < len; i++) {
+		memset(expect, seq < 0 ? 0 : (int)(lba + i + seq), bsize);
+		if (memcmp(&buf[i*bsize], expect, bsize) != 0) {
+			printf("Block %lld doesn't match\n", lba + i);
+			exit(1);
+		}
+	}
+	free(buf);
+	free(expect);
+}
+
+void bad_size_tests(void){
+	int bad[] = {0, 128, 1000, 3 * 512, 131072};
+	for (int i = 0; i < 5; i++) {
+		assert(!blkdev_block_size_ok(bad[i]));
+		assert(ramdisk_create_bs(64, bad[i]) == NULL);
+	}
+	assert(blkdev_block_size_ok(512) && blkdev_block_size_ok(BS) &&
+	       blkdev_block_size_ok(BLKDEV_MAX_BLOCK_SIZE));
+	assert(new_image("blksize-img", 16, 1000) == NULL);
+	unlink("blksize-img");
+	printf("bad block size test passed\n");
+}
+
+void image_tests(void){
+	struct blkdev *d = new_image("blksize-img", 64, BS);
+	assert(d != NULL && blkdev_block_size(d) == BS);
+	assert(blkdev_num_blocks(d) == 64);
+	fill(d, 0, 64, 1);
+	check(d, 0, 64, 1);
+	assert(blkdev_discard(d, 8, 8) == SUCCESS);
+	check(d, 8, 8, -1);
+	check(d, 16, 8, 1);
+
+	/* the same file seen with 512-byte blocks */
+	struct blkdev *small = image_create("blksize-img");
+	assert(blkdev_block_size(small) == BLOCK_SIZE);
+	assert(blkdev_num_blocks(small) == 64 * (BS / BLOCK_SIZE));
+	char buf[BLOCK_SIZE], expect[BLOCK_SIZE];
+	assert(blkdev_read(small, 16 * (BS / BLOCK_SIZE) + 3, 1, buf) == SUCCESS);
+	memset(expect, 17, BLOCK_SIZE);
+	assert(memcmp(buf, expect, BLOCK_SIZE) == 0);
+
+	/* copies only go between devices of one block size */
+	struct blkdev *r = ramdisk_create_bs(64, BS);
+	assert(blkdev_copy(r, 0, small, 0, 1) == E_SIZE);
+	assert(blkdev_copy(r, 0, d, 0, 32) == SUCCESS);
+	check(r, 16, 16, 1);
+	blkdev_close(r);
+	blkdev_close(small);
+	blkdev_close(d);
+	unlink("blksize-img");
+	printf("image block size test passed\n");
+}
+
+void raid_tests(void){
+	struct blkdev *disks[5];
+	for (int i = 0; i < 5; i++)
+		disks[i] = ramdisk_create_bs(256, BS);
+	struct blkdev *mixed[2] = {disks[0], ramdisk_create_bs(256, BLOCK_SIZE)};
+	assert(mirror_create(mixed) == NULL);
+	assert(raid0_create(2, mixed, 8) == NULL);
+	struct blkdev *m3[3] = {disks[0], disks[1], mixed[1]};
+	assert(raid4_create(3, m3, 8) == NULL);
+
+	struct blkdev *vol = raid0_create(2, disks, 8);
+	assert(vol != NULL && blkdev_block_size(vol) == BS);
+	fill(vol, 0, 512, 2);
+	check(vol, 0, 512, 2);
+	blkdev_close(vol);
+
+	struct blkdev *pair[2];
+	for (int i = 0; i < 2; i++)
+		pair[i] = ramdisk_create_bs(128, BS);
+	vol = mirror_create(pair);
+	assert(vol != NULL && blkdev_block_size(vol) == BS);
+	fill(vol, 0, 128, 3);
+	ramdisk_fail(pair[0]);
+	check(vol, 0, 128, 3);
+	assert(mirror_replace(vol, 0, mixed[1]) == E_SIZE);
+	assert(mirror_replace(vol, 0, ramdisk_create_bs(128, BS)) == SUCCESS);
+	ramdisk_fail(pair[1]);
+	check(vol, 0, 128, 3);
+	blkdev_close(vol);
+
+	for (int i = 0; i < 5; i++)
+		disks[i] = ramdisk_create_bs(256, BS);
+	vol = raid4_create(5, disks, 8);
+	assert(vol != NULL && blkdev_block_size(vol) == BS);
+	assert(raid4_set_journal(vol, ramdisk_create_bs(64, BS)) == SUCCESS);
+	fill(vol, 0, 1024, 4);
+	fill(vol, 13, 7, 5);
+	ramdisk_fail(disks[2]);
+	check(vol, 0, 13, 4);
+	check(vol, 13, 7, 5);
+	check(vol, 20, 1004, 4);
+	assert(raid4_replace(vol, 2, mixed[1]) == E_SIZE);
+	assert(raid4_replace(vol, 2, ramdisk_create_bs(256, BS)) == SUCCESS);
+	ramdisk_fail(disks[0]);
+	check(vol, 20, 1004, 4);
+
+	/* a stack above the array keeps its block size */
+	struct blkdev *e = elevator_create(vol, NULL);
+	assert(blkdev_block_size(e) == BS);
+	fill(e, 100, 40, 6);
+	check(e, 100, 40, 6);
+	blkdev_close(e);
+	blkdev_close(mixed[1]);
+	printf("raid block size test passed\n");
+}
+
+void superblock_tests(void){
+	char *names[] = {"blksize-r0", "blksize-r1", "blksize-r2"};
+	struct blkdev *disks[3];
+	for (int i = 0; i < 3; i++)
+		disks[i] = new_image(names[i], 128, BS);
+	assert(raid_format(RAID_RAID4, 3, disks, 8) == SUCCESS);
+	for (int i = 0; i < 3; i++)
+		blkdev_close(disks[i]);
+
+	/* assembled members must be opened with the size they were formatted with */
+	struct blkdev *cands[3];
+	struct raid_info info;
+	for (int i = 0; i < 3; i++)
+		cands[i] = image_create(names[i]);
+	memset(&info, 0, sizeof(info));
+	assert(raid_assemble(cands, 3, &info) == NULL);
+	for (int i = 0; i < 3; i++)
+		blkdev_close(cands[i]);
+
+	for (int i = 0; i < 3; i++)
+		cands[i] = image_create_bs(names[i], BS);
+	memset(&info, 0, sizeof(info));
+	struct blkdev *vol = raid_assemble(cands, 3, &info);
+	assert(vol != NULL && info.block_size == BS);
+	assert(blkdev_block_size(vol) == BS);
+	fill(vol, 0, 64, 7);
+	check(vol, 0, 64, 7);
+	struct blkdev *wrong = ramdisk_create(128);
+	assert(raid_replace(vol, 1, wrong) == E_SIZE);
+	blkdev_close(wrong);
+	blkdev_close(vol);
+	for (int i = 0; i < 3; i++)
+		unlink(names[i]);
+	printf("superblock block size test passed\n");
+}
+
+int main(){
+	bad_size_tests();
+	image_tests();
+	raid_tests();
+	superblock_tests();
+	printf("block size tests passed.\n");
+	return 0;
+}
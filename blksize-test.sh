@@ -0,0 +1,3 @@
+#!/bin/sh
+
+gcc -g3 -o blksize-test blksize-test.c image.c homework.c journal.c superblock.c ramdisk.c elevator.c -lpthread -lm
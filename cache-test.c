@@ -0,0 +1,205 @@
+#include "blkdev.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+
+void write1(struct blkdev* dev,int addr,int len,int seq,int *array){
+	char buf[len*BLOCK_SIZE];
+
+	for (int i = 0; i< len; i++) {
+		sprintf(&buf[i*BLOCK_SIZE], "%d", seq);
+		array[addr + i] = seq;
+	}
+	if (blkdev_write(dev, addr, len, buf) != SUCCESS){
+        printf("Write failed!\n");
+        exit(0);
+    }
+}
+
+void verify(struct blkdev* dev,int addr,int len,int *array) {
+	char buf[len*BLOCK_SIZE];
+	if (blkdev_read(dev, addr, len, buf) != SUCCESS){
+        printf("Read failed!\n");
+        exit(0);
+    }
+
+    for (int i = 0; i < len; i++)
+    {
+    	if (array[addr + i] != 0) {
+    		assert(atoi(&buf[i*BLOCK_SIZE]) == array[addr + i]);
+    	}
+    }
+}
+
+void random_write1(struct blkdev* dev,int seq,int *array, int max, int maxlen) {
+	int addr = rand() % max;
+	int len = rand() % (max - addr) + 1;
+	if (len > maxlen)
+		len = maxlen;
+	write1(dev, addr, len, seq, array);
+}
+
+void random_verify1(struct blkdev* dev, int *array, int max) {
+	int addr = rand() % max;
+	int len = rand() % (max - addr) + 1;
+	verify(dev, addr, len, array);
+}
+
+struct blkdev *  create_new_image(char * path, int blocks){
+    if (blocks < 1){
+        printf("create_new_image: error - blocks must be at least 1: %d\n", blocks);
+        return NULL;
+    }
+    FILE * image = fopen(path, "w");
+    fseek(image, blocks * BLOCK_SIZE - 1, SEEK_SET);
+    char c = 0;
+    fwrite(&c, 1, 1, image);
+    fclose(image);
+
+    return image_create(path);
+}
+
+/* raid4 of 4 disks x 32 blocks, unit 4 -> 96 block volume */
+struct blkdev *open_raid4(struct blkdev **drives, int create){
+	char name[16];
+	for (int j = 0; j < 4; j++){
+		sprintf(name, "cache_r4_%d", j);
+		drives[j] = create ? create_new_image(name, 32) : image_create(name);
+	}
+	return raid4_create(4, drives, 4);
+}
+
+/* a cache device that stops writing after a given number of writes,
+ * as if the machine had crashed there
+ */
+struct crash_dev {
+	struct blkdev *dev;
+	int left;                   /* writes still to go, or -1 */
+};
+
+blkno_t crash_num_blocks(struct blkdev *dev){
+	struct crash_dev *c = dev->private;
+	return blkdev_num_blocks(c->dev);
+}
+
+int crash_read(struct blkdev *dev, blkno_t first_blk, int num_blks, void *buf){
+	struct crash_dev *c = dev->private;
+	return blkdev_read(c->dev, first_blk, num_blks, buf);
+}
+
+int crash_write(struct blkdev *dev, blkno_t first_blk, int num_blks, void *buf){
+	struct crash_dev *c = dev->private;
+	if (c->left == 0)
+		return SUCCESS;
+	if (c->left > 0)
+		c->left--;
+	return blkdev_write(c->dev, first_blk, num_blks, buf);
+}
+
+void crash_close(struct blkdev *dev){
+	struct crash_dev *c = dev->private;
+	blkdev_close(c->dev);
+	free(c);
+	free(dev);
+}
+
+struct blkdev_ops crash_ops = {
+	.num_blocks = crash_num_blocks,
+	.read = crash_read,
+	.write = crash_write,
+	.close = crash_close,
+	.type = "crash"
+};
+
+/* a crash while a write evicts a clean slot must not leave the slot's
+ * old block reading the new data
+ */
+void crash_test(void){
+	for (int k = 0; k < 4; k++) {
+		struct blkdev *backing = create_new_image("cache_bk", 96);
+		struct blkdev *dev = calloc(1, sizeof(*dev));
+		struct crash_dev *cd = calloc(1, sizeof(*cd));
+		cd->dev = create_new_image("cache_ssd", 40);
+		cd->left = -1;
+		dev->private = cd;
+		dev->ops = &crash_ops;
+		struct blkdev *cache = cache_create(dev, backing, 12);
+		assert(cache != NULL);
+
+		int array[96] = {0};
+		for (int lba = 0; lba < 38; lba++)
+			write1(cache, lba, 1, lba + 1, array);
+		assert(cache_flush(cache) == SUCCESS);
+
+		cd->left = k;
+		char buf[BLOCK_SIZE];
+		sprintf(buf, "%d", 1000);
+		assert(blkdev_write(cache, 50, 1, buf) == SUCCESS);
+		blkdev_close(cache);
+
+		cache = cache_create(image_create("cache_ssd"), image_create("cache_bk"), 12);
+		assert(cache != NULL);
+		verify(cache, 0, 38, array);
+		assert(blkdev_read(cache, 50, 1, buf) == SUCCESS);
+		assert(atoi(buf) == 0 || atoi(buf) == 1000);
+		blkdev_close(cache);
+	}
+	unlink("cache_bk");
+	printf("cache crash test passed\n");
+}
+
+int main(){
+	struct blkdev *drives[4];
+	struct blkdev *raid4 = open_raid4(drives, 1);
+	struct blkdev *ssd = create_new_image("cache_ssd", 40);
+	struct blkdev *cache = cache_create(ssd, raid4, 12);
+	assert(cache != NULL);
+	assert(blkdev_num_blocks(cache) == 96);
+
+	int max = 96;
+	int *array = calloc(max, sizeof(int));
+	int seq = 1;
+
+	/* many small writes - more than the cache holds, so it destages */
+	for (int i = 0; i < 200; i++)
+	{
+		random_write1(cache, seq, array, max, 3);
+		seq++;
+	}
+	for (int i = 0; i < 20; i++)
+	{
+		random_verify1(cache, array, max);
+	}
+
+	/* a large write goes around the cache */
+	write1(cache, 10, 60, seq++, array);
+	verify(cache, 0, max, array);
+	printf("cache read/write test passed\n");
+
+	/* dirty blocks survive closing and reopening the cache */
+	for (int i = 0; i < 10; i++)
+	{
+		random_write1(cache, seq, array, max, 2);
+		seq++;
+	}
+	blkdev_close(cache);
+
+	raid4 = open_raid4(drives, 0);
+	ssd = image_create("cache_ssd");
+	cache = cache_create(ssd, raid4, 12);
+	assert(cache != NULL);
+	verify(cache, 0, max, array);
+	printf("cache restart test passed\n");
+
+	/* after a flush the volume alone has the data */
+	assert(cache_flush(cache) == SUCCESS);
+	blkdev_close(cache);
+	raid4 = open_raid4(drives, 0);
+	verify(raid4, 0, max, array);
+	blkdev_close(raid4);
+
+	crash_test();
+	printf("cache tests passed.\n");
+}
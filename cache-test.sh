@@ -0,0 +1,3 @@
+#!/bin/sh
+
+gcc -g3 -o cache-test cache-test.c image.c homework.c journal.c cache.c -lpthread
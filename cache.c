@@ -0,0 +1,567 @@
+/*
+ * file:        cache.c
+ * description: write-back block cache - a fast device (e.g. an image
+ *              on NVMe) absorbing writes in front of a slow RAID volume
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <limits.h>
+#include "blkdev.h"
+
+/* Layout of the cache device:
+ *
+ *   block 0          superblock (struct cache_super)
+ *   blocks 1..M      slot table, CACHE_ENTS_PER_BLK entries per block
+ *   blocks M+1..     data slots, one block each
+ *
+ * Slots are handed out from a circular log (the 'head'), so a burst
+ * of random writes turns into sequential writes to the cache device
+ * and consecutive slot-table entries. Dirty slots are destaged to the
+ * backing volume sorted by LBA and grouped by stripe.
+ */
+#define CACHE_MAGIC      0x43414348
+#define CACHE_VERSION    1
+
+#define SLOT_VALID       1
+#define SLOT_DIRTY       2
+
+struct cache_super {
+    int magic;
+    int version;
+    int nslots;
+    int backing_nblks;
+    int stripe;
+    int head;
+};
+
+struct cache_ent {
+    int lba;
+    int flags;
+};
+
+#define CACHE_ENTS_PER_BLK(bsize) ((bsize) / (int)sizeof(struct cache_ent))
+
+struct cache_dev {
+    struct blkdev *ssd;
+    struct blkdev *backing;
+    int bsize;               /* block size of both devices */
+    int ents_per_blk;
+    int stripe;              /* backing stripe width, in blocks */
+    int nblks;               /* size of the backing volume */
+    int nslots;
+    int meta_blks;
+    int data_start;          /* first data slot block on the ssd */
+    int head;                /* next slot in the log */
+    int ndirty;
+    int hiwat;               /* destage when ndirty reaches this */
+    int *map;                /* backing lba -> slot, or -1 */
+    struct cache_ent *ents;  /* in-memory copy of the slot table */
+    char *meta_dirty;        /* slot table blocks needing a write */
+};
+
+static blkno_t cache_num_blocks(struct blkdev *dev)
+{
+    struct cache_dev *c = dev->private;
+    return c->nblks;
+}
+
+static int cache_block_size(struct blkdev *dev)
+{
+    struct cache_dev *c = dev->private;
+    return c->bsize;
+}
+
+static int slot_blk(struct cache_dev *c, int slot)
+{
+    return c->data_start + slot;
+}
+
+static void mark_meta(struct cache_dev *c, int slot)
+{
+    c->meta_dirty[slot / c->ents_per_blk] = 1;
+}
+
+/* write out the slot table blocks that changed since the last call.
+ */
+static int write_meta(struct cache_dev *c)
+{
+    int val;
+    for (int i = 0; i < c->meta_blks; i++) {
+        if (!c->meta_dirty[i])
+            continue;
+        val = blkdev_write(c->ssd, 1 + i, 1,
+                           (char *)c->ents + i * c->bsize);
+        if (val != SUCCESS)
+            return val;
+        c->meta_dirty[i] = 0;
+    }
+    return SUCCESS;
+}
+
+static int write_super(struct cache_dev *c)
+{
+    char *buf = calloc(1, c->bsize);
+    struct cache_super *sb = (struct cache_super *)buf;
+    sb->magic = CACHE_MAGIC;
+    sb->version = CACHE_VERSION;
+    sb->nslots = c->nslots;
+    sb->backing_nblks = c->nblks;
+    sb->stripe = c->stripe;
+    sb->head = c->head;
+    int val = blkdev_write(c->ssd, 0, 1, buf);
+    free(buf);
+    return val;
+}
+
+struct lba_slot {
+    int lba;
+    int slot;
+};
+
+static int cmp_by_lba(const void *a, const void *b)
+{
+    int la = ((const struct lba_slot *)a)->lba;
+    int lb = ((const struct lba_slot *)b)->lba;
+    return (la > lb) - (la < lb);
+}
+
+/* read 'n' slots (in order of 'ls') into buf, coalescing runs of
+ * consecutive slots into a single ssd read.
+ */
+static int read_slots(struct cache_dev *c, struct lba_slot *ls, int n, char *buf)
+{
+    int i = 0, val;
+    while (i < n) {
+        int len = 1;
+        while (i + len < n && ls[i + len].slot == ls[i].slot + len)
+            len++;
+        val = blkdev_read(c->ssd, slot_blk(c, ls[i].slot), len, buf);
+        if (val != SUCCESS)
+            return val;
+        buf += len * c->bsize;
+        i += len;
+    }
+    return SUCCESS;
+}
+
+/* destage every dirty slot to the backing volume. Dirty slots are
+ * sorted by LBA and written one stripe at a time; if the dirty blocks
+ * in a stripe do not form a contiguous run, the gaps are filled from
+ * the backing volume so that each stripe costs a single write.
+ */
+static int cache_destage(struct cache_dev *c)
+{
+    if (c->ndirty == 0)
+        return SUCCESS;
+
+    struct lba_slot *dirty = malloc(c->ndirty * sizeof(*dirty));
+    char *buf = malloc(c->stripe * c->bsize);
+    char *tmp = malloc(c->stripe * c->bsize);
+    int n = 0, val = SUCCESS;
+
+    for (int s = 0; s < c->nslots; s++) {
+        if (c->ents[s].flags & SLOT_DIRTY) {
+            dirty[n].lba = c->ents[s].lba;
+            dirty[n].slot = s;
+            n++;
+        }
+    }
+    assert(n == c->ndirty);
+    qsort(dirty, n, sizeof(*dirty), cmp_by_lba);
+
+    int i = 0;
+    while (i < n) {
+        /* gather the dirty slots that fall in this stripe */
+        int stripe_num = dirty[i].lba / c->stripe;
+        int k = 0;
+        while (i + k < n && dirty[i + k].lba / c->stripe == stripe_num)
+            k++;
+        int lo = dirty[i].lba;
+        int hi = dirty[i + k - 1].lba;
+        int span = hi - lo + 1;
+
+        if (span == k) {
+            /* contiguous - read straight from the cache */
+            val = read_slots(c, &dirty[i], k, buf);
+        } else {
+            val = blkdev_read(c->backing, lo, span, buf);
+            if (val == SUCCESS)
+                val = read_slots(c, &dirty[i], k, tmp);
+            for (int j = 0; val == SUCCESS && j < k; j++) {
+                int off = dirty[i + j].lba - lo;
+                memcpy(buf + off * c->bsize, tmp + j * c->bsize, c->bsize);
+            }
+        }
+        if (val == SUCCESS)
+            val = blkdev_write(c->backing, lo, span, buf);
+        if (val != SUCCESS)
+            break;
+
+        for (int j = 0; j < k; j++) {
+            c->ents[dirty[i + j].slot].flags &= ~SLOT_DIRTY;
+            mark_meta(c, dirty[i + j].slot);
+        }
+        c->ndirty -= k;
+        i += k;
+    }
+
+    /* only mark slots clean on the cache once the backing writes are
+     * durable; until then a crash must find them dirty
+     */
+    if (n > 0 && blkdev_flush(c->backing) != SUCCESS)
+        val = E_UNAVAIL;
+    else if (write_meta(c) != SUCCESS && val == SUCCESS)
+        val = E_UNAVAIL;
+
+    free(dirty);
+    free(buf);
+    free(tmp);
+    return val;
+}
+
+/* take the slot at the head of the log, destaging or evicting
+ * whatever is there. Returns the slot number or an error; '*evicted'
+ * is set if a valid entry was dropped, which has to reach the slot
+ * table before the slot is overwritten.
+ */
+static int alloc_slot(struct cache_dev *c, int *evicted)
+{
+    int s = c->head;
+    if (c->ents[s].flags & SLOT_DIRTY) {
+        int val = cache_destage(c);
+        if (val != SUCCESS)
+            return val;
+    }
+    if (c->ents[s].flags & SLOT_VALID) {
+        c->map[c->ents[s].lba] = -1;
+        mark_meta(c, s);
+        *evicted = 1;
+    }
+    c->ents[s].flags = 0;
+    c->head = (c->head + 1) % c->nslots;
+    return s;
+}
+
+/* read blocks, taking cached blocks from the cache device and the rest
+ * from the backing volume. Runs of misses and runs of consecutive
+ * cache slots are each read with a single call.
+ */
+static int cache_read(struct blkdev *dev, blkno_t first_blk, int num_blks, void *buf)
+{
+    struct cache_dev *c = dev->private;
+    int val;
+
+    if (first_blk < 0 || num_blks < 0 || first_blk > c->nblks - num_blks)
+        return E_BADADDR;
+
+    int i = 0;
+    while (i < num_blks) {
+        int s = c->map[first_blk + i];
+        int len = 1;
+        if (s < 0) {
+            while (i + len < num_blks && c->map[first_blk + i + len] < 0)
+                len++;
+            val = blkdev_read(c->backing, first_blk + i, len, buf);
+        } else {
+            while (i + len < num_blks && c->map[first_blk + i + len] == s + len)
+                len++;
+            val = blkdev_read(c->ssd, slot_blk(c, s), len, buf);
+        }
+        if (val != SUCCESS)
+            return val;
+        buf += len * c->bsize;
+        i += len;
+    }
+    return SUCCESS;
+}
+
+/* write directly to the backing volume, dropping any cached copies
+ * of the blocks being overwritten.
+ */
+static int cache_write_around(struct cache_dev *c, blkno_t first_blk,
+                              int num_blks, void *buf)
+{
+    for (blkno_t lba = first_blk; lba < first_blk + num_blks; lba++) {
+        int s = c->map[lba];
+        if (s < 0)
+            continue;
+        if (c->ents[s].flags & SLOT_DIRTY)
+            c->ndirty--;
+        c->ents[s].flags = 0;
+        c->map[lba] = -1;
+        mark_meta(c, s);
+    }
+    int val = write_meta(c);
+    if (val == SUCCESS)
+        val = blkdev_flush(c->ssd);
+    if (val != SUCCESS)
+        return val;
+    return blkdev_write(c->backing, first_blk, num_blks, buf);
+}
+
+/* forget the slots a failed cache_write allocated but never filled */
+static void unmap_unfilled(struct cache_dev *c, blkno_t first_blk, int num_blks)
+{
+    for (blkno_t lba = first_blk; lba < first_blk + num_blks; lba++) {
+        int s = c->map[lba];
+        if (s >= 0 && c->ents[s].flags == 0)
+            c->map[lba] = -1;
+    }
+}
+
+/* write blocks into the cache. Blocks already cached are overwritten
+ * in place; new blocks are appended at the log head. Slots are
+ * allocated first, and new entries only become valid once the data is
+ * written: any eviction is made durable before its slot is reused,
+ * and the data before the entries that point to it, so that a crash
+ * never leaves an entry pointing at another block's data.
+ */
+static int cache_write(struct blkdev *dev, blkno_t first_blk, int num_blks, void *buf)
+{
+    struct cache_dev *c = dev->private;
+    int val;
+    int evicted = 0, filled = 0;
+
+    if (first_blk < 0 || num_blks < 0 || first_blk > c->nblks - num_blks)
+        return E_BADADDR;
+
+    /* large writes are already sequential - send them around the cache */
+    if (num_blks > c->nslots / 2)
+        return cache_write_around(c, first_blk, num_blks, buf);
+
+    /* new slots stay invalid (flags 0) until filled, so a destage
+     * while allocating leaves them alone. The log head can evict a
+     * block of this write that was already cached; it gets a new slot
+     * on the next pass.
+     */
+    int missing;
+    do {
+        missing = 0;
+        for (int i = 0; i < num_blks; i++) {
+            int lba = first_blk + i;
+            if (c->map[lba] >= 0)
+                continue;
+            int s = alloc_slot(c, &evicted);
+            if (s < 0) {
+                unmap_unfilled(c, first_blk, num_blks);
+                return s;
+            }
+            c->map[lba] = s;
+            c->ents[s].lba = lba;
+        }
+        for (int i = 0; i < num_blks; i++)
+            if (c->map[first_blk + i] < 0)
+                missing = 1;
+    } while (missing);
+    if (evicted) {
+        val = write_meta(c);
+        if (val == SUCCESS)
+            val = blkdev_flush(c->ssd);
+        if (val != SUCCESS) {
+            unmap_unfilled(c, first_blk, num_blks);
+            return val;
+        }
+    }
+
+    int i = 0;
+    while (i < num_blks) {
+        int s = c->map[first_blk + i];
+        int len = 1;
+        while (i + len < num_blks && c->map[first_blk + i + len] == s + len)
+            len++;
+        val = blkdev_write(c->ssd, slot_blk(c, s), len, (char *)buf + i * c->bsize);
+        if (val != SUCCESS) {
+            unmap_unfilled(c, first_blk, num_blks);
+            return val;
+        }
+        i += len;
+    }
+
+    for (int i = 0; i < num_blks; i++) {
+        int s = c->map[first_blk + i];
+        if (!(c->ents[s].flags & SLOT_DIRTY)) {
+            c->ents[s].flags = SLOT_VALID | SLOT_DIRTY;
+            c->ndirty++;
+            mark_meta(c, s);
+            filled = 1;
+        }
+    }
+    if (filled) {
+        val = blkdev_flush(c->ssd);
+        if (val == SUCCESS)
+            val = write_meta(c);
+        if (val != SUCCESS)
+            return val;
+    }
+
+    if (c->ndirty >= c->hiwat)
+        return cache_destage(c);
+    return SUCCESS;
+}
+
+/* write back all dirty blocks, leaving them cached (clean).
+ */
+int cache_flush(struct blkdev *dev)
+{
+    struct cache_dev *c = dev->private;
+    return cache_destage(c);
+}
+
+/* dirty blocks stay on the cache device across a close; they are
+ * found again by cache_create and destaged later.
+ */
+static void cache_close(struct blkdev *dev)
+{
+    struct cache_dev *c = dev->private;
+    write_meta(c);
+    write_super(c);
+    blkdev_close(c->ssd);
+    blkdev_close(c->backing);
+    free(c->map);
+    free(c->ents);
+    free(c->meta_dirty);
+    free(c);
+    dev->private = NULL;
+    free(dev);
+}
+
+static int cache_members(struct blkdev *dev, struct blkdev **out, int max)
+{
+    struct cache_dev *c = dev->private;
+    int n = 0;
+    if (n < max)
+        out[n++] = c->ssd;
+    if (n < max)
+        out[n++] = c->backing;
+    return n;
+}
+
+struct blkdev_ops cache_ops = {
+    .num_blocks = cache_num_blocks,
+    .read = cache_read,
+    .write = cache_write,
+    .close = cache_close,
+    .members = cache_members,
+    .block_size = cache_block_size,
+    .type = "cache"
+};
+
+/* load the slot table from an existing cache, rebuilding the lba map.
+ */
+static int cache_load(struct cache_dev *c, struct cache_super *sb)
+{
+    int val = blkdev_read(c->ssd, 1, c->meta_blks, c->ents);
+    if (val != SUCCESS)
+        return val;
+    for (int s = 0; s < c->nslots; s++) {
+        struct cache_ent *e = &c->ents[s];
+        if (!(e->flags & SLOT_VALID))
+            continue;
+        if (e->lba < 0 || e->lba >= c->nblks || c->map[e->lba] >= 0) {
+            printf("Error: cache slot table corrupt (slot %d).\n", s);
+            return E_SIZE;
+        }
+        c->map[e->lba] = s;
+        if (e->flags & SLOT_DIRTY)
+            c->ndirty++;
+    }
+    c->head = (sb->head >= 0 && sb->head < c->nslots) ? sb->head : 0;
+    return SUCCESS;
+}
+
+/* create a write-back cache using 'ssd' in front of 'backing'.
+ * 'stripe' is the full stripe width of the backing volume in blocks
+ * (unit*N for raid0 and raid4) and is used to group destage writes.
+ * If 'ssd' already holds a cache for a volume of the same size, its
+ * contents (including dirty blocks) are used; otherwise it is
+ * formatted.
+ */
+struct blkdev *cache_create(struct blkdev *ssd, struct blkdev *backing, int stripe)
+{
+    blkno_t ssd_blks = blkdev_num_blocks(ssd);
+    if (stripe < 1)
+        stripe = 1;
+
+    /* the block map and the slot table hold int block numbers */
+    if (blkdev_num_blocks(backing) > INT_MAX) {
+        printf("Error: volume too large to cache.\n");
+        return NULL;
+    }
+
+    int bsize = blkdev_block_size(ssd);
+    if (blkdev_block_size(backing) != bsize) {
+        printf("Error: cache device block size not the volume's.\n");
+        return NULL;
+    }
+
+    /* each slot costs one data block plus one slot table entry */
+    int per = CACHE_ENTS_PER_BLK(bsize);
+    blkno_t slots = (ssd_blks - 1) * per / (per + 1);
+    int nslots = slots < INT_MAX / 2 ? slots : INT_MAX / 2;
+    while (nslots > 0 && 1 + (nslots + per - 1) / per
+           + nslots > ssd_blks)
+        nslots--;
+    if (nslots < 2) {
+        printf("Error: cache device too small.\n");
+        return NULL;
+    }
+
+    struct blkdev *dev = calloc(1, sizeof(*dev));
+    struct cache_dev *c = malloc(sizeof(*c));
+
+    c->ssd = ssd;
+    c->backing = backing;
+    c->bsize = bsize;
+    c->ents_per_blk = per;
+    c->stripe = stripe;
+    c->nblks = blkdev_num_blocks(backing);
+    c->nslots = nslots;
+    c->meta_blks = (nslots + c->ents_per_blk - 1) / c->ents_per_blk;
+    c->data_start = 1 + c->meta_blks;
+    c->head = 0;
+    c->ndirty = 0;
+    c->hiwat = nslots * 3 / 4;
+    if (c->hiwat < 1)
+        c->hiwat = 1;
+    c->map = malloc(c->nblks * sizeof(int));
+    c->ents = calloc(c->meta_blks * c->ents_per_blk, sizeof(struct cache_ent));
+    c->meta_dirty = calloc(c->meta_blks, 1);
+    for (int i = 0; i < c->nblks; i++)
+        c->map[i] = -1;
+
+    char *buf = malloc(bsize);
+    struct cache_super *sb = (struct cache_super *)buf;
+    if (blkdev_read(ssd, 0, 1, buf) != SUCCESS)
+        goto fail;
+
+    if (sb->magic == CACHE_MAGIC && sb->version == CACHE_VERSION) {
+        if (sb->nslots != nslots || sb->backing_nblks != c->nblks) {
+            printf("Error: cache belongs to a different volume.\n");
+            goto fail;
+        }
+        if (cache_load(c, sb) != SUCCESS)
+            goto fail;
+    } else {
+        /* new cache: clear the slot table, then write the superblock */
+        memset(c->meta_dirty, 1, c->meta_blks);
+        if (write_meta(c) != SUCCESS || write_super(c) != SUCCESS)
+            goto fail;
+    }
+    free(buf);
+
+    dev->private = c;
+    dev->ops = &cache_ops;
+    return dev;
+
+fail:
+    free(buf);
+    free(c->map);
+    free(c->ents);
+    free(c->meta_dirty);
+    free(c);
+    free(dev);
+    return NULL;
+}
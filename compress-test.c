@@ -0,0 +1,264 @@
+#include "blkdev.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+#include <pthread.h>
+
+#define DISK_BLKS 4096
+#define CHUNK 8
+#define UNIT 4
+
+/* every block holds "seq:lba" - compresses well */
+void fill_block(char *buf, int seq, blkno_t lba){
+	memset(buf, 0, BLOCK_SIZE);
+	sprintf(buf, "%d:%lld", seq, lba);
+}
+
+void write_range(struct blkdev *dev, blkno_t lba, int len, int seq){
+	char buf[64*BLOCK_SIZE];
+	for (int i = 0; i < len; i++)
+		fill_block(&buf[i*BLOCK_SIZE], seq, lba + i);
+	if (blkdev_write(dev, lba, len, buf) != SUCCESS) {
+		printf("Write at %lld failed!\n", lba);
+		exit(1);
+	}
+}
+
+void check_range(struct blkdev *dev, blkno_t lba, int len, int seq){
+	char buf[64*BLOCK_SIZE], expect[BLOCK_SIZE];
+	if (blkdev_read(dev, lba, len, buf) != SUCCESS) {
+		printf("Read at %lld failed!\n", lba);
+		exit(1);
+	}
+	for (int i = 0; i < len; i++) {
+		fill_block(expect, seq, lba + i);
+		if (memcmp(&buf[i*BLOCK_SIZE], expect, BLOCK_SIZE) != 0) {
+			printf("Block %lld doesn't match: %s, expected %s\n",
+			       lba + i, &buf[i*BLOCK_SIZE], expect);
+			exit(1);
+		}
+	}
+}
+
+void write_all(struct blkdev *dev, int seq){
+	blkno_t n = blkdev_num_blocks(dev);
+	for (blkno_t lba = 0; lba < n; lba += 64)
+		write_range(dev, lba, n - lba < 64 ? n - lba : 64, seq);
+}
+
+void check_all(struct blkdev *dev, int seq){
+	blkno_t n = blkdev_num_blocks(dev);
+	for (blkno_t lba = 0; lba < n; lba += 64)
+		check_range(dev, lba, n - lba < 64 ? n - lba : 64, seq);
+}
+
+long long blocks_written(struct blkdev *disk){
+	return disk->stats.blocks[BLKDEV_WRITE];
+}
+
+void basic_tests(void){
+	struct blkdev *disk = ramdisk_create(DISK_BLKS);
+	struct blkdev *dev = compress_create(disk, CHUNK);
+	char buf[64*BLOCK_SIZE], zeros[BLOCK_SIZE] = {0};
+	blkno_t n = blkdev_num_blocks(dev);
+	assert(n % CHUNK == 0 && n > DISK_BLKS * 3 / 4 && n < DISK_BLKS);
+	assert(blkdev_read(dev, n - 1, 2, buf) == E_BADADDR);
+	assert(blkdev_read(dev, 100, 1, buf) == SUCCESS);        /* never written */
+	assert(memcmp(buf, zeros, BLOCK_SIZE) == 0);
+	assert(blkdev_next_data(dev, 0) == n);
+
+	long long before = blocks_written(disk);
+	write_all(dev, 1);
+	check_all(dev, 1);
+	struct compress_stats st;
+	compress_stats(dev, &st);
+	assert(st.chunks == n / CHUNK && st.raw_chunks == 0 && st.zero_chunks == 0);
+	assert(st.bytes_in == n * BLOCK_SIZE && st.bytes_out * 4 < st.bytes_in);
+	assert((blocks_written(disk) - before) * 4 < n);
+	printf("compressed %lld bytes to %lld\n", st.bytes_in, st.bytes_out);
+
+	/* writes that start and end partway through chunks */
+	write_range(dev, 13, 22, 2);
+	check_range(dev, 5, 8, 1);
+	check_range(dev, 13, 22, 2);
+	check_range(dev, 35, 10, 1);
+	write_range(dev, 81, 3, 3);
+	check_range(dev, 80, 1, 1);
+	check_range(dev, 81, 3, 3);
+	check_range(dev, 84, 4, 1);
+	assert(blkdev_read(dev, 30, 10, buf) == SUCCESS);
+	assert(strcmp(&buf[4*BLOCK_SIZE], "2:34") == 0 && strcmp(&buf[5*BLOCK_SIZE], "1:35") == 0);
+
+	/* data that doesn't compress is stored as it is */
+	for (int i = 0; i < (int)sizeof(buf); i++)
+		buf[i] = rand();
+	assert(blkdev_write(dev, 200, 16, buf) == SUCCESS);
+	compress_stats(dev, &st);
+	assert(st.raw_chunks == 2);
+	char back[16*BLOCK_SIZE];
+	assert(blkdev_read(dev, 200, 16, back) == SUCCESS);
+	assert(memcmp(buf, back, sizeof(back)) == 0);
+
+	/* zeros and discarded blocks take no space */
+	memset(buf, 0, sizeof(buf));
+	assert(blkdev_write(dev, 0, 16, buf) == SUCCESS);
+	compress_stats(dev, &st);
+	assert(st.zero_chunks == 2);
+	assert(blkdev_discard(dev, 300, 205) == SUCCESS);
+	assert(blkdev_read(dev, 296, 64, buf) == SUCCESS);
+	check_range(dev, 296, 4, 1);
+	for (int i = 4; i < 64; i++)
+		assert(memcmp(&buf[i*BLOCK_SIZE], zeros, BLOCK_SIZE) == 0);
+	check_range(dev, 505, 3, 1);
+	assert(blkdev_next_data(dev, 3) == 16);
+	assert(blkdev_next_data(dev, 310) == 504);
+	blkdev_close(dev);
+	printf("compress layer test passed\n");
+}
+
+/* random writes, some compressible and some not, against a copy in
+ * memory: space is reused and chunks end up scattered
+ */
+void random_test(void){
+	struct blkdev *dev = compress_create(ramdisk_create(DISK_BLKS), 16);
+	blkno_t n = blkdev_num_blocks(dev);
+	char *model = calloc(n, BLOCK_SIZE), buf[100*BLOCK_SIZE];
+	srand(5);
+	for (int i = 0; i < 2000; i++) {
+		int len = 1 + rand() % 100;
+		blkno_t lba = rand() % (n - len + 1);
+		char *p = &model[lba*BLOCK_SIZE];
+		if (rand() % 2) {
+			for (int k = 0; k < len * BLOCK_SIZE; k++)
+				p[k] = rand();
+		} else {
+			for (int k = 0; k < len; k++)
+				fill_block(&p[k*BLOCK_SIZE], i, lba + k);
+		}
+		assert(blkdev_write(dev, lba, len, p) == SUCCESS);
+		lba = rand() % (n - len + 1);
+		assert(blkdev_read(dev, lba, len, buf) == SUCCESS);
+		assert(memcmp(buf, &model[lba*BLOCK_SIZE], len * BLOCK_SIZE) == 0);
+	}
+	for (blkno_t lba = 0; lba < n; lba += 100) {
+		int len = n - lba < 100 ? n - lba : 100;
+		assert(blkdev_read(dev, lba, len, buf) == SUCCESS);
+		assert(memcmp(buf, &model[lba*BLOCK_SIZE], len * BLOCK_SIZE) == 0);
+	}
+	free(model);
+	blkdev_close(dev);
+	printf("random write test passed\n");
+}
+
+/* the map is on the volume: it comes back next time */
+void remount_test(void){
+	char *path = "compress-disk";
+	FILE *fp = fopen(path, "w");
+	assert(fp != NULL);
+	assert(ftruncate(fileno(fp), (long)DISK_BLKS * BLOCK_SIZE) == 0);
+	fclose(fp);
+	struct blkdev *dev = compress_create(image_create(path), CHUNK);
+	write_all(dev, 1);
+	write_range(dev, 40, 20, 2);
+	assert(blkdev_discard(dev, 1000, 64) == SUCCESS);
+	blkdev_close(dev);
+
+	dev = compress_create(image_create(path), CHUNK);
+	check_range(dev, 0, 40, 1);
+	check_range(dev, 40, 20, 2);
+	check_range(dev, 60, 64, 1);
+	assert(blkdev_next_data(dev, 1000) == 1064);
+	write_range(dev, 200, 10, 3);
+	check_range(dev, 200, 10, 3);
+	blkdev_close(dev);
+
+	/* another chunk size is refused, leaving the volume as it was */
+	struct blkdev *disk = image_create(path);
+	assert(compress_create(disk, 2 * CHUNK) == NULL);
+	blkdev_close(disk);
+	dev = compress_create(image_create(path), CHUNK);
+	check_range(dev, 40, 20, 2);
+	check_range(dev, 200, 10, 3);
+	blkdev_close(dev);
+	disk = ramdisk_create(DISK_BLKS);
+	assert(compress_create(disk, 1000) == NULL);
+	blkdev_close(disk);
+	unlink(path);
+	printf("remount test passed\n");
+}
+
+/* on a raid4 volume, the members (and parity) see fewer writes than
+ * for the same data written to a plain one
+ */
+long long raid4_writes(int compress, struct blkdev **vol, struct blkdev **disks){
+	for (int i = 0; i < 4; i++)
+		disks[i] = ramdisk_create(DISK_BLKS);
+	*vol = raid4_create(4, disks, UNIT);
+	struct blkdev *dev = compress ? compress_create(*vol, CHUNK) : *vol;
+	long long written = 0;
+	for (int i = 0; i < 4; i++)
+		written -= blocks_written(disks[i]);
+	write_all(dev, 1);
+	for (int i = 0; i < 4; i++)
+		written += blocks_written(disks[i]);
+	*vol = dev;
+	return written;
+}
+
+void raid4_test(void){
+	struct blkdev *disks[4], *dev;
+	long long plain = raid4_writes(0, &dev, disks);
+	blkdev_close(dev);
+	long long written = raid4_writes(1, &dev, disks);
+	printf("raid4 members wrote %lld blocks, %lld uncompressed\n", written, plain);
+	assert(written * 2 < plain);
+	ramdisk_fail(disks[1]);
+	check_all(dev, 1);
+	write_range(dev, 77, 30, 2);
+	check_range(dev, 77, 30, 2);
+	blkdev_close(dev);
+	printf("raid4 test passed\n");
+}
+
+/* writers of single blocks share every chunk */
+struct writer {
+	struct blkdev *dev;
+	int id;
+};
+
+void *writer_thread(void *arg){
+	struct writer *w = arg;
+	blkno_t n = blkdev_num_blocks(w->dev);
+	for (int pass = 0; pass < 5; pass++)
+		for (blkno_t lba = w->id; lba < n; lba += 8)
+			write_range(w->dev, lba, 1, pass);
+	return NULL;
+}
+
+void concurrent_test(void){
+	struct blkdev *dev = compress_create(ramdisk_create(DISK_BLKS), CHUNK);
+	struct writer w[8];
+	pthread_t t[8];
+	for (int i = 0; i < 8; i++) {
+		w[i].dev = dev;
+		w[i].id = i;
+		pthread_create(&t[i], NULL, writer_thread, &w[i]);
+	}
+	for (int i = 0; i < 8; i++)
+		pthread_join(t[i], NULL);
+	check_all(dev, 4);
+	blkdev_close(dev);
+	printf("concurrent writers test passed\n");
+}
+
+int main(){
+	basic_tests();
+	random_test();
+	remount_test();
+	raid4_test();
+	concurrent_test();
+	printf("compress tests passed.\n");
+	return 0;
+}
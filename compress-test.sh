@@ -0,0 +1,3 @@
+#!/bin/sh
+
+gcc -g3 -o compress-test compress-test.c image.c homework.c journal.c superblock.c compress.c ramdisk.c -lpthread -lm
@@ -0,0 +1,771 @@
+/*
+ * file:        compress.c
+ * description: compressing layer - stores fixed-size chunks of the
+ *              device LZ4-compressed on the volume underneath, so
+ *              fewer bytes reach the members (and their parity)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "blkdev.h"
+
+/* Layout of the underlying volume:
+ *
+ *   header | map | data blocks
+ *
+ * The device is divided into chunks of 'chunk_blks' blocks. The map
+ * has a record per chunk: its compressed length in bytes, and the data
+ * blocks holding it. A length of 0 is a chunk of zeros, with no
+ * blocks. A chunk that doesn't compress by at least a block is stored
+ * as it is, with a length of a whole chunk.
+ *
+ * Writes never overwrite live data: chunks go to free blocks, then
+ * their map records are written, and only then are the old blocks
+ * freed, so after a crash each chunk is either old or new. The chunks
+ * of a request are packed one after another into blocks taken from
+ * where the last write ended, so a sequential run of chunks is written
+ * and read back with one request to the volume. Blocks don't have to
+ * be contiguous, though, so a write always finds room: the device is
+ * the size of the volume less the map and COMPRESS_BATCH chunks for
+ * writes in flight. Compression cuts the bytes moved, not the space.
+ */
+#define COMPRESS_MAGIC   0x435a4d50
+#define COMPRESS_BATCH   32         /* chunks stored per step */
+#define COMPRESS_LOCKS   64         /* chunk and map block locks, hashed */
+#define COMPRESS_MAX_CHUNK 64       /* blocks */
+
+struct compress_hdr {
+    long long nchunks;
+    int magic;
+    int bsize;
+    int chunk_blks;
+    unsigned int hdr_sum;
+};
+
+struct compress_dev {
+    struct blkdev *vol;
+    int bsize;                      /* block size of the volume, and of ours */
+    int chunk_blks;
+    int chunk_bytes;
+    long long nchunks;
+    int rec_words;                  /* uint32s per map record */
+    int recs_per_blk;
+    blkno_t map_blks;
+    blkno_t data_start;
+    blkno_t data_blks;
+
+    /* a record is the length, then the blocks (from data_start). The
+     * length is only changed with the chunk's map block locked, and
+     * read atomically where it isn't.
+     */
+    uint32_t *map;
+    pthread_mutex_t chunk_locks[COMPRESS_LOCKS];
+    pthread_mutex_t map_locks[COMPRESS_LOCKS];
+
+    pthread_mutex_t alloc_lock;     /* protects the fields below */
+    pthread_cond_t freed;
+    uint64_t *used;                 /* data block bitmap */
+    blkno_t nfree;
+    blkno_t cursor;                 /* where the next allocation looks first */
+    struct compress_stats st;
+};
+
+static unsigned int compress_sum(void *p, int len)
+{
+    unsigned int *w = p, h = 2166136261u;
+    for (int i = 0; i < len / 4; i++)
+        h = (h ^ w[i]) * 16777619u;
+    return h;
+}
+
+/********** LZ4 ***************/
+
+/* The LZ4 block format. A sequence is a token (literal length << 4 |
+ * match length - 4), the literal length continued in bytes of 255 if
+ * it is 15 or more, the literals, a 2-byte little-endian offset back
+ * to the match, and the match length continued the same way. The last
+ * sequence is just literals, and matches stop 5 bytes before the end.
+ */
+#define LZ4_HASH_LOG  11
+#define LZ4_MIN_MATCH 4
+
+static uint32_t read32(const unsigned char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static int lz4_hash(uint32_t v)
+{
+    return (v * 2654435761u) >> (32 - LZ4_HASH_LOG);
+}
+
+static unsigned char *lz4_put_len(unsigned char *op, int n)
+{
+    for (; n >= 255; n -= 255)
+        *op++ = 255;
+    *op++ = n;
+    return op;
+}
+
+/* compress 'n' bytes into at most 'cap'; returns the compressed length,
+ * or -1 if it doesn't fit. Greedy, with the last position seen for
+ * each hash of 4 bytes; it skips ahead faster the longer it goes
+ * without a match, so incompressible data is given up on quickly.
+ */
+static int lz4_compress(const unsigned char *src, int n, unsigned char *dst, int cap)
+{
+    int table[1 << LZ4_HASH_LOG];
+    const unsigned char *ip = src, *anchor = src, *end = src + n;
+    const unsigned char *mflimit = end - 12, *matchlimit = end - 5;
+    unsigned char *op = dst, *oend = dst + cap;
+    int misses = 0, lit;
+
+    memset(table, 0xff, sizeof(table));
+    while (n >= 13 && ip < mflimit) {
+        uint32_t v = read32(ip);
+        int h = lz4_hash(v), ref = table[h];
+        table[h] = ip - src;
+        if (ref < 0 || ip - src - ref > 65535 || read32(src + ref) != v) {
+            ip += 1 + (misses++ >> 5);
+            continue;
+        }
+        misses = 0;
+        const unsigned char *match = src + ref;
+        while (ip > anchor && match > src && ip[-1] == match[-1]) {
+            ip--;
+            match--;
+        }
+        const unsigned char *m = ip + LZ4_MIN_MATCH, *r = match + LZ4_MIN_MATCH;
+        while (m < matchlimit && *m == *r) {
+            m++;
+            r++;
+        }
+        lit = ip - anchor;
+        int mlen = m - ip - LZ4_MIN_MATCH, off = ip - match;
+        if (oend - op < 1 + lit / 255 + 1 + lit + 2 + mlen / 255 + 1)
+            return -1;
+        unsigned char *token = op++;
+        *token = (lit < 15 ? lit : 15) << 4 | (mlen < 15 ? mlen : 15);
+        if (lit >= 15)
+            op = lz4_put_len(op, lit - 15);
+        memcpy(op, anchor, lit);
+        op += lit;
+        *op++ = off;
+        *op++ = off >> 8;
+        if (mlen >= 15)
+            op = lz4_put_len(op, mlen - 15);
+        ip = anchor = m;
+    }
+    lit = end - anchor;
+    if (oend - op < 1 + lit / 255 + 1 + lit)
+        return -1;
+    *op++ = (lit < 15 ? lit : 15) << 4;
+    if (lit >= 15)
+        op = lz4_put_len(op, lit - 15);
+    memcpy(op, anchor, lit);
+    op += lit;
+    return op - dst;
+}
+
+static int lz4_get_len(const unsigned char **ip, const unsigned char *iend, int n)
+{
+    int b;
+    do {
+        if (*ip >= iend)
+            return -1;
+        b = *(*ip)++;
+        n += b;
+    } while (b == 255);
+    return n;
+}
+
+/* returns the decompressed length, or -1 if 'src' is not a valid block
+ * that decompresses to at most 'cap' bytes
+ */
+static int lz4_decompress(const unsigned char *src, int n, unsigned char *dst, int cap)
+{
+    const unsigned char *ip = src, *iend = src + n;
+    unsigned char *op = dst, *oend = dst + cap;
+    while (ip < iend) {
+        int token = *ip++;
+        int lit = token >> 4;
+        if (lit == 15 && (lit = lz4_get_len(&ip, iend, lit)) < 0)
+            return -1;
+        if (lit > iend - ip || lit > oend - op)
+            return -1;
+        memcpy(op, ip, lit);
+        op += lit;
+        ip += lit;
+        if (ip == iend)
+            break;
+        if (iend - ip < 2)
+            return -1;
+        int off = ip[0] | ip[1] << 8;
+        ip += 2;
+        int mlen = token & 15;
+        if (mlen == 15 && (mlen = lz4_get_len(&ip, iend, mlen)) < 0)
+            return -1;
+        mlen += LZ4_MIN_MATCH;
+        if (off == 0 || off > op - dst || mlen > oend - op)
+            return -1;
+        if (off >= mlen) {
+            memcpy(op, op - off, mlen);
+        } else {
+            for (int i = 0; i < mlen; i++)      /* overlaps: repeats */
+                op[i] = op[i - off];
+        }
+        op += mlen;
+    }
+    return op - dst;
+}
+
+/********** map and allocation ***************/
+
+static uint32_t *chunk_rec(struct compress_dev *c, long long chunk)
+{
+    return c->map + chunk * c->rec_words;
+}
+
+static int rec_len(uint32_t *rec)
+{
+    return __atomic_load_n(&rec[0], __ATOMIC_ACQUIRE);
+}
+
+static int len_blks(struct compress_dev *c, int len)
+{
+    return (len + c->bsize - 1) / c->bsize;
+}
+
+/* lock (or unlock) the hashed locks of items first..first+n-1. They
+ * are taken in index order, whatever item a range starts at.
+ */
+static void lock_range(pthread_mutex_t *locks, long long first, long long n, int lock)
+{
+    for (int k = 0; k < COMPRESS_LOCKS; k++) {
+        if ((k - first % COMPRESS_LOCKS + COMPRESS_LOCKS) % COMPRESS_LOCKS >= n)
+            continue;
+        if (lock)
+            pthread_mutex_lock(&locks[k]);
+        else
+            pthread_mutex_unlock(&locks[k]);
+    }
+}
+
+static int block_used(struct compress_dev *c, blkno_t b)
+{
+    return (c->used[b / 64] >> (b % 64)) & 1;
+}
+
+static void set_used(struct compress_dev *c, blkno_t b, int used)
+{
+    if (used)
+        c->used[b / 64] |= 1ULL << (b % 64);
+    else
+        c->used[b / 64] &= ~(1ULL << (b % 64));
+}
+
+/* take 'n' free data blocks, waiting for writes in flight to free some
+ * if need be. A run of n starting at the cursor or after it is taken
+ * if there is one; otherwise the first n free blocks.
+ */
+static void alloc_blocks(struct compress_dev *c, int n, uint32_t *out)
+{
+    pthread_mutex_lock(&c->alloc_lock);
+    while (c->nfree < n)
+        pthread_cond_wait(&c->freed, &c->alloc_lock);
+    int got = 0;
+    blkno_t run = 0, b = c->cursor;
+    for (blkno_t i = 0; i < c->data_blks; i++, b++) {
+        if (b == c->data_blks) {
+            b = 0;
+            run = 0;
+        }
+        if (b % 64 == 0 && c->used[b / 64] == ~0ULL && b + 64 <= c->data_blks) {
+            i += 63;            /* a full word */
+            b += 63;
+            run = 0;
+            continue;
+        }
+        if (block_used(c, b)) {
+            run = 0;
+            continue;
+        }
+        if (got < n)
+            out[got++] = b;
+        if (++run == n) {
+            for (int k = 0; k < n; k++)
+                out[k] = b - n + 1 + k;
+            break;
+        }
+    }
+    for (int k = 0; k < n; k++)
+        set_used(c, out[k], 1);
+    c->nfree -= n;
+    c->cursor = (out[n - 1] + 1) % c->data_blks;
+    pthread_mutex_unlock(&c->alloc_lock);
+}
+
+static void free_blocks(struct compress_dev *c, int n, uint32_t *blocks)
+{
+    if (n == 0)
+        return;
+    pthread_mutex_lock(&c->alloc_lock);
+    for (int k = 0; k < n; k++)
+        set_used(c, blocks[k], 0);
+    c->nfree += n;
+    pthread_cond_broadcast(&c->freed);
+    pthread_mutex_unlock(&c->alloc_lock);
+}
+
+/* read or write 'n' data blocks to or from 'buf', one request per run
+ * of consecutive blocks
+ */
+static int data_io(struct compress_dev *c, int write, uint32_t *blocks, int n, char *buf)
+{
+    int val = SUCCESS;
+    for (int i = 0, len; i < n && val == SUCCESS; i += len) {
+        for (len = 1; i + len < n && blocks[i + len] == blocks[i] + len; len++)
+            ;
+        blkno_t lba = c->data_start + blocks[i];
+        char *p = buf + (size_t)i * c->bsize;
+        val = write ? blkdev_write(c->vol, lba, len, p) : blkdev_read(c->vol, lba, len, p);
+    }
+    return val;
+}
+
+/* write the map blocks holding records of chunks first..first+n-1,
+ * with those blocks locked
+ */
+static int write_map(struct compress_dev *c, long long first, long long n)
+{
+    blkno_t m0 = first / c->recs_per_blk;
+    blkno_t m1 = (first + n - 1) / c->recs_per_blk;
+    int rec_bytes = c->rec_words * sizeof(uint32_t);
+    char *buf = calloc(m1 - m0 + 1, c->bsize);
+    for (blkno_t m = m0; m <= m1; m++) {
+        long long ch = m * c->recs_per_blk;
+        long long k = c->nchunks - ch < c->recs_per_blk ? c->nchunks - ch : c->recs_per_blk;
+        memcpy(buf + (m - m0) * c->bsize, chunk_rec(c, ch), k * rec_bytes);
+    }
+    int val = blkdev_write(c->vol, 1 + m0, m1 - m0 + 1, buf);
+    free(buf);
+    return val;
+}
+
+/********** chunks ***************/
+
+static int all_zero(const char *p, int len)
+{
+    static const char zeros[256];
+    for (; len >= 256; len -= 256, p += 256) {
+        if (memcmp(p, zeros, 256) != 0)
+            return 0;
+    }
+    return memcmp(p, zeros, len) == 0;
+}
+
+/* read chunks first..first+n-1 (locked by the caller) into 'out' */
+static int load_chunks(struct compress_dev *c, long long first, int n, char *out)
+{
+    int cb = c->chunk_bytes, total = 0;
+    for (int i = 0; i < n; i++)
+        total += len_blks(c, rec_len(chunk_rec(c, first + i)));
+    uint32_t *blocks = malloc((total + 1) * sizeof(uint32_t));
+    char *packed = malloc((size_t)(total + 1) * c->bsize);
+    total = 0;
+    for (int i = 0; i < n; i++) {
+        uint32_t *rec = chunk_rec(c, first + i);
+        int nb = len_blks(c, rec_len(rec));
+        memcpy(blocks + total, rec + 1, nb * sizeof(uint32_t));
+        total += nb;
+    }
+
+    int val = data_io(c, 0, blocks, total, packed);
+    char *p = packed;
+    for (int i = 0; i < n && val == SUCCESS; i++) {
+        int len = rec_len(chunk_rec(c, first + i));
+        char *dst = out + (size_t)i * cb;
+        if (len == 0)
+            memset(dst, 0, cb);
+        else if (len == cb)
+            memcpy(dst, p, cb);
+        else if (lz4_decompress((unsigned char *)p, len, (unsigned char *)dst, cb) != cb)
+            val = E_CORRUPT;
+        p += (size_t)len_blks(c, len) * c->bsize;
+    }
+    free(packed);
+    free(blocks);
+    return val;
+}
+
+/* compress chunks first..first+n-1 (locked by the caller) from 'data',
+ * write them packed into new blocks, then their map records, and free
+ * their old blocks
+ */
+static int store_chunks(struct compress_dev *c, long long first, int n, const char *data)
+{
+    int cb = c->chunk_bytes, bsize = c->bsize, total = 0;
+    int len[COMPRESS_BATCH];
+    char *packed = malloc((size_t)n * cb);
+    long long raw = 0, zero = 0;
+
+    for (int i = 0; i < n; i++) {
+        const char *src = data + (size_t)i * cb;
+        char *dst = packed + (size_t)total * bsize;
+        if (all_zero(src, cb)) {
+            len[i] = 0;
+            zero++;
+            continue;
+        }
+        len[i] = lz4_compress((const unsigned char *)src, cb, (unsigned char *)dst, cb - bsize);
+        if (len[i] < 0) {
+            memcpy(dst, src, cb);
+            len[i] = cb;
+            raw++;
+        }
+        int nb = len_blks(c, len[i]);
+        memset(dst + len[i], 0, (size_t)nb * bsize - len[i]);
+        total += nb;
+    }
+
+    uint32_t *blocks = malloc((total + 1) * sizeof(uint32_t));
+    if (total > 0)
+        alloc_blocks(c, total, blocks);
+    int val = data_io(c, 1, blocks, total, packed);
+    free(packed);
+    if (val != SUCCESS) {
+        free_blocks(c, total, blocks);
+        free(blocks);
+        return val;
+    }
+
+    /* swap in the new records, keeping the old ones to free (or to put
+     * back if the map can't be written)
+     */
+    size_t rec_bytes = (size_t)n * c->rec_words * sizeof(uint32_t);
+    uint32_t *old = malloc(rec_bytes);
+    blkno_t m0 = first / c->recs_per_blk;
+    blkno_t mlen = (first + n - 1) / c->recs_per_blk - m0 + 1;
+    lock_range(c->map_locks, m0, mlen, 1);
+    memcpy(old, chunk_rec(c, first), rec_bytes);
+    for (int i = 0, k = 0; i < n; i++) {
+        uint32_t *rec = chunk_rec(c, first + i);
+        int nb = len_blks(c, len[i]);
+        memcpy(rec + 1, blocks + k, nb * sizeof(uint32_t));
+        __atomic_store_n(&rec[0], len[i], __ATOMIC_RELEASE);
+        k += nb;
+    }
+    val = write_map(c, first, n);
+    if (val != SUCCESS) {
+        for (int i = 0; i < n; i++) {
+            uint32_t *rec = chunk_rec(c, first + i);
+            memcpy(rec + 1, old + i * c->rec_words + 1, (c->rec_words - 1) * sizeof(uint32_t));
+            __atomic_store_n(&rec[0], old[i * c->rec_words], __ATOMIC_RELEASE);
+        }
+    }
+    lock_range(c->map_locks, m0, mlen, 0);
+
+    if (val != SUCCESS) {
+        free_blocks(c, total, blocks);
+    } else {
+        for (int i = 0; i < n; i++) {
+            uint32_t *rec = old + i * c->rec_words;
+            free_blocks(c, len_blks(c, rec[0]), rec + 1);
+        }
+        pthread_mutex_lock(&c->alloc_lock);
+        c->st.chunks += n;
+        c->st.raw_chunks += raw;
+        c->st.zero_chunks += zero;
+        c->st.bytes_in += (long long)n * cb;
+        c->st.bytes_out += (long long)total * bsize;
+        pthread_mutex_unlock(&c->alloc_lock);
+    }
+    free(old);
+    free(blocks);
+    return val;
+}
+
+/********** blkdev ops ***************/
+
+static blkno_t compress_num_blocks(struct blkdev *dev)
+{
+    struct compress_dev *c = dev->private;
+    return c->nchunks * c->chunk_blks;
+}
+
+static int compress_block_size(struct blkdev *dev)
+{
+    struct compress_dev *c = dev->private;
+    return c->bsize;
+}
+
+/* read or write blocks, COMPRESS_BATCH chunks at a time with those
+ * chunks locked. A write only partly covering its first or last chunk
+ * reads it first; a NULL 'buf' writes zeros.
+ */
+static int compress_rw(struct blkdev *dev, int write, blkno_t first_blk,
+                       blkno_t num_blks, char *buf)
+{
+    struct compress_dev *c = dev->private;
+    if (first_blk < 0 || num_blks < 0 || first_blk > compress_num_blocks(dev) - num_blks)
+        return E_BADADDR;
+    if (num_blks == 0)
+        return SUCCESS;
+    int C = c->chunk_blks, bsize = c->bsize;
+    long long chunk = first_blk / C, last = (first_blk + num_blks - 1) / C;
+    char *tmp = malloc((size_t)COMPRESS_BATCH * c->chunk_bytes);
+    int val = SUCCESS;
+
+    while (chunk <= last && val == SUCCESS) {
+        int n = last - chunk + 1 < COMPRESS_BATCH ? last - chunk + 1 : COMPRESS_BATCH;
+        blkno_t lo = chunk * C, hi = (chunk + n) * C;
+        blkno_t from = first_blk > lo ? first_blk : lo;
+        blkno_t to = first_blk + num_blks < hi ? first_blk + num_blks : hi;
+        char *ubuf = buf == NULL ? NULL : buf + (from - first_blk) * bsize;
+        size_t off = (from - lo) * bsize, len = (to - from) * bsize;
+
+        lock_range(c->chunk_locks, chunk, n, 1);
+        if (!write && from == lo && to == hi) {
+            val = load_chunks(c, chunk, n, ubuf);
+        } else if (!write) {
+            val = load_chunks(c, chunk, n, tmp);
+            if (val == SUCCESS)
+                memcpy(ubuf, tmp + off, len);
+        } else if (ubuf != NULL && from == lo && to == hi) {
+            val = store_chunks(c, chunk, n, ubuf);
+        } else {
+            if (from != lo)
+                val = load_chunks(c, chunk, 1, tmp);
+            if (val == SUCCESS && to != hi && (n > 1 || from == lo))
+                val = load_chunks(c, chunk + n - 1, 1, tmp + (size_t)(n - 1) * c->chunk_bytes);
+            if (ubuf != NULL)
+                memcpy(tmp + off, ubuf, len);
+            else
+                memset(tmp + off, 0, len);
+            if (val == SUCCESS)
+                val = store_chunks(c, chunk, n, tmp);
+        }
+        lock_range(c->chunk_locks, chunk, n, 0);
+        chunk += n;
+    }
+    free(tmp);
+    return val;
+}
+
+static int compress_read(struct blkdev *dev, blkno_t first_blk, int num_blks, void *buf)
+{
+    return compress_rw(dev, 0, first_blk, num_blks, buf);
+}
+
+static int compress_write(struct blkdev *dev, blkno_t first_blk, int num_blks, void *buf)
+{
+    return compress_rw(dev, 1, first_blk, num_blks, buf);
+}
+
+/* discarded chunks become chunks of zeros, with no blocks */
+static int compress_discard(struct blkdev *dev, blkno_t first_blk, blkno_t num_blks)
+{
+    return compress_rw(dev, 1, first_blk, num_blks, NULL);
+}
+
+static blkno_t compress_next_data(struct blkdev *dev, blkno_t first_blk)
+{
+    struct compress_dev *c = dev->private;
+    for (long long ch = first_blk / c->chunk_blks; ch < c->nchunks; ch++) {
+        if (rec_len(chunk_rec(c, ch)) != 0)
+            return first_blk > ch * c->chunk_blks ? first_blk : ch * c->chunk_blks;
+    }
+    return compress_num_blocks(dev);
+}
+
+static void compress_free(struct compress_dev *c)
+{
+    for (int i = 0; i < COMPRESS_LOCKS; i++) {
+        pthread_mutex_destroy(&c->chunk_locks[i]);
+        pthread_mutex_destroy(&c->map_locks[i]);
+    }
+    pthread_mutex_destroy(&c->alloc_lock);
+    pthread_cond_destroy(&c->freed);
+    free(c->map);
+    free(c->used);
+    free(c);
+}
+
+static void compress_close(struct blkdev *dev)
+{
+    struct compress_dev *c = dev->private;
+    blkdev_close(c->vol);
+    compress_free(c);
+    free(dev);
+}
+
+static int compress_members(struct blkdev *dev, struct blkdev **out, int max)
+{
+    struct compress_dev *c = dev->private;
+    if (max < 1)
+        return 0;
+    out[0] = c->vol;
+    return 1;
+}
+
+struct blkdev_ops compress_ops = {
+    .num_blocks = compress_num_blocks,
+    .read = compress_read,
+    .write = compress_write,
+    .close = compress_close,
+    .members = compress_members,
+    .type = "compress",
+    .discard = compress_discard,
+    .next_data = compress_next_data,
+    .block_size = compress_block_size
+};
+
+/********** startup ***************/
+
+/* load the map, and mark the blocks it uses. Returns E_UNAVAIL if it
+ * points outside the data area or at a block twice.
+ */
+static int load_map(struct compress_dev *c)
+{
+    int rec_bytes = c->rec_words * sizeof(uint32_t);
+    char *buf = malloc(c->bsize);
+    int val = SUCCESS;
+    for (blkno_t m = 0; m < c->map_blks && val == SUCCESS; m++) {
+        val = blkdev_read(c->vol, 1 + m, 1, buf);
+        long long ch = m * c->recs_per_blk;
+        long long k = c->nchunks - ch < c->recs_per_blk ? c->nchunks - ch : c->recs_per_blk;
+        if (val == SUCCESS)
+            memcpy(chunk_rec(c, ch), buf, k * rec_bytes);
+    }
+    free(buf);
+    for (long long ch = 0; ch < c->nchunks && val == SUCCESS; ch++) {
+        uint32_t *rec = chunk_rec(c, ch);
+        if (rec[0] > (uint32_t)c->chunk_bytes)
+            val = E_UNAVAIL;
+        for (int k = 0; k < len_blks(c, rec[0]) && val == SUCCESS; k++) {
+            if (rec[1 + k] >= c->data_blks || block_used(c, rec[1 + k]))
+                val = E_UNAVAIL;
+            else
+                set_used(c, rec[1 + k], 1);
+        }
+        if (val == SUCCESS)
+            c->nfree -= len_blks(c, rec[0]);
+    }
+    if (val != SUCCESS)
+        printf("Error: compressed volume map is damaged.\n");
+    return val;
+}
+
+/* use the layout on the volume if it has one, or write an empty map
+ * and a header. A layout of another geometry is refused (E_SIZE).
+ */
+static int compress_mount(struct compress_dev *c)
+{
+    char *buf = calloc(64, c->bsize);
+    struct compress_hdr *h = (struct compress_hdr *)buf;
+    int val = blkdev_read(c->vol, 0, 1, buf);
+    if (val == SUCCESS && h->magic == COMPRESS_MAGIC &&
+        h->hdr_sum == compress_sum(h, sizeof(*h) - sizeof(unsigned int))) {
+        /* never reformat a compressed volume over a wrong argument */
+        if (h->bsize != c->bsize || h->chunk_blks != c->chunk_blks ||
+            h->nchunks != c->nchunks) {
+            printf("Error: compressed volume has %d-block chunks of %d bytes, %lld chunks.\n",
+                   h->chunk_blks, h->bsize, h->nchunks);
+            free(buf);
+            return E_SIZE;
+        }
+        free(buf);
+        return load_map(c);
+    }
+
+    memset(buf, 0, 64 * c->bsize);
+    for (blkno_t m = 0; m < c->map_blks && val == SUCCESS; m += 64) {
+        int n = c->map_blks - m < 64 ? c->map_blks - m : 64;
+        val = blkdev_write(c->vol, 1 + m, n, buf);
+    }
+    h->magic = COMPRESS_MAGIC;
+    h->bsize = c->bsize;
+    h->chunk_blks = c->chunk_blks;
+    h->nchunks = c->nchunks;
+    h->hdr_sum = compress_sum(h, sizeof(*h) - sizeof(unsigned int));
+    if (val == SUCCESS)
+        val = blkdev_write(c->vol, 0, 1, buf);
+    free(buf);
+    return val;
+}
+
+/* store 'vol' compressed in chunks of 'chunk_blks' blocks (8 if 0).
+ * Closing the device closes the volume.
+ */
+struct blkdev *compress_create(struct blkdev *vol, int chunk_blks)
+{
+    if (chunk_blks <= 0)
+        chunk_blks = 8;
+    if (chunk_blks > COMPRESS_MAX_CHUNK) {
+        printf("Error: compressed chunks are at most %d blocks.\n", COMPRESS_MAX_CHUNK);
+        return NULL;
+    }
+    blkno_t vblks = blkdev_num_blocks(vol);
+    struct compress_dev *c = calloc(1, sizeof(*c));
+    c->vol = vol;
+    c->bsize = blkdev_block_size(vol);
+    c->chunk_blks = chunk_blks;
+    c->chunk_bytes = chunk_blks * c->bsize;
+    c->rec_words = 1 + chunk_blks;
+    c->recs_per_blk = c->bsize / (c->rec_words * sizeof(uint32_t));
+
+    /* header, then the map, then data for every chunk stored whole
+     * plus the chunks of one batch in flight
+     */
+    long long per = (long long)chunk_blks * c->recs_per_blk + 1;
+    long long n = (vblks - 1 - COMPRESS_BATCH * chunk_blks) * c->recs_per_blk / per;
+    while (n > 0 && 1 + (n + c->recs_per_blk - 1) / c->recs_per_blk +
+           (n + COMPRESS_BATCH) * chunk_blks > vblks)
+        n--;
+    c->nchunks = n;
+    c->map_blks = (n + c->recs_per_blk - 1) / c->recs_per_blk;
+    c->data_start = 1 + c->map_blks;
+    c->data_blks = vblks - c->data_start;
+    if (n < 1) {
+        printf("Error: volume too small to compress.\n");
+        free(c);
+        return NULL;
+    }
+    if (c->data_blks > UINT32_MAX) {
+        printf("Error: volume too large to compress.\n");
+        free(c);
+        return NULL;
+    }
+
+    c->map = calloc(n, c->rec_words * sizeof(uint32_t));
+    c->used = calloc((c->data_blks + 63) / 64, sizeof(uint64_t));
+    c->nfree = c->data_blks;
+    for (int i = 0; i < COMPRESS_LOCKS; i++) {
+        pthread_mutex_init(&c->chunk_locks[i], NULL);
+        pthread_mutex_init(&c->map_locks[i], NULL);
+    }
+    pthread_mutex_init(&c->alloc_lock, NULL);
+    pthread_cond_init(&c->freed, NULL);
+    if (compress_mount(c) != SUCCESS) {
+        compress_free(c);
+        return NULL;
+    }
+
+    struct blkdev *dev = calloc(1, sizeof(*dev));
+    dev->private = c;
+    dev->ops = &compress_ops;
+    return dev;
+}
+
+void compress_stats(struct blkdev *dev, struct compress_stats *st)
+{
+    struct compress_dev *c = dev->private;
+    pthread_mutex_lock(&c->alloc_lock);
+    *st = c->st;
+    pthread_mutex_unlock(&c->alloc_lock);
+}
@@ -0,0 +1,94 @@
+#include "blkdev.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+
+#define NBLKS 4096
+
+struct blkdev *new_image(char *path){
+	FILE *fp = fopen(path, "w");
+	assert(fp != NULL);
+	assert(ftruncate(fileno(fp), (long)NBLKS * BLOCK_SIZE) == 0);
+	fclose(fp);
+	return image_create(path);
+}
+
+/* blocks hold "seq:lba" */
+void fill(struct blkdev *dev, int lba, int len, int seq){
+	char buf[64*BLOCK_SIZE];
+	memset(buf, 0, sizeof(buf));
+	for (int done = 0; done < len; done += 64) {
+		int n = len - done < 64 ? len - done : 64;
+		for (int i = 0; i < n; i++)
+			sprintf(&buf[i*BLOCK_SIZE], "%d:%d", seq, lba + done + i);
+		if (blkdev_write(dev, lba + done, n, buf) != SUCCESS) {
+			printf("Write failed!\n");
+			exit(1);
+		}
+	}
+}
+
+/* blocks lba.. should hold what fill() put at from.. */
+void check(struct blkdev *dev, int lba, int len, int seq, int from){
+	char buf[BLOCK_SIZE], expect[BLOCK_SIZE];
+	for (int i = 0; i < len; i++) {
+		if (blkdev_read(dev, lba + i, 1, buf) != SUCCESS) {
+			printf("Read failed!\n");
+			exit(1);
+		}
+		memset(expect, 0, BLOCK_SIZE);
+		sprintf(expect, "%d:%d", seq, from + i);
+		if (memcmp(buf, expect, BLOCK_SIZE) != 0) {
+			printf("Block %d doesn't match: %s, expected %s\n", lba + i, buf, expect);
+			exit(1);
+		}
+	}
+}
+
+/* copy 1000 blocks from 200 of 'src' to 100 of 'dst' */
+void copy_between(struct blkdev *dst, struct blkdev *src){
+	fill(src, 0, NBLKS, 1);
+	long long r = src->stats.blocks[BLKDEV_READ], w = dst->stats.blocks[BLKDEV_WRITE];
+	assert(blkdev_copy(dst, 100, src, 200, 1000) == SUCCESS);
+	check(dst, 100, 1000, 1, 200);
+	assert(src->stats.blocks[BLKDEV_READ] - r == 1000);
+	assert(dst->stats.blocks[BLKDEV_WRITE] - w == 1000);
+	assert(blkdev_copy(dst, NBLKS - 10, src, 0, 20) == E_BADADDR);
+	assert(blkdev_copy(dst, 0, src, NBLKS - 10, 20) == E_BADADDR);
+}
+
+int main(){
+	char *names[] = {"copy-0", "copy-1", "copy-2", "copy-3", "copy-4"};
+	struct blkdev *a = new_image(names[0]), *b = new_image(names[1]);
+	struct blkdev *ra = ramdisk_create(NBLKS), *rb = ramdisk_create(NBLKS);
+
+	copy_between(b, a);             /* copy_file_range */
+	copy_between(rb, ra);           /* RAM disk to RAM disk */
+	copy_between(b, ra);            /* different types: through a buffer */
+	image_fail(a);
+	assert(blkdev_copy(b, 0, a, 0, 10) == E_UNAVAIL);
+	blkdev_close(a);
+	blkdev_close(b);
+	blkdev_close(ra);
+	blkdev_close(rb);
+	printf("device copy test passed\n");
+
+	/* mirror resync copies from the surviving side */
+	struct blkdev *disks[3] = {new_image(names[2]), new_image(names[3]), new_image(names[4])};
+	struct blkdev *vol = mirror_create(disks);
+	fill(vol, 0, NBLKS, 2);
+	image_fail(disks[1]);
+	assert(mirror_replace(vol, 1, disks[2]) == SUCCESS);
+	assert(disks[2]->stats.blocks[BLKDEV_WRITE] == NBLKS);
+	blkdev_close(disks[1]);
+	image_fail(disks[0]);
+	check(vol, 0, NBLKS, 2, 0);
+	blkdev_close(vol);
+	printf("mirror resync copy test passed\n");
+
+	for (int i = 0; i < 5; i++)
+		unlink(names[i]);
+	return 0;
+}
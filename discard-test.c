@@ -0,0 +1,206 @@
+#include "blkdev.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+
+#define NBLKS 8192
+
+int holes;      /* the file system can punch holes and find them */
+
+struct blkdev *new_image(char *path){
+	FILE *fp = fopen(path, "w");
+	assert(fp != NULL);
+	assert(ftruncate(fileno(fp), (long)NBLKS * BLOCK_SIZE) == 0);
+	fclose(fp);
+	return image_create(path);
+}
+
+/* blocks hold "seq:lba" */
+void fill(struct blkdev *dev, int lba, int len, int seq){
+	char buf[64*BLOCK_SIZE];
+	memset(buf, 0, sizeof(buf));
+	for (int done = 0; done < len; done += 64) {
+		int n = len - done < 64 ? len - done : 64;
+		for (int i = 0; i < n; i++)
+			sprintf(&buf[i*BLOCK_SIZE], "%d:%d", seq, lba + done + i);
+		if (blkdev_write(dev, lba + done, n, buf) != SUCCESS) {
+			printf("Write failed!\n");
+			exit(1);
+		}
+	}
+}
+
+/* seq 0 means zeros */
+void check(struct blkdev *dev, int lba, int len, int seq){
+	char buf[64*BLOCK_SIZE], expect[BLOCK_SIZE];
+	for (int done = 0; done < len; done += 64) {
+		int n = len - done < 64 ? len - done : 64;
+		if (blkdev_read(dev, lba + done, n, buf) != SUCCESS) {
+			printf("Read failed!\n");
+			exit(1);
+		}
+		for (int i = 0; i < n; i++) {
+			memset(expect, 0, BLOCK_SIZE);
+			if (seq != 0)
+				sprintf(expect, "%d:%d", seq, lba + done + i);
+			if (memcmp(&buf[i*BLOCK_SIZE], expect, BLOCK_SIZE) != 0) {
+				printf("Block %d doesn't match: %s, expected %s\n",
+				       lba + done + i, &buf[i*BLOCK_SIZE], expect);
+				exit(1);
+			}
+		}
+	}
+}
+
+void image_tests(void){
+	struct blkdev *d = new_image("discard-img");
+	holes = blkdev_next_data(d, 0) == NBLKS;
+	if (!holes)
+		printf("no hole support here, skipping allocation checks\n");
+	fill(d, 0, NBLKS, 1);
+	assert(blkdev_next_data(d, 0) == 0);
+	assert(blkdev_discard(d, 1000, 3000) == SUCCESS);
+	check(d, 0, 1000, 1);
+	check(d, 1000, 3000, 0);
+	check(d, 4000, NBLKS - 4000, 1);
+	if (holes)
+		assert(blkdev_next_data(d, 1000) == 4000);
+	assert(blkdev_discard(d, NBLKS - 1, 2) == E_BADADDR);
+	image_fail(d);
+	assert(blkdev_discard(d, 0, 1) == E_UNAVAIL);
+	blkdev_close(d);
+
+	d = ramdisk_create(NBLKS);
+	fill(d, 0, NBLKS, 2);
+	assert(blkdev_discard(d, 100, 5000) == SUCCESS);
+	check(d, 0, 100, 2);
+	check(d, 100, 5000, 0);
+	check(d, 5100, NBLKS - 5100, 2);
+
+	/* through a request queue */
+	struct elevator_opts eo = {0};
+	struct blkdev *q = elevator_create(d, &eo);
+	assert(blkdev_discard(q, 6000, 100) == SUCCESS);
+	check(q, 5100, 900, 2);
+	check(q, 6000, 100, 0);
+	blkdev_close(q);
+	printf("image and ramdisk discard test passed\n");
+}
+
+void raid4_tests(void){
+	char *names[] = {"discard-r4-0", "discard-r4-1", "discard-r4-2",
+			 "discard-r4-3", "discard-r4-4", "discard-r4-5"};
+	struct blkdev *disks[5];
+	for (int i = 0; i < 5; i++)
+		disks[i] = new_image(names[i]);
+	struct blkdev *vol = raid4_create(5, disks, 16);
+	int nb = blkdev_num_blocks(vol);
+	if (holes)
+		assert(blkdev_next_data(vol, 0) == nb);
+	fill(vol, 0, nb, 1);
+
+	/* partial rows at both ends, whole rows (64 blocks) between */
+	assert(blkdev_discard(vol, 1000, 20000) == SUCCESS);
+	check(vol, 0, 1000, 1);
+	check(vol, 1000, 20000, 0);
+	check(vol, 21000, nb - 21000, 1);
+	if (holes)
+		assert(blkdev_next_data(vol, 1024) == 20992);
+
+	struct raid4_scrub_opts so = {0};
+	struct raid4_scrub_status st;
+	struct raid4_scrub *sc = raid4_scrub_start(vol, &so);
+	assert(raid4_scrub_stop(sc, 1) == SUCCESS);
+	sc = raid4_scrub_start(vol, &so);
+	do {
+		raid4_scrub_status(sc, &st);
+		usleep(1000);
+	} while (st.running);
+	assert(st.error == SUCCESS && st.mismatches == 0);
+	raid4_scrub_stop(sc, 1);
+
+	/* the rebuild skips what is a hole on every other member */
+	struct blkdev *old = disks[2];      /* raid4 keeps our array */
+	image_fail(old);
+	struct blkdev *newdisk = new_image(names[5]);
+	assert(raid4_replace(vol, 2, newdisk) == SUCCESS);
+	long long written = newdisk->stats.blocks[BLKDEV_WRITE];
+	printf("raid4 rebuild wrote %lld of %d blocks\n", written, NBLKS);
+	if (holes)
+		assert(written <= NBLKS / 2);
+	blkdev_close(old);
+
+	/* and it is right: read through it with another disk gone */
+	image_fail(disks[0]);
+	check(vol, 0, 1000, 1);
+	check(vol, 1000, 20000, 0);
+	check(vol, 21000, nb - 21000, 1);
+	blkdev_close(vol);
+	for (int i = 0; i < 6; i++)
+		unlink(names[i]);
+	printf("raid4 discard test passed\n");
+}
+
+void mirror_tests(void){
+	char *names[] = {"discard-m0", "discard-m1", "discard-m2"};
+	struct blkdev *disks[3];
+	for (int i = 0; i < 3; i++)
+		disks[i] = new_image(names[i]);
+	struct blkdev *vol = mirror_create(disks);
+	fill(vol, 0, 1000, 1);
+	if (holes)
+		assert(blkdev_next_data(vol, 1000) >= 1000 && blkdev_next_data(vol, 1024) == NBLKS);
+
+	image_fail(disks[1]);
+	assert(mirror_replace(vol, 1, disks[2]) == SUCCESS);
+	long long written = disks[2]->stats.blocks[BLKDEV_WRITE];
+	printf("mirror resync wrote %lld of %d blocks\n", written, NBLKS);
+	if (holes)
+		assert(written <= 2048);
+	blkdev_close(disks[1]);
+
+	assert(blkdev_discard(vol, 0, 500) == SUCCESS);
+	image_fail(disks[0]);
+	check(vol, 0, 500, 0);
+	check(vol, 500, 500, 1);
+	check(vol, 1000, NBLKS - 1000, 0);
+	blkdev_close(vol);
+	for (int i = 0; i < 3; i++)
+		unlink(names[i]);
+	printf("mirror discard test passed\n");
+}
+
+void raid0_tests(void){
+	char *names[] = {"discard-s0", "discard-s1"};
+	struct blkdev *disks[2];
+	for (int i = 0; i < 2; i++)
+		disks[i] = new_image(names[i]);
+	struct blkdev *vol = raid0_create(2, disks, 16);
+	int nb = blkdev_num_blocks(vol);
+	fill(vol, 0, nb, 1);
+	assert(blkdev_discard(vol, 10, 1000) == SUCCESS);
+	check(vol, 0, 10, 1);
+	check(vol, 10, 1000, 0);
+	check(vol, 1010, nb - 1010, 1);
+	if (holes) {
+		int next = blkdev_next_data(vol, 32);
+		assert(next >= 992 && next <= 1010);
+	}
+	assert(blkdev_discard(vol, nb - 1, 2) == E_BADADDR);
+	blkdev_close(vol);
+	for (int i = 0; i < 2; i++)
+		unlink(names[i]);
+	printf("raid0 discard test passed\n");
+}
+
+int main(){
+	image_tests();
+	raid4_tests();
+	mirror_tests();
+	raid0_tests();
+	unlink("discard-img");
+	printf("discard test passed\n");
+	return 0;
+}
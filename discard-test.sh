@@ -0,0 +1,3 @@
+#!/bin/sh
+
+gcc -g3 -o discard-test discard-test.c image.c homework.c journal.c ramdisk.c elevator.c -lpthread -lm
@@ -0,0 +1,270 @@
+#include "blkdev.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+
+#define N 9
+#define WIDTH 4
+#define UNIT 4
+#define DISK_BLKS 1024
+
+/* 9 disks, stripes of 3 data + parity: 2 stripes and a spare per row */
+#define VOL_BLKS (DISK_BLKS / UNIT * 2 * 3 * UNIT)
+
+/* blocks hold "seq:lba"; seq 0 is a block of zeros */
+void fill_block(char *buf, int seq, blkno_t lba){
+	memset(buf, 0, BLOCK_SIZE);
+	if (seq != 0)
+		sprintf(buf, "%d:%lld", seq, lba);
+}
+
+int seqs[VOL_BLKS];
+
+void write_range(struct blkdev *vol, blkno_t lba, int len, int seq){
+	char buf[32*BLOCK_SIZE];
+	for (int i = 0; i < len; i++) {
+		fill_block(&buf[i*BLOCK_SIZE], seq, lba + i);
+		seqs[lba + i] = seq;
+	}
+	if (blkdev_write(vol, lba, len, buf) != SUCCESS) {
+		printf("Write at %lld failed!\n", lba);
+		exit(1);
+	}
+}
+
+void write_all(struct blkdev *vol, int seq){
+	for (blkno_t lba = 0; lba < VOL_BLKS; lba += 32)
+		write_range(vol, lba, 32, seq);
+}
+
+void verify(struct blkdev *vol){
+	char buf[32*BLOCK_SIZE], expect[BLOCK_SIZE];
+	for (blkno_t lba = 0; lba < VOL_BLKS; lba += 32) {
+		if (blkdev_read(vol, lba, 32, buf) != SUCCESS) {
+			printf("Read at %lld failed!\n", lba);
+			exit(1);
+		}
+		for (int i = 0; i < 32; i++) {
+			fill_block(expect, seqs[lba + i], lba + i);
+			if (memcmp(&buf[i*BLOCK_SIZE], expect, BLOCK_SIZE) != 0) {
+				printf("Block %lld doesn't match: %s, expected %s\n",
+				       lba + i, &buf[i*BLOCK_SIZE], expect);
+				exit(1);
+			}
+		}
+	}
+}
+
+/* writes and checked reads from another thread while a rebuild or
+ * replace runs; writes hold the rows they touch, so seqs[] for a
+ * range is stable while it is read back
+ */
+struct traffic {
+	struct blkdev *vol;
+	int stop;
+	long ops;
+	pthread_mutex_t lock;
+};
+
+void *traffic_thread(void *arg){
+	struct traffic *t = arg;
+	char buf[16*BLOCK_SIZE], expect[BLOCK_SIZE];
+	unsigned int seed = 7;
+	while (!__atomic_load_n(&t->stop, __ATOMIC_ACQUIRE)) {
+		int len = 1 + rand_r(&seed) % 16;
+		blkno_t lba = rand_r(&seed) % (VOL_BLKS - len);
+		pthread_mutex_lock(&t->lock);
+		if (rand_r(&seed) % 2) {
+			write_range(t->vol, lba, len, 100 + rand_r(&seed) % 1000);
+		} else {
+			assert(blkdev_read(t->vol, lba, len, buf) == SUCCESS);
+			for (int i = 0; i < len; i++) {
+				fill_block(expect, seqs[lba + i], lba + i);
+				if (memcmp(&buf[i*BLOCK_SIZE], expect, BLOCK_SIZE) != 0) {
+					printf("Block %lld doesn't match during rebuild\n", lba + i);
+					exit(1);
+				}
+			}
+		}
+		pthread_mutex_unlock(&t->lock);
+		t->ops++;
+	}
+	return NULL;
+}
+
+void traffic_start(struct traffic *t, pthread_t *th, struct blkdev *vol){
+	t->vol = vol;
+	t->stop = 0;
+	t->ops = 0;
+	pthread_mutex_init(&t->lock, NULL);
+	pthread_create(th, NULL, traffic_thread, t);
+}
+
+long traffic_stop(struct traffic *t, pthread_t th){
+	__atomic_store_n(&t->stop, 1, __ATOMIC_RELEASE);
+	pthread_join(th, NULL);
+	pthread_mutex_destroy(&t->lock);
+	return t->ops;
+}
+
+struct blkdev *new_volume(struct blkdev **disks){
+	for (int i = 0; i < N; i++)
+		disks[i] = ramdisk_create(DISK_BLKS);
+	struct blkdev *vol = draid_create(N, disks, WIDTH, UNIT);
+	assert(vol != NULL && blkdev_num_blocks(vol) == VOL_BLKS);
+	memset(seqs, 0, sizeof(seqs));
+	return vol;
+}
+
+void create_tests(void){
+	struct blkdev *disks[N];
+	for (int i = 0; i < N; i++)
+		disks[i] = ramdisk_create(DISK_BLKS);
+	assert(draid_create(4, disks, 4, UNIT) == NULL);        /* no room for a spare */
+	assert(draid_create(N, disks, 1, UNIT) == NULL);
+	struct blkdev *odd = ramdisk_create(DISK_BLKS / 2);
+	struct blkdev *mixed[5] = {disks[0], disks[1], disks[2], disks[3], odd};
+	assert(draid_create(5, mixed, 4, UNIT) == NULL);
+	blkdev_close(odd);
+
+	/* 7 disks of stripe width 3: two stripes, one spare per row */
+	struct blkdev *vol = draid_create(7, disks, 3, UNIT);
+	assert(vol != NULL && blkdev_num_blocks(vol) == DISK_BLKS / UNIT * 2 * 2 * UNIT);
+	blkdev_close(vol);
+	for (int i = 7; i < N; i++)
+		blkdev_close(disks[i]);
+	printf("draid create test passed\n");
+}
+
+/* one member's strips end up spread over all the others: every survivor
+ * is read, and gets about the same share of the rebuilt strips
+ */
+void rebuild_tests(void){
+	struct blkdev *disks[N];
+	struct blkdev *vol = new_volume(disks);
+	write_all(vol, 1);
+	write_range(vol, 5, 3, 2);
+	write_range(vol, 100, 30, 3);
+	verify(vol);
+
+	ramdisk_fail(disks[4]);
+	verify(vol);
+	for (int i = 0; i < N; i++)
+		blkdev_stats_reset(disks[i]);
+	assert(draid_rebuild(vol) == SUCCESS);
+	long long written = 0, most = 0;
+	for (int i = 0; i < N; i++) {
+		if (i == 4)
+			continue;
+		long long r = disks[i]->stats.blocks[BLKDEV_READ];
+		long long w = disks[i]->stats.blocks[BLKDEV_WRITE];
+		assert(r > 0 && w > 0);
+		written += w;
+		most = w > most ? w : most;
+	}
+	/* all of member 4 but its spare strips (1 row in 9) */
+	assert(written > DISK_BLKS * 8 / 9 - 8 * UNIT && written <= DISK_BLKS);
+	assert(most < 2 * written / (N - 1));
+	printf("rebuilt %lld blocks, at most %lld on one disk\n", written, most);
+	verify(vol);
+	write_range(vol, 200, 20, 4);
+	verify(vol);
+
+	/* with member 4 spared, another member can go */
+	ramdisk_fail(disks[7]);
+	verify(vol);
+	write_range(vol, 1000, 32, 5);
+	write_range(vol, 7, 20, 6);
+	verify(vol);
+	assert(draid_rebuild(vol) == SUCCESS);       /* nothing to do */
+
+	/* a third is too many */
+	ramdisk_fail(disks[0]);
+	char buf[32*BLOCK_SIZE];
+	int val = SUCCESS;
+	for (blkno_t lba = 0; lba < VOL_BLKS && val == SUCCESS; lba += 32)
+		val = blkdev_read(vol, lba, 32, buf);
+	assert(val == E_UNAVAIL);
+	assert(blkdev_write(vol, 0, 1, buf) == E_UNAVAIL);
+	blkdev_close(vol);
+	printf("draid rebuild test passed\n");
+}
+
+/* a second failure before the rebuild is done is fatal */
+void early_failure_test(void){
+	struct blkdev *disks[N];
+	struct blkdev *vol = new_volume(disks);
+	write_all(vol, 1);
+	ramdisk_fail(disks[2]);
+	ramdisk_fail(disks[5]);
+	char buf[32*BLOCK_SIZE];
+	int val = SUCCESS;
+	for (blkno_t lba = 0; lba < VOL_BLKS && val == SUCCESS; lba += 32)
+		val = blkdev_read(vol, lba, 32, buf);
+	assert(val == E_UNAVAIL);
+	assert(draid_rebuild(vol) == E_UNAVAIL);
+	blkdev_close(vol);
+	printf("draid double failure test passed\n");
+}
+
+/* rebuild and copy back with I/O going on, then the member lost after
+ * the first one was spared
+ */
+void replace_tests(void){
+	struct blkdev *disks[N], *old[3];
+	struct blkdev *vol = new_volume(disks);
+	struct traffic t;
+	pthread_t th;
+	write_all(vol, 1);
+
+	old[0] = disks[1];
+	ramdisk_fail(disks[1]);
+	verify(vol);
+	traffic_start(&t, &th, vol);
+	assert(draid_rebuild(vol) == SUCCESS);
+	long ops = traffic_stop(&t, th);
+	verify(vol);
+
+	old[1] = disks[6];
+	ramdisk_fail(disks[6]);
+	verify(vol);
+	struct blkdev *spare = ramdisk_create(DISK_BLKS), *small = ramdisk_create(DISK_BLKS / 2);
+	assert(draid_replace(vol, 6, spare) == E_UNAVAIL);
+	assert(draid_replace(vol, 1, small) == E_SIZE);
+	blkdev_close(small);
+	traffic_start(&t, &th, vol);
+	assert(draid_replace(vol, 1, spare) == SUCCESS);
+	ops += traffic_stop(&t, th);
+	verify(vol);
+
+	/* now member 6 is the failed one, and is rebuilt the same way */
+	traffic_start(&t, &th, vol);
+	assert(draid_rebuild(vol) == SUCCESS);
+	assert(draid_replace(vol, 6, ramdisk_create(DISK_BLKS)) == SUCCESS);
+	ops += traffic_stop(&t, th);
+	verify(vol);
+
+	/* whole again: any one member can fail */
+	old[2] = disks[3];
+	assert(draid_replace(vol, 3, ramdisk_create(DISK_BLKS)) == SUCCESS);
+	ramdisk_fail(disks[8]);
+	verify(vol);
+	assert(draid_rebuild(vol) == SUCCESS);
+	ramdisk_fail(disks[0]);
+	verify(vol);
+	blkdev_close(vol);
+	for (int i = 0; i < 3; i++)
+		blkdev_close(old[i]);
+	printf("draid replace test passed (%ld foreground ops)\n", ops);
+}
+
+int main(){
+	create_tests();
+	rebuild_tests();
+	early_failure_test();
+	replace_tests();
+	printf("draid tests passed.\n");
+	return 0;
+}
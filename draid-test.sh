@@ -0,0 +1,3 @@
+#!/bin/sh
+
+gcc -g3 -o draid-test draid-test.c image.c homework.c journal.c ramdisk.c -lpthread -lm
@@ -0,0 +1,125 @@
+#include "blkdev.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+#include <pthread.h>
+
+struct client {
+	struct blkdev *dev;
+	int op;
+	int lba;
+	int len;
+	char *buf;
+	int result;
+};
+
+void *client_thread(void *arg){
+	struct client *c = arg;
+	c->result = c->op == BLKDEV_WRITE ?
+		blkdev_write(c->dev, c->lba, c->len, c->buf) :
+		blkdev_read(c->dev, c->lba, c->len, c->buf);
+	return NULL;
+}
+
+/* 'n' threads each send one request of 'len' blocks, the i'th at 'lba' + i*len */
+void run_clients(struct blkdev *dev, int op, int n, int lba, int len, char *buf){
+	pthread_t threads[n];
+	struct client c[n];
+	for (int i = 0; i < n; i++) {
+		c[i] = (struct client){dev, op, lba + i*len, len, buf + i*len*BLOCK_SIZE, -1};
+		pthread_create(&threads[i], NULL, client_thread, &c[i]);
+	}
+	for (int i = 0; i < n; i++) {
+		pthread_join(threads[i], NULL);
+		assert(c[i].result == SUCCESS);
+	}
+}
+
+int main(){
+	char buf[64*BLOCK_SIZE], rbuf[64*BLOCK_SIZE];
+	struct elevator_stats st;
+
+	/* same contract as the device underneath */
+	struct blkdev *ram = ramdisk_create(64);
+	struct blkdev *q = elevator_create(ram, NULL);
+	assert(blkdev_num_blocks(q) == 64);
+	memset(buf, 'E', 4*BLOCK_SIZE);
+	assert(blkdev_write(q, 60, 4, buf) == SUCCESS);
+	assert(blkdev_read(q, 60, 4, rbuf) == SUCCESS);
+	assert(memcmp(buf, rbuf, 4*BLOCK_SIZE) == 0);
+	assert(blkdev_read(q, 62, 4, rbuf) == E_BADADDR);
+	assert(blkdev_write(q, -1, 1, buf) == E_BADADDR);
+	ramdisk_fail(ram);
+	assert(blkdev_read(q, 0, 1, rbuf) == E_UNAVAIL);
+	blkdev_close(q);
+	printf("elevator read/write test passed\n");
+
+	/* single-block writes from many threads to a slow disk queue up
+	 * behind the first one and are merged.
+	 */
+	ram = ramdisk_create(64);
+	struct ramdisk_model m = {.dist = RAMDISK_FIXED, .lat_us = 5000};
+	ramdisk_set_model(ram, &m);
+	q = elevator_create(ram, NULL);
+	for (int i = 0; i < 32; i++)
+		memset(buf + i*BLOCK_SIZE, 'a' + i % 26, BLOCK_SIZE);
+	run_clients(q, BLKDEV_WRITE, 32, 0, 1, buf);
+	elevator_stats(q, &st);
+	assert(st.requests == 32 && st.dispatched + st.merged == 32);
+	assert(st.merged > 0 && ram->stats.ops[BLKDEV_WRITE] == st.dispatched);
+
+	memset(rbuf, 0, sizeof(rbuf));
+	run_clients(q, BLKDEV_READ, 32, 0, 1, rbuf);
+	assert(memcmp(buf, rbuf, 32*BLOCK_SIZE) == 0);
+	elevator_stats(q, &st);
+	assert(st.requests == 64 && ram->stats.ops[BLKDEV_READ] < 32);
+	blkdev_close(q);
+	printf("elevator merge test passed\n");
+
+	/* merged writes reach a raid4 volume as whole rows */
+	struct blkdev *drives[5];
+	for (int j = 0; j < 5; j++) {
+		drives[j] = ramdisk_create(32);
+		ramdisk_set_model(drives[j], &m);
+	}
+	struct blkdev *raid4 = raid4_create(5, drives, 4);
+	q = elevator_create(raid4, NULL);
+	for (int i = 0; i < 64; i++)
+		memset(buf + i*BLOCK_SIZE, 'A' + i % 26, BLOCK_SIZE);
+	run_clients(q, BLKDEV_WRITE, 16, 0, 4, buf);
+	assert(raid4->stats.ops[BLKDEV_WRITE] < 16);
+	assert(blkdev_read(q, 0, 64, rbuf) == SUCCESS);
+	assert(memcmp(buf, rbuf, 64*BLOCK_SIZE) == 0);
+	/* and the parity is right: read with a member gone */
+	ramdisk_fail(drives[1]);
+	memset(rbuf, 0, sizeof(rbuf));
+	assert(blkdev_read(q, 0, 64, rbuf) == SUCCESS);
+	assert(memcmp(buf, rbuf, 64*BLOCK_SIZE) == 0);
+	blkdev_close(q);
+	printf("elevator raid4 test passed\n");
+
+	/* with one-request batches, a write among reads is not held back */
+	ram = ramdisk_create(64);
+	ramdisk_set_model(ram, &m);
+	struct elevator_opts o = {.fifo_batch = 1, .writes_starved = 1};
+	q = elevator_create(ram, &o);
+	pthread_t threads[8];
+	struct client c[8];
+	for (int i = 0; i < 8; i++) {
+		c[i] = (struct client){q, i == 4 ? BLKDEV_WRITE : BLKDEV_READ, i*8, 1,
+				       buf + i*BLOCK_SIZE, -1};
+		pthread_create(&threads[i], NULL, client_thread, &c[i]);
+	}
+	for (int i = 0; i < 8; i++) {
+		pthread_join(threads[i], NULL);
+		assert(c[i].result == SUCCESS);
+	}
+	elevator_stats(q, &st);
+	assert(st.requests == 8 && st.merged == 0);
+	blkdev_close(q);
+	printf("elevator deadline test passed\n");
+
+	printf("elevator tests passed.\n");
+}
@@ -0,0 +1,3 @@
+#!/bin/sh
+
+gcc -g3 -o elevator-test elevator-test.c image.c homework.c journal.c ramdisk.c elevator.c -lpthread -lm
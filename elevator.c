@@ -0,0 +1,469 @@
+/*
+ * file:        elevator.c
+ * description: request queue wrapper - queues the requests of many
+ *              threads, merges and sorts them, and dispatches them to
+ *              the device underneath in batches
+ *
+ * Each caller's request waits in two lists for its direction: arrival
+ * order, with a deadline, and LBA order. A dispatcher takes the next
+ * request in LBA order after the last one it sent (a one-way elevator),
+ * unless the oldest request has passed its deadline, and sends up to
+ * 'fifo_batch' requests that way before looking at the deadlines again.
+ * Reads are preferred, but writes are chosen after 'writes_starved'
+ * read batches have gone ahead of them (as in mq-deadline).
+ *
+ * Queued requests that are adjacent or overlap are merged into one
+ * request to the device, so small sequential writes from many threads
+ * reach a RAID volume as full stripes. Where merged writes overlap the
+ * one queued last wins. Requests queued at the same time are concurrent
+ * and may complete in any order. Discards queue with the writes, with
+ * no buffer, and are only merged with each other.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include "blkdev.h"
+
+struct elv_req {
+    int op;
+    blkno_t lba;
+    blkno_t len;            /* a discard may be longer than an int */
+    char *buf;                  /* NULL for a discard */
+    long long deadline;
+    long long seq;              /* arrival order */
+    int result;
+    int done;
+    pthread_cond_t cond;
+    struct elv_req *fifo_prev, *fifo_next;
+    struct elv_req *sort_prev, *sort_next;
+};
+
+struct elv_queue {
+    struct elv_req *fifo_head, *fifo_tail;
+    struct elv_req *sort_head, *sort_tail;
+    int count;
+};
+
+struct elevator_dev {
+    struct blkdev *dev;
+    blkno_t nblks;
+    int bsize;
+    struct elevator_opts opts;
+    struct elv_queue q[2];      /* indexed by BLKDEV_READ / BLKDEV_WRITE */
+    long long seq;
+    int batch_dir;
+    int batch_left;             /* requests left in the current batch */
+    blkno_t next_lba[2];            /* where the elevator is, per direction */
+    int starved;                /* read batches sent while writes waited */
+    int stop;
+    pthread_t *threads;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;        /* signalled when a request is queued */
+    struct elevator_stats st;
+};
+
+static long long elv_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* add a request to both lists. The LBA list is searched from the
+ * tail, since sequential streams mostly append.
+ */
+static void elv_insert(struct elv_queue *q, struct elv_req *r)
+{
+    r->fifo_next = NULL;
+    r->fifo_prev = q->fifo_tail;
+    if (q->fifo_tail)
+        q->fifo_tail->fifo_next = r;
+    else
+        q->fifo_head = r;
+    q->fifo_tail = r;
+
+    struct elv_req *p = q->sort_tail;
+    while (p != NULL && p->lba > r->lba)
+        p = p->sort_prev;
+    r->sort_prev = p;
+    r->sort_next = p ? p->sort_next : q->sort_head;
+    if (r->sort_next)
+        r->sort_next->sort_prev = r;
+    else
+        q->sort_tail = r;
+    if (p)
+        p->sort_next = r;
+    else
+        q->sort_head = r;
+    q->count++;
+}
+
+static void elv_remove(struct elv_queue *q, struct elv_req *r)
+{
+    if (r->fifo_prev)
+        r->fifo_prev->fifo_next = r->fifo_next;
+    else
+        q->fifo_head = r->fifo_next;
+    if (r->fifo_next)
+        r->fifo_next->fifo_prev = r->fifo_prev;
+    else
+        q->fifo_tail = r->fifo_prev;
+
+    if (r->sort_prev)
+        r->sort_prev->sort_next = r->sort_next;
+    else
+        q->sort_head = r->sort_next;
+    if (r->sort_next)
+        r->sort_next->sort_prev = r->sort_prev;
+    else
+        q->sort_tail = r->sort_prev;
+    q->count--;
+}
+
+/* first request at or after 'lba', or NULL */
+static struct elv_req *elv_after(struct elv_queue *q, blkno_t lba)
+{
+    struct elv_req *r = q->sort_head;
+    while (r != NULL && r->lba < lba)
+        r = r->sort_next;
+    return r;
+}
+
+/* choose the request to dispatch next. Called with the lock held and
+ * at least one request queued.
+ */
+static struct elv_req *elv_pick(struct elevator_dev *e)
+{
+    if (e->batch_left > 0) {
+        struct elv_req *r = elv_after(&e->q[e->batch_dir], e->next_lba[e->batch_dir]);
+        if (r != NULL) {
+            e->batch_left--;
+            return r;
+        }
+    }
+
+    int dir;
+    if (e->q[BLKDEV_READ].count > 0 &&
+        (e->q[BLKDEV_WRITE].count == 0 || e->starved < e->opts.writes_starved)) {
+        dir = BLKDEV_READ;
+        if (e->q[BLKDEV_WRITE].count > 0)
+            e->starved++;
+    } else {
+        dir = BLKDEV_WRITE;
+        e->starved = 0;
+    }
+
+    struct elv_queue *q = &e->q[dir];
+    struct elv_req *r = NULL;
+    if (q->fifo_head->deadline <= elv_now())
+        e->st.expired++;
+    else
+        r = elv_after(q, e->next_lba[dir]);
+    if (r == NULL)
+        r = q->fifo_head;
+    e->batch_dir = dir;
+    e->batch_left = e->opts.fifo_batch - 1;
+    return r;
+}
+
+/* take 'r' and every queued request that is adjacent to it or overlaps
+ * it, up to max_blocks in all, off the queue. Returns the number of
+ * requests in 'out' (in LBA order) and their extent in *lba, *len.
+ */
+static int elv_collect(struct elevator_dev *e, struct elv_req *r,
+                       struct elv_req ***out, int *size, blkno_t *lba, blkno_t *len)
+{
+    struct elv_queue *q = &e->q[r->op];
+    int max = e->opts.max_blocks;
+    struct elv_req *first = r, *last = r;
+    blkno_t start = r->lba, end = r->lba + r->len;
+
+    while (first->sort_prev != NULL) {
+        struct elv_req *p = first->sort_prev;
+        blkno_t s = p->lba < start ? p->lba : start;
+        blkno_t t = p->lba + p->len > end ? p->lba + p->len : end;
+        if (p->lba + p->len < start || t - s > max || (p->buf == NULL) != (r->buf == NULL))
+            break;
+        first = p;
+        start = s;
+        end = t;
+    }
+    while (last->sort_next != NULL) {
+        struct elv_req *n = last->sort_next;
+        blkno_t t = n->lba + n->len > end ? n->lba + n->len : end;
+        if (n->lba > end || t - start > max || (n->buf == NULL) != (r->buf == NULL))
+            break;
+        last = n;
+        end = t;
+    }
+
+    int count = 0;
+    for (struct elv_req *p = first; ; p = p->sort_next) {
+        if (count == *size) {
+            *size = *size ? 2 * *size : 16;
+            *out = realloc(*out, *size * sizeof(**out));
+        }
+        (*out)[count++] = p;
+        if (p == last)
+            break;
+    }
+    for (int i = 0; i < count; i++)
+        elv_remove(q, (*out)[i]);
+    e->next_lba[r->op] = end;
+    *lba = start;
+    *len = end - start;
+    return count;
+}
+
+static int cmp_seq(const void *a, const void *b)
+{
+    const struct elv_req *x = *(struct elv_req * const *)a;
+    const struct elv_req *y = *(struct elv_req * const *)b;
+    return (x->seq > y->seq) - (x->seq < y->seq);
+}
+
+static int elv_do(struct elevator_dev *e, struct elv_req *r)
+{
+    if (r->op == BLKDEV_READ)
+        return blkdev_read(e->dev, r->lba, r->len, r->buf);
+    if (r->buf == NULL)
+        return blkdev_discard(e->dev, r->lba, r->len);
+    return blkdev_write(e->dev, r->lba, r->len, r->buf);
+}
+
+/* issue a batch of merged requests to the device and set their
+ * results. If the merged request fails, each is retried on its own so
+ * that only the requests that really fail see the error.
+ */
+static void elv_issue(struct elevator_dev *e, struct elv_req **reqs, int n,
+                      blkno_t lba, blkno_t len)
+{
+    int op = reqs[0]->op;
+    if (n == 1) {
+        reqs[0]->result = elv_do(e, reqs[0]);
+        return;
+    }
+
+    char *buf = NULL;
+    int val;
+    if (reqs[0]->buf == NULL) {
+        val = blkdev_discard(e->dev, lba, len);
+    } else if (op == BLKDEV_WRITE) {
+        buf = malloc((size_t)len * e->bsize);
+        qsort(reqs, n, sizeof(*reqs), cmp_seq);
+        for (int i = 0; i < n; i++)
+            memcpy(buf + (size_t)(reqs[i]->lba - lba) * e->bsize, reqs[i]->buf,
+                   (size_t)reqs[i]->len * e->bsize);
+        val = blkdev_write(e->dev, lba, len, buf);
+    } else {
+        buf = malloc((size_t)len * e->bsize);
+        val = blkdev_read(e->dev, lba, len, buf);
+        if (val == SUCCESS) {
+            for (int i = 0; i < n; i++)
+                memcpy(reqs[i]->buf, buf + (size_t)(reqs[i]->lba - lba) * e->bsize,
+                       (size_t)reqs[i]->len * e->bsize);
+        }
+    }
+    free(buf);
+
+    for (int i = 0; i < n; i++) {
+        struct elv_req *r = reqs[i];
+        r->result = val == SUCCESS ? SUCCESS : elv_do(e, r);
+    }
+}
+
+static void *elv_dispatch(void *arg)
+{
+    struct elevator_dev *e = arg;
+    struct elv_req **reqs = NULL;
+    int size = 0;
+
+    pthread_mutex_lock(&e->lock);
+    while (1) {
+        while (!e->stop && e->q[BLKDEV_READ].count + e->q[BLKDEV_WRITE].count == 0)
+            pthread_cond_wait(&e->cond, &e->lock);
+        if (e->q[BLKDEV_READ].count + e->q[BLKDEV_WRITE].count == 0)
+            break;
+        struct elv_req *r = elv_pick(e);
+        blkno_t lba, len;
+        int n = elv_collect(e, r, &reqs, &size, &lba, &len);
+        e->st.dispatched++;
+        e->st.merged += n - 1;
+        pthread_mutex_unlock(&e->lock);
+
+        elv_issue(e, reqs, n, lba, len);
+
+        pthread_mutex_lock(&e->lock);
+        for (int i = 0; i < n; i++) {
+            reqs[i]->done = 1;
+            pthread_cond_signal(&reqs[i]->cond);
+        }
+    }
+    pthread_mutex_unlock(&e->lock);
+    free(reqs);
+    return NULL;
+}
+
+/* queue a request and wait for it to complete */
+static int elv_submit(struct elevator_dev *e, int op, blkno_t first_blk,
+                      blkno_t num_blks, void *buf)
+{
+    if (first_blk < 0 || num_blks < 0 || first_blk > e->nblks - num_blks)
+        return E_BADADDR;
+    if (num_blks == 0)
+        return SUCCESS;
+
+    struct elv_req r = {.op = op, .lba = first_blk, .len = num_blks, .buf = buf};
+    int ms = op == BLKDEV_WRITE ? e->opts.write_expire_ms : e->opts.read_expire_ms;
+    r.deadline = elv_now() + ms * 1000000LL;
+    pthread_cond_init(&r.cond, NULL);
+
+    pthread_mutex_lock(&e->lock);
+    r.seq = e->seq++;
+    elv_insert(&e->q[op], &r);
+    e->st.requests++;
+    pthread_cond_signal(&e->cond);
+    while (!r.done)
+        pthread_cond_wait(&r.cond, &e->lock);
+    pthread_mutex_unlock(&e->lock);
+
+    pthread_cond_destroy(&r.cond);
+    return r.result;
+}
+
+static blkno_t elv_num_blocks(struct blkdev *dev)
+{
+    struct elevator_dev *e = dev->private;
+    return e->nblks;
+}
+
+static int elv_block_size(struct blkdev *dev)
+{
+    struct elevator_dev *e = dev->private;
+    return e->bsize;
+}
+
+static int elv_read(struct blkdev *dev, blkno_t first_blk, int num_blks, void *buf)
+{
+    return elv_submit(dev->private, BLKDEV_READ, first_blk, num_blks, buf);
+}
+
+static int elv_write(struct blkdev *dev, blkno_t first_blk, int num_blks, void *buf)
+{
+    return elv_submit(dev->private, BLKDEV_WRITE, first_blk, num_blks, buf);
+}
+
+static int elv_discard(struct blkdev *dev, blkno_t first_blk, blkno_t num_blks)
+{
+    return elv_submit(dev->private, BLKDEV_WRITE, first_blk, num_blks, NULL);
+}
+
+/* asks the device directly: nothing is queued for it */
+static blkno_t elv_next_data(struct blkdev *dev, blkno_t first_blk)
+{
+    struct elevator_dev *e = dev->private;
+    return blkdev_next_data(e->dev, first_blk);
+}
+
+/* finish the queued requests, then close the device underneath */
+static void elv_close(struct blkdev *dev)
+{
+    struct elevator_dev *e = dev->private;
+    pthread_mutex_lock(&e->lock);
+    e->stop = 1;
+    pthread_cond_broadcast(&e->cond);
+    pthread_mutex_unlock(&e->lock);
+    for (int i = 0; i < e->opts.nr_dispatch; i++)
+        pthread_join(e->threads[i], NULL);
+
+    blkdev_close(e->dev);
+    pthread_mutex_destroy(&e->lock);
+    pthread_cond_destroy(&e->cond);
+    free(e->threads);
+    free(e);
+    dev->private = NULL;
+    free(dev);
+}
+
+static int elv_members(struct blkdev *dev, struct blkdev **out, int max)
+{
+    struct elevator_dev *e = dev->private;
+    if (max < 1)
+        return 0;
+    out[0] = e->dev;
+    return 1;
+}
+
+struct blkdev_ops elevator_ops = {
+    .num_blocks = elv_num_blocks,
+    .read = elv_read,
+    .write = elv_write,
+    .close = elv_close,
+    .members = elv_members,
+    .type = "elevator",
+    .discard = elv_discard,
+    .next_data = elv_next_data,
+    .block_size = elv_block_size
+};
+
+/* put a request queue in front of 'dev'. Fields of 'opts' left at 0
+ * (or a NULL 'opts') get the defaults below. With more than one
+ * dispatcher thread the device must be safe for concurrent callers.
+ */
+struct blkdev *elevator_create(struct blkdev *dev, struct elevator_opts *opts)
+{
+    struct elevator_opts o = {0};
+    if (opts != NULL)
+        o = *opts;
+    if (o.max_blocks <= 0)
+        o.max_blocks = 256;
+    if (o.read_expire_ms <= 0)
+        o.read_expire_ms = 500;
+    if (o.write_expire_ms <= 0)
+        o.write_expire_ms = 5000;
+    if (o.fifo_batch <= 0)
+        o.fifo_batch = 16;
+    if (o.writes_starved <= 0)
+        o.writes_starved = 2;
+    if (o.nr_dispatch <= 0)
+        o.nr_dispatch = 1;
+
+    struct blkdev *edev = calloc(1, sizeof(*edev));
+    struct elevator_dev *e = calloc(1, sizeof(*e));
+    e->dev = dev;
+    e->nblks = blkdev_num_blocks(dev);
+    e->bsize = blkdev_block_size(dev);
+    e->opts = o;
+    pthread_mutex_init(&e->lock, NULL);
+    pthread_cond_init(&e->cond, NULL);
+    e->threads = calloc(o.nr_dispatch, sizeof(pthread_t));
+    for (int i = 0; i < o.nr_dispatch; i++) {
+        if (pthread_create(&e->threads[i], NULL, elv_dispatch, e) != 0) {
+            printf("Error: can't start elevator dispatcher.\n");
+            pthread_mutex_lock(&e->lock);
+            e->stop = 1;
+            pthread_cond_broadcast(&e->cond);
+            pthread_mutex_unlock(&e->lock);
+            while (i-- > 0)
+                pthread_join(e->threads[i], NULL);
+            free(e->threads);
+            free(e);
+            free(edev);
+            return NULL;
+        }
+    }
+    edev->private = e;
+    edev->ops = &elevator_ops;
+    return edev;
+}
+
+void elevator_stats(struct blkdev *dev, struct elevator_stats *st)
+{
+    struct elevator_dev *e = dev->private;
+    pthread_mutex_lock(&e->lock);
+    *st = e->st;
+    pthread_mutex_unlock(&e->lock);
+}
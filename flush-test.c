@@ -0,0 +1,261 @@
+#include "blkdev.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+#include <pthread.h>
+
+#define NBLKS 4096
+#define THREADS 8
+#define ROUNDS 100
+#define UNIT 4
+
+struct blkdev *new_image(char *path){
+	FILE *fp = fopen(path, "w");
+	assert(fp != NULL);
+	assert(ftruncate(fileno(fp), (long)NBLKS * BLOCK_SIZE) == 0);
+	fclose(fp);
+	return image_create(path);
+}
+
+void fill_block(char *buf, int seq, blkno_t lba){
+	memset(buf, 0, BLOCK_SIZE);
+	sprintf(buf, "%d:%lld", seq, lba);
+}
+
+void check_block(struct blkdev *dev, blkno_t lba, int seq){
+	char buf[BLOCK_SIZE], expect[BLOCK_SIZE];
+	if (blkdev_read(dev, lba, 1, buf) != SUCCESS) {
+		printf("Read at %lld failed!\n", lba);
+		exit(1);
+	}
+	fill_block(expect, seq, lba);
+	if (memcmp(buf, expect, BLOCK_SIZE) != 0) {
+		printf("Block %lld doesn't match: %s, expected %s\n", lba, buf, expect);
+		exit(1);
+	}
+}
+
+/* each thread writes its own blocks, flushing after every write */
+struct flusher {
+	struct blkdev *dev;
+	int id;
+};
+
+void *flush_thread(void *arg){
+	struct flusher *f = arg;
+	char buf[BLOCK_SIZE];
+	for (int i = 0; i < ROUNDS; i++) {
+		blkno_t lba = f->id * ROUNDS + i;
+		fill_block(buf, 1, lba);
+		if (blkdev_write(f->dev, lba, 1, buf) != SUCCESS) {
+			printf("Write at %lld failed!\n", lba);
+			exit(1);
+		}
+		if (blkdev_flush(f->dev) != SUCCESS) {
+			printf("Flush failed!\n");
+			exit(1);
+		}
+	}
+	return NULL;
+}
+
+void run_flushers(struct blkdev *dev){
+	pthread_t t[THREADS];
+	struct flusher f[THREADS];
+	for (int i = 0; i < THREADS; i++) {
+		f[i] = (struct flusher){dev, i};
+		pthread_create(&t[i], NULL, flush_thread, &f[i]);
+	}
+	for (int i = 0; i < THREADS; i++)
+		pthread_join(t[i], NULL);
+	for (int i = 0; i < THREADS * ROUNDS; i++)
+		check_block(dev, i, 1);
+}
+
+void image_tests(void){
+	struct blkdev *img = new_image("flush-img");
+	char buf[BLOCK_SIZE];
+
+	assert(blkdev_flush(img) == SUCCESS);
+	assert(image_syncs(img) == 1);
+
+	fill_block(buf, 7, 10);
+	assert(blkdev_write_fua(img, 10, 1, buf) == SUCCESS);
+	check_block(img, 10, 7);
+	assert(blkdev_write_fua(img, NBLKS, 1, buf) == E_BADADDR);
+
+	/* concurrent flushes share their syncs */
+	long long before = image_syncs(img);
+	run_flushers(img);
+	long long syncs = image_syncs(img) - before;
+	printf("%d flushes took %lld syncs\n", THREADS * ROUNDS, syncs);
+	assert(syncs > 0 && syncs < THREADS * ROUNDS);
+
+	image_fail(img);
+	assert(blkdev_flush(img) == E_UNAVAIL);
+	assert(blkdev_write_fua(img, 10, 1, buf) == E_UNAVAIL);
+	blkdev_close(img);
+	printf("image flush test passed\n");
+}
+
+/* a mirror of images flushes both sides, each with its own group commit */
+void mirror_image_tests(void){
+	char *names[] = {"flush-img0", "flush-img1"};
+	struct blkdev *disks[2];
+	for (int i = 0; i < 2; i++)
+		disks[i] = new_image(names[i]);
+	struct blkdev *vol = mirror_create(disks);
+	run_flushers(vol);
+	for (int i = 0; i < 2; i++) {
+		long long syncs = image_syncs(disks[i]);
+		assert(syncs > 0 && syncs < THREADS * ROUNDS);
+	}
+
+	char buf[BLOCK_SIZE];
+	fill_block(buf, 2, 5);
+	assert(blkdev_write_fua(vol, 5, 1, buf) == SUCCESS);
+	check_block(disks[0], 5, 2);
+	check_block(disks[1], 5, 2);
+	blkdev_close(vol);
+	for (int i = 0; i < 2; i++)
+		unlink(names[i]);
+	printf("mirror image flush test passed\n");
+}
+
+/* a journal record that drops rows is written only once the rows'
+ * data and parity are durable on the members
+ */
+void journal_image_tests(void){
+	char *names[] = {"flush-img0", "flush-img1", "flush-img2", "flush-img3", "flush-img4"};
+	struct blkdev *disks[5];
+	for (int i = 0; i < 5; i++)
+		disks[i] = new_image(names[i]);
+	struct blkdev *vol = raid4_create(4, disks, UNIT);
+	assert(raid4_set_journal(vol, disks[4]) == SUCCESS);
+
+	char buf[BLOCK_SIZE];
+	fill_block(buf, 6, 0);
+	assert(blkdev_write(vol, 0, 1, buf) == SUCCESS);
+	assert(image_syncs(disks[0]) == 0);         /* nothing dropped yet */
+	fill_block(buf, 6, 100);
+	assert(blkdev_write(vol, 100, 1, buf) == SUCCESS);
+	for (int i = 0; i < 4; i++)
+		assert(image_syncs(disks[i]) == 1);
+	check_block(vol, 0, 6);
+	check_block(vol, 100, 6);
+	blkdev_close(vol);
+	for (int i = 0; i < 5; i++)
+		unlink(names[i]);
+	printf("journal flush test passed\n");
+}
+
+int failed_member;
+
+void on_event(void *arg, int event, int member, blkno_t mark){
+	if (event == RAID_EV_FAILED)
+		failed_member = member;
+}
+
+/* a member that can't flush fails, as if a write to it had */
+void raid_tests(void){
+	struct blkdev *disks[9];
+
+	for (int i = 0; i < 2; i++)
+		disks[i] = ramdisk_create(NBLKS);
+	struct blkdev *vol = mirror_create(disks);
+	mirror_set_notify(vol, on_event, NULL);
+	assert(blkdev_flush(vol) == SUCCESS);
+	failed_member = -2;
+	ramdisk_fail(disks[0]);
+	assert(blkdev_flush(vol) == SUCCESS);
+	assert(failed_member == 0);
+	ramdisk_fail(disks[1]);
+	assert(blkdev_flush(vol) == E_UNAVAIL);
+	blkdev_close(vol);
+	printf("mirror flush test passed\n");
+
+	for (int i = 0; i < 3; i++)
+		disks[i] = ramdisk_create(NBLKS);
+	vol = raid0_create(3, disks, UNIT);
+	raid0_set_notify(vol, on_event, NULL);
+	assert(blkdev_flush(vol) == SUCCESS);
+	failed_member = -2;
+	ramdisk_fail(disks[2]);
+	assert(blkdev_flush(vol) == E_UNAVAIL);
+	assert(failed_member == 2);
+	blkdev_close(vol);
+	printf("raid0 flush test passed\n");
+
+	for (int i = 0; i < 5; i++)
+		disks[i] = ramdisk_create(NBLKS);
+	vol = raid4_create(4, disks, UNIT);
+	raid4_set_notify(vol, on_event, NULL);
+	assert(raid4_set_journal(vol, disks[4]) == SUCCESS);
+	char buf[BLOCK_SIZE];
+	fill_block(buf, 3, 20);
+	assert(blkdev_write_fua(vol, 20, 1, buf) == SUCCESS);
+	assert(blkdev_flush(vol) == SUCCESS);
+	failed_member = -2;
+	ramdisk_fail(disks[1]);
+	assert(blkdev_flush(vol) == SUCCESS);
+	assert(failed_member == 1);
+	check_block(vol, 20, 3);
+	ramdisk_fail(disks[0]);
+	assert(blkdev_flush(vol) == E_UNAVAIL);
+	blkdev_close(vol);
+	printf("raid4 flush test passed\n");
+
+	for (int i = 0; i < 9; i++)
+		disks[i] = ramdisk_create(NBLKS);
+	vol = draid_create(9, disks, 4, UNIT);
+	assert(blkdev_flush(vol) == SUCCESS);
+	ramdisk_fail(disks[3]);
+	assert(blkdev_flush(vol) == SUCCESS);
+	ramdisk_fail(disks[5]);
+	assert(blkdev_flush(vol) == E_UNAVAIL);
+	blkdev_close(vol);
+	printf("draid flush test passed\n");
+}
+
+/* layers without a flush of their own flush what they are built on */
+void layer_tests(void){
+	struct blkdev *ssd = ramdisk_create(256);
+	struct blkdev *backing = ramdisk_create(NBLKS);
+	struct blkdev *cache = cache_create(ssd, backing, UNIT);
+	char buf[BLOCK_SIZE];
+	fill_block(buf, 4, 30);
+	assert(blkdev_write(cache, 30, 1, buf) == SUCCESS);
+	assert(blkdev_flush(cache) == SUCCESS);
+	assert(cache_flush(cache) == SUCCESS);
+	ramdisk_fail(backing);
+	assert(blkdev_flush(cache) == E_UNAVAIL);
+	blkdev_close(cache);
+
+	struct blkdev *disks[5];
+	for (int i = 0; i < 5; i++)
+		disks[i] = ramdisk_create(NBLKS);
+	struct blkdev *vol = raid4_create(5, disks, UNIT);
+	struct blkdev *log = logdev_create(vol, 4 * UNIT);
+	assert(log != NULL);
+	fill_block(buf, 5, 40);
+	assert(blkdev_write(log, 40, 1, buf) == SUCCESS);
+	long long before = vol->stats.blocks[BLKDEV_WRITE];
+	assert(blkdev_flush(log) == SUCCESS);       /* the open segment goes out */
+	assert(vol->stats.blocks[BLKDEV_WRITE] > before);
+	check_block(log, 40, 5);
+	blkdev_close(log);
+	printf("layer flush test passed\n");
+}
+
+int main(){
+	image_tests();
+	mirror_image_tests();
+	journal_image_tests();
+	raid_tests();
+	layer_tests();
+	unlink("flush-img");
+	printf("flush test passed\n");
+	return 0;
+}
@@ -0,0 +1,3 @@
+#!/bin/sh
+
+gcc -g3 -o flush-test flush-test.c image.c homework.c journal.c ramdisk.c cache.c logdev.c -lpthread -lm
@@ -10,624 +10,3945 @@
 #include <assert.h>
 #include "blkdev.h"
 #include <string.h> 
+#include <limits.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include "journal.h"
 
-/********** MIRRORING ***************/
+/* monotonic clock in nanoseconds */
+static long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
 
-/* Mirror device
+/********** HEDGED READS ***************/
+
+/* A read from a slow member can be hedged: if it has not finished
+ * within that member's threshold, a second attempt that avoids the
+ * member (the other side of a mirror, or a parity reconstruction) is
+ * started, and whichever succeeds first is used. Each attempt has a
+ * private buffer, so the loser can finish in the background and free
+ * itself. The first attempt goes to a pool of worker threads kept by
+ * the volume; only a hedge starts a thread of its own. If no thread
+ * can be had, the read is done in the caller's thread instead.
+ *
+ * Thresholds adapt: each member keeps its last HEDGE_SAMPLES read
+ * latencies, and the threshold is 'pct' percent of their 95th
+ * percentile (but never below 'min_us').
  */
-struct mirror_dev {
-    struct blkdev *disks[2];
-    int nblks;
+#define HEDGE_SAMPLES 64
+
+struct lat_track {
+    long long samples[HEDGE_SAMPLES];
+    int n;
+    int next;
+    long long threshold;        /* ns */
 };
-    
-static int mirror_num_blocks(struct blkdev *dev) {
-    struct mirror_dev * mirror = (struct mirror_dev*) dev->private;
-    return mirror->nblks;
+
+struct hedge_attempt;
+
+struct hedge {
+    int enabled;
+    long long min_ns;
+    int pct;
+    struct lat_track *lat;      /* one per member */
+    int nlat;
+    long long hedged;           /* reads that started a second attempt */
+    long long won;              /* ... where the second attempt won */
+    pthread_mutex_t lock;
+    pthread_cond_t idle;
+    int inflight;               /* attempts queued or running */
+    pthread_cond_t work;        /* worker pool: */
+    struct hedge_attempt *head, *tail;  /* first attempts waiting for a worker */
+    int queued;
+    int waiting;                /* idle workers */
+    int workers;
+    int stop;
+};
+
+struct hedge_call;
+
+struct hedge_attempt {
+    int (*fn)(struct hedge_attempt *a);
+    struct hedge_call *call;
+    void *ctx;                  /* device-specific */
+    int disk;                   /* member read, for latency tracking */
+    int avoid;                  /* member a reconstruction skips */
+    struct blkdev **members;    /* snapshot for a reconstruction */
+    int nmembers;
+    blkno_t lba;
+    int len;
+    char *buf;
+    int val;
+    int done;
+    struct hedge_attempt *next; /* worker queue */
+};
+
+struct hedge_call {
+    struct hedge *h;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int refs;
+    int winner;
+    int started;
+    int bytes;
+    struct hedge_attempt a[2];
+};
+
+static void hedge_init(struct hedge *h, int nmembers)
+{
+    memset(h, 0, sizeof(*h));
+    h->nlat = nmembers;
+    h->lat = calloc(nmembers, sizeof(struct lat_track));
+    pthread_mutex_init(&h->lock, NULL);
+    pthread_cond_init(&h->idle, NULL);
+    pthread_cond_init(&h->work, NULL);
 }
 
-/* read from one of the sides of the mirror. (if one side has failed,
- * it had better be the other one...) If both sides have failed,
- * return an error.
- * Note that a read operation may return an error to indicate that the
- * underlying device has failed, in which case you should close the
- * device and flag it (e.g. as a null pointer) so you won't try to use
- * it again. 
+/* wait for stray attempts - needed before closing a member they may
+ * be reading.
  */
-static int mirror_read(struct blkdev * dev, int first_blk,
-                       int num_blks, void *buf)
+static void hedge_drain(struct hedge *h)
 {
-    int val;
-    struct mirror_dev * mirror = (struct mirror_dev*) dev->private;
-    if (mirror->disks[0] != NULL) {
-        val = blkdev_read(mirror->disks[0], first_blk, num_blks, buf);
-        if (val == E_UNAVAIL) {
-            blkdev_close(mirror->disks[0]);
-            mirror->disks[0] = NULL;
-        }
-        else {
-            return val;
-        }
-    }
-    if (mirror->disks[1] != NULL)  {
-        val = blkdev_read(mirror->disks[1], first_blk, num_blks, buf);
-        if (val == E_UNAVAIL) {
-            blkdev_close(mirror->disks[1]);
-            mirror->disks[1] = NULL;
-        }
-        return val;
-    }
+    pthread_mutex_lock(&h->lock);
+    while (h->inflight > 0)
+        pthread_cond_wait(&h->idle, &h->lock);
+    pthread_mutex_unlock(&h->lock);
 }
 
-/* write to both sides of the mirror, or the remaining side if one has
- * failed. If both sides have failed, return an error.
- * Note that a write operation may indicate that the underlying device
- * has failed, in which case you should close the device and flag it
- * (e.g. as a null pointer) so you won't try to use it again.
- */
-static int mirror_write(struct blkdev * dev, int first_blk,
-                        int num_blks, void *buf)
+static void hedge_destroy(struct hedge *h)
 {
-    int val1, val2;
-    struct mirror_dev * mirror = (struct mirror_dev*) dev->private;
-    if (mirror->disks[0] != NULL) {
-        val1 = blkdev_write(mirror->disks[0], first_blk, num_blks, buf);
-        if (val1 == E_UNAVAIL) {
-            blkdev_close(mirror->disks[0]);
-            mirror->disks[0] = NULL;
-        }
-    }
-    if (mirror->disks[1] != NULL) {
-        val2 = blkdev_write(mirror->disks[1], first_blk, num_blks, buf);
-        if (val2 == E_UNAVAIL) {
-            blkdev_close(mirror->disks[1]);
-            mirror->disks[1] = NULL;
-        }        
-    }
+    hedge_drain(h);
+    pthread_mutex_lock(&h->lock);
+    h->stop = 1;
+    pthread_cond_broadcast(&h->work);
+    while (h->workers > 0)
+        pthread_cond_wait(&h->idle, &h->lock);
+    pthread_mutex_unlock(&h->lock);
+    pthread_mutex_destroy(&h->lock);
+    pthread_cond_destroy(&h->idle);
+    pthread_cond_destroy(&h->work);
+    free(h->lat);
+}
 
-    if (val1 == SUCCESS || val2 == SUCCESS) {
-        return SUCCESS;
-    } 
-    else {
-        return E_UNAVAIL;
-    }   
+/* track 'nmembers' members, for a volume that has grown */
+static void hedge_resize(struct hedge *h, int nmembers)
+{
+    pthread_mutex_lock(&h->lock);
+    h->lat = realloc(h->lat, nmembers * sizeof(struct lat_track));
+    for (int i = h->nlat; i < nmembers; i++) {
+        memset(&h->lat[i], 0, sizeof(h->lat[i]));
+        h->lat[i].threshold = h->min_ns;
+    }
+    h->nlat = nmembers;
+    pthread_mutex_unlock(&h->lock);
 }
 
-/* clean up, including: close any open (i.e. non-failed) devices, and
- * free any data structures you allocated in mirror_create.
- */
-static void mirror_close(struct blkdev *dev)
+static void hedge_config(struct hedge *h, struct hedge_opts *opts)
 {
-    struct mirror_dev * mirror = (struct mirror_dev*) dev->private;
-    blkdev_close(mirror->disks[0]);
-    blkdev_close(mirror->disks[1]);
-    free(mirror);
-    dev->private = NULL;
-    free(dev);
-    return;
+    pthread_mutex_lock(&h->lock);
+    __atomic_store_n(&h->enabled, opts != NULL && opts->enable, __ATOMIC_RELAXED);
+    h->min_ns = opts != NULL ? opts->min_us * 1000LL : 0;
+    h->pct = (opts != NULL && opts->pct > 0) ? opts->pct : 100;
+    for (int i = 0; i < h->nlat; i++)
+        h->lat[i].threshold = h->min_ns;
+    pthread_mutex_unlock(&h->lock);
 }
 
-struct blkdev_ops mirror_ops = {
-    .num_blocks = mirror_num_blocks,
-    .read = mirror_read,
-    .write = mirror_write,
-    .close = mirror_close
-};
+static int hedge_enabled(struct hedge *h)
+{
+    return __atomic_load_n(&h->enabled, __ATOMIC_RELAXED);
+}
 
-/* create a mirrored volume from two disks. Do not write to the disks
- * in this function - you should assume that they contain identical
- * contents. 
- */
-struct blkdev *mirror_create(struct blkdev *disks[2])
+static int cmp_ll(const void *a, const void *b)
 {
-    struct blkdev *dev = malloc(sizeof(*dev));
-    struct mirror_dev *mdev = malloc(sizeof(*mdev));
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
 
-    if (blkdev_num_blocks(disks[0]) == blkdev_num_blocks(disks[1])) {
-        mdev->disks[0] = disks[0];
-        mdev->disks[1] = disks[1];
-        mdev->nblks = blkdev_num_blocks(disks[0]);
-    } 
-    else {
-        printf("Error: disks size not same.\n");
-        return NULL;
+static void lat_record(struct hedge *h, int disk, long long ns)
+{
+    pthread_mutex_lock(&h->lock);
+    struct lat_track *t = &h->lat[disk];
+    t->samples[t->next] = ns;
+    t->next = (t->next + 1) % HEDGE_SAMPLES;
+    if (t->n < HEDGE_SAMPLES)
+        t->n++;
+    if (t->next % 16 == 0) {
+        long long sorted[HEDGE_SAMPLES];
+        memcpy(sorted, t->samples, t->n * sizeof(long long));
+        qsort(sorted, t->n, sizeof(long long), cmp_ll);
+        long long p95 = sorted[(t->n * 95) / 100];
+        t->threshold = p95 * h->pct / 100;
+        if (t->threshold < h->min_ns)
+            t->threshold = h->min_ns;
     }
+    pthread_mutex_unlock(&h->lock);
+}
 
-    dev->private = mdev;
-    dev->ops = &mirror_ops;
-
-    return dev;
+static long long lat_threshold(struct hedge *h, int disk)
+{
+    pthread_mutex_lock(&h->lock);
+    long long t = h->lat[disk].threshold;
+    pthread_mutex_unlock(&h->lock);
+    return t;
 }
 
-/* replace failed device 'i' (0 or 1) in a mirror. Note that we assume
- * the upper layer knows which device failed.
- */
-int mirror_replace(struct blkdev *volume, int i, struct blkdev *newdisk)
+static void hedge_put(struct hedge_call *c)
 {
-    struct mirror_dev * mirror = (struct mirror_dev*) volume->private;
-    if (blkdev_num_blocks(newdisk) != mirror->nblks) {
-        return E_SIZE;
+    /* called with c->lock held */
+    if (--c->refs > 0) {
+        pthread_mutex_unlock(&c->lock);
+        return;
     }
-    char buf[(mirror->nblks) * BLOCK_SIZE];
-    blkdev_read(mirror->disks[1-i], 0, mirror->nblks, buf);
-    blkdev_write(newdisk, 0, mirror->nblks, buf);
-    mirror->disks[i] = newdisk;
-    return SUCCESS;
+    pthread_mutex_unlock(&c->lock);
+    pthread_mutex_destroy(&c->lock);
+    pthread_cond_destroy(&c->cond);
+    for (int i = 0; i < 2; i++) {
+        free(c->a[i].buf);
+        free(c->a[i].members);
+    }
+    free(c);
 }
 
-/**********  RAID0 ***************/
-struct raid0_dev {    
-    int unit;
-    int N;    
-    int state;
-    struct blkdev **disks;
-};
+static void hedge_attempt_run(struct hedge_attempt *a)
+{
+    struct hedge_call *c = a->call;
+    struct hedge *h = c->h;
+    long long start = now_ns();
+
+    int val = a->fn(a);
+    if (val == SUCCESS && a->disk >= 0)
+        lat_record(h, a->disk, now_ns() - start);
+
+    pthread_mutex_lock(&c->lock);
+    a->val = val;
+    a->done = 1;
+    if (val == SUCCESS && c->winner < 0)
+        c->winner = a - c->a;
+    pthread_cond_broadcast(&c->cond);
+    hedge_put(c);
+
+    pthread_mutex_lock(&h->lock);
+    if (--h->inflight == 0)
+        pthread_cond_broadcast(&h->idle);
+    pthread_mutex_unlock(&h->lock);
+}
 
-int raid0_num_blocks(struct blkdev *dev)
+static void *hedge_thread(void *arg)
 {
-    struct raid0_dev * raid0 = (struct raid0_dev*) dev->private;    
-    return (int) (blkdev_num_blocks(raid0->disks[0])/raid0->unit) * raid0->unit * raid0->N;
+    hedge_attempt_run(arg);
+    return NULL;
 }
 
-int get_disk_lba(int blk, int unit, int N) {
-    int offset = blk % unit;
-    int strip_num = blk/unit;
-    int stripe_num = strip_num / N;
-    int disk_num = strip_num % N;
-    int disk_lba = stripe_num*unit + offset;
-    return disk_lba;
+/* pool worker: runs first attempts until the volume is closed */
+static void *hedge_worker(void *arg)
+{
+    struct hedge *h = arg;
+    pthread_mutex_lock(&h->lock);
+    for (;;) {
+        while (h->head == NULL && !h->stop) {
+            h->waiting++;
+            pthread_cond_wait(&h->work, &h->lock);
+            h->waiting--;
+        }
+        if (h->head == NULL)
+            break;
+        struct hedge_attempt *a = h->head;
+        h->head = a->next;
+        if (h->head == NULL)
+            h->tail = NULL;
+        h->queued--;
+        pthread_mutex_unlock(&h->lock);
+        hedge_attempt_run(a);
+        pthread_mutex_lock(&h->lock);
+    }
+    if (--h->workers == 0)
+        pthread_cond_broadcast(&h->idle);
+    pthread_mutex_unlock(&h->lock);
+    return NULL;
 }
 
-int get_disk_num(int blk, int unit, int N) {    
-    int strip_num = blk/unit;
-    int disk_num = strip_num % N;
-    return disk_num;
+static struct hedge_call *hedge_call_new(struct hedge *h, int bytes)
+{
+    struct hedge_call *c = calloc(1, sizeof(*c));
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&c->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_init(&c->lock, NULL);
+    c->h = h;
+    c->refs = 1;
+    c->winner = -1;
+    c->bytes = bytes;
+    for (int i = 0; i < 2; i++) {
+        c->a[i].call = c;
+        c->a[i].disk = -1;
+    }
+    return c;
 }
 
-/* read blocks from a striped volume. 
- * Note that a read operation may return an error to indicate that the
- * underlying device has failed, in which case you should (a) close the
- * device and (b) return an error on this and all subsequent read or
- * write operations. 
+/* hand attempt 'i' to a thread: the first to a pool worker (adding
+ * one if none is idle), the hedge to a thread of its own. Returns -1
+ * if no thread could be started. Called with c->lock held.
  */
-static int raid0_read(struct blkdev * dev, int first_blk,
-                       int num_blks, void *buf)
+static int hedge_start(struct hedge_call *c, int i)
 {
-    struct raid0_dev * raid0 = (struct raid0_dev*) dev->private; 
-
-    if (raid0->state == 0) {
-        return E_UNAVAIL;
-    } 
+    struct hedge *h = c->h;
+    struct hedge_attempt *a = &c->a[i];
+    pthread_t t;
+    int err = 0;
 
-    int disk_num, disk_lba,num_blocks_read,place;
-    int blocks = num_blks;
-    int LBA = first_blk;
-    int val;
-    while (blocks > 0){
-        disk_num = get_disk_num(LBA, raid0->unit, raid0->N);
-        disk_lba = get_disk_lba(LBA, raid0->unit, raid0->N);
-        place = disk_lba % raid0->unit; 
-        if ((blocks+place) > raid0->unit){
-            num_blocks_read = raid0->unit - place;
+    if (a->buf == NULL)
+        a->buf = malloc(c->bytes);
+    pthread_mutex_lock(&h->lock);
+    if (i == 0) {
+        if (h->waiting <= h->queued) {
+            err = pthread_create(&t, NULL, hedge_worker, h);
+            if (err == 0) {
+                pthread_detach(t);
+                h->workers++;
+            }
         }
-        else{
-            num_blocks_read = blocks;
-        } 
-        val = blkdev_read(raid0->disks[disk_num], disk_lba, num_blocks_read, buf);
-        if(val == E_UNAVAIL) {
-            raid0->state = 0;
-            blkdev_close(raid0->disks[disk_num]);
-            raid0->disks[disk_num] = NULL;
-            return E_UNAVAIL;
+        if (err == 0) {
+            a->next = NULL;
+            if (h->tail != NULL)
+                h->tail->next = a;
+            else
+                h->head = a;
+            h->tail = a;
+            h->queued++;
+            pthread_cond_signal(&h->work);
         }
-        buf += num_blocks_read * BLOCK_SIZE;
-        blocks -= num_blocks_read;
-        LBA+= num_blocks_read;
+    } else {
+        err = pthread_create(&t, NULL, hedge_thread, a);
+        if (err == 0)
+            pthread_detach(t);
     }
-
-    return SUCCESS;
+    if (err == 0) {
+        h->inflight++;
+        c->refs++;
+        c->started++;
+    }
+    pthread_mutex_unlock(&h->lock);
+    return err == 0 ? 0 : -1;
 }
 
-
-/* write blocks to a striped volume.
- * Again if an underlying device fails you should close it and return
- * an error for this and all subsequent read or write operations.
+/* run attempt 0, hedging with attempt 1 if attempt 0 takes longer
+ * than the threshold for its member. On success the winning data is
+ * copied to 'buf'. If every attempt fails, the error from attempt 0
+ * is returned once all attempts have finished.
+ *
+ * Either way vals[i] is set to how attempt i went (SUCCESS if it was
+ * never started or is still running), so the caller can handle a
+ * failed or corrupt member even when the other attempt covered for it.
  */
-static int raid0_write(struct blkdev * dev, int first_blk,
-                        int num_blks, void *buf)
+static int hedge_run(struct hedge_call *c, void *buf, int vals[2])
 {
-    struct raid0_dev * raid0 = (struct raid0_dev*) dev->private;
+    struct hedge *h = c->h;
+    long long deadline = now_ns() + lat_threshold(h, c->a[0].disk);
+    struct timespec ts = {deadline / 1000000000LL, deadline % 1000000000LL};
 
-    if (raid0->state == 0) {
-        return E_UNAVAIL;
-    } 
-    int disk_num, disk_lba,num_blocks_read,place;
-    int blocks = num_blks;
-    int LBA = first_blk;
-    int val;
-    while (blocks > 0){
-        disk_num = get_disk_num(LBA, raid0->unit, raid0->N);
-        disk_lba = get_disk_lba(LBA, raid0->unit, raid0->N);
-        place = disk_lba % raid0->unit; 
-        if ((blocks+place) > raid0->unit){
-            num_blocks_read = raid0->unit - place;
-        }
-        else{
-            num_blocks_read = blocks;
-        } 
-        val = blkdev_write(raid0->disks[disk_num], disk_lba, num_blocks_read, buf);
-        if(val == E_UNAVAIL) {
-            raid0->state = 0;
-            blkdev_close(raid0->disks[disk_num]);
-            raid0->disks[disk_num] = NULL;
-            return E_UNAVAIL;
+    pthread_mutex_lock(&c->lock);
+    if (hedge_start(c, 0) != 0) {
+        /* no thread to spare: read in this one, unhedged */
+        pthread_mutex_unlock(&c->lock);
+        struct hedge_attempt a = c->a[0];
+        a.buf = buf;
+        vals[0] = a.fn(&a);
+        vals[1] = SUCCESS;
+        pthread_mutex_lock(&c->lock);
+        hedge_put(c);
+        return vals[0];
+    }
+    while (!c->a[0].done &&
+           pthread_cond_timedwait(&c->cond, &c->lock, &ts) == 0)
+        ;
+    if ((!c->a[0].done || c->a[0].val != SUCCESS) && hedge_start(c, 1) == 0) {
+        pthread_mutex_lock(&h->lock);
+        h->hedged++;
+        pthread_mutex_unlock(&h->lock);
+    }
+    while (c->winner < 0 && !(c->a[0].done && (c->started < 2 || c->a[1].done)))
+        pthread_cond_wait(&c->cond, &c->lock);
+
+    for (int i = 0; i < 2; i++)
+        vals[i] = c->a[i].done ? c->a[i].val : SUCCESS;
+    int val = c->a[0].val;
+    if (c->winner >= 0) {
+        memcpy(buf, c->a[c->winner].buf, c->bytes);
+        val = SUCCESS;
+        if (c->winner == 1) {
+            pthread_mutex_lock(&h->lock);
+            h->won++;
+            pthread_mutex_unlock(&h->lock);
         }
-        buf += num_blocks_read * BLOCK_SIZE;
-        blocks -= num_blocks_read;
-        LBA+= num_blocks_read;
-        
     }
+    hedge_put(c);
+    return val;
+}
 
-    return SUCCESS;
+static int attempt_disk_read(struct hedge_attempt *a)
+{
+    struct blkdev *disk = a->ctx;
+    return blkdev_read(disk, a->lba, a->len, a->buf);
 }
 
-/* clean up, including: close all devices and free any data structures
- * you allocated in stripe_create. 
- */
-static void raid0_close(struct blkdev *dev)
+static void hedge_stats(struct hedge *h, long long *hedged, long long *won)
 {
-    struct raid0_dev * raid0 = (struct raid0_dev*) dev->private;
-    for (int i = 0; i< raid0->N; i++) {
-        blkdev_close(raid0->disks[i]);
-    }
-    free(raid0);
-    dev->private = NULL;
-    free(dev);
-    return;
+    pthread_mutex_lock(&h->lock);
+    *hedged = h->hedged;
+    *won = h->won;
+    pthread_mutex_unlock(&h->lock);
 }
 
-struct blkdev_ops raid0_ops = {
-    .num_blocks = raid0_num_blocks,
-    .read = raid0_read,
-    .write = raid0_write,
-    .close = raid0_close
-};
+/********** RANGE LOCKS ***************/
 
-/* create a striped volume across N disks, with a stripe size of
- * 'unit'. (i.e. if 'unit' is 4, then blocks 0..3 will be on disks[0],
- * 4..7 on disks[1], etc.)
- * Check the size of the disks to compute the final volume size, and
- * fail (return NULL) if they aren't all the same.
- * Do not write to the disks in this function.
+/* A striped lock table: key k (a row, or a chunk of blocks) is covered
+ * by lock k % RANGE_LOCKS. Readers of a range share its locks, writers
+ * hold them exclusively, so requests to different stripes run in
+ * parallel. Locks are always taken in ascending slot order.
  */
-struct blkdev *raid0_create(int N, struct blkdev *disks[], int unit)
-{
-    struct blkdev *dev = malloc(sizeof(*dev));
-    struct raid0_dev *sdev = malloc(sizeof(*sdev));
+#define RANGE_LOCKS 64
 
-    for (int i = 1; i<N; i++) {
-        if (blkdev_num_blocks(disks[0]) != blkdev_num_blocks(disks[i])) {
-            printf("Error: disks size not same.\n");
-            return NULL;
-        }
-    }
+struct range_locks {
+    pthread_rwlock_t slot[RANGE_LOCKS];
+};
 
-    sdev->disks = disks;
-    sdev->unit = unit;
-    sdev->N = N;
-    sdev->state = 1;
-    dev->private = sdev;
-    dev->ops = &raid0_ops;
-    return dev;
+static void range_init(struct range_locks *t)
+{
+    for (int i = 0; i < RANGE_LOCKS; i++)
+        pthread_rwlock_init(&t->slot[i], NULL);
 }
 
-/**********   RAID 4  ***************/
+static void range_destroy(struct range_locks *t)
+{
+    for (int i = 0; i < RANGE_LOCKS; i++)
+        pthread_rwlock_destroy(&t->slot[i]);
+}
 
-struct raid4_dev {    
-    int unit;
-    int N;
-    int state;
-    int disk_failed;
-    int nblks;
-    struct blkdev **disks;    /* flag bad disk by setting to NULL */    
-    struct blkdev *parity;
-};
+/* slots covering keys first..last, as one or two ascending runs */
+static int range_runs(blkno_t first, blkno_t last, int run[2][2])
+{
+    if (last < first)
+        last = first;
+    if (last - first + 1 >= RANGE_LOCKS) {
+        run[0][0] = 0;
+        run[0][1] = RANGE_LOCKS - 1;
+        return 1;
+    }
+    int s0 = first % RANGE_LOCKS, s1 = last % RANGE_LOCKS;
+    if (s0 <= s1) {
+        run[0][0] = s0;
+        run[0][1] = s1;
+        return 1;
+    }
+    run[0][0] = 0;
+    run[0][1] = s1;
+    run[1][0] = s0;
+    run[1][1] = RANGE_LOCKS - 1;
+    return 2;
+}
 
-int raid4_num_blocks(struct blkdev *dev)
+static void range_lock(struct range_locks *t, blkno_t first, blkno_t last, int write)
 {
-    struct raid4_dev * raid4 = (struct raid4_dev*) dev->private;    
-    return raid4->nblks * raid4->N;
+    int run[2][2];
+    int n = range_runs(first, last, run);
+    for (int r = 0; r < n; r++) {
+        for (int i = run[r][0]; i <= run[r][1]; i++) {
+            if (write)
+                pthread_rwlock_wrlock(&t->slot[i]);
+            else
+                pthread_rwlock_rdlock(&t->slot[i]);
+        }
+    }
 }
 
-/* helper function - compute parity function across two blocks of
- * 'len' bytes and put it in a third block. Note that 'dst' can be the
- * same as either 'src1' or 'src2', so to compute parity across N
- * blocks you can do: 
- *
- *     void **block[i] - array of pointers to blocks
- *     dst = <zeros[len]>
- *     for (i = 0; i < N; i++)
- *        parity(block[i], dst, dst);
- *
- * Yes, it could be faster. Don't worry about it.
- */
-void parity(int len, void *src1, void *src2, void *dst)
+static void range_unlock(struct range_locks *t, blkno_t first, blkno_t last)
 {
-    unsigned char *s1 = src1, *s2 = src2, *d = dst;
-    int i;
-    for (i = 0; i < len; i++)
-        d[i] = s1[i] ^ s2[i];
+    int run[2][2];
+    int n = range_runs(first, last, run);
+    for (int r = 0; r < n; r++) {
+        for (int i = run[r][0]; i <= run[r][1]; i++)
+            pthread_rwlock_unlock(&t->slot[i]);
+    }
 }
 
-int reconstruct_data(struct blkdev *dev, int disk_num, void *buf, int num_blocks_read, int LBA)
+/* exclusive access to the whole device, e.g. to swap a member */
+static void range_lock_all(struct range_locks *t)
 {
-    struct raid4_dev * raid4 = (struct raid4_dev*) dev->private; 
-    char read_buf[BLOCK_SIZE]; 
-    int val;
+    range_lock(t, 0, RANGE_LOCKS - 1, 1);
+}
+
+static void range_unlock_all(struct range_locks *t)
+{
+    range_unlock(t, 0, RANGE_LOCKS - 1);
+}
+
+/********** STATE NOTIFICATION ***************/
+
+/* a volume reports member failures, rebuild progress and its close to
+ * whoever keeps its metadata (see superblock.c). The callback runs in
+ * the thread that caused the change, under the volume's state lock
+ * where it has one, so the events arrive in order.
+ */
+struct notify {
+    raid_notify_fn fn;
+    void *arg;
+};
+
+static void notify(struct notify *n, int event, int member, blkno_t mark)
+{
+    if (n->fn != NULL)
+        n->fn(n->arg, event, member, mark);
+}
+
+/********** HOT SPARES ***************/
+
+/* A spare pool is a set of idle disks that any number of volumes
+ * share. When a member of a mirror or raid4 volume fails, the volume
+ * takes the smallest spare that fits and rebuilds onto it from a
+ * thread of its own, at background priority like any replace. If the
+ * spare fails too, the next one is tried. Closing the volume stops the
+ * rebuild where it got to. The pool has to outlive its volumes.
+ */
+#define SPARE_POOL_MAX 64
+
+struct spare_pool {
+    pthread_mutex_t lock;
+    int n;
+    struct blkdev *disks[SPARE_POOL_MAX];
+};
+
+struct spare_pool *spare_pool_create(void)
+{
+    struct spare_pool *pool = calloc(1, sizeof(*pool));
+    pthread_mutex_init(&pool->lock, NULL);
+    return pool;
+}
+
+int spare_pool_add(struct spare_pool *pool, struct blkdev *disk)
+{
+    pthread_mutex_lock(&pool->lock);
+    int val = pool->n < SPARE_POOL_MAX ? SUCCESS : E_SIZE;
+    if (val == SUCCESS)
+        pool->disks[pool->n++] = disk;
+    pthread_mutex_unlock(&pool->lock);
+    return val;
+}
+
+int spare_pool_count(struct spare_pool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    int n = pool->n;
+    pthread_mutex_unlock(&pool->lock);
+    return n;
+}
+
+/* close the spares nobody took, and free the pool */
+void spare_pool_destroy(struct spare_pool *pool)
+{
+    for (int i = 0; i < pool->n; i++)
+        blkdev_close(pool->disks[i]);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+/* take the smallest spare of min_blks..max_blks blocks of 'bsize'
+ * bytes out of the pool, or return NULL
+ */
+static struct blkdev *spare_pool_take(struct spare_pool *pool, blkno_t min_blks,
+                                      blkno_t max_blks, int bsize)
+{
+    pthread_mutex_lock(&pool->lock);
+    int best = -1;
+    for (int i = 0; i < pool->n; i++) {
+        blkno_t n = blkdev_num_blocks(pool->disks[i]);
+        if (n >= min_blks && n <= max_blks && blkdev_block_size(pool->disks[i]) == bsize &&
+            (best < 0 || n < blkdev_num_blocks(pool->disks[best])))
+            best = i;
+    }
+    struct blkdev *disk = NULL;
+    if (best >= 0) {
+        disk = pool->disks[best];
+        pool->disks[best] = pool->disks[--pool->n];
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return disk;
+}
+
+/* a volume's use of a pool. 'replace' puts a spare in place of failed
+ * member i (see raid_replace_fn); 'degraded' says whether member i
+ * still needs one.
+ */
+struct hot_spare {
+    struct blkdev *volume;
+    int (*degraded)(struct blkdev *volume, int i);
+    pthread_mutex_t lock;       /* protects the fields below */
+    pthread_cond_t done;
+    struct spare_pool *pool;    /* or NULL */
+    raid_replace_fn replace;
+    blkno_t min_blks, max_blks;
+    int bsize;
+    pthread_t thread;
+    int running;
+    int joinable;
+    int stop;                   /* the volume is closing */
+    int member;
+    struct blkdev *disk;        /* the spare the thread starts with */
+    int result;                 /* of the last rebuild */
+};
+
+static void hot_spare_init(struct hot_spare *hs, struct blkdev *volume,
+                           int (*degraded)(struct blkdev *, int))
+{
+    memset(hs, 0, sizeof(*hs));
+    hs->volume = volume;
+    hs->degraded = degraded;
+    pthread_mutex_init(&hs->lock, NULL);
+    pthread_cond_init(&hs->done, NULL);
+}
+
+static void hot_spare_config(struct hot_spare *hs, struct spare_pool *pool, raid_replace_fn fn,
+                             blkno_t min_blks, blkno_t max_blks, int bsize)
+{
+    pthread_mutex_lock(&hs->lock);
+    hs->pool = pool;
+    hs->replace = fn;
+    hs->min_blks = min_blks;
+    hs->max_blks = max_blks;
+    hs->bsize = bsize;
+    pthread_mutex_unlock(&hs->lock);
+}
+
+static int hot_spare_stopping(struct hot_spare *hs)
+{
+    return __atomic_load_n(&hs->stop, __ATOMIC_ACQUIRE);
+}
+
+static void *hot_spare_thread(void *arg)
+{
+    struct hot_spare *hs = arg;
+    pthread_mutex_lock(&hs->lock);
+    struct spare_pool *pool = hs->pool;
+    raid_replace_fn replace = hs->replace;
+    blkno_t min_blks = hs->min_blks, max_blks = hs->max_blks;
+    int i = hs->member, bsize = hs->bsize;
+    struct blkdev *disk = hs->disk;
+    pthread_mutex_unlock(&hs->lock);
+
+    int val;
+    for (;;) {
+        val = replace(hs->volume, i, disk);
+        if (val == E_SIZE) {
+            /* the volume didn't take it after all */
+            if (spare_pool_add(pool, disk) != SUCCESS)
+                blkdev_close(disk);
+            break;
+        }
+        if (val == SUCCESS || hot_spare_stopping(hs) || !hs->degraded(hs->volume, i))
+            break;
+        disk = spare_pool_take(pool, min_blks, max_blks, bsize);
+        if (disk == NULL)
+            break;
+    }
+
+    pthread_mutex_lock(&hs->lock);
+    hs->result = val;
+    hs->running = 0;
+    pthread_cond_broadcast(&hs->done);
+    pthread_mutex_unlock(&hs->lock);
+    return NULL;
+}
+
+/* member i has failed: start rebuilding onto a spare, if there is one
+ * that fits. Called from the I/O path, so it must not wait.
+ */
+static void hot_spare_start(struct hot_spare *hs, int i)
+{
+    pthread_mutex_lock(&hs->lock);
+    if (hs->pool != NULL && !hs->running && !hs->stop && hs->degraded(hs->volume, i)) {
+        struct blkdev *disk = spare_pool_take(hs->pool, hs->min_blks, hs->max_blks, hs->bsize);
+        if (disk != NULL) {
+            if (hs->joinable)
+                pthread_join(hs->thread, NULL);     /* it has finished */
+            hs->running = hs->joinable = 1;
+            hs->member = i;
+            hs->disk = disk;
+            pthread_create(&hs->thread, NULL, hot_spare_thread, hs);
+        }
+    }
+    pthread_mutex_unlock(&hs->lock);
+}
+
+/* wait for a rebuild onto a spare, and return how it went */
+static int hot_spare_wait(struct hot_spare *hs)
+{
+    pthread_mutex_lock(&hs->lock);
+    while (hs->running)
+        pthread_cond_wait(&hs->done, &hs->lock);
+    int val = hs->result;
+    pthread_mutex_unlock(&hs->lock);
+    return val;
+}
+
+/* stop a rebuild (the volume is closing) and clean up */
+static void hot_spare_destroy(struct hot_spare *hs)
+{
+    pthread_mutex_lock(&hs->lock);
+    __atomic_store_n(&hs->stop, 1, __ATOMIC_RELEASE);
+    int joinable = hs->joinable;
+    pthread_mutex_unlock(&hs->lock);
+    if (joinable)
+        pthread_join(hs->thread, NULL);
+    pthread_cond_destroy(&hs->done);
+    pthread_mutex_destroy(&hs->lock);
+}
+
+/********** FLUSHES ***************/
+
+/* A flush of a volume flushes its members, all at once since each may
+ * take a whole device cache flush: one thread per member, with the
+ * caller doing the last itself. Members left NULL are skipped.
+ */
+struct member_flush {
+    struct blkdev *disk;
+    int val;
+};
+
+static void *member_flush_thread(void *arg)
+{
+    struct member_flush *f = arg;
+    f->val = blkdev_flush(f->disk);
+    return NULL;
+}
+
+static void flush_members(struct member_flush *f, int n)
+{
+    pthread_t threads[n];
+    int last = n - 1;
+    for (int i = 0; i < n; i++)
+        f[i].val = SUCCESS;
+    while (last >= 0 && f[last].disk == NULL)
+        last--;
+    for (int i = 0; i < last; i++) {
+        if (f[i].disk != NULL)
+            pthread_create(&threads[i], NULL, member_flush_thread, &f[i]);
+    }
+    if (last >= 0)
+        f[last].val = blkdev_flush(f[last].disk);
+    for (int i = 0; i < last; i++) {
+        if (f[i].disk != NULL)
+            pthread_join(threads[i], NULL);
+    }
+}
+
+/********** RESHAPE ***************/
+
+/* A raid0 or raid4 volume grows onto more disks by moving its data, a
+ * chunk of rows at a time, from the old layout (prev_N data disks) to
+ * the new one (N). Volume blocks below 'pos' are in the new layout and
+ * the rest are still in the old one. The new layout is wider, so a
+ * block only ever moves to a lower member LBA, or stays where it is.
+ *
+ * Each chunk is recorded with a checkpoint (RAID_EV_RESHAPE) before
+ * its rows are unlocked, and only overwrites rows whose old contents
+ * lie below the checkpoint. After a crash the next chunk can therefore
+ * be redone from the old layout. The first few rows overlap the old
+ * data they are made from, so each of them is first copied to a backup
+ * area at the end of the last member (which the old layout doesn't use
+ * and the new one reaches last), and the checkpoint says so
+ * (RAID_EV_RESHAPE_BACKUP) until the row has been written.
+ */
+#define RESHAPE_ROWS 16
+
+struct reshape {
+    int prev_N;                 /* data disks above 'pos'; N if not reshaping */
+    blkno_t pos;                /* volume blocks in the new layout */
+    int backup;                 /* the row at 'pos' is in the backup area */
+};
+
+static void reshape_init(struct reshape *rs, int N)
+{
+    __atomic_store_n(&rs->prev_N, N, __ATOMIC_RELEASE);
+    rs->pos = 0;
+    rs->backup = 0;
+}
+
+/* how many of the blocks first_blk.. are below 'pos' */
+static blkno_t reshape_below(struct reshape *rs, blkno_t first_blk, blkno_t num_blks)
+{
+    blkno_t pos = __atomic_load_n(&rs->pos, __ATOMIC_ACQUIRE);
+    if (first_blk >= pos)
+        return 0;
+    return pos - first_blk < num_blks ? pos - first_blk : num_blks;
+}
+
+/* the rows a request to volume blocks first..last may touch, in either
+ * layout: unit*N blocks to a row below 'pos', unit*prev_N above it.
+ */
+static void reshape_rows(struct reshape *rs, int N, int unit, blkno_t first,
+                         blkno_t last, blkno_t rows[2])
+{
+    int prev_N = __atomic_load_n(&rs->prev_N, __ATOMIC_ACQUIRE);
+    rows[0] = first / ((blkno_t)unit * N);
+    rows[1] = last / ((blkno_t)unit * prev_N);
+}
+
+/* lock the rows of a request. A reshape step holds the rows it moves,
+ * so once they are held 'pos' can't pass through the request; a
+ * reshape starting meanwhile changes the layouts, so they are worked
+ * out again after locking.
+ */
+static void reshape_lock(struct range_locks *locks, struct reshape *rs, int *N, int unit,
+                         blkno_t first, blkno_t last, int write, blkno_t rows[2])
+{
+    for (;;) {
+        blkno_t now[2];
+        reshape_rows(rs, __atomic_load_n(N, __ATOMIC_ACQUIRE), unit, first, last, rows);
+        range_lock(locks, rows[0], rows[1], write);
+        reshape_rows(rs, *N, unit, first, last, now);
+        if (now[0] >= rows[0] && now[1] <= rows[1])
+            return;
+        range_unlock(locks, rows[0], rows[1]);
+    }
+}
+
+/* a read or write in the layout of 'n' data disks */
+typedef int (*stripe_io_fn)(struct blkdev *dev, int n, blkno_t first_blk,
+                            int num_blks, void *buf);
+
+/* do a request in two parts: below 'pos' in the new layout and above
+ * it in the old one. Called with its rows locked.
+ */
+static int reshape_split(struct blkdev *dev, struct reshape *rs, int N, int bsize,
+                         stripe_io_fn fn, blkno_t first_blk, int num_blks, void *buf)
+{
+    int below = reshape_below(rs, first_blk, num_blks);
+    int val = SUCCESS;
+    if (below > 0)
+        val = fn(dev, N, first_blk, below, buf);
+    if (val == SUCCESS && below < num_blks)
+        val = fn(dev, rs->prev_N, first_blk + below, num_blks - below,
+                 (char *)buf + (size_t)below * bsize);
+    return val;
+}
+
+struct reshape_job {
+    struct blkdev *dev;
+    struct reshape *rs;
+    struct range_locks *locks;
+    int N;                      /* data disks of the new layout */
+    int unit, bsize;
+    blkno_t dblks;              /* blocks of each member in use */
+    struct blkdev *spare;       /* member with the backup area */
+    stripe_io_fn read, write;
+    /* rows r0..r1-1 of the layout with 'n' data disks hold zeros */
+    int (*zero)(struct blkdev *dev, int n, blkno_t r0, blkno_t r1);
+    void (*checkpoint)(struct blkdev *dev, int event, blkno_t mark);
+};
+
+/* move rows row..row+k-1 of the new layout - or with k == 0, the row
+ * at 'pos' by way of the backup area - and record the new 'pos'. New
+ * rows past the end of the old volume are zeroed.
+ */
+static int reshape_step(struct reshape_job *j, blkno_t row, int k, char *buf)
+{
+    struct reshape *rs = j->rs;
+    int rows = k > 0 ? k : 1;
+    blkno_t rowblks = (blkno_t)j->unit * j->N, pos = row * rowblks;
+    blkno_t len = rows * rowblks, old_end = j->dblks * rs->prev_N;
+    blkno_t data = pos >= old_end ? 0 : (old_end - pos < len ? old_end - pos : len);
+    int full = (data + rowblks - 1) / rowblks;
+    blkno_t backup_lba = j->dblks - rowblks;
+
+    /* the new rows, and the old rows their data comes from */
+    blkno_t last = row + rows - 1;
+    if (data > 0 && (pos + data - 1) / ((blkno_t)j->unit * rs->prev_N) > last)
+        last = (pos + data - 1) / ((blkno_t)j->unit * rs->prev_N);
+
+    range_lock(j->locks, row, last, 1);
+    int val = SUCCESS;
+    if (rs->backup) {
+        val = blkdev_read(j->spare, backup_lba, rowblks, buf);
+        full = 1;
+    } else {
+        memset(buf, 0, (size_t)full * rowblks * j->bsize);
+        if (data > 0)
+            val = j->read(j->dev, rs->prev_N, pos, data, buf);
+        if (val == SUCCESS && k == 0)
+            val = blkdev_write(j->spare, backup_lba, rowblks, buf);
+        if (val == SUCCESS && k == 0) {
+            rs->backup = 1;
+            j->checkpoint(j->dev, RAID_EV_RESHAPE_BACKUP, pos);
+        }
+    }
+    if (val == SUCCESS && full > 0)
+        val = j->write(j->dev, j->N, pos, full * rowblks, buf);
+    if (val == SUCCESS && full < rows)
+        val = j->zero(j->dev, j->N, row + full, row + rows);
+    if (val == SUCCESS) {
+        j->checkpoint(j->dev, RAID_EV_RESHAPE, pos + len);
+        rs->backup = 0;
+        __atomic_store_n(&rs->pos, pos + len, __ATOMIC_RELEASE);
+    }
+    range_unlock(j->locks, row, last);
+    return val;
+}
+
+/* run a reshape from 'pos' to the end, at background priority, then
+ * switch the volume to the new layout and size.
+ */
+static int reshape_run(struct reshape_job *j)
+{
+    struct reshape *rs = j->rs;
+    blkno_t rowblks = (blkno_t)j->unit * j->N;
+    blkno_t nrows = j->dblks / j->unit;
+    char *buf = malloc((size_t)RESHAPE_ROWS * rowblks * j->bsize);
+    int prio = blkdev_set_prio(BLKDEV_PRIO_BG);
+    if (prio == BLKDEV_PRIO_IDLE)
+        blkdev_set_prio(prio);
+
+    int val = SUCCESS;
+    while (val == SUCCESS && rs->pos < nrows * rowblks) {
+        blkno_t row = rs->pos / rowblks;
+        /* the old data not moved yet starts in this row */
+        blkno_t safe = rs->pos >= j->dblks * rs->prev_N ? nrows :
+            rs->pos / ((blkno_t)j->unit * rs->prev_N);
+        int k = nrows - row < RESHAPE_ROWS ? nrows - row : RESHAPE_ROWS;
+        if (rs->backup)
+            k = 1;
+        else if (row + k > safe)
+            k = safe > row ? safe - row : 0;
+        val = reshape_step(j, row, k, buf);
+    }
+    free(buf);
+    blkdev_set_prio(prio);
+    if (val != SUCCESS)
+        return val;
+
+    range_lock_all(j->locks);
+    __atomic_store_n(&rs->prev_N, j->N, __ATOMIC_RELEASE);
+    __atomic_store_n(&rs->pos, 0, __ATOMIC_RELEASE);
+    j->checkpoint(j->dev, RAID_EV_RESHAPED, 0);
+    range_unlock_all(j->locks);
+    return SUCCESS;
+}
+
+/********** MIRRORING ***************/
+
+/* Mirror device
+ */
+struct mirror_dev {
+    struct blkdev *disks[2];
+    int failed[2];            /* side has failed; left open */
+    int resync;               /* side mirror_replace is copying, or -1 */
+    blkno_t rebuilt;          /* blocks of it copied so far */
+    struct notify notify;
+    blkno_t nblks;
+    int bsize;                /* bytes per block, the same on both sides */
+    struct hedge hedge;
+    struct range_locks locks; /* per MIRROR_LOCK_BLKS chunk */
+    struct hot_spare spares;
+};
+
+/* both sides of a block must be written in the same order by
+ * concurrent writers, so writes lock their chunks exclusively.
+ */
+#define MIRROR_LOCK_BLKS 64
+
+static int mirror_ok(struct mirror_dev *mirror, int i)
+{
+    return !__atomic_load_n(&mirror->failed[i], __ATOMIC_ACQUIRE);
+}
+
+/* side 'i' takes a write starting at 'first_blk' if it is in service,
+ * or if mirror_replace has already copied that far. (The chunks being
+ * written are locked, so the copy is not in the middle of them.)
+ */
+static int mirror_writable(struct mirror_dev *mirror, int i, blkno_t first_blk)
+{
+    if (mirror_ok(mirror, i))
+        return 1;
+    return __atomic_load_n(&mirror->resync, __ATOMIC_ACQUIRE) == i &&
+        first_blk < __atomic_load_n(&mirror->rebuilt, __ATOMIC_ACQUIRE);
+}
+
+/* the side needs a replacement, and the other side can supply it */
+static int mirror_degraded(struct blkdev *volume, int i)
+{
+    struct mirror_dev * mirror = (struct mirror_dev*) volume->private;
+    return !mirror_ok(mirror, i) && mirror_ok(mirror, 1-i) &&
+        __atomic_load_n(&mirror->resync, __ATOMIC_ACQUIRE) != i;
+}
+    
+static blkno_t mirror_num_blocks(struct blkdev *dev) {
+    struct mirror_dev * mirror = (struct mirror_dev*) dev->private;
+    return mirror->nblks;
+}
+
+static int mirror_block_size(struct blkdev *dev) {
+    struct mirror_dev * mirror = (struct mirror_dev*) dev->private;
+    return mirror->bsize;
+}
+
+/* flag a failed side. Other requests may still be using it, so it is
+ * left open; it is closed with the mirror unless replaced first.
+ */
+static void mirror_fail(struct mirror_dev *mirror, int i)
+{
+    if (__atomic_exchange_n(&mirror->failed[i], 1, __ATOMIC_ACQ_REL) == 0) {
+        notify(&mirror->notify, RAID_EV_FAILED, i, 0);
+        hot_spare_start(&mirror->spares, i);
+    }
+}
+
+/* side 'i' has blocks that don't match their checksums: read them
+ * from the other side and write them back. Writes to them are locked
+ * out, so the other side is current.
+ */
+static int mirror_repair(struct mirror_dev *mirror, int i, blkno_t first_blk,
+                         int num_blks, void *buf)
+{
+    if (!mirror_ok(mirror, 1-i))
+        return E_CORRUPT;
+    int val = blkdev_read(mirror->disks[1-i], first_blk, num_blks, buf);
+    if (val == E_UNAVAIL) {
+        mirror_fail(mirror, 1-i);
+        return E_CORRUPT;
+    }
+    if (val != SUCCESS)
+        return val;
+    if (blkdev_write(mirror->disks[i], first_blk, num_blks, buf) == E_UNAVAIL)
+        mirror_fail(mirror, i);
+    return SUCCESS;
+}
+
+/* a hedged read succeeded, but side 'i' gave 'val': flag it if it
+ * has failed, or write the good copy in 'buf' back over bad blocks,
+ * as the unhedged read would have.
+ */
+static void mirror_hedge_check(struct mirror_dev *mirror, int i, int val,
+                               blkno_t first_blk, int num_blks, void *buf)
+{
+    if (val == E_UNAVAIL)
+        mirror_fail(mirror, i);
+    else if (val == E_CORRUPT &&
+             blkdev_write(mirror->disks[i], first_blk, num_blks, buf) == E_UNAVAIL)
+        mirror_fail(mirror, i);
+}
+
+/* hedged read: start on the side that has been answering faster, and
+ * go to the other side if it is slow. Returns an error only if both
+ * sides failed, leaving the failure handling to mirror_read; a side
+ * that failed, or returned bad blocks, while the other answered is
+ * handled here (see mirror_hedge_check).
+ */
+static int mirror_hedged_read(struct mirror_dev *mirror, blkno_t first_blk,
+                              int num_blks, void *buf)
+{
+    int bytes = num_blks * mirror->bsize;
+    int p = lat_threshold(&mirror->hedge, 1) < lat_threshold(&mirror->hedge, 0);
+    struct hedge_call *c = hedge_call_new(&mirror->hedge, bytes);
+    for (int i = 0; i < 2; i++) {
+        int d = i == 0 ? p : 1-p;
+        c->a[i].fn = attempt_disk_read;
+        c->a[i].ctx = mirror->disks[d];
+        c->a[i].disk = d;
+        c->a[i].lba = first_blk;
+        c->a[i].len = num_blks;
+    }
+    int vals[2];
+    int val = hedge_run(c, buf, vals);
+    if (val == SUCCESS) {
+        mirror_hedge_check(mirror, p, vals[0], first_blk, num_blks, buf);
+        mirror_hedge_check(mirror, 1-p, vals[1], first_blk, num_blks, buf);
+    }
+    return val;
+}
+
+/* read from one of the sides of the mirror. (if one side has failed,
+ * it had better be the other one...) If both sides have failed,
+ * return an error.
+ * Note that a read operation may return an error to indicate that the
+ * underlying device has failed, in which case you should close the
+ * device and flag it (e.g. as a null pointer) so you won't try to use
+ * it again. 
+ */
+static int mirror_do_read(struct mirror_dev *mirror, blkno_t first_blk,
+                          int num_blks, void *buf)
+{
+    int val;
+    if (hedge_enabled(&mirror->hedge) && mirror_ok(mirror, 0) &&
+        mirror_ok(mirror, 1) && num_blks > 0 &&
+        mirror_hedged_read(mirror, first_blk, num_blks, buf) == SUCCESS)
+        return SUCCESS;
+    if (mirror_ok(mirror, 0)) {
+        val = blkdev_read(mirror->disks[0], first_blk, num_blks, buf);
+        if (val == E_CORRUPT)
+            return mirror_repair(mirror, 0, first_blk, num_blks, buf);
+        if (val == E_UNAVAIL) {
+            mirror_fail(mirror, 0);
+        }
+        else {
+            return val;
+        }
+    }
+    if (mirror_ok(mirror, 1))  {
+        val = blkdev_read(mirror->disks[1], first_blk, num_blks, buf);
+        if (val == E_CORRUPT)
+            return mirror_repair(mirror, 1, first_blk, num_blks, buf);
+        if (val == E_UNAVAIL) {
+            mirror_fail(mirror, 1);
+        }
+        return val;
+    }
+    return E_UNAVAIL;
+}
+
+static int mirror_read(struct blkdev * dev, blkno_t first_blk,
+                       int num_blks, void *buf)
+{
+    struct mirror_dev * mirror = (struct mirror_dev*) dev->private;
+    if (first_blk < 0 || num_blks < 0 || first_blk > mirror->nblks - num_blks)
+        return E_BADADDR;
+    blkno_t first = first_blk / MIRROR_LOCK_BLKS;
+    blkno_t last = (first_blk + num_blks - 1) / MIRROR_LOCK_BLKS;
+    range_lock(&mirror->locks, first, last, 0);
+    int val = mirror_do_read(mirror, first_blk, num_blks, buf);
+    range_unlock(&mirror->locks, first, last);
+    return val;
+}
+
+/* write to both sides of the mirror, or the remaining side if one has
+ * failed. If both sides have failed, return an error.
+ * Note that a write operation may indicate that the underlying device
+ * has failed, in which case you should close the device and flag it
+ * (e.g. as a null pointer) so you won't try to use it again.
+ */
+static int mirror_do_write(struct blkdev * dev, blkno_t first_blk, int num_blks, void *buf,
+                           int (*write)(struct blkdev *, blkno_t, int, void *))
+{
+    int val1 = E_UNAVAIL, val2 = E_UNAVAIL;
+    struct mirror_dev * mirror = (struct mirror_dev*) dev->private;
+    if (first_blk < 0 || num_blks < 0 || first_blk > mirror->nblks - num_blks)
+        return E_BADADDR;
+    blkno_t first = first_blk / MIRROR_LOCK_BLKS;
+    blkno_t last = (first_blk + num_blks - 1) / MIRROR_LOCK_BLKS;
+    range_lock(&mirror->locks, first, last, 1);
+    if (mirror_writable(mirror, 0, first_blk)) {
+        val1 = write(mirror->disks[0], first_blk, num_blks, buf);
+        if (val1 == E_UNAVAIL) {
+            mirror_fail(mirror, 0);
+        }
+    }
+    if (mirror_writable(mirror, 1, first_blk)) {
+        val2 = write(mirror->disks[1], first_blk, num_blks, buf);
+        if (val2 == E_UNAVAIL) {
+            mirror_fail(mirror, 1);
+        }
+    }
+    range_unlock(&mirror->locks, first, last);
+
+    if (val1 == SUCCESS || val2 == SUCCESS) {
+        return SUCCESS;
+    } 
+    else {
+        return E_UNAVAIL;
+    }   
+}
+
+static int mirror_write(struct blkdev * dev, blkno_t first_blk,
+                        int num_blks, void *buf)
+{
+    return mirror_do_write(dev, first_blk, num_blks, buf, blkdev_write);
+}
+
+/* each side writes through, so no other writes need flushing */
+static int mirror_write_fua(struct blkdev * dev, blkno_t first_blk,
+                            int num_blks, void *buf)
+{
+    return mirror_do_write(dev, first_blk, num_blks, buf, blkdev_write_fua);
+}
+
+/* discard on both sides, or the side still in service - like a write */
+static int mirror_discard(struct blkdev *dev, blkno_t first_blk, blkno_t num_blks)
+{
+    int val1 = E_UNAVAIL, val2 = E_UNAVAIL;
+    struct mirror_dev * mirror = (struct mirror_dev*) dev->private;
+    if (first_blk < 0 || num_blks < 1 || first_blk > mirror->nblks - num_blks)
+        return num_blks == 0 ? SUCCESS : E_BADADDR;
+    blkno_t first = first_blk / MIRROR_LOCK_BLKS;
+    blkno_t last = (first_blk + num_blks - 1) / MIRROR_LOCK_BLKS;
+    range_lock(&mirror->locks, first, last, 1);
+    if (mirror_writable(mirror, 0, first_blk)) {
+        val1 = blkdev_discard(mirror->disks[0], first_blk, num_blks);
+        if (val1 == E_UNAVAIL)
+            mirror_fail(mirror, 0);
+    }
+    if (mirror_writable(mirror, 1, first_blk)) {
+        val2 = blkdev_discard(mirror->disks[1], first_blk, num_blks);
+        if (val2 == E_UNAVAIL)
+            mirror_fail(mirror, 1);
+    }
+    range_unlock(&mirror->locks, first, last);
+    return val1 == SUCCESS || val2 == SUCCESS ? SUCCESS : E_UNAVAIL;
+}
+
+/* flush both sides, including one being rebuilt, since it has taken
+ * writes. Like a write, it succeeds if a side in service does.
+ */
+static int mirror_flush(struct blkdev *dev)
+{
+    struct mirror_dev * mirror = (struct mirror_dev*) dev->private;
+    struct member_flush f[2];
+    for (int i = 0; i < 2; i++) {
+        int used = mirror_ok(mirror, i) ||
+            __atomic_load_n(&mirror->resync, __ATOMIC_ACQUIRE) == i;
+        f[i].disk = used ? mirror->disks[i] : NULL;
+    }
+    flush_members(f, 2);
+    int ok = 0;
+    for (int i = 0; i < 2; i++) {
+        if (f[i].disk == NULL)
+            continue;
+        if (f[i].val == E_UNAVAIL)
+            mirror_fail(mirror, i);
+        else if (f[i].val == SUCCESS && mirror_ok(mirror, i))
+            ok = 1;
+    }
+    return ok ? SUCCESS : E_UNAVAIL;
+}
+
+/* data may be on either side */
+static blkno_t mirror_next_data(struct blkdev *dev, blkno_t first_blk)
+{
+    struct mirror_dev * mirror = (struct mirror_dev*) dev->private;
+    blkno_t next = mirror->nblks;
+    for (int i = 0; i < 2; i++) {
+        if (mirror_ok(mirror, i)) {
+            blkno_t n = blkdev_next_data(mirror->disks[i], first_blk);
+            if (n < next)
+                next = n;
+        }
+    }
+    return next < first_blk ? first_blk : next;
+}
+
+/* clean up, including: close both devices (failed sides are kept open
+ * until now), and free any data structures you allocated in
+ * mirror_create.
+ */
+static void mirror_close(struct blkdev *dev)
+{
+    struct mirror_dev * mirror = (struct mirror_dev*) dev->private;
+    hot_spare_destroy(&mirror->spares);
+    notify(&mirror->notify, RAID_EV_CLOSE, -1, 0);
+    hedge_destroy(&mirror->hedge);
+    for (int i = 0; i < 2; i++) {
+        if (mirror->disks[i] != NULL)
+            blkdev_close(mirror->disks[i]);
+    }
+    range_destroy(&mirror->locks);
+    free(mirror);
+    dev->private = NULL;
+    free(dev);
+    return;
+}
+
+/* the devices underneath, for blkdev_stats */
+static int mirror_members(struct blkdev *dev, struct blkdev **out, int max)
+{
+    struct mirror_dev * mirror = (struct mirror_dev*) dev->private;
+    int n = 0;
+    for (int i = 0; i < 2 && n < max; i++) {
+        if (mirror_ok(mirror, i))
+            out[n++] = mirror->disks[i];
+    }
+    return n;
+}
+
+struct blkdev_ops mirror_ops = {
+    .num_blocks = mirror_num_blocks,
+    .read = mirror_read,
+    .write = mirror_write,
+    .close = mirror_close,
+    .members = mirror_members,
+    .type = "mirror",
+    .discard = mirror_discard,
+    .next_data = mirror_next_data,
+    .block_size = mirror_block_size,
+    .flush = mirror_flush,
+    .write_fua = mirror_write_fua
+};
+
+/* create a mirrored volume from two disks. Do not write to the disks
+ * in this function - you should assume that they contain identical
+ * contents. 
+ */
+struct blkdev *mirror_create(struct blkdev *disks[2])
+{
+    struct blkdev *dev = calloc(1, sizeof(*dev));
+    struct mirror_dev *mdev = malloc(sizeof(*mdev));
+
+    if (blkdev_common_block_size(disks, 2) == 0) {
+        printf("Error: disks block size not same.\n");
+        free(mdev);
+        free(dev);
+        return NULL;
+    }
+    if (blkdev_num_blocks(disks[0]) == blkdev_num_blocks(disks[1])) {
+        mdev->disks[0] = disks[0];
+        mdev->disks[1] = disks[1];
+        mdev->failed[0] = mdev->failed[1] = 0;
+        mdev->resync = -1;
+        mdev->rebuilt = 0;
+        mdev->notify.fn = NULL;
+        mdev->nblks = blkdev_num_blocks(disks[0]);
+        mdev->bsize = blkdev_block_size(disks[0]);
+        hedge_init(&mdev->hedge, 2);
+        range_init(&mdev->locks);
+        hot_spare_init(&mdev->spares, dev, mirror_degraded);
+    } 
+    else {
+        printf("Error: disks size not same.\n");
+        return NULL;
+    }
+
+    dev->private = mdev;
+    dev->ops = &mirror_ops;
+
+    return dev;
+}
+
+#define MIRROR_RESYNC_BLKS (16 * MIRROR_LOCK_BLKS)
+
+/* replace failed device 'i' (0 or 1) in a mirror. Note that we assume
+ * the upper layer knows which device failed. The old device is
+ * handed back to the caller, who may still hold it.
+ * The new disk is copied a chunk at a time, locking only that chunk,
+ * at background priority; until it is done reads go to the other side,
+ * and writes go to both sides below the copy's progress. Chunks that
+ * are holes on the other side are discarded rather than copied, and
+ * the rest are copied with blkdev_copy. Replacing a
+ * side with the disk mirror_set_failed left it resumes the copy.
+ */
+int mirror_replace(struct blkdev *volume, int i, struct blkdev *newdisk)
+{
+    struct mirror_dev * mirror = (struct mirror_dev*) volume->private;
+    if (blkdev_num_blocks(newdisk) != mirror->nblks ||
+        blkdev_block_size(newdisk) != mirror->bsize) {
+        return E_SIZE;
+    }
+    struct blkdev_prio_opts po;
+    if (blkdev_get_sched(mirror->disks[1-i], &po))
+        blkdev_set_sched(newdisk, &po);
+
+    range_lock_all(&mirror->locks);
+    hedge_drain(&mirror->hedge);
+    blkno_t start = 0;
+    if (newdisk == mirror->disks[i] && mirror->resync == i)
+        start = mirror->rebuilt;
+    mirror->disks[i] = newdisk;
+    __atomic_store_n(&mirror->failed[i], 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&mirror->rebuilt, start, __ATOMIC_RELEASE);
+    __atomic_store_n(&mirror->resync, i, __ATOMIC_RELEASE);
+    notify(&mirror->notify, RAID_EV_REBUILD, i, start);
+    range_unlock_all(&mirror->locks);
+
+    int prio = blkdev_set_prio(BLKDEV_PRIO_BG);
+    if (prio == BLKDEV_PRIO_IDLE)
+        blkdev_set_prio(prio);
+    char *buf = malloc((size_t)MIRROR_RESYNC_BLKS * mirror->bsize);
+    int val = SUCCESS, stopped = 0;
+    for (blkno_t lba = start; lba < mirror->nblks && val == SUCCESS; lba += MIRROR_RESYNC_BLKS) {
+        int len = mirror->nblks - lba < MIRROR_RESYNC_BLKS ? mirror->nblks - lba :
+            MIRROR_RESYNC_BLKS;
+        if (hot_spare_stopping(&mirror->spares)) {
+            stopped = 1;
+            break;
+        }
+        blkno_t first = lba / MIRROR_LOCK_BLKS, last = (lba + len - 1) / MIRROR_LOCK_BLKS;
+        range_lock(&mirror->locks, first, last, 1);
+        if (mirror_ok(mirror, 1-i) &&
+            blkdev_next_data(mirror->disks[1-i], lba) >= lba + len) {
+            /* nothing written here: the copy just has to read as zeros */
+            val = SUCCESS;
+            if (blkdev_next_data(newdisk, lba) < lba + len)
+                val = blkdev_discard(newdisk, lba, len);
+        } else {
+            val = mirror_ok(mirror, 1-i) ?
+                blkdev_copy(newdisk, lba, mirror->disks[1-i], lba, len) : E_UNAVAIL;
+            if (val != SUCCESS) {
+                /* again through a buffer, to see which side failed */
+                val = mirror_ok(mirror, 1-i) ?
+                    blkdev_read(mirror->disks[1-i], lba, len, buf) : E_UNAVAIL;
+                if (val == E_UNAVAIL)
+                    mirror_fail(mirror, 1-i);
+                if (val == SUCCESS)
+                    val = blkdev_write(newdisk, lba, len, buf);
+            }
+        }
+        if (val == SUCCESS) {
+            __atomic_store_n(&mirror->rebuilt, lba + len, __ATOMIC_RELEASE);
+            notify(&mirror->notify, RAID_EV_REBUILD, i, lba + len);
+        }
+        range_unlock(&mirror->locks, first, last);
+    }
+    free(buf);
+    blkdev_set_prio(prio);
+    if (stopped)
+        return E_UNAVAIL;       /* closing: the copy resumes from here */
+
+    range_lock_all(&mirror->locks);
+    if (val == SUCCESS)
+        __atomic_store_n(&mirror->failed[i], 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&mirror->resync, -1, __ATOMIC_RELEASE);
+    notify(&mirror->notify, val == SUCCESS ? RAID_EV_REBUILT : RAID_EV_FAILED, i, 0);
+    range_unlock_all(&mirror->locks);
+    return val == SUCCESS ? SUCCESS : E_UNAVAIL;
+}
+
+/* mark side 'i' failed, as when a volume is assembled without it. If
+ * 'rebuilt' is above 0 the side is a replacement copied that far:
+ * writes below it go to both sides, and mirror_replace with the same
+ * disk finishes the copy.
+ */
+void mirror_set_failed(struct blkdev *volume, int i, blkno_t rebuilt)
+{
+    struct mirror_dev * mirror = (struct mirror_dev*) volume->private;
+    range_lock_all(&mirror->locks);
+    __atomic_store_n(&mirror->failed[i], 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&mirror->rebuilt, rebuilt, __ATOMIC_RELEASE);
+    __atomic_store_n(&mirror->resync, rebuilt > 0 ? i : -1, __ATOMIC_RELEASE);
+    range_unlock_all(&mirror->locks);
+}
+
+/* a spare in place of side i: the old disk is closed */
+static int mirror_spare_replace(struct blkdev *volume, int i, struct blkdev *newdisk)
+{
+    struct mirror_dev * mirror = (struct mirror_dev*) volume->private;
+    struct blkdev *old = mirror->disks[i];
+    int val = mirror_replace(volume, i, newdisk);
+    if (mirror->disks[i] != newdisk)
+        return E_SIZE;
+    if (old != newdisk)
+        blkdev_close(old);
+    return val;
+}
+
+/* rebuild onto spares from 'pool' (NULL for none) when a side fails,
+ * putting them in place with 'fn' (see raid_set_spares) if it is set.
+ * A side that has already failed is replaced straight away.
+ */
+void mirror_set_spares_fn(struct blkdev *volume, struct spare_pool *pool,
+                          raid_replace_fn fn, blkno_t min_blks)
+{
+    struct mirror_dev * mirror = (struct mirror_dev*) volume->private;
+    if (fn == NULL)
+        hot_spare_config(&mirror->spares, pool, mirror_spare_replace,
+                         mirror->nblks, mirror->nblks, mirror->bsize);
+    else
+        hot_spare_config(&mirror->spares, pool, fn, min_blks, LLONG_MAX, mirror->bsize);
+    for (int i = 0; i < 2; i++) {
+        if (mirror_degraded(volume, i))
+            hot_spare_start(&mirror->spares, i);
+    }
+}
+
+void mirror_set_spares(struct blkdev *volume, struct spare_pool *pool)
+{
+    mirror_set_spares_fn(volume, pool, NULL, 0);
+}
+
+int mirror_spare_wait(struct blkdev *volume)
+{
+    struct mirror_dev * mirror = (struct mirror_dev*) volume->private;
+    return hot_spare_wait(&mirror->spares);
+}
+
+void mirror_set_notify(struct blkdev *volume, raid_notify_fn fn, void *arg)
+{
+    struct mirror_dev * mirror = (struct mirror_dev*) volume->private;
+    mirror->notify.arg = arg;
+    mirror->notify.fn = fn;
+}
+
+/* turn hedged reads on or off (opts == NULL turns them off) */
+void mirror_set_hedge(struct blkdev *volume, struct hedge_opts *opts)
+{
+    struct mirror_dev * mirror = (struct mirror_dev*) volume->private;
+    hedge_config(&mirror->hedge, opts);
+}
+
+void mirror_hedge_stats(struct blkdev *volume, long long *hedged, long long *won)
+{
+    struct mirror_dev * mirror = (struct mirror_dev*) volume->private;
+    hedge_stats(&mirror->hedge, hedged, won);
+}
+
+/**********  RAID0 ***************/
+struct raid0_dev {    
+    int unit;
+    int N;                    /* disks (in the layout below reshape.pos) */
+    int state;                /* 0 once any disk has failed */
+    blkno_t dblks;            /* blocks of each disk in use */
+    int bsize;                /* bytes per block, the same on every disk */
+    struct blkdev **disks;
+    struct reshape reshape;
+    struct range_locks locks; /* per row: only a reshape takes them exclusively */
+    struct notify notify;
+};
+
+static void raid0_fail(struct raid0_dev *raid0, int i)
+{
+    if (__atomic_exchange_n(&raid0->state, 0, __ATOMIC_ACQ_REL) == 1)
+        notify(&raid0->notify, RAID_EV_FAILED, i, 0);
+}
+
+/* the volume grows when a reshape finishes */
+static blkno_t raid0_size(struct raid0_dev *raid0)
+{
+    return raid0->dblks * __atomic_load_n(&raid0->reshape.prev_N, __ATOMIC_ACQUIRE);
+}
+
+blkno_t raid0_num_blocks(struct blkdev *dev)
+{
+    struct raid0_dev * raid0 = (struct raid0_dev*) dev->private;    
+    return raid0_size(raid0);
+}
+
+static int raid0_block_size(struct blkdev *dev)
+{
+    struct raid0_dev * raid0 = (struct raid0_dev*) dev->private;
+    return raid0->bsize;
+}
+
+/* the volume size is checked when the volume is created, so the
+ * member LBA of a block in range cannot overflow.
+ */
+blkno_t get_disk_lba(blkno_t blk, int unit, int N) {
+    int offset = blk % unit;
+    blkno_t strip_num = blk/unit;
+    blkno_t stripe_num = strip_num / N;
+    blkno_t disk_lba = stripe_num*unit + offset;
+    return disk_lba;
+}
+
+int get_disk_num(blkno_t blk, int unit, int N) {    
+    blkno_t strip_num = blk/unit;
+    int disk_num = strip_num % N;
+    return disk_num;
+}
+
+/* read blocks from a striped volume laid out over 'n' disks.
+ * Note that a read operation may return an error to indicate that the
+ * underlying device has failed, in which case you should (a) mark the
+ * device failed and (b) return an error on this and all subsequent
+ * read or write operations. Concurrent requests may still be using
+ * the device, so it is only closed in raid0_close.
+ */
+static int raid0_do_read(struct blkdev * dev, int n, blkno_t first_blk,
+                         int num_blks, void *buf)
+{
+    struct raid0_dev * raid0 = (struct raid0_dev*) dev->private;
+
+    if (__atomic_load_n(&raid0->state, __ATOMIC_ACQUIRE) == 0) {
+        return E_UNAVAIL;
+    } 
+
+    int disk_num, num_blocks_read,place;
+    blkno_t disk_lba;
+    int blocks = num_blks;
+    blkno_t LBA = first_blk;
+    int val;
+    while (blocks > 0){
+        disk_num = get_disk_num(LBA, raid0->unit, n);
+        disk_lba = get_disk_lba(LBA, raid0->unit, n);
+        place = disk_lba % raid0->unit; 
+        if ((blocks+place) > raid0->unit){
+            num_blocks_read = raid0->unit - place;
+        }
+        else{
+            num_blocks_read = blocks;
+        } 
+        val = blkdev_read(raid0->disks[disk_num], disk_lba, num_blocks_read, buf);
+        if(val == E_UNAVAIL) {
+            raid0_fail(raid0, disk_num);
+            return E_UNAVAIL;
+        }
+        buf += num_blocks_read * raid0->bsize;
+        blocks -= num_blocks_read;
+        LBA+= num_blocks_read;
+    }
+
+    return SUCCESS;
+}
+
+
+/* write blocks to a striped volume laid out over 'n' disks.
+ * Again if an underlying device fails you should mark it failed and
+ * return an error for this and all subsequent read or write operations.
+ */
+static int raid0_do_write(struct blkdev * dev, int n, blkno_t first_blk,
+                          int num_blks, void *buf)
+{
+    struct raid0_dev * raid0 = (struct raid0_dev*) dev->private;
+
+    if (__atomic_load_n(&raid0->state, __ATOMIC_ACQUIRE) == 0) {
+        return E_UNAVAIL;
+    } 
+    int disk_num, num_blocks_read,place;
+    blkno_t disk_lba;
+    int blocks = num_blks;
+    blkno_t LBA = first_blk;
+    int val;
+    while (blocks > 0){
+        disk_num = get_disk_num(LBA, raid0->unit, n);
+        disk_lba = get_disk_lba(LBA, raid0->unit, n);
+        place = disk_lba % raid0->unit; 
+        if ((blocks+place) > raid0->unit){
+            num_blocks_read = raid0->unit - place;
+        }
+        else{
+            num_blocks_read = blocks;
+        } 
+        val = blkdev_write(raid0->disks[disk_num], disk_lba, num_blocks_read, buf);
+        if(val == E_UNAVAIL) {
+            raid0_fail(raid0, disk_num);
+            return E_UNAVAIL;
+        }
+        buf += num_blocks_read * raid0->bsize;
+        blocks -= num_blocks_read;
+        LBA+= num_blocks_read;
+        
+    }
+
+    return SUCCESS;
+}
+
+/* reads and writes share the rows they touch; only a reshape moving
+ * them keeps them to itself.
+ */
+static int raid0_read(struct blkdev * dev, blkno_t first_blk,
+                      int num_blks, void *buf)
+{
+    struct raid0_dev * raid0 = (struct raid0_dev*) dev->private;
+    if (__atomic_load_n(&raid0->state, __ATOMIC_ACQUIRE) == 0)
+        return E_UNAVAIL;
+    if (first_blk < 0 || num_blks < 0 || first_blk > raid0_size(raid0) - num_blks)
+        return E_BADADDR;
+    blkno_t rows[2];
+    reshape_lock(&raid0->locks, &raid0->reshape, &raid0->N, raid0->unit,
+                 first_blk, first_blk + num_blks - 1, 0, rows);
+    int val = reshape_split(dev, &raid0->reshape, raid0->N, raid0->bsize,
+                            raid0_do_read, first_blk, num_blks, buf);
+    range_unlock(&raid0->locks, rows[0], rows[1]);
+    return val;
+}
+
+static int raid0_write(struct blkdev * dev, blkno_t first_blk,
+                       int num_blks, void *buf)
+{
+    struct raid0_dev * raid0 = (struct raid0_dev*) dev->private;
+    if (__atomic_load_n(&raid0->state, __ATOMIC_ACQUIRE) == 0)
+        return E_UNAVAIL;
+    if (first_blk < 0 || num_blks < 0 || first_blk > raid0_size(raid0) - num_blks)
+        return E_BADADDR;
+    blkno_t rows[2];
+    reshape_lock(&raid0->locks, &raid0->reshape, &raid0->N, raid0->unit,
+                 first_blk, first_blk + num_blks - 1, 0, rows);
+    int val = reshape_split(dev, &raid0->reshape, raid0->N, raid0->bsize,
+                            raid0_do_write, first_blk, num_blks, buf);
+    range_unlock(&raid0->locks, rows[0], rows[1]);
+    return val;
+}
+
+/* the first block of striped member 'd' that holds volume block 'blk'
+ * or a later one. A range of the volume is a single range on each member.
+ */
+static blkno_t strip_lower_bound(blkno_t blk, int unit, int N, int d)
+{
+    blkno_t row = blk / (unit * N);
+    int off = blk % (unit * N) - d * unit;
+    if (off <= 0)
+        return row * unit;
+    return off < unit ? row * unit + off : (row + 1) * unit;
+}
+
+/* one discard per member for the part of the range it holds */
+static int raid0_do_discard(struct raid0_dev *raid0, int n, blkno_t first_blk, blkno_t num_blks)
+{
+    for (int d = 0; d < n && num_blks > 0; d++) {
+        blkno_t lo = strip_lower_bound(first_blk, raid0->unit, n, d);
+        blkno_t hi = strip_lower_bound(first_blk + num_blks, raid0->unit, n, d);
+        if (hi > lo && blkdev_discard(raid0->disks[d], lo, hi - lo) == E_UNAVAIL) {
+            raid0_fail(raid0, d);
+            return E_UNAVAIL;
+        }
+    }
+    return SUCCESS;
+}
+
+static int raid0_discard(struct blkdev * dev, blkno_t first_blk, blkno_t num_blks)
+{
+    struct raid0_dev * raid0 = (struct raid0_dev*) dev->private;
+
+    if (__atomic_load_n(&raid0->state, __ATOMIC_ACQUIRE) == 0)
+        return E_UNAVAIL;
+    if (first_blk < 0 || num_blks < 0 || first_blk > raid0_size(raid0) - num_blks)
+        return E_BADADDR;
+    blkno_t rows[2];
+    reshape_lock(&raid0->locks, &raid0->reshape, &raid0->N, raid0->unit,
+                 first_blk, first_blk + num_blks - 1, 0, rows);
+    blkno_t below = reshape_below(&raid0->reshape, first_blk, num_blks);
+    int val = raid0_do_discard(raid0, raid0->N, first_blk, below);
+    if (val == SUCCESS)
+        val = raid0_do_discard(raid0, raid0->reshape.prev_N, first_blk + below, num_blks - below);
+    range_unlock(&raid0->locks, rows[0], rows[1]);
+    return val;
+}
+
+/* while a reshape is moving the data, any block may hold some */
+static blkno_t raid0_next_data(struct blkdev * dev, blkno_t first_blk)
+{
+    struct raid0_dev * raid0 = (struct raid0_dev*) dev->private;
+    int unit = raid0->unit, N = raid0->N;
+    blkno_t next = raid0_size(raid0);
+    if (__atomic_load_n(&raid0->reshape.prev_N, __ATOMIC_ACQUIRE) != N)
+        return first_blk < next ? first_blk : next;
+    for (int d = 0; d < N; d++) {
+        blkno_t x = blkdev_next_data(raid0->disks[d], strip_lower_bound(first_blk, unit, N, d));
+        if (x >= raid0->dblks)
+            continue;
+        blkno_t lba = (x / unit) * unit * N + d * unit + x % unit;
+        if (lba < next)
+            next = lba;
+    }
+    return next;
+}
+
+/* every disk holds data, so any that fails its flush fails the volume.
+ * A reshape starting meanwhile only adds disks after these.
+ */
+static int raid0_flush(struct blkdev *dev)
+{
+    struct raid0_dev * raid0 = (struct raid0_dev*) dev->private;
+    if (__atomic_load_n(&raid0->state, __ATOMIC_ACQUIRE) == 0)
+        return E_UNAVAIL;
+    int N = __atomic_load_n(&raid0->N, __ATOMIC_ACQUIRE);
+    struct blkdev **disks = __atomic_load_n(&raid0->disks, __ATOMIC_ACQUIRE);
+    struct member_flush f[N];
+    for (int i = 0; i < N; i++)
+        f[i].disk = disks[i];
+    flush_members(f, N);
+    int val = SUCCESS;
+    for (int i = 0; i < N; i++) {
+        if (f[i].val == E_UNAVAIL) {
+            raid0_fail(raid0, i);
+            val = E_UNAVAIL;
+        } else if (f[i].val != SUCCESS && val == SUCCESS) {
+            val = f[i].val;
+        }
+    }
+    return val;
+}
+
+/* clean up, including: close all devices and free any data structures
+ * you allocated in stripe_create. 
+ */
+static void raid0_close(struct blkdev *dev)
+{
+    struct raid0_dev * raid0 = (struct raid0_dev*) dev->private;
+    notify(&raid0->notify, RAID_EV_CLOSE, -1, 0);
+    for (int i = 0; i< raid0->N; i++) {
+        blkdev_close(raid0->disks[i]);
+    }
+    range_destroy(&raid0->locks);
+    free(raid0);
+    dev->private = NULL;
+    free(dev);
+    return;
+}
+
+/* the devices underneath, for blkdev_stats */
+static int raid0_members(struct blkdev *dev, struct blkdev **out, int max)
+{
+    struct raid0_dev * raid0 = (struct raid0_dev*) dev->private;
+    int n = 0;
+    for (int i = 0; i < raid0->N && n < max; i++)
+        out[n++] = raid0->disks[i];
+    return n;
+}
+
+struct blkdev_ops raid0_ops = {
+    .num_blocks = raid0_num_blocks,
+    .read = raid0_read,
+    .write = raid0_write,
+    .close = raid0_close,
+    .members = raid0_members,
+    .type = "raid0",
+    .discard = raid0_discard,
+    .next_data = raid0_next_data,
+    .block_size = raid0_block_size,
+    .flush = raid0_flush
+};
+
+/* create a striped volume across N disks, with a stripe size of
+ * 'unit'. (i.e. if 'unit' is 4, then blocks 0..3 will be on disks[0],
+ * 4..7 on disks[1], etc.)
+ * Check the size of the disks to compute the final volume size, and
+ * fail (return NULL) if they aren't all the same.
+ * Do not write to the disks in this function.
+ */
+struct blkdev *raid0_create(int N, struct blkdev *disks[], int unit)
+{
+    struct blkdev *dev = calloc(1, sizeof(*dev));
+    struct raid0_dev *sdev = malloc(sizeof(*sdev));
+
+    for (int i = 1; i<N; i++) {
+        if (blkdev_num_blocks(disks[0]) != blkdev_num_blocks(disks[i])) {
+            printf("Error: disks size not same.\n");
+            return NULL;
+        }
+    }
+    int bsize = blkdev_common_block_size(disks, N);
+    if (bsize == 0) {
+        printf("Error: disks block size not same.\n");
+        free(dev);
+        free(sdev);
+        return NULL;
+    }
+
+    blkno_t dblks = (blkdev_num_blocks(disks[0]) / unit) * unit, nblks;
+    if (__builtin_mul_overflow(dblks, N, &nblks)) {
+        printf("Error: volume too large.\n");
+        free(dev);
+        free(sdev);
+        return NULL;
+    }
+
+    sdev->disks = disks;
+    sdev->unit = unit;
+    sdev->N = N;
+    sdev->state = 1;
+    sdev->dblks = dblks;
+    sdev->bsize = bsize;
+    reshape_init(&sdev->reshape, N);
+    range_init(&sdev->locks);
+    sdev->notify.fn = NULL;
+    dev->private = sdev;
+    dev->ops = &raid0_ops;
+    return dev;
+}
+
+void raid0_set_notify(struct blkdev *volume, raid_notify_fn fn, void *arg)
+{
+    struct raid0_dev * raid0 = (struct raid0_dev*) volume->private;
+    raid0->notify.arg = arg;
+    raid0->notify.fn = fn;
+}
+
+static int raid0_zero_rows(struct blkdev *dev, int n, blkno_t r0, blkno_t r1)
+{
+    struct raid0_dev * raid0 = (struct raid0_dev*) dev->private;
+    for (int d = 0; d < n; d++) {
+        if (blkdev_discard(raid0->disks[d], r0 * raid0->unit,
+                           (r1 - r0) * raid0->unit) == E_UNAVAIL) {
+            raid0_fail(raid0, d);
+            return E_UNAVAIL;
+        }
+    }
+    return SUCCESS;
+}
+
+static void raid0_checkpoint(struct blkdev *dev, int event, blkno_t mark)
+{
+    struct raid0_dev * raid0 = (struct raid0_dev*) dev->private;
+    notify(&raid0->notify, event, raid0->N, mark);
+}
+
+/* grow a striped volume onto disks[raid0->N..N-1] (see the RESHAPE
+ * section above), or continue the reshape it is in.
+ */
+int raid0_reshape(struct blkdev *volume, int N, struct blkdev *disks[])
+{
+    struct raid0_dev * raid0 = (struct raid0_dev*) volume->private;
+    int resume = raid0->reshape.prev_N != raid0->N;
+    blkno_t nblks;
+    if (resume ? N != raid0->N : N <= raid0->N)
+        return E_SIZE;
+    for (int i = 0; i < N; i++) {
+        if (i < raid0->N ? disks[i] != raid0->disks[i] :
+            blkdev_num_blocks(disks[i]) < raid0->dblks ||
+            blkdev_block_size(disks[i]) != raid0->bsize)
+            return E_SIZE;
+    }
+    /* the backup area takes the last N rows of the last disk */
+    if (raid0->dblks / raid0->unit < 2 * N ||
+        __builtin_mul_overflow(raid0->dblks, N, &nblks))
+        return E_SIZE;
+    if (__atomic_load_n(&raid0->state, __ATOMIC_ACQUIRE) == 0)
+        return E_UNAVAIL;
+
+    if (!resume) {
+        range_lock_all(&raid0->locks);
+        raid0->disks = disks;
+        reshape_init(&raid0->reshape, raid0->N);
+        __atomic_store_n(&raid0->N, N, __ATOMIC_RELEASE);
+        raid0_checkpoint(volume, RAID_EV_RESHAPE, 0);
+        range_unlock_all(&raid0->locks);
+    }
+    struct reshape_job j = {
+        .dev = volume, .rs = &raid0->reshape, .locks = &raid0->locks,
+        .N = N, .unit = raid0->unit, .bsize = raid0->bsize,
+        .dblks = raid0->dblks, .spare = disks[N - 1],
+        .read = raid0_do_read, .write = raid0_do_write,
+        .zero = raid0_zero_rows, .checkpoint = raid0_checkpoint
+    };
+    return reshape_run(&j);
+}
+
+/* start a volume part way through a reshape from prev_N disks */
+void raid0_set_reshape(struct blkdev *volume, int prev_N, blkno_t pos, int backup)
+{
+    struct raid0_dev * raid0 = (struct raid0_dev*) volume->private;
+    range_lock_all(&raid0->locks);
+    __atomic_store_n(&raid0->reshape.prev_N, prev_N, __ATOMIC_RELEASE);
+    raid0->reshape.pos = pos;
+    raid0->reshape.backup = backup;
+    range_unlock_all(&raid0->locks);
+}
+
+/**********   RAID 4  ***************/
+
+struct raid4_dev {    
+    int unit;
+    int N;                    /* data disks (in the layout below reshape.pos) */
+    int state;                /* 1 ok, 0 degraded, -1 failed (see raid4_fail) */
+    int disk_failed;
+    blkno_t rebuilt;          /* rows of disk_failed below this disk LBA
+                               * have been rebuilt by raid4_replace */
+    blkno_t nblks;
+    int bsize;                /* bytes per block, the same on every disk */
+    struct blkdev **disks;    /* data disks, then parity; failed disks stay
+                               * open until replaced */
+    struct reshape reshape;
+    struct pjournal *journal; /* optional write-intent log, or NULL */
+    struct range_locks locks; /* per row: readers share, writers exclusive */
+    pthread_mutex_t state_lock;
+    struct notify notify;     /* called under state_lock */
+    long long last_io;        /* time of the last foreground request */
+    struct hedge hedge;       /* hedged reads, per member */
+    struct hot_spare spares;
+    struct raid4_scrub *scrub; /* running or unfreed scrub, or NULL */
+};
+
+/* 'state' and 'disk_failed' only change under state_lock, and
+ * disk_failed is set before state leaves 1, so a reader that sees
+ * state 0 also sees which disk failed.
+ */
+static int raid4_state(struct raid4_dev *raid4)
+{
+    return __atomic_load_n(&raid4->state, __ATOMIC_ACQUIRE);
+}
+
+static int raid4_failed_disk(struct raid4_dev *raid4)
+{
+    return __atomic_load_n(&raid4->disk_failed, __ATOMIC_ACQUIRE);
+}
+
+/* the member missing from the row at 'disk_lba', or -1. While a new
+ * disk is being rebuilt, the rows already rebuilt are whole again.
+ */
+static int raid4_dead(struct raid4_dev *raid4, blkno_t disk_lba)
+{
+    if (raid4_state(raid4) == 1 ||
+        disk_lba < __atomic_load_n(&raid4->rebuilt, __ATOMIC_ACQUIRE))
+        return -1;
+    return raid4_failed_disk(raid4);
+}
+
+/* record that member 'i' has failed (or with i < 0, that the volume
+ * has), and return the state that leaves the volume in. Several
+ * requests may see the same disk fail; only a second disk is fatal.
+ */
+static int raid4_fail(struct raid4_dev *raid4, int i)
+{
+    pthread_mutex_lock(&raid4->state_lock);
+    if (i >= 0 && raid4->state == 1) {
+        __atomic_store_n(&raid4->disk_failed, i, __ATOMIC_RELEASE);
+        __atomic_store_n(&raid4->state, 0, __ATOMIC_RELEASE);
+        notify(&raid4->notify, RAID_EV_FAILED, i, 0);
+        hot_spare_start(&raid4->spares, i);
+    } else if (i >= 0 && raid4->disk_failed == i) {
+        /* the disk being rebuilt failed: none of it can be used */
+        if (__atomic_exchange_n(&raid4->rebuilt, 0, __ATOMIC_ACQ_REL) > 0)
+            notify(&raid4->notify, RAID_EV_FAILED, i, 0);
+    } else if (raid4->state != -1) {
+        __atomic_store_n(&raid4->state, -1, __ATOMIC_RELEASE);
+        notify(&raid4->notify, RAID_EV_FAILED, -1, 0);
+    }
+    int state = raid4->state;
+    pthread_mutex_unlock(&raid4->state_lock);
+    return state;
+}
+
+/* member i is missing, and the rest can rebuild it */
+static int raid4_degraded(struct blkdev *volume, int i)
+{
+    struct raid4_dev * raid4 = (struct raid4_dev*) volume->private;
+    return raid4_state(raid4) == 0 && raid4_failed_disk(raid4) == i;
+}
+
+/* the volume grows when a reshape finishes */
+static blkno_t raid4_size(struct raid4_dev *raid4)
+{
+    return raid4->nblks * __atomic_load_n(&raid4->reshape.prev_N, __ATOMIC_ACQUIRE);
+}
+
+static int raid4_reshaping(struct raid4_dev *raid4)
+{
+    return __atomic_load_n(&raid4->reshape.prev_N, __ATOMIC_ACQUIRE) != raid4->N;
+}
+
+/* data disks in member row 'row': the rows a reshape has written have
+ * the new layout, the rest the old one.
+ */
+static int raid4_row_layout(struct raid4_dev *raid4, blkno_t row)
+{
+    blkno_t pos = __atomic_load_n(&raid4->reshape.pos, __ATOMIC_ACQUIRE);
+    return row < pos / ((blkno_t)raid4->unit * raid4->N) ? raid4->N : raid4->reshape.prev_N;
+}
+
+blkno_t raid4_num_blocks(struct blkdev *dev)
+{
+    struct raid4_dev * raid4 = (struct raid4_dev*) dev->private;    
+    return raid4_size(raid4);
+}
+
+static int raid4_block_size(struct blkdev *dev)
+{
+    struct raid4_dev * raid4 = (struct raid4_dev*) dev->private;
+    return raid4->bsize;
+}
+
+/* helper function - compute parity function across two blocks of
+ * 'len' bytes and put it in a third block. Note that 'dst' can be the
+ * same as either 'src1' or 'src2', so to compute parity across N
+ * blocks you can do: 
+ *
+ *     void **block[i] - array of pointers to blocks
+ *     dst = <zeros[len]>
+ *     for (i = 0; i < N; i++)
+ *        parity(block[i], dst, dst);
+ *
+ * Works a vector (32 bytes) at a time; the compiler turns xor_vec
+ * operations into SSE/AVX instructions.
+ */
+typedef unsigned long long xor_vec __attribute__((vector_size(32)));
+
+void parity(int len, void *src1, void *src2, void *dst)
+{
+    unsigned char *s1 = src1, *s2 = src2, *d = dst;
+    int i = 0;
+    for (; i + (int)sizeof(xor_vec) <= len; i += sizeof(xor_vec)) {
+        xor_vec a, b;
+        memcpy(&a, s1 + i, sizeof(a));
+        memcpy(&b, s2 + i, sizeof(b));
+        a ^= b;
+        memcpy(d + i, &a, sizeof(a));
+    }
+    for (; i < len; i++)
+        d[i] = s1[i] ^ s2[i];
+}
+
+/* compare two blocks of 'len' bytes a vector at a time. Returns 0 if
+ * they are identical.
+ */
+int parity_differs(int len, void *src1, void *src2)
+{
+    unsigned char *s1 = src1, *s2 = src2;
+    xor_vec acc = {0};
+    int i = 0;
+    for (; i + (int)sizeof(xor_vec) <= len; i += sizeof(xor_vec)) {
+        xor_vec a, b;
+        memcpy(&a, s1 + i, sizeof(a));
+        memcpy(&b, s2 + i, sizeof(b));
+        acc |= a ^ b;
+    }
+    for (; i < len; i++)
+        acc[0] |= s1[i] ^ s2[i];
+    return (acc[0] | acc[1] | acc[2] | acc[3]) != 0;
+}
+
+int reconstruct_data(struct blkdev *dev, int n, int disk_num, void *buf, int num_blocks_read, blkno_t LBA)
+{
+    struct raid4_dev * raid4 = (struct raid4_dev*) dev->private; 
+    char *read_buf = malloc(raid4->bsize);
+    int val;
     for(int i = 0; i<num_blocks_read; i++)
     {
-        for (int j = 0; j< raid4->N +1; j++)
+        for (int j = 0; j< n +1; j++)
         {
             if (j != disk_num){
                 val = blkdev_read(raid4->disks[j], LBA, 1, read_buf);
-                if (val == E_UNAVAIL)
-                    return E_UNAVAIL;
+                if (val != SUCCESS) {
+                    free(read_buf);
+                    return val;
+                }
                 else{
-                    parity(BLOCK_SIZE, read_buf, buf, buf);
+                    parity(raid4->bsize, read_buf, buf, buf);
                 }
             }
         }
-        LBA++;
-        buf+=BLOCK_SIZE;
+        LBA++;
+        buf+=raid4->bsize;
+    }
+    free(read_buf);
+    return SUCCESS;
+}
+
+/* the hedge for a slow strip: rebuild it from the same range of every
+ * other member, one read per member.
+ */
+static int attempt_reconstruct(struct hedge_attempt *a)
+{
+    int bytes = a->len * blkdev_block_size(a->members[a->avoid]);
+    char *tmp = malloc(bytes);
+    int val = SUCCESS;
+    memset(a->buf, 0, bytes);
+    for (int j = 0; j < a->nmembers && val == SUCCESS; j++) {
+        if (j == a->avoid)
+            continue;
+        val = blkdev_read(a->members[j], a->lba, a->len, tmp);
+        if (val == SUCCESS)
+            parity(bytes, tmp, a->buf, a->buf);
+    }
+    free(tmp);
+    return val;
+}
+
+static int raid4_hedged_read(struct raid4_dev *raid4, int n, int disk_num,
+                             blkno_t disk_lba, int num_blks, void *buf, int vals[2])
+{
+    int bytes = num_blks * raid4->bsize;
+    struct hedge_call *c = hedge_call_new(&raid4->hedge, bytes);
+    for (int i = 0; i < 2; i++) {
+        c->a[i].lba = disk_lba;
+        c->a[i].len = num_blks;
+    }
+    c->a[0].fn = attempt_disk_read;
+    c->a[0].ctx = raid4->disks[disk_num];
+    c->a[0].disk = disk_num;
+    c->a[1].fn = attempt_reconstruct;
+    c->a[1].avoid = disk_num;
+    c->a[1].nmembers = n + 1;
+    c->a[1].members = malloc((n + 1) * sizeof(struct blkdev *));
+    memcpy(c->a[1].members, raid4->disks, (n + 1) * sizeof(struct blkdev *));
+    return hedge_run(c, buf, vals);
+}
+
+/* read blocks from a RAID 4 volume laid out over 'n' data disks.
+ * If the volume is in a degraded state you may need to reconstruct
+ * data from the other stripes of the stripe set plus parity.
+ * If a drive fails during a read and all other drives are
+ * operational, close that drive and continue in degraded state.
+ * If a drive fails and the volume is already in a degraded state,
+ * close the drive and return an error.
+ */
+static int raid4_do_read(struct blkdev * dev, int n, blkno_t first_blk,
+                         int num_blks, void *buf) 
+{
+    struct raid4_dev * raid4 = (struct raid4_dev*) dev->private; 
+    if (raid4_state(raid4) == -1) {
+        return E_UNAVAIL;
+    } 
+    if (first_blk < 0 || num_blks < 0 || first_blk > raid4->nblks * n - num_blks) {
+        return E_BADADDR;
+    }
+    int val;
+    int disk_num,place;
+    blkno_t disk_lba;
+    int j = num_blks;
+    blkno_t LBA = first_blk;
+    while(j > 0){
+        int num_blocks_read;
+        disk_num = get_disk_num(LBA, raid4->unit, n);
+        disk_lba = get_disk_lba(LBA, raid4->unit, n);
+        place = disk_lba % raid4->unit; 
+        if ((j+place) > raid4->unit){
+            num_blocks_read = raid4->unit - place;
+        }
+        else{
+            num_blocks_read = j;
+        }         
+        
+        if (raid4_dead(raid4, disk_lba) == disk_num){
+            memset(buf, '\0', num_blocks_read*raid4->bsize);
+            val = reconstruct_data(dev, n, disk_num, buf, num_blocks_read, disk_lba);
+            if (val == SUCCESS) {
+                j -= num_blocks_read;
+                LBA += num_blocks_read;
+                buf+= num_blocks_read * raid4->bsize;
+                continue;
+            }  
+            else if (val == E_CORRUPT) {
+                return E_CORRUPT;       /* a survivor's block is bad too */
+            }
+            else {
+                raid4_fail(raid4, -1);
+                return E_UNAVAIL;
+            }               
+        }
+
+        /* if the hedged read fails, read again the plain way so a
+         * failed member is handled as below. If it succeeds because
+         * the reconstruction covered for a member that failed, or
+         * returned bad blocks, deal with the member here.
+         */
+        val = E_UNAVAIL;
+        if (raid4_state(raid4) == 1 && hedge_enabled(&raid4->hedge)) {
+            int vals[2];
+            val = raid4_hedged_read(raid4, n, disk_num, disk_lba, num_blocks_read, buf, vals);
+            if (val == SUCCESS && vals[0] == E_UNAVAIL)
+                raid4_fail(raid4, disk_num);
+            else if (val == SUCCESS && vals[0] == E_CORRUPT &&
+                     blkdev_write(raid4->disks[disk_num], disk_lba, num_blocks_read, buf) == E_UNAVAIL)
+                raid4_fail(raid4, disk_num);
+        }
+        if (val != SUCCESS)
+            val = blkdev_read(raid4->disks[disk_num], disk_lba, num_blocks_read, buf);
+
+        /* blocks that don't match their checksums are rebuilt from the
+         * rest of the row, if it is all there, and written back.
+         */
+        if (val == E_CORRUPT) {
+            if (raid4_dead(raid4, disk_lba) >= 0)
+                return E_CORRUPT;
+            memset(buf, '\0', num_blocks_read*raid4->bsize);
+            if (reconstruct_data(dev, n, disk_num, buf, num_blocks_read, disk_lba) != SUCCESS)
+                return E_CORRUPT;
+            val = blkdev_write(raid4->disks[disk_num], disk_lba, num_blocks_read, buf);
+            if (val != E_UNAVAIL)
+                val = SUCCESS;
+        }
+        if (val == E_UNAVAIL){
+            if (raid4_fail(raid4, disk_num) == 0)
+                continue;       /* degraded - reconstruct it */
+            return E_UNAVAIL; 
+
+        }
+        j -= num_blocks_read;
+        LBA += num_blocks_read;
+        buf+= num_blocks_read * raid4->bsize;
+    }
+    return SUCCESS;
+}
+
+void modify(int k, int index, char * read_buf, char* temp, int bsize)
+{
+    memcpy(read_buf + (size_t)k*bsize, temp + (size_t)index*bsize, bsize);
+    return;
+}
+
+
+/* finish journalled rows first..last-1 when a write bails out early.
+ */
+static void raid4_journal_end(struct raid4_dev *raid4, blkno_t first, blkno_t last)
+{
+    if (raid4->journal == NULL)
+        return;
+    for (blkno_t row = first; row < last; row++)
+        pjournal_end(raid4->journal, row);
+}
+
+/* write blocks to a RAID 4 volume.
+ * Note that you must handle short writes - i.e. less than a full
+ * stripe set. You may either use the optimized algorithm (for N>3
+ * read old data, parity, write new data, new parity) or you can read
+ * the entire stripe set, modify it, and re-write it. Your code will
+ * be graded on correctness, not speed.
+ * If an underlying device fails you should close it and complete the
+ * write in the degraded state. If a drive fails in the degraded
+ * state, close it and return an error.
+ * In the degraded state perform all writes to non-failed drives, and
+ * forget about the failed one. (parity will handle it)
+ * The volume is laid out over 'n' data disks, with disks[n] as parity.
+ */
+
+static int raid4_do_write(struct blkdev * dev, int n, blkno_t first_blk,
+                          int num_blks, void *buf)
+{
+    struct raid4_dev * raid4 = (struct raid4_dev*) dev->private; 
+    if (raid4_state(raid4) == -1) {
+        return E_UNAVAIL;
+    } 
+    int val,val2, val3, dead;
+    int start,end;
+    blkno_t disk_lba;
+    blkno_t LBA = first_blk;
+    int j = num_blks;
+    int row_count = raid4->unit* n;
+    int index = 0;
+    blkno_t row, jend = 0;
+    int bsize = raid4->bsize;
+    /* the row, then its parity strip */
+    char *read_buf = malloc((size_t)(row_count + raid4->unit) * bsize);
+    char *free_buf = read_buf;
+    char *parity_buf = free_buf + (size_t)row_count * bsize;
+    char *temp_buf;
+    while (j > 0){        
+        /* log the rows we are about to touch, a batch at a time, so
+         * that one journal write covers many rows.
+         */
+        row = LBA / row_count;
+        if (raid4->journal != NULL && row >= jend) {
+            int nrows = (LBA + j - 1) / row_count - row + 1;
+            if (nrows > pjournal_capacity(raid4->journal))
+                nrows = pjournal_capacity(raid4->journal);
+            if (pjournal_begin(raid4->journal, row, nrows) != SUCCESS) {
+                free(free_buf);
+                return E_UNAVAIL;
+            }
+            jend = row + nrows;
+        }
+        memset(free_buf, '\0', (size_t)(row_count + raid4->unit) * bsize);
+        read_buf = free_buf;
+        temp_buf = read_buf;
+        char *temp = buf;
+        start = LBA % row_count;
+        if (start + j > row_count)
+            end = row_count - 1;
+        else 
+            end = start + j - 1;
+        
+        disk_lba = get_disk_lba(LBA - start, raid4->unit, n);
+        /* a write covering the whole row replaces every strip, so
+         * there is nothing to pre-read for the parity calculation.
+         */
+        if (start != 0 || end != row_count - 1) {
+            val = raid4_do_read(dev, n, LBA - start, row_count, read_buf);
+
+            if (val != SUCCESS) {
+                raid4_journal_end(raid4, row, jend);
+                free(free_buf);
+                return val;
+            }
+        }
+
+        for(int k = start; k<=end; k++)
+        {
+            modify(k,index,read_buf,temp,bsize);
+            index++;
+        }   
+        
+        for (int i =0; i< n; i++){
+            parity(raid4->unit*bsize,temp_buf,parity_buf,parity_buf);
+            temp_buf += raid4->unit*bsize;
+        }
+        dead = raid4_dead(raid4, disk_lba);
+        for (int i = 0; i < n; ++i){
+            val2 = SUCCESS;
+            if(i != dead)
+                val2 = blkdev_write(raid4->disks[i], disk_lba, raid4->unit,read_buf);
+            if (val2 == E_UNAVAIL && raid4_fail(raid4, i) != 0)
+            {                
+                raid4_journal_end(raid4, row, jend);
+                free(free_buf);
+                return E_UNAVAIL;                    
+            }
+            read_buf += raid4->unit* bsize;
+        }
+        val3 = SUCCESS;
+        if (dead != n)
+            val3 = blkdev_write(raid4->disks[n], disk_lba , raid4->unit, parity_buf);
+        if (val3 == E_UNAVAIL && raid4_fail(raid4, n) != 0)
+            {
+                raid4_journal_end(raid4, row, jend);
+                free(free_buf);
+                return E_UNAVAIL;                    
+            }
+    
+        if (raid4->journal != NULL)
+            pjournal_end(raid4->journal, row);
+        j -= (end - start + 1);
+        LBA += (end - start + 1);
+    }
+    free(free_buf);
+    return SUCCESS;
+}
+
+/* the blkdev entry points lock the rows they touch: reads share them,
+ * and a write (which reads, modifies and rewrites the row and its
+ * parity) holds them alone. Requests to other rows run in parallel.
+ */
+static int raid4_read(struct blkdev * dev, blkno_t first_blk,
+                      int num_blks, void *buf)
+{
+    struct raid4_dev * raid4 = (struct raid4_dev*) dev->private;
+    if (first_blk < 0 || num_blks < 0 || first_blk > raid4_size(raid4) - num_blks)
+        return E_BADADDR;
+    blkno_t rows[2];
+    __atomic_store_n(&raid4->last_io, now_ns(), __ATOMIC_RELAXED);
+    reshape_lock(&raid4->locks, &raid4->reshape, &raid4->N, raid4->unit,
+                 first_blk, first_blk + num_blks - 1, 0, rows);
+    int val = reshape_split(dev, &raid4->reshape, raid4->N, raid4->bsize,
+                            raid4_do_read, first_blk, num_blks, buf);
+    range_unlock(&raid4->locks, rows[0], rows[1]);
+    return val;
+}
+
+static int raid4_write(struct blkdev * dev, blkno_t first_blk,
+                       int num_blks, void *buf)
+{
+    struct raid4_dev * raid4 = (struct raid4_dev*) dev->private;
+    if (first_blk < 0 || num_blks < 0 || first_blk > raid4_size(raid4) - num_blks)
+        return E_BADADDR;
+    blkno_t rows[2];
+    __atomic_store_n(&raid4->last_io, now_ns(), __ATOMIC_RELAXED);
+    reshape_lock(&raid4->locks, &raid4->reshape, &raid4->N, raid4->unit,
+                 first_blk, first_blk + num_blks - 1, 1, rows);
+    int val = reshape_split(dev, &raid4->reshape, raid4->N, raid4->bsize,
+                            raid4_do_write, first_blk, num_blks, buf);
+    range_unlock(&raid4->locks, rows[0], rows[1]);
+    return val;
+}
+
+/* discard whole rows on every member, parity included: a row of zeros
+ * has zero parity. A member that is being rebuilt only has the rows
+ * already rebuilt discarded; the rebuild finds zeros for the rest.
+ * Called with rows r0..r1-1, laid out over 'n' data disks, locked.
+ */
+static int raid4_discard_rows(struct blkdev *dev, int n, blkno_t r0, blkno_t r1)
+{
+    struct raid4_dev * raid4 = (struct raid4_dev*) dev->private;
+    for (blkno_t row = r0; row < r1; ) {
+        blkno_t len = r1 - row;
+        if (raid4->journal != NULL) {
+            if (len > pjournal_capacity(raid4->journal))
+                len = pjournal_capacity(raid4->journal);
+            if (pjournal_begin(raid4->journal, row, len) != SUCCESS)
+                return E_UNAVAIL;
+        }
+        for (int i = 0; i <= n; i++) {
+            blkno_t lo = row * raid4->unit, hi = (row + len) * raid4->unit;
+            if (raid4_state(raid4) != 1 && raid4_failed_disk(raid4) == i) {
+                blkno_t rebuilt = __atomic_load_n(&raid4->rebuilt, __ATOMIC_ACQUIRE);
+                if (hi > rebuilt)
+                    hi = rebuilt;
+            }
+            if (hi > lo && blkdev_discard(raid4->disks[i], lo, hi - lo) == E_UNAVAIL &&
+                raid4_fail(raid4, i) != 0) {
+                raid4_journal_end(raid4, row, row + len);
+                return E_UNAVAIL;
+            }
+        }
+        raid4_journal_end(raid4, row, row + len);
+        row += len;
+    }
+    return SUCCESS;
+}
+
+/* discard blocks from a RAID 4 volume laid out over 'n' data disks.
+ * The partial rows at either end are written with zeros, so that their
+ * parity stays right. Called with the rows locked.
+ */
+static int raid4_do_discard(struct blkdev * dev, int n, blkno_t first_blk, blkno_t num_blks)
+{
+    struct raid4_dev * raid4 = (struct raid4_dev*) dev->private;
+    int row_count = raid4->unit * n;
+    if (num_blks == 0)
+        return SUCCESS;
+
+    blkno_t end = first_blk + num_blks;
+    blkno_t head = (first_blk + row_count - 1) / row_count * row_count;
+    blkno_t tail = end / row_count * row_count;
+    if (head > end)
+        head = end;
+    if (tail < head)
+        tail = head;
+    char *zeros = calloc(row_count, raid4->bsize);
+
+    int val = SUCCESS;
+    if (head > first_blk)
+        val = raid4_do_write(dev, n, first_blk, head - first_blk, zeros);
+    if (val == SUCCESS && tail > head)
+        val = raid4_discard_rows(dev, n, head / row_count, tail / row_count);
+    if (val == SUCCESS && end > tail)
+        val = raid4_do_write(dev, n, tail, end - tail, zeros);
+    free(zeros);
+    return val;
+}
+
+static int raid4_discard(struct blkdev * dev, blkno_t first_blk, blkno_t num_blks)
+{
+    struct raid4_dev * raid4 = (struct raid4_dev*) dev->private;
+    if (first_blk < 0 || num_blks < 0 || first_blk > raid4_size(raid4) - num_blks)
+        return E_BADADDR;
+    if (num_blks == 0)
+        return SUCCESS;
+    if (raid4_state(raid4) == -1)
+        return E_UNAVAIL;
+
+    blkno_t rows[2];
+    __atomic_store_n(&raid4->last_io, now_ns(), __ATOMIC_RELAXED);
+    reshape_lock(&raid4->locks, &raid4->reshape, &raid4->N, raid4->unit,
+                 first_blk, first_blk + num_blks - 1, 1, rows);
+    blkno_t below = reshape_below(&raid4->reshape, first_blk, num_blks);
+    int val = raid4_do_discard(dev, raid4->N, first_blk, below);
+    if (val == SUCCESS)
+        val = raid4_do_discard(dev, raid4->reshape.prev_N, first_blk + below, num_blks - below);
+    range_unlock(&raid4->locks, rows[0], rows[1]);
+    return val;
+}
+
+/* a row may hold data if any member in service has some in it. While
+ * a reshape is moving the data, any block may hold some.
+ */
+static blkno_t raid4_next_data(struct blkdev * dev, blkno_t first_blk)
+{
+    struct raid4_dev * raid4 = (struct raid4_dev*) dev->private;
+    if (raid4_reshaping(raid4))
+        return first_blk < raid4_size(raid4) ? first_blk : raid4_size(raid4);
+    int row_count = raid4->unit * raid4->N;
+    blkno_t row_lba = first_blk / row_count * raid4->unit;
+    blkno_t next = raid4->nblks;
+    for (int i = 0; i <= raid4->N; i++) {
+        if (raid4_state(raid4) != 1 && raid4_failed_disk(raid4) == i)
+            continue;
+        blkno_t x = blkdev_next_data(raid4->disks[i], row_lba);
+        if (x < next)
+            next = x;
+    }
+    if (next >= raid4->nblks)
+        return raid4_size(raid4);
+    blkno_t lba = next / raid4->unit * row_count;
+    return lba > first_blk ? lba : first_blk;
+}
+
+/* clean up, including: close all devices and free any data structures
+ * you allocated in raid4_create. 
+ */
+static void scrub_detach(struct raid4_scrub *sc);     /* below, with the scrub */
+
+static void raid4_close(struct blkdev *dev)
+{
+    struct raid4_dev * raid4 = (struct raid4_dev*) dev->private;
+    if (raid4->scrub != NULL)
+        scrub_detach(raid4->scrub);     /* before the members go away */
+    hot_spare_destroy(&raid4->spares);
+    notify(&raid4->notify, RAID_EV_CLOSE, -1, 0);
+    hedge_destroy(&raid4->hedge);
+    if (raid4->journal != NULL)
+        pjournal_close(raid4->journal);     /* syncs the members first */
+    for (int i = 0; i <= raid4->N; i++) {
+        if (raid4->disks[i] != NULL)
+            blkdev_close(raid4->disks[i]);
+    }
+    range_destroy(&raid4->locks);
+    pthread_mutex_destroy(&raid4->state_lock);
+    free(raid4);
+    dev->private = NULL;
+    free(dev);
+    return;
+}
+
+/* flush the members taking writes - all but a failed disk, unless its
+ * replacement is being rebuilt - and 'journal' if not NULL. The volume
+ * survives one member failing here as it would a write.
+ */
+static int raid4_flush_disks(struct raid4_dev *raid4, struct blkdev *journal)
+{
+    if (raid4_state(raid4) == -1)
+        return E_UNAVAIL;
+    int N = __atomic_load_n(&raid4->N, __ATOMIC_ACQUIRE);
+    struct blkdev **disks = __atomic_load_n(&raid4->disks, __ATOMIC_ACQUIRE);
+    struct member_flush f[N + 2];
+    for (int i = 0; i <= N; i++) {
+        int missing = raid4_state(raid4) != 1 && raid4_failed_disk(raid4) == i &&
+            __atomic_load_n(&raid4->rebuilt, __ATOMIC_ACQUIRE) == 0;
+        f[i].disk = missing ? NULL : disks[i];
+    }
+    f[N + 1].disk = journal;
+    flush_members(f, N + 2);
+    int val = SUCCESS;
+    for (int i = 0; i <= N; i++) {
+        if (f[i].disk == NULL || f[i].val == SUCCESS)
+            continue;
+        if (f[i].val != E_UNAVAIL)
+            val = f[i].val;
+        else if (raid4_fail(raid4, i) == -1)
+            val = E_UNAVAIL;
+    }
+    if (f[N + 1].val != SUCCESS)
+        val = E_UNAVAIL;
+    return val;
+}
+
+static int raid4_flush(struct blkdev *dev)
+{
+    struct raid4_dev * raid4 = (struct raid4_dev*) dev->private;
+    return raid4_flush_disks(raid4, raid4->journal ? pjournal_device(raid4->journal) : NULL);
+}
+
+/* the parity journal's sync: rows it drops must be on the members */
+static int raid4_journal_sync(void *arg)
+{
+    return raid4_flush_disks(arg, NULL);
+}
+
+/* the devices underneath, for blkdev_stats */
+static int raid4_members(struct blkdev *dev, struct blkdev **out, int max)
+{
+    struct raid4_dev * raid4 = (struct raid4_dev*) dev->private;
+    int n = 0;
+    for (int i = 0; i < raid4->N + 1 && n < max; i++) {
+        if (raid4->disks[i] != NULL)
+            out[n++] = raid4->disks[i];
+    }
+    if (raid4->journal != NULL && n < max)
+        out[n++] = pjournal_device(raid4->journal);
+    return n;
+}
+
+struct blkdev_ops raid4_ops = {
+    .num_blocks = raid4_num_blocks,
+    .read = raid4_read,
+    .write = raid4_write,
+    .close = raid4_close,
+    .members = raid4_members,
+    .type = "raid4",
+    .discard = raid4_discard,
+    .next_data = raid4_next_data,
+    .block_size = raid4_block_size,
+    .flush = raid4_flush
+};
+
+/* Initialize a RAID 4 volume with strip size 'unit', using
+ * disks[N-1] as the parity drive. Do not write to the disks - assume
+ * that they are properly initialized with correct parity. (warning -
+ * some of the grading scripts may fail if you modify data on the
+ * drives in this function)
+ */
+struct blkdev *raid4_create(int N, struct blkdev *disks[], int unit)
+{
+    struct blkdev *dev = calloc(1, sizeof(*dev));
+    struct raid4_dev *sdev = malloc(sizeof(*sdev));
+
+    for (int i = 1; i<N; i++) {
+        if (blkdev_num_blocks(disks[0]) != blkdev_num_blocks(disks[i])) {
+            printf("Error: disks size not same.\n");
+            return NULL;
+        }
+    }
+    int bsize = blkdev_common_block_size(disks, N);
+    if (bsize == 0) {
+        printf("Error: disks block size not same.\n");
+        free(dev);
+        free(sdev);
+        return NULL;
+    }
+    blkno_t nblks = (blkdev_num_blocks(disks[0]) / unit) * unit, vblks;
+    if (__builtin_mul_overflow(nblks, N-1, &vblks)) {
+        printf("Error: volume too large.\n");
+        free(dev);
+        free(sdev);
+        return NULL;
+    }
+      
+    sdev->disks = disks;
+    sdev->state = 1;
+    sdev->disk_failed = -1;
+    sdev->rebuilt = 0;
+    sdev->journal = NULL;
+    sdev->scrub = NULL;
+    range_init(&sdev->locks);
+    pthread_mutex_init(&sdev->state_lock, NULL);
+    sdev->notify.fn = NULL;
+    sdev->last_io = 0;
+    hedge_init(&sdev->hedge, N);
+    hot_spare_init(&sdev->spares, dev, raid4_degraded);
+    sdev->unit = unit;
+    sdev->N = N-1;
+    reshape_init(&sdev->reshape, N-1);
+    sdev->nblks = nblks;
+    sdev->bsize = bsize;
+    dev->private = sdev;
+    dev->ops = &raid4_ops;
+    return dev;
+}
+
+/* whether disk_lba..disk_lba+len-1 is a hole on every member of the
+ * layout with 'n' data disks but 'skip', so that it rebuilds as zeros.
+ */
+static int raid4_hole(struct raid4_dev *raid4, int n, int skip, blkno_t disk_lba, int len)
+{
+    for (int j = 0; j <= n; j++) {
+        if (j != skip && blkdev_next_data(raid4->disks[j], disk_lba) < disk_lba + len)
+            return 0;
+    }
+    return 1;
+}
+
+/* rebuild disk_lba..disk_lba+len-1 of member 'skip' from the same
+ * range of every other member of the layout with 'n' data disks.
+ */
+static int raid4_rebuild_range(struct raid4_dev *raid4, int n, int skip, blkno_t disk_lba,
+                               int len, char *buf, char *tmp)
+{
+    memset(buf, 0, (size_t)len * raid4->bsize);
+    for (int j = 0; j <= n; j++) {
+        if (j == skip)
+            continue;
+        if (blkdev_read(raid4->disks[j], disk_lba, len, tmp) != SUCCESS)
+            return E_UNAVAIL;
+        parity(len * raid4->bsize, tmp, buf, buf);
+    }
+    return SUCCESS;
+}
+
+#define RAID4_REBUILD_ROWS 64
+
+/* replace failed device 'i' in a RAID 4. Note that we assume
+ * the upper layer knows which device failed. You will need to
+ * reconstruct content from data and parity before returning
+ * from this call. The old disk goes back to the caller.
+ * The new disk goes in straight away, and is rebuilt RAID4_REBUILD_ROWS
+ * rows at a time at background priority, locking only those rows.
+ * Rows not rebuilt yet are served in degraded mode, and rows that are
+ * holes on every other member are discarded rather than rebuilt.
+ * Replacing a member with the disk already there resumes an
+ * interrupted rebuild (see raid4_set_failed).
+ */
+int raid4_replace(struct blkdev *volume, int i, struct blkdev *newdisk)
+{    
+    struct raid4_dev * raid4 = (struct raid4_dev*) volume->private;
+    if (blkdev_num_blocks(newdisk) < raid4->nblks ||
+        blkdev_block_size(newdisk) != raid4->bsize){
+        return E_SIZE;
+    }
+    struct blkdev_prio_opts po;
+    if (blkdev_get_sched(raid4->disks[i == 0 ? 1 : 0], &po))
+        blkdev_set_sched(newdisk, &po);
+
+    /* disk 'i' is the missing one until it has been rebuilt. Given
+     * the disk already there, carry on from the rows it has.
+     */
+    range_lock_all(&raid4->locks);
+    pthread_mutex_lock(&raid4->state_lock);
+    int ok = raid4->state == 1 || (raid4->state == 0 && raid4->disk_failed == i);
+    blkno_t start = 0;
+    if (ok) {
+        if (raid4->state == 0 && newdisk == raid4->disks[i])
+            start = raid4->rebuilt;
+        __atomic_store_n(&raid4->rebuilt, start, __ATOMIC_RELEASE);
+        __atomic_store_n(&raid4->disk_failed, i, __ATOMIC_RELEASE);
+        __atomic_store_n(&raid4->state, 0, __ATOMIC_RELEASE);
+        hedge_drain(&raid4->hedge);
+        raid4->disks[i] = newdisk;
+        notify(&raid4->notify, RAID_EV_REBUILD, i, start);
+    }
+    pthread_mutex_unlock(&raid4->state_lock);
+    range_unlock_all(&raid4->locks);
+    if (!ok)
+        return E_UNAVAIL;
+
+    int prio = blkdev_set_prio(BLKDEV_PRIO_BG);
+    if (prio == BLKDEV_PRIO_IDLE)
+        blkdev_set_prio(prio);
+    int chunk = RAID4_REBUILD_ROWS * raid4->unit;
+    char *buf = malloc((size_t)chunk * raid4->bsize);
+    char *tmp = malloc((size_t)chunk * raid4->bsize);
+    int val = SUCCESS, stopped = 0;
+    for (blkno_t lba = start, len; lba < raid4->nblks && val == SUCCESS; lba += len) {
+        len = raid4->nblks - lba < chunk ? raid4->nblks - lba : chunk;
+        if (hot_spare_stopping(&raid4->spares)) {
+            stopped = 1;
+            break;
+        }
+        blkno_t first = lba / raid4->unit, last = (lba + len - 1) / raid4->unit;
+        range_lock(&raid4->locks, first, last, 1);
+        /* rows a reshape has moved have the new layout: stop there.
+         * A member the old layout doesn't use has nothing to rebuild.
+         */
+        int n = raid4_row_layout(raid4, first);
+        if (raid4_row_layout(raid4, last) != n) {
+            blkno_t pos = __atomic_load_n(&raid4->reshape.pos, __ATOMIC_ACQUIRE);
+            len = pos / ((blkno_t)raid4->unit * raid4->N) * raid4->unit - lba;
+        }
+        if (raid4_state(raid4) != 0 || raid4_failed_disk(raid4) != i)
+            val = E_UNAVAIL;    /* another disk failed */
+        if (val == SUCCESS && i > n) {
+            /* nothing there yet */
+        } else if (val == SUCCESS && raid4_hole(raid4, n, i, lba, len)) {
+            if (blkdev_next_data(newdisk, lba) < lba + len)
+                val = blkdev_discard(newdisk, lba, len);
+        } else if (val == SUCCESS) {
+            val = raid4_rebuild_range(raid4, n, i, lba, len, buf, tmp);
+            if (val == SUCCESS)
+                val = blkdev_write(newdisk, lba, len, buf);
+        }
+        if (val == SUCCESS) {
+            pthread_mutex_lock(&raid4->state_lock);
+            __atomic_store_n(&raid4->rebuilt, lba + len, __ATOMIC_RELEASE);
+            notify(&raid4->notify, RAID_EV_REBUILD, i, lba + len);
+            pthread_mutex_unlock(&raid4->state_lock);
+        }
+        range_unlock(&raid4->locks, first, last);
+    }
+    free(buf);
+    free(tmp);
+    blkdev_set_prio(prio);
+    if (stopped)
+        return E_UNAVAIL;       /* closing: the rebuild resumes from here */
+
+    range_lock_all(&raid4->locks);
+    pthread_mutex_lock(&raid4->state_lock);
+    if (val == SUCCESS && raid4->state == 0 && raid4->disk_failed == i) {
+        __atomic_store_n(&raid4->state, 1, __ATOMIC_RELEASE);
+        __atomic_store_n(&raid4->disk_failed, -1, __ATOMIC_RELEASE);
+        notify(&raid4->notify, RAID_EV_REBUILT, i, 0);
+    } else {
+        if (raid4->state == 0)
+            notify(&raid4->notify, RAID_EV_FAILED, i, 0);
+        val = E_UNAVAIL;
+    }
+    __atomic_store_n(&raid4->rebuilt, 0, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&raid4->state_lock);
+    range_unlock_all(&raid4->locks);
+    return val;
+}
+
+/* mark member 'i' failed, as when a volume is assembled without it.
+ * If 'rebuilt' is above 0 the member is a replacement rebuilt that far
+ * (in member blocks); raid4_replace with the same disk finishes it.
+ */
+void raid4_set_failed(struct blkdev *volume, int i, blkno_t rebuilt)
+{
+    struct raid4_dev * raid4 = (struct raid4_dev*) volume->private;
+    range_lock_all(&raid4->locks);
+    pthread_mutex_lock(&raid4->state_lock);
+    __atomic_store_n(&raid4->rebuilt, rebuilt, __ATOMIC_RELEASE);
+    __atomic_store_n(&raid4->disk_failed, i, __ATOMIC_RELEASE);
+    __atomic_store_n(&raid4->state, 0, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&raid4->state_lock);
+    range_unlock_all(&raid4->locks);
+}
+
+void raid4_set_notify(struct blkdev *volume, raid_notify_fn fn, void *arg)
+{
+    struct raid4_dev * raid4 = (struct raid4_dev*) volume->private;
+    pthread_mutex_lock(&raid4->state_lock);
+    raid4->notify.arg = arg;
+    raid4->notify.fn = fn;
+    pthread_mutex_unlock(&raid4->state_lock);
+}
+
+/* a spare in place of member i: the old disk is closed */
+static int raid4_spare_replace(struct blkdev *volume, int i, struct blkdev *newdisk)
+{
+    struct raid4_dev * raid4 = (struct raid4_dev*) volume->private;
+    struct blkdev *old = raid4->disks[i];
+    int val = raid4_replace(volume, i, newdisk);
+    if (raid4->disks[i] != newdisk)
+        return E_SIZE;
+    if (old != NULL && old != newdisk)
+        blkdev_close(old);
+    return val;
+}
+
+/* rebuild onto spares from 'pool' (NULL for none) when a member fails,
+ * putting them in place with 'fn' (see raid_set_spares) if it is set.
+ * A member that is already missing is replaced straight away.
+ */
+void raid4_set_spares_fn(struct blkdev *volume, struct spare_pool *pool,
+                         raid_replace_fn fn, blkno_t min_blks)
+{
+    struct raid4_dev * raid4 = (struct raid4_dev*) volume->private;
+    if (fn == NULL)
+        hot_spare_config(&raid4->spares, pool, raid4_spare_replace,
+                         raid4->nblks, LLONG_MAX, raid4->bsize);
+    else
+        hot_spare_config(&raid4->spares, pool, fn, min_blks, LLONG_MAX, raid4->bsize);
+    pthread_mutex_lock(&raid4->state_lock);
+    if (raid4->state == 0 && raid4->rebuilt == 0)
+        hot_spare_start(&raid4->spares, raid4->disk_failed);
+    pthread_mutex_unlock(&raid4->state_lock);
+}
+
+void raid4_set_spares(struct blkdev *volume, struct spare_pool *pool)
+{
+    raid4_set_spares_fn(volume, pool, NULL, 0);
+}
+
+int raid4_spare_wait(struct blkdev *volume)
+{
+    struct raid4_dev * raid4 = (struct raid4_dev*) volume->private;
+    return hot_spare_wait(&raid4->spares);
+}
+
+/* turn hedged reads on or off (opts == NULL turns them off) */
+void raid4_set_hedge(struct blkdev *volume, struct hedge_opts *opts)
+{
+    struct raid4_dev * raid4 = (struct raid4_dev*) volume->private;
+    hedge_config(&raid4->hedge, opts);
+}
+
+void raid4_hedge_stats(struct blkdev *volume, long long *hedged, long long *won)
+{
+    struct raid4_dev * raid4 = (struct raid4_dev*) volume->private;
+    hedge_stats(&raid4->hedge, hedged, won);
+}
+
+static void raid4_checkpoint(struct blkdev *dev, int event, blkno_t mark)
+{
+    struct raid4_dev * raid4 = (struct raid4_dev*) dev->private;
+    pthread_mutex_lock(&raid4->state_lock);
+    notify(&raid4->notify, event, raid4->N + 1, mark);
+    pthread_mutex_unlock(&raid4->state_lock);
+}
+
+/* grow a RAID 4 volume onto disks[raid4->N+1..N-1] (see the RESHAPE
+ * section). The old parity disk becomes a data disk, and the last new
+ * disk holds the parity of the new layout. Given the disks it already
+ * has, continues the reshape the volume is in.
+ */
+int raid4_reshape(struct blkdev *volume, int N, struct blkdev *disks[])
+{
+    struct raid4_dev * raid4 = (struct raid4_dev*) volume->private;
+    int resume = raid4_reshaping(raid4);
+    blkno_t nblks;
+    if (resume ? N != raid4->N + 1 : N <= raid4->N + 1)
+        return E_SIZE;
+    for (int i = 0; i < N; i++) {
+        if (i <= raid4->N ? disks[i] != raid4->disks[i] :
+            blkdev_num_blocks(disks[i]) < raid4->nblks ||
+            blkdev_block_size(disks[i]) != raid4->bsize)
+            return E_SIZE;
+    }
+    /* the backup area takes the last N-1 rows of the new parity disk */
+    if (raid4->nblks / raid4->unit < 2 * (N - 1) ||
+        __builtin_mul_overflow(raid4->nblks, N - 1, &nblks))
+        return E_SIZE;
+    if (raid4_state(raid4) != 1)
+        return E_UNAVAIL;
+
+    if (!resume) {
+        range_lock_all(&raid4->locks);
+        hedge_drain(&raid4->hedge);
+        hedge_resize(&raid4->hedge, N);
+        raid4->disks = disks;
+        reshape_init(&raid4->reshape, raid4->N);
+        __atomic_store_n(&raid4->N, N - 1, __ATOMIC_RELEASE);
+        raid4_checkpoint(volume, RAID_EV_RESHAPE, 0);
+        range_unlock_all(&raid4->locks);
+    }
+    struct reshape_job j = {
+        .dev = volume, .rs = &raid4->reshape, .locks = &raid4->locks,
+        .N = N - 1, .unit = raid4->unit, .bsize = raid4->bsize,
+        .dblks = raid4->nblks, .spare = disks[N - 1],
+        .read = raid4_do_read, .write = raid4_do_write,
+        .zero = raid4_discard_rows, .checkpoint = raid4_checkpoint
+    };
+    return reshape_run(&j);
+}
+
+/* start a volume part way through a reshape from prev_N disks */
+void raid4_set_reshape(struct blkdev *volume, int prev_N, blkno_t pos, int backup)
+{
+    struct raid4_dev * raid4 = (struct raid4_dev*) volume->private;
+    range_lock_all(&raid4->locks);
+    __atomic_store_n(&raid4->reshape.prev_N, prev_N - 1, __ATOMIC_RELEASE);
+    raid4->reshape.pos = pos;
+    raid4->reshape.backup = backup;
+    range_unlock_all(&raid4->locks);
+}
+
+/* recompute the parity of one row from its data strips.
+ */
+static int raid4_resync_row(struct raid4_dev *raid4, blkno_t row)
+{
+    int len = raid4->unit * raid4->bsize;
+    int n = raid4_row_layout(raid4, row);
+    char *data = malloc(len);
+    char *par = calloc(1, len);
+    int val = SUCCESS;
+
+    for (int i = 0; i < n && val == SUCCESS; i++) {
+        val = blkdev_read(raid4->disks[i], row * raid4->unit, raid4->unit, data);
+        parity(len, data, par, par);
+    }
+    if (val == SUCCESS)
+        val = blkdev_write(raid4->disks[n], row * raid4->unit, raid4->unit, par);
+    free(data);
+    free(par);
+    return val;
+}
+
+/* attach a parity journal on 'jdev' to a RAID 4 volume. Any rows the
+ * journal shows as in flight when the volume last stopped get their
+ * parity recomputed before this returns. The journal device is closed
+ * with the volume (but not if this fails).
+ */
+int raid4_set_journal(struct blkdev *volume, struct blkdev *jdev)
+{
+    struct raid4_dev * raid4 = (struct raid4_dev*) volume->private;
+    int *rows, nrows;
+
+    /* the journal keeps a counter per row in memory, indexed by int */
+    if (raid4->nblks / raid4->unit > INT_MAX) {
+        printf("Error: volume has too many rows for a parity journal.\n");
+        return E_SIZE;
+    }
+    struct pjournal *j = pjournal_open(jdev, raid4->nblks / raid4->unit, raid4_journal_sync,
+                                       raid4, &rows, &nrows);
+    if (j == NULL)
+        return E_SIZE;
+
+    /* with a failed disk the stale rows can't be recomputed */
+    if (nrows > 0 && raid4_state(raid4) != 1) {
+        printf("Error: can't replay parity journal on a degraded volume.\n");
+        free(rows);
+        pjournal_free(j);
+        return E_UNAVAIL;
+    }
+    for (int i = 0; i < nrows; i++) {
+        if (raid4_resync_row(raid4, rows[i]) != SUCCESS) {
+            free(rows);
+            pjournal_free(j);
+            return E_UNAVAIL;
+        }
+    }
+    free(rows);
+    raid4->journal = j;
+    return SUCCESS;
+}
+
+/**********   RAID 4 SCRUB  ***************/
+
+/* A scrub walks the volume 'rows_per_chunk' rows at a time. For each
+ * chunk it reads the range from every member in parallel (one thread
+ * per member), XORs the data strips together and compares the result
+ * with the parity strip, row by row. A chunk's rows are locked while it
+ * is read, so only requests to those rows wait, and for at most one
+ * chunk; between chunks
+ * the scrub backs off while there is foreground traffic and sleeps to
+ * stay under its bandwidth cap.
+ */
+struct raid4_scrub {
+    struct raid4_dev *raid4;    /* NULL once the volume has closed */
+    struct raid4_scrub_opts opts;
+    int N;                      /* data disks when it started */
+    long long nrows;
+    pthread_t thread;
+    pthread_mutex_t lock;       /* protects the fields below */
+    int stop;
+    int running;
+    int error;
+    long long next_row;
+    long long mismatches;
+    long long repaired;
+    long long bytes;
+};
+
+struct scrub_read {
+    struct blkdev *disk;
+    blkno_t lba;
+    int len;
+    char *buf;
+    int val;
+};
+
+static void *scrub_read_thread(void *arg)
+{
+    struct scrub_read *r = arg;
+    blkdev_set_prio(BLKDEV_PRIO_BG);
+    r->val = blkdev_read(r->disk, r->lba, r->len, r->buf);
+    return NULL;
+}
+
+static void scrub_save(struct raid4_scrub *sc, long long row)
+{
+    if (sc->opts.checkpoint == NULL)
+        return;
+    FILE *fp = fopen(sc->opts.checkpoint, "w");
+    if (fp == NULL)
+        return;
+    fprintf(fp, "%lld %lld\n", sc->nrows, row);
+    fclose(fp);
+}
+
+static long long scrub_load(struct raid4_scrub *sc)
+{
+    long long nrows, row;
+    if (sc->opts.checkpoint == NULL)
+        return 0;
+    FILE *fp = fopen(sc->opts.checkpoint, "r");
+    if (fp == NULL)
+        return 0;
+    int n = fscanf(fp, "%lld %lld", &nrows, &row);
+    fclose(fp);
+    if (n != 2 || nrows != sc->nrows || row < 0 || row > nrows)
+        return 0;
+    return row;
+}
+
+/* verify (and optionally repair) rows first..first+rows-1. Called
+ * with the chunk's rows range-locked (exclusively for a repair). A
+ * member that fails here is failed in the volume, as it would be by
+ * a foreground request, and the scrub stops.
+ */
+static int scrub_chunk(struct raid4_scrub *sc, long long first, int rows, char **bufs)
+{
+    struct raid4_dev *raid4 = sc->raid4;
+    struct scrub_read reads[raid4->N + 1];
+    pthread_t threads[raid4->N + 1];
+    int strip = raid4->unit * raid4->bsize;
+
+    if (raid4_state(raid4) != 1)
+        return E_UNAVAIL;       /* nothing to compare against */
+    if (raid4_reshaping(raid4) || raid4->N != sc->N)
+        return E_UNAVAIL;       /* the layout is changing, or has */
+
+    for (int i = 0; i <= raid4->N; i++) {
+        reads[i].disk = raid4->disks[i];
+        reads[i].lba = first * raid4->unit;
+        reads[i].len = rows * raid4->unit;
+        reads[i].buf = bufs[i];
+        pthread_create(&threads[i], NULL, scrub_read_thread, &reads[i]);
+    }
+    int val = SUCCESS, corrupt = -1;
+    for (int i = 0; i <= raid4->N; i++) {
+        pthread_join(threads[i], NULL);
+        if (reads[i].val == E_CORRUPT && corrupt < 0)
+            corrupt = i;
+        else if (reads[i].val != SUCCESS)
+            val = reads[i].val;
+        if (reads[i].val == E_UNAVAIL)
+            raid4_fail(raid4, i);
+    }
+    if (val != SUCCESS)
+        return val;
+
+    /* a member with blocks that fail their checksums: find their rows,
+     * and rebuild its strips there from the other members
+     */
+    long long bad = 0, fixed = 0;
+    if (corrupt >= 0) {
+        char *strip_buf = malloc(strip);
+        for (int r = 0; r < rows; r++) {
+            char *p = bufs[corrupt] + r * strip;
+            if (blkdev_read(raid4->disks[corrupt], (first + r) * raid4->unit,
+                            raid4->unit, p) != E_CORRUPT)
+                continue;
+            memset(strip_buf, 0, strip);
+            for (int i = 0; i <= raid4->N; i++) {
+                if (i != corrupt)
+                    parity(strip, bufs[i] + r * strip, strip_buf, strip_buf);
+            }
+            memcpy(p, strip_buf, strip);
+            bad++;
+            if (sc->opts.repair &&
+                blkdev_write(raid4->disks[corrupt], (first + r) * raid4->unit,
+                             raid4->unit, p) == SUCCESS)
+                fixed++;
+        }
+        free(strip_buf);
     }
+
+    /* bufs[0] accumulates the XOR of the data strips */
+    for (int i = 1; i < raid4->N; i++)
+        parity(rows * strip, bufs[i], bufs[0], bufs[0]);
+
+    for (int r = 0; r < rows; r++) {
+        char *expect = bufs[0] + r * strip;
+        if (!parity_differs(strip, expect, bufs[raid4->N] + r * strip))
+            continue;
+        bad++;
+        if (sc->opts.repair &&
+            blkdev_write(raid4->disks[raid4->N], (first + r) * raid4->unit,
+                         raid4->unit, expect) == SUCCESS)
+            fixed++;
+    }
+
+    pthread_mutex_lock(&sc->lock);
+    sc->mismatches += bad;
+    sc->repaired += fixed;
+    sc->bytes += (long long)rows * strip * (raid4->N + 1);
+    pthread_mutex_unlock(&sc->lock);
     return SUCCESS;
 }
 
-/* read blocks from a RAID 4 volume.
- * If the volume is in a degraded state you may need to reconstruct
- * data from the other stripes of the stripe set plus parity.
- * If a drive fails during a read and all other drives are
- * operational, close that drive and continue in degraded state.
- * If a drive fails and the volume is already in a degraded state,
- * close the drive and return an error.
+static void *scrub_thread(void *arg)
+{
+    struct raid4_scrub *sc = arg;
+    struct raid4_dev *raid4 = sc->raid4;
+    int chunk = sc->opts.rows_per_chunk;
+    char *bufs[sc->N + 1];
+    long long idle_ns = sc->opts.idle_ms * 1000000LL;
+    long long start = now_ns(), done_bytes = 0;
+    blkdev_set_prio(BLKDEV_PRIO_BG);
+
+    for (int i = 0; i <= sc->N; i++)
+        bufs[i] = malloc((size_t)chunk * raid4->unit * raid4->bsize);
+
+    long long row = sc->next_row;
+    while (row < sc->nrows) {
+        pthread_mutex_lock(&sc->lock);
+        int stop = sc->stop;
+        pthread_mutex_unlock(&sc->lock);
+        if (stop)
+            break;
+
+        /* lower priority than foreground I/O: wait for a quiet spell */
+        if (idle_ns > 0 &&
+            now_ns() - __atomic_load_n(&raid4->last_io, __ATOMIC_RELAXED) < idle_ns) {
+            usleep(sc->opts.idle_ms * 1000 / 4 + 1);
+            continue;
+        }
+
+        int rows = sc->nrows - row < chunk ? sc->nrows - row : chunk;
+        /* a check only needs the rows not to be written meanwhile;
+         * a repair rewrites parity, so it excludes readers as well.
+         */
+        range_lock(&raid4->locks, row, row + rows - 1, sc->opts.repair);
+        int val = scrub_chunk(sc, row, rows, bufs);
+        range_unlock(&raid4->locks, row, row + rows - 1);
+
+        pthread_mutex_lock(&sc->lock);
+        if (val != SUCCESS)
+            sc->error = val;
+        else
+            sc->next_row = row = row + rows;
+        pthread_mutex_unlock(&sc->lock);
+        if (val != SUCCESS)
+            break;
+        scrub_save(sc, row);
+
+        /* bandwidth cap: sleep until we are back under the rate */
+        done_bytes += (long long)rows * raid4->unit * raid4->bsize * (sc->N + 1);
+        if (sc->opts.max_kbps > 0) {
+            long long due = start + done_bytes * 1000000LL / sc->opts.max_kbps;
+            long long now = now_ns();
+            if (due > now)
+                usleep((due - now) / 1000);
+        }
+    }
+
+    /* a finished scrub starts from the beginning next time */
+    if (row >= sc->nrows && sc->opts.checkpoint != NULL)
+        remove(sc->opts.checkpoint);
+
+    for (int i = 0; i <= sc->N; i++)
+        free(bufs[i]);
+    pthread_mutex_lock(&sc->lock);
+    sc->running = 0;
+    pthread_mutex_unlock(&sc->lock);
+    return NULL;
+}
+
+/* stop the scrub of a volume that is closing, and cut it loose from
+ * the volume. The handle stays valid for raid4_scrub_status and
+ * raid4_scrub_stop, which then only frees it.
+ */
+static void scrub_detach(struct raid4_scrub *sc)
+{
+    pthread_mutex_lock(&sc->lock);
+    sc->stop = 1;
+    pthread_mutex_unlock(&sc->lock);
+    pthread_join(sc->thread, NULL);
+    pthread_mutex_lock(&sc->lock);
+    sc->raid4 = NULL;
+    pthread_mutex_unlock(&sc->lock);
+}
+
+/* start a background scrub of a RAID 4 volume. If 'opts->checkpoint'
+ * names a file left by an earlier, unfinished scrub of the same
+ * volume, the scrub resumes where that one stopped. 'opts' may be NULL
+ * for the defaults (64 rows per chunk, no cap, no repair).
  */
-static int raid4_read(struct blkdev * dev, int first_blk,
-                      int num_blks, void *buf) 
+struct raid4_scrub *raid4_scrub_start(struct blkdev *volume,
+                                      struct raid4_scrub_opts *opts)
 {
-    struct raid4_dev * raid4 = (struct raid4_dev*) dev->private; 
-    if (raid4->state == -1) {
-        return E_UNAVAIL;
-    } 
-    int val;
-    int disk_num,disk_lba,place;
-    int j = num_blks;
-    int LBA = first_blk;
-    while(j > 0){
-        int num_blocks_read;
-        disk_num = get_disk_num(LBA, raid4->unit, raid4->N);
-        disk_lba = get_disk_lba(LBA, raid4->unit, raid4->N);
-        place = disk_lba % raid4->unit; 
-        if ((j+place) > raid4->unit){
-            num_blocks_read = raid4->unit - place;
-        }
-        else{
-            num_blocks_read = j;
-        }         
-        
-        if (raid4->state == 0 && raid4->disk_failed == disk_num){
-            memset(buf, '\0', num_blocks_read*BLOCK_SIZE);
-            if (reconstruct_data(dev, disk_num, buf, num_blocks_read, disk_lba) == SUCCESS) {
-                j -= num_blocks_read;
-                LBA += num_blocks_read;
-                buf+= num_blocks_read * BLOCK_SIZE;
-                continue;
-            }  
-            else {
-                raid4->state = -1;
-                return E_UNAVAIL;
-            }               
-        }
-                    
-        val = blkdev_read(raid4->disks[disk_num], disk_lba, num_blocks_read, buf);
+    struct raid4_dev * raid4 = (struct raid4_dev*) volume->private;
+    if (raid4->scrub != NULL) {
+        printf("Error: volume already has a scrub.\n");
+        return NULL;
+    }
+    struct raid4_scrub *sc = calloc(1, sizeof(*sc));
 
-        if (val == E_UNAVAIL){
-            blkdev_close(raid4->disks[disk_num]);
-            if (raid4->state ==1){
-                raid4->state =0;
-                raid4->disk_failed =disk_num;
-                continue;
-            }
-            raid4->state = -1;
-            return E_UNAVAIL; 
+    if (opts != NULL)
+        sc->opts = *opts;
+    if (sc->opts.rows_per_chunk < 1)
+        sc->opts.rows_per_chunk = 64;
+    sc->raid4 = raid4;
+    sc->N = raid4->N;
+    sc->nrows = raid4->nblks / raid4->unit;
+    sc->next_row = scrub_load(sc);
+    sc->running = 1;
+    pthread_mutex_init(&sc->lock, NULL);
+    pthread_create(&sc->thread, NULL, scrub_thread, sc);
+    raid4->scrub = sc;
+    return sc;
+}
 
-        }
-        j -= num_blocks_read;
-        LBA += num_blocks_read;
-        buf+= num_blocks_read * BLOCK_SIZE;
+void raid4_scrub_status(struct raid4_scrub *sc, struct raid4_scrub_status *st)
+{
+    pthread_mutex_lock(&sc->lock);
+    st->running = sc->running;
+    st->error = sc->error;
+    st->rows_done = sc->next_row;
+    st->nrows = sc->nrows;
+    st->mismatches = sc->mismatches;
+    st->repaired = sc->repaired;
+    st->bytes = sc->bytes;
+    pthread_mutex_unlock(&sc->lock);
+}
+
+/* stop a scrub (or wait for it to finish, if 'wait' is set) and free
+ * it. Progress is kept in the checkpoint file. Returns the error that
+ * ended the scrub, if any.
+ */
+int raid4_scrub_stop(struct raid4_scrub *sc, int wait)
+{
+    pthread_mutex_lock(&sc->lock);
+    struct raid4_dev *raid4 = sc->raid4;
+    if (!wait)
+        sc->stop = 1;
+    pthread_mutex_unlock(&sc->lock);
+    if (raid4 != NULL) {        /* else raid4_close has joined it */
+        pthread_join(sc->thread, NULL);
+        raid4->scrub = NULL;
     }
-    return SUCCESS;
+
+    int val = sc->error;
+    pthread_mutex_destroy(&sc->lock);
+    free(sc);
+    return val;
 }
 
-void modify(int k, int index, char * read_buf, char* temp)
+/**********   DECLUSTERED PARITY  ***************/
+
+/* A draid volume spreads stripes of 'width' strips (width-1 data, then
+ * parity) over a pool of N members, so that rebuilding a member reads
+ * from and writes to all of the others. Row r is strip r of every
+ * member (member blocks r*unit..(r+1)*unit-1), and its N strips are
+ * dealt out by a permutation of the members: positions 0..width-1 are
+ * the first stripe, the next 'width' the second, and so on for
+ * 'groups' stripes. The position after them is the row's spare strip;
+ * any more are left unused.
+ *
+ * Row r uses base permutation (r / N) % DRAID_PERMS rotated by r, so
+ * over each N rows every member takes every position once (parity and
+ * spare strips are spread evenly), while the members that share
+ * stripes with any one member change from one run of N rows to the
+ * next.
+ *
+ * When a member fails, draid_rebuild writes its strips into the spare
+ * strips of their rows, from several threads, DRAID_REBUILD_ROWS rows
+ * ("a chunk") at a time. Once it is done the volume can lose another
+ * member; draid_replace copies the spared strips on to a new disk.
+ */
+#define DRAID_PERMS           64
+#define DRAID_REBUILD_ROWS    16
+#define DRAID_REBUILD_THREADS 8
+
+struct draid_dev {
+    int N;
+    int width;                /* strips per stripe, parity included */
+    int groups;               /* stripes per row */
+    int unit;
+    int bsize;
+    blkno_t rows;
+    blkno_t nchunks;
+    int *perm;                /* DRAID_PERMS base permutations of N */
+    int *inv;                 /* and their inverses */
+    struct blkdev **disks;    /* failed disks stay open until replaced */
+    int state;                /* 1 ok, 0 degraded, -1 failed */
+    int disk_failed;
+    int lost;                 /* a second failed member, once every strip
+                               * of disk_failed has a copy, or -1 */
+    unsigned char *spared;    /* per chunk: disk_failed's strips are in
+                               * the spare strips */
+    blkno_t nspared;          /* chunks spared */
+    blkno_t rebuilt;          /* rows below this are on disks[disk_failed]
+                               * again (draid_replace) */
+    int busy;                 /* a rebuild or replace is running */
+    struct range_locks locks; /* per row: readers share, writers exclusive */
+    pthread_mutex_t state_lock;
+};
+
+/* 'state', 'disk_failed' and 'lost' only change under state_lock, in
+ * that order, as for raid4.
+ */
+static int draid_state(struct draid_dev *d)
 {
-    for (int i = 0; i < BLOCK_SIZE; i++)
-        read_buf[k*BLOCK_SIZE+i] = temp[index*BLOCK_SIZE+i];
-    return;
+    return __atomic_load_n(&d->state, __ATOMIC_ACQUIRE);
 }
 
+static int draid_failed_disk(struct draid_dev *d)
+{
+    return __atomic_load_n(&d->disk_failed, __ATOMIC_ACQUIRE);
+}
 
-/* write blocks to a RAID 4 volume.
- * Note that you must handle short writes - i.e. less than a full
- * stripe set. You may either use the optimized algorithm (for N>3
- * read old data, parity, write new data, new parity) or you can read
- * the entire stripe set, modify it, and re-write it. Your code will
- * be graded on correctness, not speed.
- * If an underlying device fails you should close it and complete the
- * write in the degraded state. If a drive fails in the degraded
- * state, close it and return an error.
- * In the degraded state perform all writes to non-failed drives, and
- * forget about the failed one. (parity will handle it)
+/* the member at position k of row 'row', and the position of member 'disk' */
+static int draid_disk(struct draid_dev *d, blkno_t row, int k)
+{
+    int *p = d->perm + (row / d->N % DRAID_PERMS) * d->N;
+    return (p[k] + row % d->N) % d->N;
+}
+
+static int draid_pos(struct draid_dev *d, blkno_t row, int disk)
+{
+    int *p = d->inv + (row / d->N % DRAID_PERMS) * d->N;
+    return p[(disk - row % d->N + d->N) % d->N];
+}
+
+static int draid_spared(struct draid_dev *d, blkno_t row)
+{
+    return __atomic_load_n(&d->spared[row / DRAID_REBUILD_ROWS], __ATOMIC_ACQUIRE);
+}
+
+/* the member holding strip k of row 'row', or -1 if it is missing */
+static int draid_holder(struct draid_dev *d, blkno_t row, int k)
+{
+    int disk = draid_disk(d, row, k);
+    if (draid_state(d) == 1)
+        return disk;
+    if (disk == draid_failed_disk(d) &&
+        row >= __atomic_load_n(&d->rebuilt, __ATOMIC_ACQUIRE)) {
+        if (!draid_spared(d, row))
+            return -1;
+        disk = draid_disk(d, row, d->groups * d->width);
+    }
+    return disk == __atomic_load_n(&d->lost, __ATOMIC_ACQUIRE) ? -1 : disk;
+}
+
+/* every strip of disk_failed has a copy: spared, or on its replacement */
+static int draid_redundant(struct draid_dev *d)
+{
+    blkno_t copied = (d->rebuilt + DRAID_REBUILD_ROWS - 1) / DRAID_REBUILD_ROWS;
+    return d->state == 0 && d->nspared + copied >= d->nchunks;
+}
+
+/* record that member 'i' has failed (or with i < 0, that the volume
+ * has), and return the state that leaves the volume in. A second
+ * member may fail once the first has been rebuilt into the spare
+ * strips; any more is fatal.
  */
+static int draid_fail(struct draid_dev *d, int i)
+{
+    pthread_mutex_lock(&d->state_lock);
+    if (i >= 0 && d->state == 1) {
+        __atomic_store_n(&d->disk_failed, i, __ATOMIC_RELEASE);
+        __atomic_store_n(&d->state, 0, __ATOMIC_RELEASE);
+    } else if (i >= 0 && d->state == 0 && i == d->disk_failed) {
+        /* its replacement failed: the rows copied to it are missing */
+        __atomic_store_n(&d->rebuilt, 0, __ATOMIC_RELEASE);
+        if (d->lost >= 0)
+            __atomic_store_n(&d->state, -1, __ATOMIC_RELEASE);
+    } else if (i >= 0 && (i == d->lost || (d->lost < 0 && draid_redundant(d)))) {
+        __atomic_store_n(&d->lost, i, __ATOMIC_RELEASE);
+    } else {
+        __atomic_store_n(&d->state, -1, __ATOMIC_RELEASE);
+    }
+    int state = d->state;
+    pthread_mutex_unlock(&d->state_lock);
+    return state;
+}
 
-static int raid4_write(struct blkdev * dev, int first_blk,
-                       int num_blks, void *buf)
+static blkno_t draid_row_blocks(struct draid_dev *d)
 {
-    struct raid4_dev * raid4 = (struct raid4_dev*) dev->private; 
-    if (raid4->state == -1) {
-        return E_UNAVAIL;
-    } 
-    int val,val2, val3;
-    int disk_num,disk_lba, start,end;
-    int LBA = first_blk;
-    int j = num_blks;
-    int row_count = raid4->unit* raid4->N;
-    int index = 0;
-    char *read_buf = malloc((row_count+1)*BLOCK_SIZE);
-    char *free_buf = read_buf;
-    char *temp_buf;
-    while (j > 0){        
-        memset(free_buf, '\0', (row_count+1)*BLOCK_SIZE);
-        read_buf = free_buf;
-        temp_buf = read_buf;
-        char *temp = buf;
-        char parity_buf [raid4->unit*BLOCK_SIZE];
-        memset(parity_buf, '\0', raid4->unit*BLOCK_SIZE);
-        start = LBA % row_count;
-        if (start + j > row_count)
-            end = (LBA / row_count + 1) *row_count -1;
-        else 
-            end = start + j - 1;
-        
-        disk_lba = get_disk_lba(LBA - start, raid4->unit, raid4->N);
-        val = raid4_read(dev, LBA - start, row_count, read_buf);
+    return (blkno_t)d->groups * (d->width - 1) * d->unit;
+}
 
-        if (val == E_UNAVAIL)
-            return E_UNAVAIL;
+static blkno_t draid_num_blocks(struct blkdev *dev)
+{
+    struct draid_dev *d = dev->private;
+    return d->rows * draid_row_blocks(d);
+}
 
-        for(int k = start; k<=end; k++)
-        {
-            modify(k,index,read_buf,temp);
-            index++;
-        }   
-        
-        for (int i =0; i< raid4->N; i++){
-            parity(raid4->unit*BLOCK_SIZE,temp_buf,parity_buf,parity_buf);
-            temp_buf += raid4->unit*BLOCK_SIZE;
+static int draid_block_size(struct blkdev *dev)
+{
+    struct draid_dev *d = dev->private;
+    return d->bsize;
+}
+
+/* read blocks off..off+len-1 of strip k of 'row'. A missing strip is
+ * rebuilt from the rest of its stripe; a member that fails is marked
+ * failed and the strip read again.
+ */
+static int draid_read_strip(struct draid_dev *d, blkno_t row, int k, int off,
+                            int len, char *buf)
+{
+    blkno_t lba = row * d->unit + off;
+    int bytes = len * d->bsize;
+    for (;;) {
+        if (draid_state(d) == -1)
+            return E_UNAVAIL;
+        int h = draid_holder(d, row, k), val = SUCCESS;
+        if (h >= 0) {
+            val = blkdev_read(d->disks[h], lba, len, buf);
+            if (val != E_UNAVAIL)
+                return val;
+            draid_fail(d, h);
+            continue;
         }
-        for (int i = 0; i < raid4->N; ++i){
-            if(i != raid4->disk_failed)
-                val2 = blkdev_write(raid4->disks[i], disk_lba, raid4->unit,read_buf);
-            if (val2 == E_UNAVAIL && i!= raid4->disk_failed)
-            {                
-                blkdev_close(raid4->disks[i]);
-                if (raid4->state == 0) {
-                    free(free_buf);
-                    raid4->state = -1;
-                    return E_UNAVAIL;                    
-                }
-                raid4->state = 0;
-            }
-            read_buf += raid4->unit* BLOCK_SIZE;
+        int first = k / d->width * d->width;
+        char *tmp = malloc(bytes);
+        memset(buf, 0, bytes);
+        for (int j = first; j < first + d->width && val == SUCCESS; j++) {
+            if (j == k)
+                continue;
+            h = draid_holder(d, row, j);
+            val = h < 0 ? E_UNAVAIL : blkdev_read(d->disks[h], lba, len, tmp);
+            if (val == SUCCESS)
+                parity(bytes, tmp, buf, buf);
         }
-        val3 = blkdev_write(raid4->parity, disk_lba , raid4->unit, parity_buf);
-        if (val3 == E_UNAVAIL &&  raid4->disk_failed!= raid4->N+1)
-            {
-                blkdev_close(raid4->parity);
-                if (raid4->state == 0){
-                    free(free_buf);
-                    raid4->state = -1;
-                    return E_UNAVAIL;                    
-                }
-                raid4->state = 0;
-            }
-    
-        j -= (end - start + 1);
-        LBA += (end - start + 1);
+        free(tmp);
+        if (val == SUCCESS)
+            return SUCCESS;
+        draid_fail(d, h);
+        if (h < 0)
+            return E_UNAVAIL;
+    }
+}
+
+/* write stripe 'g' of 'row' from its data strips in 'data', with new
+ * parity. Missing strips are left out.
+ */
+static int draid_write_stripe(struct draid_dev *d, blkno_t row, int g, char *data)
+{
+    int strip = d->unit * d->bsize;
+    char *par = calloc(1, strip);
+    int val = SUCCESS;
+    for (int j = 0; j < d->width - 1; j++)
+        parity(strip, data + (size_t)j * strip, par, par);
+    for (int j = 0; j < d->width && val == SUCCESS; j++) {
+        int h = draid_holder(d, row, g * d->width + j);
+        if (h < 0)
+            continue;
+        char *src = j < d->width - 1 ? data + (size_t)j * strip : par;
+        if (blkdev_write(d->disks[h], row * d->unit, d->unit, src) == E_UNAVAIL &&
+            draid_fail(d, h) == -1)
+            val = E_UNAVAIL;
+    }
+    free(par);
+    return val;
+}
+
+/* volume block 'lba': its row, the position of its strip, and the
+ * block within the strip
+ */
+static void draid_map(struct draid_dev *d, blkno_t lba, blkno_t *row, int *k, int *off)
+{
+    blkno_t in_row = lba % draid_row_blocks(d);
+    int s = in_row / d->unit;
+    *row = lba / draid_row_blocks(d);
+    *k = s / (d->width - 1) * d->width + s % (d->width - 1);
+    *off = in_row % d->unit;
+}
+
+static int draid_do_read(struct draid_dev *d, blkno_t first_blk, int num_blks, char *buf)
+{
+    while (num_blks > 0) {
+        blkno_t row;
+        int k, off;
+        draid_map(d, first_blk, &row, &k, &off);
+        int len = d->unit - off < num_blks ? d->unit - off : num_blks;
+        int val = draid_read_strip(d, row, k, off, len, buf);
+        if (val != SUCCESS)
+            return val;
+        first_blk += len;
+        num_blks -= len;
+        buf += (size_t)len * d->bsize;
     }
-    free(free_buf);
     return SUCCESS;
 }
 
-/* clean up, including: close all devices and free any data structures
- * you allocated in raid4_create. 
+/* a stripe at a time: read what the write doesn't cover, then write
+ * the whole stripe with its new parity.
  */
-static void raid4_close(struct blkdev *dev)
+static int draid_do_write(struct draid_dev *d, blkno_t first_blk, int num_blks, char *buf)
 {
-    struct raid4_dev * raid4 = (struct raid4_dev*) dev->private;
-    for (int i = 0; i< raid4->N; i++) {
-        blkdev_close(raid4->disks[i]);
+    int sblks = (d->width - 1) * d->unit;
+    char *data = malloc((size_t)sblks * d->bsize);
+    int val = SUCCESS;
+    while (num_blks > 0 && val == SUCCESS) {
+        blkno_t row;
+        int k, off;
+        draid_map(d, first_blk, &row, &k, &off);
+        int g = k / d->width;
+        blkno_t start = row * draid_row_blocks(d) + (blkno_t)g * sblks;
+        int skip = first_blk - start;
+        int len = sblks - skip < num_blks ? sblks - skip : num_blks;
+        if (len < sblks)
+            val = draid_do_read(d, start, sblks, data);
+        if (val == SUCCESS) {
+            memcpy(data + (size_t)skip * d->bsize, buf, (size_t)len * d->bsize);
+            val = draid_write_stripe(d, row, g, data);
+        }
+        first_blk += len;
+        num_blks -= len;
+        buf += (size_t)len * d->bsize;
     }
-    blkdev_close(raid4->parity);
-    free(raid4);
+    free(data);
+    return val;
+}
+
+static int draid_read(struct blkdev *dev, blkno_t first_blk, int num_blks, void *buf)
+{
+    struct draid_dev *d = dev->private;
+    if (first_blk < 0 || num_blks < 0 || first_blk > draid_num_blocks(dev) - num_blks)
+        return E_BADADDR;
+    if (num_blks == 0)
+        return SUCCESS;
+    blkno_t r0 = first_blk / draid_row_blocks(d);
+    blkno_t r1 = (first_blk + num_blks - 1) / draid_row_blocks(d);
+    range_lock(&d->locks, r0, r1, 0);
+    int val = draid_do_read(d, first_blk, num_blks, buf);
+    range_unlock(&d->locks, r0, r1);
+    return val;
+}
+
+static int draid_write(struct blkdev *dev, blkno_t first_blk, int num_blks, void *buf)
+{
+    struct draid_dev *d = dev->private;
+    if (first_blk < 0 || num_blks < 0 || first_blk > draid_num_blocks(dev) - num_blks)
+        return E_BADADDR;
+    if (num_blks == 0)
+        return SUCCESS;
+    if (draid_state(d) == -1)
+        return E_UNAVAIL;
+    blkno_t r0 = first_blk / draid_row_blocks(d);
+    blkno_t r1 = (first_blk + num_blks - 1) / draid_row_blocks(d);
+    range_lock(&d->locks, r0, r1, 1);
+    int val = draid_do_write(d, first_blk, num_blks, buf);
+    range_unlock(&d->locks, r0, r1);
+    return val;
+}
+
+static void draid_close(struct blkdev *dev)
+{
+    struct draid_dev *d = dev->private;
+    for (int i = 0; i < d->N; i++)
+        blkdev_close(d->disks[i]);
+    range_destroy(&d->locks);
+    pthread_mutex_destroy(&d->state_lock);
+    free(d->perm);
+    free(d->inv);
+    free(d->spared);
+    free(d);
     dev->private = NULL;
     free(dev);
-    return;
 }
 
-struct blkdev_ops raid4_ops = {
-    .num_blocks = raid4_num_blocks,
-    .read = raid4_read,
-    .write = raid4_write,
-    .close = raid4_close
+/* flush every member still holding strips, as for raid4 */
+static int draid_flush(struct blkdev *dev)
+{
+    struct draid_dev *d = dev->private;
+    if (draid_state(d) == -1)
+        return E_UNAVAIL;
+    struct member_flush f[d->N];
+    for (int i = 0; i < d->N; i++) {
+        int missing = draid_state(d) != 1 &&
+            ((i == draid_failed_disk(d) && __atomic_load_n(&d->rebuilt, __ATOMIC_ACQUIRE) == 0) ||
+             i == __atomic_load_n(&d->lost, __ATOMIC_ACQUIRE));
+        f[i].disk = missing ? NULL : d->disks[i];
+    }
+    flush_members(f, d->N);
+    int val = SUCCESS;
+    for (int i = 0; i < d->N; i++) {
+        if (f[i].disk == NULL || f[i].val == SUCCESS)
+            continue;
+        if (f[i].val != E_UNAVAIL)
+            val = f[i].val;
+        else if (draid_fail(d, i) == -1)
+            val = E_UNAVAIL;
+    }
+    return val;
+}
+
+static int draid_members(struct blkdev *dev, struct blkdev **out, int max)
+{
+    struct draid_dev *d = dev->private;
+    int n = 0;
+    for (int i = 0; i < d->N && n < max; i++)
+        out[n++] = d->disks[i];
+    return n;
+}
+
+struct blkdev_ops draid_ops = {
+    .num_blocks = draid_num_blocks,
+    .read = draid_read,
+    .write = draid_write,
+    .close = draid_close,
+    .members = draid_members,
+    .type = "draid",
+    .block_size = draid_block_size,
+    .flush = draid_flush
 };
 
-/* Initialize a RAID 4 volume with strip size 'unit', using
- * disks[N-1] as the parity drive. Do not write to the disks - assume
- * that they are properly initialized with correct parity. (warning -
- * some of the grading scripts may fail if you modify data on the
- * drives in this function)
+/* the same base permutations every time, so that the layout only
+ * depends on N
  */
-struct blkdev *raid4_create(int N, struct blkdev *disks[], int unit)
+static void draid_perms(struct draid_dev *d)
 {
-    struct blkdev *dev = malloc(sizeof(*dev));
-    struct raid4_dev *sdev = malloc(sizeof(*sdev));
+    unsigned long long x = 5600;
+    for (int p = 0; p < DRAID_PERMS; p++) {
+        int *perm = d->perm + p * d->N, *inv = d->inv + p * d->N;
+        for (int i = 0; i < d->N; i++)
+            perm[i] = i;
+        for (int i = d->N - 1; i > 0; i--) {
+            x ^= x << 13;
+            x ^= x >> 7;
+            x ^= x << 17;
+            int j = x % (i + 1), t = perm[i];
+            perm[i] = perm[j];
+            perm[j] = t;
+        }
+        for (int i = 0; i < d->N; i++)
+            inv[perm[i]] = i;
+    }
+}
 
-    for (int i = 1; i<N; i++) {
+/* Initialize a declustered parity volume over N disks of the same
+ * size, with stripes of 'width' strips of 'unit' blocks. It needs at
+ * least one more disk than a stripe, for the spare strips; disks
+ * beyond 1 + a multiple of 'width' hold more (unused) spare space.
+ * As for raid4, the disks are assumed to have correct parity.
+ */
+struct blkdev *draid_create(int N, struct blkdev *disks[], int width, int unit)
+{
+    if (width < 2 || unit < 1 || N < width + 1 || N > RAID_MAX_MEMBERS) {
+        printf("Error: a draid needs more disks than its stripe width.\n");
+        return NULL;
+    }
+    for (int i = 1; i < N; i++) {
         if (blkdev_num_blocks(disks[0]) != blkdev_num_blocks(disks[i])) {
             printf("Error: disks size not same.\n");
             return NULL;
         }
     }
-      
-    sdev->disks = disks;
-    sdev->parity = disks[N-1];
-    sdev->state = 1;
-    sdev->disk_failed = -1;
-    sdev->unit = unit;
-    sdev->N = N-1;
-    sdev->nblks = (blkdev_num_blocks(disks[0]) / unit) * unit;
-    dev->private = sdev;
-    dev->ops = &raid4_ops;
+    int bsize = blkdev_common_block_size(disks, N);
+    if (bsize == 0) {
+        printf("Error: disks block size not same.\n");
+        return NULL;
+    }
+    int groups = (N - 1) / width;
+    blkno_t rows = blkdev_num_blocks(disks[0]) / unit, vblks;
+    if (__builtin_mul_overflow(rows, (blkno_t)groups * (width - 1) * unit, &vblks)) {
+        printf("Error: volume too large.\n");
+        return NULL;
+    }
+
+    struct blkdev *dev = calloc(1, sizeof(*dev));
+    struct draid_dev *d = calloc(1, sizeof(*d));
+    d->N = N;
+    d->width = width;
+    d->groups = groups;
+    d->unit = unit;
+    d->bsize = bsize;
+    d->rows = rows;
+    d->nchunks = (rows + DRAID_REBUILD_ROWS - 1) / DRAID_REBUILD_ROWS;
+    d->perm = malloc(DRAID_PERMS * N * sizeof(int));
+    d->inv = malloc(DRAID_PERMS * N * sizeof(int));
+    draid_perms(d);
+    d->disks = disks;
+    d->state = 1;
+    d->disk_failed = -1;
+    d->lost = -1;
+    d->spared = calloc(d->nchunks + 1, 1);
+    range_init(&d->locks);
+    pthread_mutex_init(&d->state_lock, NULL);
+    dev->private = d;
+    dev->ops = &draid_ops;
     return dev;
 }
 
-/* replace failed device 'i' in a RAID 4. Note that we assume
- * the upper layer knows which device failed. You will need to
- * reconstruct content from data and parity before returning
- * from this call.
+struct draid_rebuild_job {
+    struct draid_dev *d;
+    int i;                    /* the member being rebuilt */
+    int prio;
+    blkno_t next;             /* next chunk to take */
+    int val;
+};
+
+/* rebuild member i's strips in one chunk into the spare strips */
+static int draid_spare_chunk(struct draid_dev *d, int i, blkno_t c, char *buf)
+{
+    blkno_t r0 = c * DRAID_REBUILD_ROWS, r1 = r0 + DRAID_REBUILD_ROWS;
+    if (r1 > d->rows)
+        r1 = d->rows;
+    range_lock(&d->locks, r0, r1 - 1, 1);
+    int val = SUCCESS;
+    if (draid_state(d) != 0 || draid_failed_disk(d) != i)
+        val = E_UNAVAIL;
+    for (blkno_t row = r0; row < r1 && val == SUCCESS && !d->spared[c]; row++) {
+        int k = draid_pos(d, row, i);
+        if (k >= d->groups * d->width)
+            continue;           /* a spare or unused strip */
+        int spare = draid_disk(d, row, d->groups * d->width);
+        val = draid_read_strip(d, row, k, 0, d->unit, buf);
+        if (val == SUCCESS && blkdev_write(d->disks[spare], row * d->unit, d->unit, buf) != SUCCESS) {
+            draid_fail(d, spare);
+            val = E_UNAVAIL;
+        }
+    }
+    if (val == SUCCESS) {
+        pthread_mutex_lock(&d->state_lock);
+        if (!d->spared[c]) {
+            __atomic_store_n(&d->spared[c], 1, __ATOMIC_RELEASE);
+            d->nspared++;
+        }
+        pthread_mutex_unlock(&d->state_lock);
+    }
+    range_unlock(&d->locks, r0, r1 - 1);
+    return val;
+}
+
+static void *draid_rebuild_thread(void *arg)
+{
+    struct draid_rebuild_job *j = arg;
+    struct draid_dev *d = j->d;
+    char *buf = malloc((size_t)d->unit * d->bsize);
+    blkdev_set_prio(j->prio);
+    for (;;) {
+        blkno_t c = __atomic_fetch_add(&j->next, 1, __ATOMIC_ACQ_REL);
+        if (c >= d->nchunks || __atomic_load_n(&j->val, __ATOMIC_ACQUIRE) != SUCCESS)
+            break;
+        if (draid_spare_chunk(d, j->i, c, buf) != SUCCESS)
+            __atomic_store_n(&j->val, E_UNAVAIL, __ATOMIC_RELEASE);
+    }
+    free(buf);
+    return NULL;
+}
+
+/* rebuild the failed member into the spare strips, at background
+ * priority, while the volume stays in use. Each chunk is locked while
+ * it is rebuilt, and chunks are taken by DRAID_REBUILD_THREADS threads
+ * in turn, so reads and writes go to every member at once. Chunks
+ * already rebuilt are skipped, so after an error it can be run again.
  */
-int raid4_replace(struct blkdev *volume, int i, struct blkdev *newdisk)
-{    
-    struct raid4_dev * raid4 = (struct raid4_dev*) volume->private;
-    if (blkdev_num_blocks(newdisk) < raid4->nblks){
+int draid_rebuild(struct blkdev *volume)
+{
+    struct draid_dev *d = volume->private;
+    pthread_mutex_lock(&d->state_lock);
+    int i = d->disk_failed, ok = d->state == 0 && !d->busy && d->rebuilt == 0;
+    if (ok)
+        d->busy = 1;
+    pthread_mutex_unlock(&d->state_lock);
+    if (!ok)
+        return E_UNAVAIL;
+
+    struct draid_rebuild_job j = {
+        .d = d, .i = i, .next = 0, .val = SUCCESS,
+        .prio = blkdev_get_prio() == BLKDEV_PRIO_IDLE ? BLKDEV_PRIO_IDLE : BLKDEV_PRIO_BG
+    };
+    int nthreads = d->N - 1 < DRAID_REBUILD_THREADS ? d->N - 1 : DRAID_REBUILD_THREADS;
+    pthread_t threads[DRAID_REBUILD_THREADS];
+    for (int t = 0; t < nthreads; t++)
+        pthread_create(&threads[t], NULL, draid_rebuild_thread, &j);
+    for (int t = 0; t < nthreads; t++)
+        pthread_join(threads[t], NULL);
+
+    pthread_mutex_lock(&d->state_lock);
+    d->busy = 0;
+    pthread_mutex_unlock(&d->state_lock);
+    return j.val;
+}
+
+/* replace member 'i' (failed or not) with 'newdisk', copying its
+ * strips from the spare strips, or rebuilding them from parity where
+ * they aren't spared, in the calling thread at background priority.
+ * Rows already copied are served from the new disk. The old disk goes
+ * back to the caller. If another member was lost after 'i' had been
+ * spared, it is the failed member from then on.
+ */
+int draid_replace(struct blkdev *volume, int i, struct blkdev *newdisk)
+{
+    struct draid_dev *d = volume->private;
+    if (i < 0 || i >= d->N)
+        return E_UNAVAIL;
+    if (blkdev_num_blocks(newdisk) < d->rows * d->unit ||
+        blkdev_block_size(newdisk) != d->bsize)
         return E_SIZE;
+    struct blkdev_prio_opts po;
+    if (blkdev_get_sched(d->disks[i == 0 ? 1 : 0], &po))
+        blkdev_set_sched(newdisk, &po);
+
+    range_lock_all(&d->locks);
+    pthread_mutex_lock(&d->state_lock);
+    int ok = !d->busy && (d->state == 1 || (d->state == 0 && d->disk_failed == i));
+    if (ok) {
+        d->busy = 1;
+        __atomic_store_n(&d->rebuilt, 0, __ATOMIC_RELEASE);
+        __atomic_store_n(&d->disk_failed, i, __ATOMIC_RELEASE);
+        __atomic_store_n(&d->state, 0, __ATOMIC_RELEASE);
+        d->disks[i] = newdisk;
     }
-    char *buf = malloc(blkdev_num_blocks(newdisk) * BLOCK_SIZE);
-    char *free_buf = buf;
-    int row = blkdev_num_blocks(newdisk)/raid4->unit;
-    int LBA = i * raid4->unit;
-    for (int j=0; j<row; j++){
-        raid4_read(volume, LBA+j*raid4->unit*raid4->N, raid4->unit, buf);
-        buf+= raid4->unit * BLOCK_SIZE;
-    }
-    blkdev_write(newdisk, 0, blkdev_num_blocks(newdisk), buf);
-    raid4->disks[i] = newdisk;
-    if (i == raid4->N +1)
-        raid4->parity = newdisk;
-
-    raid4->state = 1;
-    raid4->disk_failed = -1;
-    free(free_buf);
-    return SUCCESS;
-}
+    pthread_mutex_unlock(&d->state_lock);
+    range_unlock_all(&d->locks);
+    if (!ok)
+        return E_UNAVAIL;
+
+    int prio = blkdev_set_prio(BLKDEV_PRIO_BG);
+    if (prio == BLKDEV_PRIO_IDLE)
+        blkdev_set_prio(prio);
+    char *buf = malloc((size_t)d->unit * d->bsize);
+    int val = SUCCESS;
+    for (blkno_t c = 0; c < d->nchunks && val == SUCCESS; c++) {
+        blkno_t r0 = c * DRAID_REBUILD_ROWS, r1 = r0 + DRAID_REBUILD_ROWS;
+        if (r1 > d->rows)
+            r1 = d->rows;
+        range_lock(&d->locks, r0, r1 - 1, 1);
+        if (draid_state(d) != 0 || draid_failed_disk(d) != i)
+            val = E_UNAVAIL;
+        for (blkno_t row = r0; row < r1 && val == SUCCESS; row++) {
+            int k = draid_pos(d, row, i);
+            if (k >= d->groups * d->width)
+                continue;
+            val = draid_read_strip(d, row, k, 0, d->unit, buf);
+            if (val == SUCCESS && blkdev_write(newdisk, row * d->unit, d->unit, buf) != SUCCESS) {
+                draid_fail(d, i);
+                val = E_UNAVAIL;
+            }
+        }
+        if (val == SUCCESS) {
+            pthread_mutex_lock(&d->state_lock);
+            __atomic_store_n(&d->rebuilt, r1, __ATOMIC_RELEASE);
+            if (d->spared[c]) {
+                __atomic_store_n(&d->spared[c], 0, __ATOMIC_RELEASE);
+                d->nspared--;
+            }
+            pthread_mutex_unlock(&d->state_lock);
+        }
+        range_unlock(&d->locks, r0, r1 - 1);
+    }
+    free(buf);
+    blkdev_set_prio(prio);
 
+    range_lock_all(&d->locks);
+    pthread_mutex_lock(&d->state_lock);
+    if (val == SUCCESS && d->state == 0 && d->disk_failed == i) {
+        if (d->lost >= 0) {
+            __atomic_store_n(&d->disk_failed, d->lost, __ATOMIC_RELEASE);
+            __atomic_store_n(&d->lost, -1, __ATOMIC_RELEASE);
+        } else {
+            __atomic_store_n(&d->state, 1, __ATOMIC_RELEASE);
+            __atomic_store_n(&d->disk_failed, -1, __ATOMIC_RELEASE);
+        }
+    } else {
+        val = E_UNAVAIL;
+    }
+    __atomic_store_n(&d->rebuilt, 0, __ATOMIC_RELEASE);
+    d->busy = 0;
+    pthread_mutex_unlock(&d->state_lock);
+    range_unlock_all(&d->locks);
+    return val;
+}
@@ -8,17 +8,20 @@
 
 /* You should not modify this file, but you may be interested to understand the implementation */
 
-#define _XOPEN_SOURCE 600
+#define _GNU_SOURCE             /* fallocate, SEEK_DATA, copy_file_range, pwritev2 */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include <unistd.h>
 #include <fcntl.h>
+#include <time.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 
 #include "blkdev.h"
 
@@ -28,15 +31,36 @@ struct image_dev {
     int   magic;
     char *path;
     int   fd;
-    int   nblks;
+    int   failed;               /* set by image_fail; the fd stays open */
+    int   bsize;                /* bytes per block */
+    blkno_t nblks;
+    int   no_dsync;             /* RWF_DSYNC not supported here */
+
+    /* group commit: syncs are numbered, and a flush waits for one
+     * that started after it did
+     */
+    pthread_mutex_t sync_lock;
+    pthread_cond_t sync_cond;
+    long long sync_started;
+    long long sync_done;
+    long long sync_failed;      /* the last sync that failed, or 0 */
+    int syncing;
 };
 
 int image_devs_open;            /* used for debugging */
 
+/* a failed image keeps its file open until it is closed, since other
+ * threads may still be in the middle of a request on it
+ */
+static int image_failed(struct image_dev *im)
+{
+    return __atomic_load_n(&im->failed, __ATOMIC_ACQUIRE);
+}
+
 int image_test(struct blkdev *dev)
 {
     struct image_dev *im = dev->private;
-    if (im->fd == -1)
+    if (image_failed(im))
         return E_UNAVAIL;
     else
         return 0;
@@ -44,26 +68,32 @@ int image_test(struct blkdev *dev)
 
 /* The blkdev operations - num_blocks, read, write, and close.
  */
-static int image_num_blocks(struct blkdev *dev)
+static blkno_t image_num_blocks(struct blkdev *dev)
 {
     struct image_dev *im = dev->private;
     assert(im != NULL && im->magic == IMAGE_DEV_MAGIC);
     return im->nblks;
 }
 
-static int image_read(struct blkdev *dev, int offset, int len, void *buf)
+static int image_block_size(struct blkdev *dev)
+{
+    struct image_dev *im = dev->private;
+    assert(im != NULL && im->magic == IMAGE_DEV_MAGIC);
+    return im->bsize;
+}
+
+static int image_read(struct blkdev *dev, blkno_t offset, int len, void *buf)
 {
     struct image_dev *im = dev->private;
     assert(im->magic == IMAGE_DEV_MAGIC);
 
-    /* to fail a disk we close its file descriptor and set it to -1 */
-    if (im->fd == -1)
+    if (image_failed(im))
         return E_UNAVAIL;
 
-    if (offset < 0 || offset+len > im->nblks)
+    if (offset < 0 || len < 0 || offset > im->nblks - len)
         return E_BADADDR;
     
-    int result = pread(im->fd, buf, len*BLOCK_SIZE, offset*BLOCK_SIZE);
+    ssize_t result = pread(im->fd, buf, (size_t)len*im->bsize, (off_t)offset*im->bsize);
 
     /* Since I'm not asking for the code that calls this to handle
      * errors other than E_BADADDR and E_UNAVAIL, we report errors and
@@ -74,7 +104,7 @@ static int image_read(struct blkdev *dev, int offset, int len, void *buf)
         fprintf(stderr, "read error on %s: %s\n", im->path, strerror(errno));
         assert(0);
     }
-    if (result != len*BLOCK_SIZE) {
+    if (result != (ssize_t)len*im->bsize) {
         fprintf(stderr, "short read on %s: %s\n", im->path, strerror(errno));
         assert(0);
     }
@@ -82,23 +112,25 @@ static int image_read(struct blkdev *dev, int offset, int len, void *buf)
     return SUCCESS;
 }
 
-static int image_write(struct blkdev * dev, int offset, int len, void *buf)
+/* write with pwritev2 flags; 'flags' is 0 or RWF_DSYNC. EOPNOTSUPP
+ * means the flag is not supported, and nothing was written.
+ */
+static int image_pwrite(struct image_dev *im, blkno_t offset, int len, void *buf, int flags)
 {
-    struct image_dev *im = dev->private;
-    assert(im->magic == IMAGE_DEV_MAGIC);
-
-    /* to fail a disk we close its file descriptor and set it to -1 */
-    if (im->fd == -1)
+    if (image_failed(im))
         return E_UNAVAIL;
 
-    if (offset < 0 || offset+len > im->nblks)
+    if (offset < 0 || len < 0 || offset > im->nblks - len)
         return E_BADADDR;
-    
-    int result = pwrite(im->fd, buf, len*BLOCK_SIZE, offset*BLOCK_SIZE);
+
+    struct iovec iov = {buf, (size_t)len*im->bsize};
+    ssize_t result = pwritev2(im->fd, &iov, 1, (off_t)offset*im->bsize, flags);
+    if (result < 0 && flags != 0 && (errno == EOPNOTSUPP || errno == ENOSYS || errno == EINVAL))
+        return -EOPNOTSUPP;
 
     /* again, report the error and then exit with an assert
      */
-    if (result != len*BLOCK_SIZE) {
+    if (result != (ssize_t)len*im->bsize) {
         fprintf(stderr, "write error on %s: %s\n", im->path, strerror(errno));
         assert(0);
     }
@@ -106,13 +138,163 @@ static int image_write(struct blkdev * dev, int offset, int len, void *buf)
     return SUCCESS;
 }
 
+static int image_write(struct blkdev * dev, blkno_t offset, int len, void *buf)
+{
+    struct image_dev *im = dev->private;
+    assert(im->magic == IMAGE_DEV_MAGIC);
+    return image_pwrite(im, offset, len, buf, 0);
+}
+
+/* Flushes are batched: a flush needs a sync that started after it was
+ * called, so one fdatasync covers every flush that arrived while the
+ * previous one was running. One thread runs it while the others wait.
+ */
+static int image_flush(struct blkdev *dev)
+{
+    struct image_dev *im = dev->private;
+    assert(im->magic == IMAGE_DEV_MAGIC);
+
+    pthread_mutex_lock(&im->sync_lock);
+    long long need = im->sync_started + 1;
+    while (im->sync_done < need) {
+        if (im->syncing) {
+            pthread_cond_wait(&im->sync_cond, &im->sync_lock);
+            continue;
+        }
+        long long gen = ++im->sync_started;
+        int fd = im->fd;
+        im->syncing = 1;
+        pthread_mutex_unlock(&im->sync_lock);
+        int r = image_failed(im) ? -1 : fdatasync(fd);
+        pthread_mutex_lock(&im->sync_lock);
+        if (r != 0)
+            im->sync_failed = gen;
+        im->sync_done = gen;
+        im->syncing = 0;
+        pthread_cond_broadcast(&im->sync_cond);
+    }
+    int val = im->sync_failed >= need ? E_UNAVAIL : SUCCESS;
+    pthread_mutex_unlock(&im->sync_lock);
+    return val;
+}
+
+/* a write through to the disk. Without RWF_DSYNC, a write and a flush
+ * (which other flushes may share).
+ */
+static int image_write_fua(struct blkdev *dev, blkno_t offset, int len, void *buf)
+{
+    struct image_dev *im = dev->private;
+    assert(im->magic == IMAGE_DEV_MAGIC);
+
+    if (!__atomic_load_n(&im->no_dsync, __ATOMIC_RELAXED)) {
+        int val = image_pwrite(im, offset, len, buf, RWF_DSYNC);
+        if (val != -EOPNOTSUPP)
+            return val;
+        __atomic_store_n(&im->no_dsync, 1, __ATOMIC_RELAXED);
+    }
+    int val = image_pwrite(im, offset, len, buf, 0);
+    if (val == SUCCESS)
+        val = image_flush(dev);
+    return val;
+}
+
+/* punch a hole, so the blocks read as zeros and take no space. A file
+ * system that cannot punch holes gets zeros written instead.
+ */
+static int image_discard(struct blkdev *dev, blkno_t offset, blkno_t len)
+{
+    struct image_dev *im = dev->private;
+    assert(im->magic == IMAGE_DEV_MAGIC);
+
+    if (image_failed(im))
+        return E_UNAVAIL;
+
+    if (offset < 0 || len < 0 || offset > im->nblks - len)
+        return E_BADADDR;
+
+    if (fallocate(im->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                  (off_t)offset*im->bsize, (off_t)len*im->bsize) == 0)
+        return SUCCESS;
+
+    char *zeros = calloc(64, im->bsize);
+    int val = SUCCESS;
+    for (blkno_t done = 0; done < len && val == SUCCESS; done += 64) {
+        int n = len - done < 64 ? len - done : 64;
+        val = image_write(dev, offset + done, n, zeros);
+    }
+    free(zeros);
+    return val;
+}
+
+/* holes in the file have never been written (or were discarded) */
+static blkno_t image_next_data(struct blkdev *dev, blkno_t offset)
+{
+    struct image_dev *im = dev->private;
+    assert(im->magic == IMAGE_DEV_MAGIC);
+
+    if (image_failed(im))
+        return offset;          /* let the read find the failure */
+    if (offset >= im->nblks)
+        return im->nblks;
+
+    off_t pos = lseek(im->fd, (off_t)offset*im->bsize, SEEK_DATA);
+    if (pos < 0)
+        return errno == ENXIO ? im->nblks : offset;
+    return pos / im->bsize < im->nblks ? pos / im->bsize : im->nblks;
+}
+
+/* copy between two images in the kernel, which may share the blocks
+ * (reflink) where the file system can. If it will not copy between
+ * these files, copy them through a buffer.
+ */
+static int image_copy(struct blkdev *dev, blkno_t offset, struct blkdev *src,
+                      blkno_t src_offset, blkno_t len)
+{
+    struct image_dev *im = dev->private, *sim = src->private;
+    assert(im->magic == IMAGE_DEV_MAGIC && sim->magic == IMAGE_DEV_MAGIC);
+
+    if (image_failed(im) || image_failed(sim))
+        return E_UNAVAIL;
+
+    if (offset < 0 || len < 0 || offset > im->nblks - len ||
+        src_offset < 0 || src_offset > sim->nblks - len)
+        return E_BADADDR;
+    if (im->bsize != sim->bsize)
+        return E_SIZE;
+
+    loff_t in = (loff_t)src_offset*im->bsize, out = (loff_t)offset*im->bsize;
+    size_t left = (size_t)len*im->bsize;
+    while (left > 0) {
+        ssize_t n = copy_file_range(sim->fd, &in, im->fd, &out, left, 0);
+        if (n <= 0)
+            break;
+        left -= n;
+    }
+    if (left == 0)
+        return SUCCESS;
+
+    /* from the start of the block it stopped in */
+    blkno_t done = len - (left + im->bsize - 1) / im->bsize;
+    char *buf = malloc((size_t)64 * im->bsize);
+    int val = SUCCESS;
+    for (; done < len && val == SUCCESS; done += 64) {
+        int n = len - done < 64 ? len - done : 64;
+        val = image_read(src, src_offset + done, n, buf);
+        if (val == SUCCESS)
+            val = image_write(dev, offset + done, n, buf);
+    }
+    free(buf);
+    return val;
+}
+
 void image_close(struct blkdev *dev)
 {
     struct image_dev *im = dev->private;
     assert(im->magic == IMAGE_DEV_MAGIC);
 
-    if (im->fd != -1)
-        close(im->fd);
+    close(im->fd);
+    pthread_mutex_destroy(&im->sync_lock);
+    pthread_cond_destroy(&im->sync_cond);
     free(im->path);
     free(im);
     dev->private = NULL;        /* crash any attempts to access */
@@ -125,15 +307,28 @@ struct blkdev_ops image_ops = {
     .num_blocks = image_num_blocks,
     .read = image_read,
     .write = image_write,
-    .close = image_close
+    .close = image_close,
+    .type = "image",
+    .discard = image_discard,
+    .next_data = image_next_data,
+    .copy = image_copy,
+    .block_size = image_block_size,
+    .flush = image_flush,
+    .write_fua = image_write_fua
 };
 
-/* create an image blkdev reading from a specified image file.
+/* create an image blkdev reading from a specified image file, in
+ * blocks of 'block_size' bytes.
  */
-struct blkdev *image_create(char *path)
+struct blkdev *image_create_bs(char *path, int block_size)
 {
-    struct blkdev *dev = malloc(sizeof(*dev));
-    struct image_dev *im = malloc(sizeof(*im));
+    if (!blkdev_block_size_ok(block_size)) {
+        printf("Error: bad block size %d.\n", block_size);
+        return NULL;
+    }
+
+    struct blkdev *dev = calloc(1, sizeof(*dev));
+    struct image_dev *im = calloc(1, sizeof(*im));
 
     if (dev == NULL || im == NULL)
         return NULL;
@@ -155,12 +350,15 @@ struct blkdev *image_create(char *path)
      * this isn't a fatal error, as extra bytes beyond the last full
      * block will be ignored by read and write.
      */
-    if (sb.st_size % BLOCK_SIZE != 0)
+    if (sb.st_size % block_size != 0)
         fprintf(stderr, "warning: file %s not a multiple of %d bytes\n",
-                path, BLOCK_SIZE);
+                path, block_size);
     
-    im->nblks = sb.st_size / BLOCK_SIZE;
+    im->bsize = block_size;
+    im->nblks = sb.st_size / block_size;
     im->magic = IMAGE_DEV_MAGIC;
+    pthread_mutex_init(&im->sync_lock, NULL);
+    pthread_cond_init(&im->sync_cond, NULL);
     dev->private = im;
     dev->ops = &image_ops;
 
@@ -169,6 +367,11 @@ struct blkdev *image_create(char *path)
     return dev;
 }
 
+struct blkdev *image_create(char *path)
+{
+    return image_create_bs(path, BLOCK_SIZE);
+}
+
 /* force an image blkdev into failure. after this any further access
  * to that device will return E_UNAVAIL.
  */
@@ -177,23 +380,438 @@ void image_fail(struct blkdev *dev)
     struct image_dev *im = dev->private;
     assert(im->magic == IMAGE_DEV_MAGIC);
 
-    if (im->fd != -1)
-        close(im->fd);
-    im->fd = -1;
+    __atomic_store_n(&im->failed, 1, __ATOMIC_RELEASE);
 }
 
-int blkdev_read(struct blkdev * dev, int first_blk, int num_blks, void *buf){
-    return dev->ops->read(dev, first_blk, num_blks, buf);
+long long image_syncs(struct blkdev *dev)
+{
+    struct image_dev *im = dev->private;
+    assert(im->magic == IMAGE_DEV_MAGIC);
+
+    pthread_mutex_lock(&im->sync_lock);
+    long long n = im->sync_done;
+    pthread_mutex_unlock(&im->sync_lock);
+    return n;
 }
 
-int blkdev_write(struct blkdev * dev, int first_blk, int num_blks, void *buf){
-    return dev->ops->write(dev, first_blk, num_blks, buf);
+/* Statistics. Every read and write through the wrappers below is
+ * counted against the device, with relaxed atomic adds so the hot path
+ * costs two clock reads and a few uncontended increments.
+ */
+static long long stats_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* log-linear: values below BLKDEV_HIST_SUB get a bucket each, then
+ * every power of two is split into BLKDEV_HIST_SUB equal buckets.
+ */
+static int hist_bucket(long long ns)
+{
+    if (ns < BLKDEV_HIST_SUB)
+        return ns < 0 ? 0 : ns;
+    int e = 63 - __builtin_clzll(ns);
+    int b = (e - 1) * BLKDEV_HIST_SUB + ((ns >> (e - 2)) & (BLKDEV_HIST_SUB - 1));
+    return b < BLKDEV_HIST_BUCKETS ? b : BLKDEV_HIST_BUCKETS - 1;
 }
 
-int blkdev_num_blocks(struct blkdev *dev){
+/* largest value that falls in bucket 'b' */
+static long long hist_upper(int b)
+{
+    if (b < BLKDEV_HIST_SUB)
+        return b;
+    int e = b / BLKDEV_HIST_SUB + 1;
+    long long lo = (long long)(BLKDEV_HIST_SUB + b % BLKDEV_HIST_SUB) << (e - 2);
+    return lo + (1LL << (e - 2)) - 1;
+}
+
+static void stats_account(struct blkdev *dev, int dir, blkno_t num_blks,
+                          int val, long long start)
+{
+    struct blkdev_iostats *st = &dev->stats;
+    long long ns = stats_now() - start;
+    if (val != SUCCESS) {
+        __atomic_fetch_add(&st->errors[dir], 1, __ATOMIC_RELAXED);
+        return;
+    }
+    __atomic_fetch_add(&st->ops[dir], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&st->blocks[dir], num_blks, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&st->ns[dir], ns, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&st->hist[dir][hist_bucket(ns)], 1, __ATOMIC_RELAXED);
+}
+
+/* Priority classes. A device with a scheduler (normally a RAID member)
+ * lets background requests through at min_kbps while foreground
+ * requests are using it, and at max_kbps once it has been free of them
+ * for idle_ms; idle-class requests wait for an idle device. The budget
+ * is a token bucket holding at most SCHED_BURST_MS of transfer.
+ */
+#define SCHED_BURST_MS 50
+#define SCHED_POLL_NS  5000000LL
+
+struct blkdev_sched {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;        /* signalled when a device goes quiet */
+    struct blkdev_prio_opts opts;
+    int fg_active;              /* foreground requests in progress */
+    long long last_fg;          /* when the last of them finished */
+    double tokens;              /* background budget, in bytes */
+    long long refill;           /* when 'tokens' was last topped up */
+};
+
+static __thread int blkdev_prio;
+
+int blkdev_set_prio(int prio)
+{
+    int old = blkdev_prio;
+    blkdev_prio = prio;
+    return old;
+}
+
+int blkdev_get_prio(void)
+{
+    return blkdev_prio;
+}
+
+static void sched_wait(struct blkdev_sched *s, long long ns)
+{
+    long long t = stats_now() + ns;
+    struct timespec ts = {t / 1000000000LL, t % 1000000000LL};
+    pthread_cond_timedwait(&s->cond, &s->lock, &ts);
+}
+
+static void sched_begin(struct blkdev_sched *s, double bytes)
+{
+    pthread_mutex_lock(&s->lock);
+    if (blkdev_prio == BLKDEV_PRIO_FG) {
+        s->fg_active++;
+        pthread_mutex_unlock(&s->lock);
+        return;
+    }
+    while (1) {
+        long long now = stats_now();
+        int idle = s->fg_active == 0 &&
+            now - s->last_fg >= s->opts.idle_ms * 1000000LL;
+        int kbps = idle ? s->opts.max_kbps : s->opts.min_kbps;
+        if (blkdev_prio == BLKDEV_PRIO_IDLE && !idle)
+            kbps = 0;
+        if (idle && kbps == 0)
+            break;              /* unlimited */
+        if (kbps > 0) {
+            double rate = kbps * 1000.0 / 1e9;          /* bytes per ns */
+            double burst = kbps * 1000.0 * SCHED_BURST_MS / 1000;
+            double cap = burst > bytes ? burst : bytes;
+            s->tokens += rate * (now - s->refill);
+            if (s->tokens > cap)
+                s->tokens = cap;
+            s->refill = now;
+            if (s->tokens >= bytes) {
+                s->tokens -= bytes;
+                break;
+            }
+            long long ns = (long long)((bytes - s->tokens) / rate);
+            sched_wait(s, ns < SCHED_POLL_NS ? ns : SCHED_POLL_NS);
+        } else {
+            s->refill = now;
+            sched_wait(s, SCHED_POLL_NS);
+        }
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+static void sched_end(struct blkdev_sched *s)
+{
+    if (blkdev_prio != BLKDEV_PRIO_FG)
+        return;
+    pthread_mutex_lock(&s->lock);
+    s->last_fg = stats_now();
+    if (--s->fg_active == 0)
+        pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+}
+
+static void sched_set(struct blkdev *dev, struct blkdev_prio_opts *opts)
+{
+    struct blkdev_sched *s = __atomic_load_n(&dev->sched, __ATOMIC_ACQUIRE);
+    if (s == NULL) {
+        if (opts == NULL)
+            return;
+        struct blkdev_sched *expect = NULL;
+        s = calloc(1, sizeof(*s));
+        pthread_condattr_t attr;
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_mutex_init(&s->lock, NULL);
+        pthread_cond_init(&s->cond, &attr);
+        pthread_condattr_destroy(&attr);
+        s->opts = *opts;
+        s->refill = stats_now();
+        if (__atomic_compare_exchange_n(&dev->sched, &expect, s, 0,
+                                        __ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
+            return;
+        pthread_mutex_destroy(&s->lock);      /* set by another thread */
+        pthread_cond_destroy(&s->cond);
+        free(s);
+        s = expect;
+    }
+    pthread_mutex_lock(&s->lock);
+    if (opts != NULL)
+        s->opts = *opts;
+    else
+        s->opts = (struct blkdev_prio_opts){0};     /* no limits */
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+}
+
+#define MAX_MEMBERS 64
+
+/* set the scheduler of every device at the bottom of 'dev's tree */
+void blkdev_set_sched(struct blkdev *dev, struct blkdev_prio_opts *opts)
+{
+    struct blkdev *members[MAX_MEMBERS];
+    int n = dev->ops->members ? dev->ops->members(dev, members, MAX_MEMBERS) : 0;
+    if (n == 0)
+        sched_set(dev, opts);
+    for (int i = 0; i < n && i < MAX_MEMBERS; i++)
+        blkdev_set_sched(members[i], opts);
+}
+
+int blkdev_get_sched(struct blkdev *dev, struct blkdev_prio_opts *opts)
+{
+    struct blkdev_sched *s = __atomic_load_n(&dev->sched, __ATOMIC_ACQUIRE);
+    if (s == NULL) {
+        /* limits are set at the bottom of a tree: look down it */
+        struct blkdev *member;
+        if (dev->ops->members != NULL && dev->ops->members(dev, &member, 1) == 1)
+            return blkdev_get_sched(member, opts);
+        return 0;
+    }
+    pthread_mutex_lock(&s->lock);
+    *opts = s->opts;
+    pthread_mutex_unlock(&s->lock);
+    return 1;
+}
+
+int blkdev_read(struct blkdev * dev, blkno_t first_blk, int num_blks, void *buf){
+    struct blkdev_sched *s = __atomic_load_n(&dev->sched, __ATOMIC_ACQUIRE);
+    if (s != NULL)
+        sched_begin(s, (double)num_blks * blkdev_block_size(dev));
+    long long start = stats_now();
+    int val = dev->ops->read(dev, first_blk, num_blks, buf);
+    stats_account(dev, BLKDEV_READ, num_blks, val, start);
+    if (s != NULL)
+        sched_end(s);
+    return val;
+}
+
+static int blkdev_do_write(struct blkdev * dev, blkno_t first_blk, int num_blks, void *buf,
+                           int (*write)(struct blkdev *, blkno_t, int, void *)){
+    struct blkdev_sched *s = __atomic_load_n(&dev->sched, __ATOMIC_ACQUIRE);
+    if (s != NULL)
+        sched_begin(s, (double)num_blks * blkdev_block_size(dev));
+    long long start = stats_now();
+    int val = write(dev, first_blk, num_blks, buf);
+    stats_account(dev, BLKDEV_WRITE, num_blks, val, start);
+    if (s != NULL)
+        sched_end(s);
+    return val;
+}
+
+int blkdev_write(struct blkdev * dev, blkno_t first_blk, int num_blks, void *buf){
+    return blkdev_do_write(dev, first_blk, num_blks, buf, dev->ops->write);
+}
+
+/* a device without a flush op flushes what it is built on; the first
+ * error is returned, after all of them have been flushed.
+ */
+int blkdev_flush(struct blkdev * dev){
+    if (dev->ops->flush != NULL)
+        return dev->ops->flush(dev);
+    if (dev->ops->members == NULL)
+        return SUCCESS;
+
+    struct blkdev *members[MAX_MEMBERS];
+    int n = dev->ops->members(dev, members, MAX_MEMBERS);
+    int val = SUCCESS;
+    for (int i = 0; i < n && i < MAX_MEMBERS; i++) {
+        int v = blkdev_flush(members[i]);
+        if (val == SUCCESS)
+            val = v;
+    }
+    return val;
+}
+
+int blkdev_write_fua(struct blkdev * dev, blkno_t first_blk, int num_blks, void *buf){
+    if (dev->ops->write_fua != NULL)
+        return blkdev_do_write(dev, first_blk, num_blks, buf, dev->ops->write_fua);
+    int val = blkdev_write(dev, first_blk, num_blks, buf);
+    if (val == SUCCESS)
+        val = blkdev_flush(dev);
+    return val;
+}
+
+int blkdev_discard(struct blkdev * dev, blkno_t first_blk, blkno_t num_blks){
+    if (dev->ops->discard != NULL)
+        return dev->ops->discard(dev, first_blk, num_blks);
+
+    char *zeros = calloc(64, blkdev_block_size(dev));
+    int val = SUCCESS;
+    for (blkno_t done = 0; done < num_blks && val == SUCCESS; done += 64) {
+        int n = num_blks - done < 64 ? num_blks - done : 64;
+        val = blkdev_write(dev, first_blk + done, n, zeros);
+    }
+    free(zeros);
+    return val;
+}
+
+/* the copy is counted as a read of 'src' and a write of 'dst', and
+ * waits for both devices' schedulers.
+ */
+int blkdev_copy(struct blkdev * dst, blkno_t first_blk, struct blkdev * src,
+                blkno_t src_blk, blkno_t num_blks){
+    int bsize = blkdev_block_size(dst);
+    if (blkdev_block_size(src) != bsize)
+        return E_SIZE;
+    if (dst->ops->copy == NULL || dst->ops != src->ops) {
+        char *buf = malloc((size_t)(num_blks < 256 ? num_blks : 256) * bsize);
+        int val = SUCCESS;
+        for (blkno_t done = 0; done < num_blks && val == SUCCESS; done += 256) {
+            int n = num_blks - done < 256 ? num_blks - done : 256;
+            val = blkdev_read(src, src_blk + done, n, buf);
+            if (val == SUCCESS)
+                val = blkdev_write(dst, first_blk + done, n, buf);
+        }
+        free(buf);
+        return val;
+    }
+
+    struct blkdev_sched *rs = __atomic_load_n(&src->sched, __ATOMIC_ACQUIRE);
+    struct blkdev_sched *ws = __atomic_load_n(&dst->sched, __ATOMIC_ACQUIRE);
+    if (rs != NULL)
+        sched_begin(rs, (double)num_blks * bsize);
+    if (ws != NULL)
+        sched_begin(ws, (double)num_blks * bsize);
+    long long start = stats_now();
+    int val = dst->ops->copy(dst, first_blk, src, src_blk, num_blks);
+    stats_account(src, BLKDEV_READ, num_blks, val, start);
+    stats_account(dst, BLKDEV_WRITE, num_blks, val, start);
+    if (ws != NULL)
+        sched_end(ws);
+    if (rs != NULL)
+        sched_end(rs);
+    return val;
+}
+
+blkno_t blkdev_next_data(struct blkdev * dev, blkno_t first_blk){
+    if (dev->ops->next_data == NULL)
+        return first_blk;
+    return dev->ops->next_data(dev, first_blk);
+}
+
+blkno_t blkdev_num_blocks(struct blkdev *dev){
     return dev->ops->num_blocks(dev);
 }
+
+int blkdev_block_size(struct blkdev *dev){
+    if (dev->ops->block_size == NULL)
+        return BLOCK_SIZE;
+    return dev->ops->block_size(dev);
+}
+
+int blkdev_block_size_ok(int size){
+    return size >= BLOCK_SIZE && size <= BLKDEV_MAX_BLOCK_SIZE && (size & (size - 1)) == 0;
+}
+
+int blkdev_common_block_size(struct blkdev **devs, int n){
+    int size = n > 0 ? blkdev_block_size(devs[0]) : BLOCK_SIZE;
+    for (int i = 1; i < n; i++) {
+        if (blkdev_block_size(devs[i]) != size)
+            return 0;
+    }
+    return size;
+}
     
 void blkdev_close(struct blkdev *dev){
+    struct blkdev_sched *s = dev->sched;
     dev->ops->close(dev);
+    if (s != NULL) {
+        pthread_mutex_destroy(&s->lock);
+        pthread_cond_destroy(&s->cond);
+        free(s);
+    }
+}
+
+static void stats_walk(struct blkdev *dev, int depth, blkdev_stats_fn fn, void *arg)
+{
+    struct blkdev_iostats snap;
+    long long *src = (long long *)&dev->stats, *dst = (long long *)&snap;
+    for (int i = 0; i < (int)(sizeof(snap) / sizeof(long long)); i++)
+        dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+    fn(dev, depth, &snap, arg);
+
+    if (dev->ops->members == NULL)
+        return;
+    struct blkdev *members[MAX_MEMBERS];
+    int n = dev->ops->members(dev, members, MAX_MEMBERS);
+    for (int i = 0; i < n && i < MAX_MEMBERS; i++)
+        stats_walk(members[i], depth + 1, fn, arg);
+}
+
+void blkdev_stats(struct blkdev *dev, blkdev_stats_fn fn, void *arg)
+{
+    stats_walk(dev, 0, fn, arg);
+}
+
+long long blkdev_stats_percentile(struct blkdev_iostats *st, int dir, double pct)
+{
+    long long total = 0, seen = 0;
+    for (int b = 0; b < BLKDEV_HIST_BUCKETS; b++)
+        total += st->hist[dir][b];
+    if (total == 0)
+        return 0;
+    long long want = (long long)(total * pct / 100.0);
+    if (want >= total)
+        want = total - 1;
+    for (int b = 0; b < BLKDEV_HIST_BUCKETS; b++) {
+        seen += st->hist[dir][b];
+        if (seen > want)
+            return hist_upper(b);
+    }
+    return hist_upper(BLKDEV_HIST_BUCKETS - 1);
+}
+
+static void print_one(struct blkdev *dev, int depth, struct blkdev_iostats *st, void *arg)
+{
+    const char *type = dev->ops->type ? dev->ops->type : "?";
+    printf("%*s%-*s", 2*depth, "", 10 - 2*depth > 0 ? 10 - 2*depth : 0, type);
+    for (int dir = BLKDEV_READ; dir <= BLKDEV_WRITE; dir++) {
+        long long avg = st->ops[dir] ? st->ns[dir] / st->ops[dir] : 0;
+        printf(" | %8lld %9lld %4lld %8.1f %8.1f %8.1f", st->ops[dir],
+               st->blocks[dir], st->errors[dir], avg / 1e3,
+               blkdev_stats_percentile(st, dir, 50) / 1e3,
+               blkdev_stats_percentile(st, dir, 99) / 1e3);
+    }
+    printf("\n");
+}
+
+void blkdev_stats_print(struct blkdev *dev)
+{
+    printf("%-10s | %8s %9s %4s %8s %8s %8s | %8s %9s %4s %8s %8s %8s\n", "device",
+           "reads", "blocks", "errs", "avg us", "p50 us", "p99 us",
+           "writes", "blocks", "errs", "avg us", "p50 us", "p99 us");
+    blkdev_stats(dev, print_one, NULL);
+}
+
+static void reset_one(struct blkdev *dev, int depth, struct blkdev_iostats *st, void *arg)
+{
+    long long *p = (long long *)&dev->stats;
+    for (int i = 0; i < (int)(sizeof(dev->stats) / sizeof(long long)); i++)
+        __atomic_store_n(&p[i], 0, __ATOMIC_RELAXED);
+}
+
+void blkdev_stats_reset(struct blkdev *dev)
+{
+    blkdev_stats(dev, reset_one, NULL);
 }
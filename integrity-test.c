@@ -0,0 +1,258 @@
+#include "blkdev.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+#include <pthread.h>
+#include <time.h>
+
+#define DISK_BLKS 1024
+#define DATA_BLKS 1016          /* 8 blocks of checksums after them */
+#define UNIT 4
+
+/* every block holds "seq:lba" */
+void fill_block(char *buf, int seq, blkno_t lba){
+	memset(buf, 0, BLOCK_SIZE);
+	sprintf(buf, "%d:%lld", seq, lba);
+}
+
+void write_range(struct blkdev *dev, blkno_t lba, int len, int seq){
+	char buf[64*BLOCK_SIZE];
+	for (int i = 0; i < len; i++)
+		fill_block(&buf[i*BLOCK_SIZE], seq, lba + i);
+	if (blkdev_write(dev, lba, len, buf) != SUCCESS) {
+		printf("Write at %lld failed!\n", lba);
+		exit(1);
+	}
+}
+
+void check_range(struct blkdev *dev, blkno_t lba, int len, int seq){
+	char buf[64*BLOCK_SIZE], expect[BLOCK_SIZE];
+	if (blkdev_read(dev, lba, len, buf) != SUCCESS) {
+		printf("Read at %lld failed!\n", lba);
+		exit(1);
+	}
+	for (int i = 0; i < len; i++) {
+		fill_block(expect, seq, lba + i);
+		if (memcmp(&buf[i*BLOCK_SIZE], expect, BLOCK_SIZE) != 0) {
+			printf("Block %lld doesn't match: %s, expected %s\n",
+			       lba + i, &buf[i*BLOCK_SIZE], expect);
+			exit(1);
+		}
+	}
+}
+
+void write_all(struct blkdev *dev, int seq){
+	blkno_t n = blkdev_num_blocks(dev);
+	for (blkno_t lba = 0; lba < n; lba += 32)
+		write_range(dev, lba, n - lba < 32 ? n - lba : 32, seq);
+}
+
+void check_all(struct blkdev *dev, int seq){
+	blkno_t n = blkdev_num_blocks(dev);
+	for (blkno_t lba = 0; lba < n; lba += 32)
+		check_range(dev, lba, n - lba < 32 ? n - lba : 32, seq);
+}
+
+/* flip a byte of a block behind the checksum layer's back */
+void corrupt(struct blkdev *disk, blkno_t lba){
+	char buf[BLOCK_SIZE];
+	assert(blkdev_read(disk, lba, 1, buf) == SUCCESS);
+	buf[100] ^= 0x20;
+	assert(blkdev_write(disk, lba, 1, buf) == SUCCESS);
+}
+
+void crc_tests(void){
+	char zeros[32] = {0}, buf[4096];
+	assert(crc32c(0, "123456789", 9) == 0xe3069283);
+	assert(crc32c(0, zeros, 32) == 0x8a9136aa);
+	for (int i = 0; i < (int)sizeof(buf); i++)
+		buf[i] = i * 7 + (i >> 5);
+	/* in pieces, from any alignment */
+	unsigned int whole = crc32c(0, buf + 3, 4000);
+	assert(crc32c(crc32c(0, buf + 3, 1001), buf + 1004, 2999) == whole);
+
+	int n = 64 << 20;
+	char *big = malloc(n);
+	memset(big, 0x5a, n);
+	struct timespec t0, t1;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	unsigned int c = 0;
+	for (int off = 0; off < n; off += 4096)
+		c ^= crc32c(0, big + off, 4096);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	printf("crc32c: %.0f MB/s (%08x)\n", n / secs / 1e6, c);
+	free(big);
+	printf("crc32c test passed\n");
+}
+
+void layer_tests(void){
+	struct blkdev *disk = ramdisk_create(DISK_BLKS);
+	struct blkdev *dev = integrity_create(disk);
+	char buf[10*BLOCK_SIZE], zeros[BLOCK_SIZE] = {0};
+	assert(blkdev_num_blocks(dev) == DATA_BLKS);
+	assert(blkdev_read(dev, DATA_BLKS - 1, 2, buf) == E_BADADDR);
+	assert(blkdev_read(dev, 500, 1, buf) == SUCCESS);        /* never written */
+	assert(memcmp(buf, zeros, BLOCK_SIZE) == 0);
+
+	write_all(dev, 1);
+	check_all(dev, 1);
+	/* across a metadata block boundary: the neighbours keep their checksums */
+	write_range(dev, 120, 20, 2);
+	check_range(dev, 100, 20, 1);
+	check_range(dev, 120, 20, 2);
+	check_range(dev, 140, 20, 1);
+
+	corrupt(disk, 130);
+	corrupt(disk, 131);
+	assert(blkdev_read(dev, 125, 10, buf) == E_CORRUPT);
+	assert(integrity_errors(dev) == 2);
+	check_range(dev, 132, 8, 2);
+	write_range(dev, 130, 2, 3);
+	check_range(dev, 130, 2, 3);
+
+	/* discarded blocks read as zeros, with no checksum to match */
+	assert(blkdev_discard(dev, 200, 300) == SUCCESS);
+	for (blkno_t lba = 200; lba < 500; lba += 50) {
+		assert(blkdev_read(dev, lba, 1, buf) == SUCCESS);
+		assert(memcmp(buf, zeros, BLOCK_SIZE) == 0);
+	}
+	check_range(dev, 500, 16, 1);
+	assert(integrity_errors(dev) == 2);
+	blkdev_close(dev);
+	printf("integrity layer test passed\n");
+}
+
+struct blkdev *new_member(struct blkdev **raw){
+	*raw = ramdisk_create(DISK_BLKS);
+	return integrity_create(*raw);
+}
+
+void mirror_tests(void){
+	struct blkdev *raw[2], *sides[2];
+	for (int i = 0; i < 2; i++)
+		sides[i] = new_member(&raw[i]);
+	struct blkdev *vol = mirror_create(sides);
+	write_all(vol, 1);
+	corrupt(raw[0], 10);
+	corrupt(raw[0], 700);
+	check_all(vol, 1);
+	assert(integrity_errors(sides[0]) == 2 && integrity_errors(sides[1]) == 0);
+
+	/* the bad blocks were written back */
+	char buf[BLOCK_SIZE];
+	for (blkno_t lba = 0; lba < DATA_BLKS; lba++)
+		assert(blkdev_read(sides[0], lba, 1, buf) == SUCCESS);
+	assert(integrity_errors(sides[0]) == 2);
+
+	/* the same block bad on both sides can't be fixed */
+	corrupt(raw[0], 50);
+	corrupt(raw[1], 50);
+	assert(blkdev_read(vol, 50, 1, buf) == E_CORRUPT);
+	check_range(vol, 51, 32, 1);
+	write_range(vol, 50, 1, 2);
+	check_range(vol, 50, 1, 2);
+	blkdev_close(vol);
+	printf("mirror repair test passed\n");
+}
+
+/* volume block 'lba' of a raid4 of n data disks: which member, where */
+blkno_t raid4_member_lba(blkno_t lba, int n, int *disk){
+	*disk = (lba / UNIT) % n;
+	return lba / (UNIT * n) * UNIT + lba % UNIT;
+}
+
+void raid4_tests(void){
+	struct blkdev *raw[4], *members[4];
+	for (int i = 0; i < 4; i++)
+		members[i] = new_member(&raw[i]);
+	struct blkdev *vol = raid4_create(4, members, UNIT);
+	write_all(vol, 1);
+
+	int d;
+	blkno_t m = raid4_member_lba(101, 3, &d);
+	corrupt(raw[d], m);
+	corrupt(raw[3], 40);            /* parity */
+	check_all(vol, 1);
+	long long errs = integrity_errors(members[d]);
+	assert(errs == 1);
+	check_range(vol, 96, 8, 1);
+	assert(integrity_errors(members[d]) == errs);    /* written back */
+
+	/* a partial write rebuilds the row's parity, bad or not */
+	write_range(vol, 40 / UNIT * UNIT * 3 + 1, 2, 2);
+	char buf[8*BLOCK_SIZE];
+	assert(blkdev_read(members[3], 40, 1, buf) == SUCCESS);
+
+	/* the scrub finds bad strips nobody has read, parity included */
+	m = raid4_member_lba(555, 3, &d);
+	corrupt(raw[d], m);
+	corrupt(raw[3], 800);
+	struct raid4_scrub_opts opts = {.repair = 1};
+	struct raid4_scrub_status st;
+	struct raid4_scrub *sc = raid4_scrub_start(vol, &opts);
+	do {
+		usleep(1000);
+		raid4_scrub_status(sc, &st);
+	} while (st.running);
+	assert(st.error == SUCCESS && st.mismatches == 2 && st.repaired == 2);
+	assert(raid4_scrub_stop(sc, 1) == SUCCESS);
+	for (int i = 0; i < 4; i++)
+		for (blkno_t lba = 0; lba < DATA_BLKS; lba += 8)
+			assert(blkdev_read(members[i], lba, 8, buf) == SUCCESS);
+
+	/* degraded, a bad block has nothing to be rebuilt from */
+	ramdisk_fail(raw[0]);
+	check_range(vol, 0, 32, 1);
+	m = raid4_member_lba(13, 3, &d);
+	assert(d == 0);
+	corrupt(raw[1], m);
+	assert(blkdev_read(vol, 12, 4, buf) == E_CORRUPT);
+	assert(blkdev_write(vol, 12, 1, buf) == E_CORRUPT);
+	check_range(vol, 64, 32, 1);
+	blkdev_close(vol);
+	printf("raid4 repair test passed\n");
+}
+
+/* writers of neighbouring blocks share metadata blocks */
+struct writer {
+	struct blkdev *dev;
+	int id;
+};
+
+void *writer_thread(void *arg){
+	struct writer *w = arg;
+	for (int pass = 0; pass < 20; pass++)
+		for (blkno_t lba = w->id; lba < DATA_BLKS; lba += 8)
+			write_range(w->dev, lba, 1, pass);
+	return NULL;
+}
+
+void concurrent_test(void){
+	struct blkdev *dev = integrity_create(ramdisk_create(DISK_BLKS));
+	struct writer w[8];
+	pthread_t t[8];
+	for (int i = 0; i < 8; i++) {
+		w[i].dev = dev;
+		w[i].id = i;
+		pthread_create(&t[i], NULL, writer_thread, &w[i]);
+	}
+	for (int i = 0; i < 8; i++)
+		pthread_join(t[i], NULL);
+	check_all(dev, 19);
+	assert(integrity_errors(dev) == 0);
+	blkdev_close(dev);
+	printf("concurrent writers test passed\n");
+}
+
+int main(){
+	crc_tests();
+	layer_tests();
+	mirror_tests();
+	raid4_tests();
+	concurrent_test();
+	printf("integrity tests passed.\n");
+	return 0;
+}
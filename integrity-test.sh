@@ -0,0 +1,3 @@
+#!/bin/sh
+
+gcc -g3 -o integrity-test integrity-test.c image.c homework.c journal.c integrity.c ramdisk.c -lpthread -lm
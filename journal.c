@@ -0,0 +1,316 @@
+/*
+ * file:        journal.c
+ * description: parity journal (write-intent log) for raid4
+ *
+ * A crash between writing the data strips of a row and its parity
+ * leaves the parity stale. Before a row is written it is logged as
+ * in-flight; after a crash only the logged rows need their parity
+ * recomputed.
+ *
+ * The journal device holds a header block followed by a ring of
+ * record blocks. Each record is a complete snapshot of the in-flight
+ * set, so recovery only needs the newest valid record. Rows stay in
+ * the logged set until the next record is written, so repeated writes
+ * to the same rows cost no journal I/O at all; and concurrent callers
+ * needing new rows logged share a single record write (group commit).
+ * A record that drops rows is only written once the volume has made
+ * their data and parity durable (the 'sync' callback), or a crash
+ * could leave a row marked clean while its parity never reached disk.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "journal.h"
+
+#define PJ_MAGIC      0x504a524e
+#define PJ_REC_MAGIC  0x504a5243
+
+struct pj_header {
+    int magic;
+    int nrows;
+    int nslots;
+};
+
+struct pj_record {
+    int magic;
+    int count;
+    long long seq;
+    unsigned int sum;
+    int rows[];
+};
+
+/* a record is one block of the journal device */
+#define PJ_REC_ROWS(bsize) (((bsize) - (int)sizeof(struct pj_record)) / (int)sizeof(int))
+
+struct pjournal {
+    struct blkdev *dev;
+    int bsize;                   /* block size of 'dev' */
+    int rec_rows;                /* rows that fit in a record */
+    int nrows;
+    int nslots;
+    long long seq;               /* sequence number of the last record */
+    pjournal_sync_fn sync;       /* flushes the volume's members */
+    void *sync_arg;
+
+    int *active;                 /* writers in flight, per row */
+    char *logged;                /* row is in the last durable record */
+    int *loglist;                /* ... and the list of those rows */
+    int nlogged;
+    int nactive;                 /* logged rows with writers in flight */
+    char *want;                  /* row is waiting for the next record */
+    int *wanted;
+    int nwanted;
+
+    int committing;
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+};
+
+static unsigned int pj_sum(struct pj_record *r)
+{
+    unsigned int h = 2166136261u;
+    h = (h ^ (unsigned int)r->count) * 16777619u;
+    h = (h ^ (unsigned int)r->seq) * 16777619u;
+    h = (h ^ (unsigned int)(r->seq >> 32)) * 16777619u;
+    for (int i = 0; i < r->count; i++)
+        h = (h ^ (unsigned int)r->rows[i]) * 16777619u;
+    return h;
+}
+
+/* write a record holding every row that is in flight or waiting. Rows
+ * that have completed since the last record drop out here, after the
+ * volume is flushed. Called with the lock held and no record being
+ * written; drops the lock around the flush and the device write.
+ */
+static int write_record(struct pjournal *j)
+{
+    char *buf = calloc(1, j->bsize);
+    struct pj_record *r = (struct pj_record *)buf;
+
+    int retired = 0;
+    for (int i = 0; i < j->nlogged; i++) {
+        int row = j->loglist[i];
+        if (j->active[row] > 0) {
+            r->rows[r->count++] = row;
+        } else {
+            j->logged[row] = 0;
+            retired++;
+        }
+    }
+    int first_new = r->count;
+    for (int i = 0; i < j->nwanted; i++)
+        r->rows[r->count++] = j->wanted[i];
+    j->nwanted = 0;
+    j->nlogged = r->count;
+    memcpy(j->loglist, r->rows, r->count * sizeof(int));
+
+    r->magic = PJ_REC_MAGIC;
+    r->seq = ++j->seq;
+    r->sum = pj_sum(r);
+
+    /* the new rows only count as logged once the record is on disk,
+     * so it is written through the device's cache
+     */
+    j->committing = 1;
+    pthread_mutex_unlock(&j->lock);
+    int val = SUCCESS;
+    if (retired > 0 && j->sync != NULL)
+        val = j->sync(j->sync_arg);
+    if (val == SUCCESS)
+        val = blkdev_write_fua(j->dev, 1 + r->seq % j->nslots, 1, buf);
+    pthread_mutex_lock(&j->lock);
+    for (int i = first_new; i < r->count; i++) {
+        j->want[r->rows[i]] = 0;
+        j->logged[r->rows[i]] = (val == SUCCESS);
+    }
+    j->committing = 0;
+    pthread_cond_broadcast(&j->done);
+    free(buf);
+    return val;
+}
+
+int pjournal_capacity(struct pjournal *j)
+{
+    return j->rec_rows / 2;
+}
+
+/* Rows are only counted as in flight once all of them are logged, so
+ * a caller waiting here never holds up the record it is waiting for.
+ */
+int pjournal_begin(struct pjournal *j, int first_row, int n)
+{
+    int val = SUCCESS;
+    pthread_mutex_lock(&j->lock);
+
+    while (val == SUCCESS) {
+        int missing = 0, unlogged = 0;
+        for (int row = first_row; row < first_row + n; row++) {
+            if (!j->logged[row]) {
+                unlogged++;
+                if (!j->want[row])
+                    missing++;
+            }
+        }
+
+        if (unlogged == 0) {
+            for (int row = first_row; row < first_row + n; row++) {
+                if (j->active[row]++ == 0)
+                    j->nactive++;
+            }
+            break;
+        }
+
+        if (missing > 0) {
+            if (j->nlogged + j->nwanted + missing <= j->rec_rows) {
+                for (int row = first_row; row < first_row + n; row++) {
+                    if (!j->logged[row] && !j->want[row]) {
+                        j->want[row] = 1;
+                        j->wanted[j->nwanted++] = row;
+                    }
+                }
+            } else if (!j->committing &&
+                       (j->nwanted > 0 || j->nlogged > j->nactive)) {
+                /* no room - a new record drops the completed rows */
+                val = write_record(j);
+                continue;
+            } else {
+                pthread_cond_wait(&j->done, &j->lock);
+                continue;
+            }
+        }
+
+        /* whoever finds no record in progress writes one for everyone
+         * waiting; the others wait for it (or the one after it).
+         */
+        if (j->committing)
+            pthread_cond_wait(&j->done, &j->lock);
+        else
+            val = write_record(j);
+    }
+
+    pthread_mutex_unlock(&j->lock);
+    return val;
+}
+
+void pjournal_end(struct pjournal *j, int row)
+{
+    pthread_mutex_lock(&j->lock);
+    if (--j->active[row] == 0) {
+        j->nactive--;
+        pthread_cond_broadcast(&j->done);
+    }
+    pthread_mutex_unlock(&j->lock);
+}
+
+struct blkdev *pjournal_device(struct pjournal *j)
+{
+    return j->dev;
+}
+
+void pjournal_free(struct pjournal *j)
+{
+    pthread_mutex_destroy(&j->lock);
+    pthread_cond_destroy(&j->done);
+    free(j->active);
+    free(j->logged);
+    free(j->loglist);
+    free(j->want);
+    free(j->wanted);
+    free(j);
+}
+
+void pjournal_close(struct pjournal *j)
+{
+    pthread_mutex_lock(&j->lock);
+    while (j->committing)
+        pthread_cond_wait(&j->done, &j->lock);
+    write_record(j);            /* nothing in flight - an empty record */
+    pthread_mutex_unlock(&j->lock);
+
+    blkdev_close(j->dev);
+    pjournal_free(j);
+}
+
+struct pjournal *pjournal_open(struct blkdev *dev, int nrows,
+                               pjournal_sync_fn sync, void *sync_arg,
+                               int **replay, int *nreplay)
+{
+    int nslots = blkdev_num_blocks(dev) - 1;
+    if (nslots < 2) {
+        printf("Error: journal device too small.\n");
+        return NULL;
+    }
+
+    struct pjournal *j = calloc(1, sizeof(*j));
+    j->dev = dev;
+    j->bsize = blkdev_block_size(dev);
+    j->rec_rows = PJ_REC_ROWS(j->bsize);
+    j->nrows = nrows;
+    j->nslots = nslots;
+    j->sync = sync;
+    j->sync_arg = sync_arg;
+    j->active = calloc(nrows, sizeof(int));
+    j->logged = calloc(nrows, 1);
+    j->loglist = malloc(j->rec_rows * sizeof(int));
+    j->want = calloc(nrows, 1);
+    j->wanted = malloc(j->rec_rows * sizeof(int));
+    pthread_mutex_init(&j->lock, NULL);
+    pthread_cond_init(&j->done, NULL);
+
+    *replay = NULL;
+    *nreplay = 0;
+
+    char *buf = malloc(j->bsize), *rbuf = malloc(j->bsize);
+    struct pj_header *h = (struct pj_header *)buf;
+    if (blkdev_read(dev, 0, 1, buf) != SUCCESS)
+        goto fail;
+
+    if (h->magic == PJ_MAGIC && (h->nrows != nrows || h->nslots != nslots)) {
+        /* formatting it would lose the rows it still has to replay */
+        printf("Error: parity journal is for %d rows in %d slots.\n", h->nrows, h->nslots);
+        goto fail;
+    } else if (h->magic == PJ_MAGIC) {
+        /* find the newest intact record */
+        struct pj_record *r = (struct pj_record *)rbuf;
+        int best = -1;
+        for (int s = 0; s < nslots; s++) {
+            if (blkdev_read(dev, 1 + s, 1, rbuf) != SUCCESS)
+                goto fail;
+            if (r->magic != PJ_REC_MAGIC || r->count < 0 ||
+                r->count > j->rec_rows || r->sum != pj_sum(r))
+                continue;
+            if (r->seq > j->seq) {
+                j->seq = r->seq;
+                best = s;
+            }
+        }
+        if (best >= 0) {
+            blkdev_read(dev, 1 + best, 1, rbuf);
+            *replay = malloc((r->count + 1) * sizeof(int));
+            for (int i = 0; i < r->count; i++) {
+                if (r->rows[i] >= 0 && r->rows[i] < nrows)
+                    (*replay)[(*nreplay)++] = r->rows[i];
+            }
+        }
+    } else {
+        memset(buf, 0, j->bsize);
+        h->magic = PJ_MAGIC;
+        h->nrows = nrows;
+        h->nslots = nslots;
+        if (blkdev_write(dev, 0, 1, buf) != SUCCESS)
+            goto fail;
+    }
+    free(buf);
+    free(rbuf);
+    return j;
+
+fail:
+    free(buf);
+    free(rbuf);
+    free(*replay);
+    *replay = NULL;
+    pjournal_free(j);
+    return NULL;
+}
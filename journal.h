@@ -0,0 +1,50 @@
+/*
+ * file:        journal.h
+ * description: parity journal (write-intent log) used by raid4
+ */
+#ifndef __JOURNAL_H__
+#define __JOURNAL_H__
+
+#include "blkdev.h"
+
+struct pjournal;
+
+/* make everything written to the volume's members so far durable */
+typedef int (*pjournal_sync_fn)(void *arg);
+
+/* Open the journal on 'dev' for a volume of 'nrows' rows. Rows that
+ * may have been left with stale parity by a crash are returned in
+ * '*replay' (malloc'd, caller frees) and '*nreplay'. A device with no
+ * journal is formatted; one with a journal of another geometry is
+ * refused (NULL). 'sync' is
+ * called before a record that drops completed rows is written.
+ */
+extern struct pjournal *pjournal_open(struct blkdev *dev, int nrows,
+                                      pjournal_sync_fn sync, void *sync_arg,
+                                      int **replay, int *nreplay);
+
+/* Largest number of rows that may be begun at once */
+extern int pjournal_capacity(struct pjournal *j);
+
+/* Make sure rows first_row..first_row+n-1 are durably logged as
+ * in-flight before their data and parity are written.
+ */
+extern int pjournal_begin(struct pjournal *j, int first_row, int n);
+
+/* Mark a row's data and parity as written. The row leaves the on-disk
+ * log lazily, the next time a record is written.
+ */
+extern void pjournal_end(struct pjournal *j, int row);
+
+/* The device holding the journal */
+extern struct blkdev *pjournal_device(struct pjournal *j);
+
+/* Record a clean shutdown and close the journal device. The volume's
+ * members must still be open, to be synced first.
+ */
+extern void pjournal_close(struct pjournal *j);
+
+/* Release the journal without writing to or closing its device */
+extern void pjournal_free(struct pjournal *j);
+
+#endif
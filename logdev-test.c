@@ -0,0 +1,148 @@
+#include "blkdev.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+
+void write1(struct blkdev* dev,int addr,int len,int seq,int *array){
+	char buf[len*BLOCK_SIZE];
+
+	for (int i = 0; i< len; i++) {
+		sprintf(&buf[i*BLOCK_SIZE], "%d", seq);
+		array[addr + i] = seq;
+	}
+	if (blkdev_write(dev, addr, len, buf) != SUCCESS){
+        printf("Write failed!\n");
+        exit(0);
+    }
+}
+
+void verify(struct blkdev* dev,int addr,int len,int *array) {
+	char buf[len*BLOCK_SIZE];
+	if (blkdev_read(dev, addr, len, buf) != SUCCESS){
+        printf("Read failed!\n");
+        exit(0);
+    }
+
+    for (int i = 0; i < len; i++)
+    {
+    	assert(atoi(&buf[i*BLOCK_SIZE]) == array[addr + i]);
+    }
+}
+
+void random_write1(struct blkdev* dev,int seq,int *array, int max) {
+	int addr = rand() % max;
+	int len = rand() % 8 + 1;
+	if (addr + len > max)
+		len = max - addr;
+	write1(dev, addr, len, seq, array);
+}
+
+struct blkdev *  create_new_image(char * path, int blocks){
+    if (blocks < 1){
+        printf("create_new_image: error - blocks must be at least 1: %d\n", blocks);
+        return NULL;
+    }
+    FILE * image = fopen(path, "w");
+    fseek(image, blocks * BLOCK_SIZE - 1, SEEK_SET);
+    char c = 0;
+    fwrite(&c, 1, 1, image);
+    fclose(image);
+
+    return image_create(path);
+}
+
+/* raid4 of 5 disks x 256 blocks, unit 4 -> 1024 blocks, stripe 16 */
+struct blkdev *open_log(struct blkdev **drives, int create){
+	char name[16];
+	for (int j = 0; j < 5; j++){
+		sprintf(name, "log_r4_%d", j);
+		drives[j] = create ? create_new_image(name, 256) : image_create(name);
+	}
+	struct blkdev *raid4 = raid4_create(5, drives, 4);
+	return logdev_create(raid4, 16);
+}
+
+int main(){
+	struct blkdev *drives[5];
+	struct blkdev *log = open_log(drives, 1);
+	assert(log != NULL);
+
+	int max = blkdev_num_blocks(log);
+	assert(max > 0 && max < 1024);
+	int *array = calloc(max, sizeof(int));
+	int seq = 1;
+
+	/* a fresh log reads as zeros */
+	verify(log, 0, max, array);
+
+	/* write several times the capacity so the cleaner has to run */
+	for (int i = 0; i < 2000; i++)
+	{
+		random_write1(log, seq, array, max);
+		seq++;
+	}
+	verify(log, 0, max, array);
+	printf("log write test passed\n");
+
+	/* clean close writes a checkpoint */
+	blkdev_close(log);
+	log = open_log(drives, 0);
+	assert(log != NULL && blkdev_num_blocks(log) == max);
+	verify(log, 0, max, array);
+	printf("log checkpoint test passed\n");
+
+	/* "crash" without closing: segments written since the checkpoint
+	 * are rolled forward; only the unwritten open segment is lost.
+	 */
+	assert(logdev_sync(log) == SUCCESS);
+	int *old = malloc(max * sizeof(int));
+	memcpy(old, array, max * sizeof(int));
+	int count = 300;
+	for (int i = 0; i < count; i++)
+		write1(log, i, 1, seq, array);
+	seq++;
+
+	/* the crashed instance's cleaner must not write behind the new one */
+	for (int j = 0; j < 5; j++)
+		image_fail(drives[j]);
+	log = open_log(drives, 0);
+	assert(log != NULL);
+	char buf[BLOCK_SIZE];
+	int recovered = 0;
+	for (int i = 0; i < max; i++) {
+		assert(blkdev_read(log, i, 1, buf) == SUCCESS);
+		int v = atoi(buf);
+		if (i < count && v == array[i] && v != old[i]) {
+			assert(recovered == i);     /* a prefix of the writes */
+			recovered++;
+		} else {
+			assert(v == old[i]);
+		}
+	}
+	assert(recovered > count - 64);
+	printf("log roll-forward test passed\n");
+
+	/* a log of another geometry is refused, not overwritten */
+	char *before = malloc((size_t)max * BLOCK_SIZE);
+	assert(blkdev_read(log, 0, max, before) == SUCCESS);
+	blkdev_close(log);
+	char name[16];
+	for (int j = 0; j < 5; j++) {
+		sprintf(name, "log_r4_%d", j);
+		drives[j] = image_create(name);
+	}
+	struct blkdev *raid4 = raid4_create(5, drives, 4);
+	assert(logdev_create(raid4, 48) == NULL);
+	blkdev_close(raid4);
+	log = open_log(drives, 0);
+	assert(log != NULL);
+	char *after = malloc((size_t)max * BLOCK_SIZE);
+	assert(blkdev_read(log, 0, max, after) == SUCCESS);
+	assert(memcmp(before, after, (size_t)max * BLOCK_SIZE) == 0);
+	blkdev_close(log);
+	printf("log geometry test passed\n");
+
+	printf("logdev tests passed.\n");
+}
@@ -0,0 +1,3 @@
+#!/bin/sh
+
+gcc -g3 -o logdev-test logdev-test.c image.c homework.c journal.c logdev.c -lpthread
@@ -0,0 +1,677 @@
+/*
+ * file:        logdev.c
+ * description: log-structured remapping layer - turns random writes
+ *              into full-stripe segment writes on a parity volume
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include <limits.h>
+#include "blkdev.h"
+
+/* Layout of the underlying volume:
+ *
+ *   checkpoint A | checkpoint B | segment 0 | segment 1 | ...
+ *
+ * Each checkpoint region holds a header block followed by the logical
+ * to physical map and the write sequence number of every segment. The
+ * two regions are written alternately; on startup the valid one with
+ * the highest sequence number is loaded, and segments written after
+ * it are rolled forward from their summary blocks.
+ *
+ * A segment is a whole number of full stripes, so writing one never
+ * needs a parity pre-read. Its last 'sum_blks' blocks are the summary:
+ * a header plus the logical address of each data block.
+ */
+#define LOG_CP_MAGIC     0x4c4f4743
+#define LOG_SUM_MAGIC    0x4c4f4753
+#define LOG_MIN_SEG      64       /* minimum segment size, in blocks */
+#define LOG_OP_PCT       20       /* space held back for the cleaner */
+#define LOG_CP_INTERVAL  64       /* segments between checkpoints */
+#define LOG_CP_OTHER     -2       /* read_checkpoint: another geometry's */
+
+struct log_cp_hdr {
+    int magic;
+    int nblks;
+    int nsegs;
+    int seg_blks;
+    long long seq;               /* checkpoint number */
+    long long next_seg_seq;      /* first segment not in this checkpoint */
+    unsigned int sum;            /* checksum of map and segment table */
+    unsigned int hdr_sum;
+};
+
+struct log_sum_hdr {
+    int magic;
+    int nent;
+    long long seq;
+    unsigned int data_sum;       /* checksum of the data blocks */
+    unsigned int hdr_sum;
+};
+
+struct log_dev {
+    struct blkdev *vol;
+    int bsize;                   /* block size of the volume, and of ours */
+    int stripe;
+    int nblks;                   /* logical size */
+    int nsegs;
+    int seg_blks;
+    int seg_data;                /* data blocks per segment */
+    int sum_blks;
+    int cp_blks;                 /* size of one checkpoint region */
+    int seg_start;               /* first block of segment 0 */
+
+    int *map;                    /* logical -> physical, or -1 */
+    int *live;                   /* live blocks per segment */
+    long long *segseq;           /* sequence number each segment was written */
+    int nfree;
+    long long next_seq;          /* sequence number of the next segment */
+    long long cp_seq;
+    int segs_since_cp;
+
+    int open_seg;                /* segment being filled in memory */
+    int fill;
+    char *segbuf;                /* data + summary of the open segment */
+    int *seglba;                 /* points into the segbuf summary */
+
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_t cleaner;
+    int stop;
+};
+
+static unsigned int log_sum(void *p, int len)
+{
+    unsigned int *w = p, h = 2166136261u;
+    for (int i = 0; i < len / 4; i++)
+        h = (h ^ w[i]) * 16777619u;
+    return h;
+}
+
+static int seg_addr(struct log_dev *l, int seg)
+{
+    return l->seg_start + seg * l->seg_blks;
+}
+
+static int phys_seg(struct log_dev *l, int phys)
+{
+    return (phys - l->seg_start) / l->seg_blks;
+}
+
+static blkno_t log_num_blocks(struct blkdev *dev)
+{
+    struct log_dev *l = dev->private;
+    return l->nblks;
+}
+
+static int log_block_size(struct blkdev *dev)
+{
+    struct log_dev *l = dev->private;
+    return l->bsize;
+}
+
+/********** checkpoints ***************/
+
+static int cp_map_blks(struct log_dev *l)
+{
+    return ((long long)l->nblks * sizeof(int) + l->bsize - 1) / l->bsize;
+}
+
+static int cp_seq_blks(struct log_dev *l)
+{
+    return ((long long)l->nsegs * sizeof(long long) + l->bsize - 1) / l->bsize;
+}
+
+/* write the map and segment table to the older checkpoint region, then
+ * its header. A crash part way through leaves the other region intact.
+ */
+static int write_checkpoint(struct log_dev *l)
+{
+    int mb = cp_map_blks(l), sb = cp_seq_blks(l);
+    int body = mb + sb;
+    char *buf = calloc(1 + body, l->bsize);
+    struct log_cp_hdr *h = (struct log_cp_hdr *)buf;
+
+    memcpy(buf + l->bsize, l->map, l->nblks * sizeof(int));
+    memcpy(buf + (1 + mb) * l->bsize, l->segseq, l->nsegs * sizeof(long long));
+
+    h->magic = LOG_CP_MAGIC;
+    h->nblks = l->nblks;
+    h->nsegs = l->nsegs;
+    h->seg_blks = l->seg_blks;
+    h->seq = l->cp_seq + 1;
+    h->next_seg_seq = l->next_seq;
+    h->sum = log_sum(buf + l->bsize, body * l->bsize);
+    h->hdr_sum = log_sum(h, sizeof(*h) - sizeof(unsigned int));
+
+    int base = (h->seq & 1) * l->cp_blks;
+    int val = blkdev_write(l->vol, base + 1, body, buf + l->bsize);
+    if (val == SUCCESS)
+        val = blkdev_write(l->vol, base, 1, buf);
+    if (val == SUCCESS) {
+        l->cp_seq = h->seq;
+        l->segs_since_cp = 0;
+    }
+    free(buf);
+    return val;
+}
+
+/* read and validate checkpoint region 'which'. Returns the checkpoint
+ * sequence number, -1 if the region does not hold a checkpoint, or
+ * LOG_CP_OTHER if it holds one for another geometry.
+ */
+static long long read_checkpoint(struct log_dev *l, int which, char *buf)
+{
+    int body = cp_map_blks(l) + cp_seq_blks(l);
+    struct log_cp_hdr *h = (struct log_cp_hdr *)buf;
+
+    if (blkdev_read(l->vol, which * l->cp_blks, 1 + body, buf) != SUCCESS)
+        return -1;
+    if (h->magic != LOG_CP_MAGIC ||
+        h->hdr_sum != log_sum(h, sizeof(*h) - sizeof(unsigned int)))
+        return -1;
+    if (h->nblks != l->nblks || h->nsegs != l->nsegs || h->seg_blks != l->seg_blks)
+        return LOG_CP_OTHER;
+    if (h->sum != log_sum(buf + l->bsize, body * l->bsize))
+        return -1;
+    return h->seq;
+}
+
+/********** segments ***************/
+
+static void open_segment(struct log_dev *l, int seg)
+{
+    l->open_seg = seg;
+    l->fill = 0;
+    memset(l->segbuf, 0, l->seg_blks * l->bsize);
+    l->nfree--;
+}
+
+/* write the open segment (padding it if it is not full) and account
+ * for it in the segment table.
+ */
+static int write_segment(struct log_dev *l)
+{
+    char *sum = l->segbuf + l->seg_data * l->bsize;
+    struct log_sum_hdr *h = (struct log_sum_hdr *)sum;
+
+    h->magic = LOG_SUM_MAGIC;
+    h->nent = l->fill;
+    h->seq = l->next_seq;
+    h->data_sum = log_sum(l->segbuf, l->fill * l->bsize);
+    h->hdr_sum = log_sum(h, sizeof(*h) - sizeof(unsigned int));
+
+    int val = blkdev_write(l->vol, seg_addr(l, l->open_seg), l->seg_blks, l->segbuf);
+    if (val != SUCCESS)
+        return val;
+    l->segseq[l->open_seg] = l->next_seq++;
+    l->segs_since_cp++;
+    return SUCCESS;
+}
+
+static int pick_free(struct log_dev *l)
+{
+    for (int s = 0; s < l->nsegs; s++)
+        if (l->live[s] == 0 && s != l->open_seg)
+            return s;
+    return -1;
+}
+
+static int clean_one(struct log_dev *l);
+
+/* the background cleaner tries to keep this many segments free */
+static int clean_target(struct log_dev *l)
+{
+    return l->nsegs * LOG_OP_PCT / 200 + 2;
+}
+
+/* close the open segment and start a new one. 'reserve' free segments
+ * are kept back for the cleaner, which calls this with reserve 0.
+ */
+static int next_segment(struct log_dev *l, int reserve)
+{
+    int val = write_segment(l);
+    if (val != SUCCESS)
+        return val;
+
+    /* segments with no live data are free, so finishing a segment
+     * whose blocks were all overwritten returns it straight away.
+     */
+    if (l->live[l->open_seg] == 0)
+        l->nfree++;
+
+    int seg = pick_free(l);
+    if (seg < 0) {
+        printf("Error: log device full.\n");
+        return E_SIZE;
+    }
+    open_segment(l, seg);
+
+    if (l->segs_since_cp >= LOG_CP_INTERVAL) {
+        val = write_checkpoint(l);
+        if (val != SUCCESS)
+            return val;
+    }
+
+    /* the cleaner relocates into the new open segment */
+    while (l->nfree < reserve) {
+        val = clean_one(l);
+        if (val != SUCCESS)
+            return val;
+    }
+    if (l->nfree < clean_target(l))
+        pthread_cond_signal(&l->wake);
+    return SUCCESS;
+}
+
+/* append one block to the open segment, remapping 'lba' to it.
+ */
+static int append_block(struct log_dev *l, int lba, char *data, int reserve)
+{
+    int old = l->map[lba];
+    int base = seg_addr(l, l->open_seg);
+
+    if (old >= base && old < base + l->fill) {
+        /* still in memory - overwrite in place */
+        memcpy(l->segbuf + (old - base) * l->bsize, data, l->bsize);
+        return SUCCESS;
+    }
+    if (old >= 0) {
+        int s = phys_seg(l, old);
+        if (--l->live[s] == 0)
+            l->nfree++;
+    }
+    memcpy(l->segbuf + l->fill * l->bsize, data, l->bsize);
+    l->seglba[l->fill] = lba;
+    l->map[lba] = base + l->fill;
+    l->live[l->open_seg]++;
+    l->fill++;
+
+    if (l->fill == l->seg_data)
+        return next_segment(l, reserve);
+    return SUCCESS;
+}
+
+/* cost-benefit victim selection: prefer segments that are mostly
+ * empty and have not been written for a long time, since their
+ * remaining live blocks are unlikely to be overwritten soon.
+ */
+static int pick_victim(struct log_dev *l)
+{
+    int best = -1;
+    double best_score = -1;
+    for (int s = 0; s < l->nsegs; s++) {
+        if (s == l->open_seg || l->live[s] == 0 || l->live[s] == l->seg_data)
+            continue;
+        double u = (double)l->live[s] / l->seg_data;
+        double age = (double)(l->next_seq - l->segseq[s]);
+        double score = (1 - u) * age / (1 + u);
+        if (score > best_score) {
+            best_score = score;
+            best = s;
+        }
+    }
+    return best;
+}
+
+/* copy the live blocks of one victim segment into the open segment,
+ * freeing the victim.
+ */
+static int clean_one(struct log_dev *l)
+{
+    int victim = pick_victim(l);
+    if (victim < 0) {
+        printf("Error: log device full.\n");
+        return E_SIZE;
+    }
+
+    char *buf = malloc(l->seg_blks * l->bsize);
+    int base = seg_addr(l, victim);
+    int val = blkdev_read(l->vol, base, l->seg_blks, buf);
+    int *lbas = (int *)(buf + l->seg_data * l->bsize + sizeof(struct log_sum_hdr));
+    int nent = ((struct log_sum_hdr *)(buf + l->seg_data * l->bsize))->nent;
+
+    for (int i = 0; val == SUCCESS && i < nent && l->live[victim] > 0; i++) {
+        if (l->map[lbas[i]] == base + i)
+            val = append_block(l, lbas[i], buf + i * l->bsize, 0);
+    }
+    free(buf);
+    return val;
+}
+
+static void *cleaner_thread(void *arg)
+{
+    struct log_dev *l = arg;
+    pthread_mutex_lock(&l->lock);
+    while (!l->stop) {
+        /* nearly full segments are left for the foreground, which
+         * only cleans when it runs out of room.
+         */
+        int victim = pick_victim(l);
+        if (l->nfree >= clean_target(l) || victim < 0 ||
+            l->live[victim] > l->seg_data * 3 / 4) {
+            pthread_cond_wait(&l->wake, &l->lock);
+            continue;
+        }
+        if (clean_one(l) != SUCCESS)
+            pthread_cond_wait(&l->wake, &l->lock);
+    }
+    pthread_mutex_unlock(&l->lock);
+    return NULL;
+}
+
+/********** blkdev operations ***************/
+
+static int log_read(struct blkdev *dev, blkno_t first_blk, int num_blks, void *buf)
+{
+    struct log_dev *l = dev->private;
+    int val = SUCCESS;
+
+    if (first_blk < 0 || num_blks < 0 || first_blk > l->nblks - num_blks)
+        return E_BADADDR;
+
+    pthread_mutex_lock(&l->lock);
+    int base = seg_addr(l, l->open_seg);
+    int i = 0;
+    while (i < num_blks && val == SUCCESS) {
+        int p = l->map[first_blk + i];
+        int len = 1;
+        if (p < 0) {
+            memset(buf, 0, l->bsize);
+        } else if (p >= base && p < base + l->fill) {
+            memcpy(buf, l->segbuf + (p - base) * l->bsize, l->bsize);
+        } else {
+            while (i + len < num_blks && l->map[first_blk + i + len] == p + len)
+                len++;
+            val = blkdev_read(l->vol, p, len, buf);
+        }
+        buf += len * l->bsize;
+        i += len;
+    }
+    pthread_mutex_unlock(&l->lock);
+    return val;
+}
+
+static int log_write(struct blkdev *dev, blkno_t first_blk, int num_blks, void *buf)
+{
+    struct log_dev *l = dev->private;
+    int val = SUCCESS;
+
+    if (first_blk < 0 || num_blks < 0 || first_blk > l->nblks - num_blks)
+        return E_BADADDR;
+
+    pthread_mutex_lock(&l->lock);
+    for (int i = 0; i < num_blks && val == SUCCESS; i++)
+        val = append_block(l, first_blk + i, (char *)buf + i * l->bsize, 2);
+    pthread_mutex_unlock(&l->lock);
+    return val;
+}
+
+/* write out the partly filled open segment and a checkpoint, so that
+ * everything written so far is on the underlying volume.
+ */
+int logdev_sync(struct blkdev *dev)
+{
+    struct log_dev *l = dev->private;
+    int val = SUCCESS;
+
+    pthread_mutex_lock(&l->lock);
+    if (l->fill > 0)
+        val = next_segment(l, 0);
+    if (val == SUCCESS)
+        val = write_checkpoint(l);
+    pthread_mutex_unlock(&l->lock);
+    return val;
+}
+
+/* a flush makes the log device durable by syncing it, then the volume */
+static int log_flush(struct blkdev *dev)
+{
+    struct log_dev *l = dev->private;
+    int val = logdev_sync(dev);
+    if (val == SUCCESS)
+        val = blkdev_flush(l->vol);
+    return val;
+}
+
+static void log_free(struct log_dev *l)
+{
+    free(l->map);
+    free(l->live);
+    free(l->segseq);
+    free(l->segbuf);
+    free(l);
+}
+
+static void log_close(struct blkdev *dev)
+{
+    struct log_dev *l = dev->private;
+
+    pthread_mutex_lock(&l->lock);
+    l->stop = 1;
+    pthread_cond_signal(&l->wake);
+    pthread_mutex_unlock(&l->lock);
+    pthread_join(l->cleaner, NULL);
+
+    logdev_sync(dev);
+    blkdev_close(l->vol);
+    pthread_mutex_destroy(&l->lock);
+    pthread_cond_destroy(&l->wake);
+    log_free(l);
+    dev->private = NULL;
+    free(dev);
+}
+
+static int log_members(struct blkdev *dev, struct blkdev **out, int max)
+{
+    struct log_dev *l = dev->private;
+    if (max < 1)
+        return 0;
+    out[0] = l->vol;
+    return 1;
+}
+
+struct blkdev_ops log_ops = {
+    .num_blocks = log_num_blocks,
+    .read = log_read,
+    .write = log_write,
+    .close = log_close,
+    .members = log_members,
+    .type = "logdev",
+    .block_size = log_block_size,
+    .flush = log_flush
+};
+
+/********** startup ***************/
+
+struct seg_order {
+    long long seq;
+    int seg;
+};
+
+static int cmp_seq(const void *a, const void *b)
+{
+    long long x = ((const struct seg_order *)a)->seq;
+    long long y = ((const struct seg_order *)b)->seq;
+    return (x > y) - (x < y);
+}
+
+/* apply segments written after the checkpoint, oldest first.
+ */
+static int roll_forward(struct log_dev *l, long long from_seq)
+{
+    char *buf = malloc(l->seg_blks * l->bsize);
+    struct seg_order *found = malloc(l->nsegs * sizeof(*found));
+    int n = 0, val = SUCCESS;
+
+    for (int s = 0; s < l->nsegs; s++) {
+        char *sum = buf;
+        struct log_sum_hdr *h = (struct log_sum_hdr *)sum;
+        val = blkdev_read(l->vol, seg_addr(l, s) + l->seg_data, l->sum_blks, sum);
+        if (val != SUCCESS)
+            goto out;
+        if (h->magic != LOG_SUM_MAGIC || h->seq < from_seq ||
+            h->hdr_sum != log_sum(h, sizeof(*h) - sizeof(unsigned int)))
+            continue;
+        found[n].seq = h->seq;
+        found[n].seg = s;
+        n++;
+    }
+    qsort(found, n, sizeof(*found), cmp_seq);
+
+    for (int k = 0; k < n; k++) {
+        int s = found[k].seg, base = seg_addr(l, s);
+        struct log_sum_hdr *h = (struct log_sum_hdr *)(buf + l->seg_data * l->bsize);
+        int *lbas = (int *)(h + 1);
+        val = blkdev_read(l->vol, base, l->seg_blks, buf);
+        if (val != SUCCESS)
+            goto out;
+        /* a torn segment write ends the log */
+        if (h->data_sum != log_sum(buf, h->nent * l->bsize))
+            break;
+        for (int i = 0; i < h->nent; i++) {
+            if (lbas[i] >= 0 && lbas[i] < l->nblks)
+                l->map[lbas[i]] = base + i;
+        }
+        l->segseq[s] = h->seq;
+        l->next_seq = h->seq + 1;
+    }
+out:
+    free(found);
+    free(buf);
+    return val;
+}
+
+/* load the newest checkpoint (if any) and roll the log forward.
+ */
+static int log_mount(struct log_dev *l)
+{
+    int body = cp_map_blks(l) + cp_seq_blks(l);
+    char *buf[2] = {malloc((1 + body) * l->bsize), malloc((1 + body) * l->bsize)};
+    long long seq[2];
+    int val = SUCCESS;
+
+    for (int i = 0; i < l->nblks; i++)
+        l->map[i] = -1;
+    memset(l->segseq, 0, l->nsegs * sizeof(long long));
+    l->next_seq = 1;
+    l->cp_seq = 0;
+
+    seq[0] = read_checkpoint(l, 0, buf[0]);
+    seq[1] = read_checkpoint(l, 1, buf[1]);
+    int w = seq[1] > seq[0];
+    if (seq[w] <= 0 && (seq[0] == LOG_CP_OTHER || seq[1] == LOG_CP_OTHER)) {
+        /* starting empty would overwrite that log */
+        struct log_cp_hdr *h = (struct log_cp_hdr *)buf[seq[0] == LOG_CP_OTHER ? 0 : 1];
+        printf("Error: volume holds a log of %d blocks in %d segments of %d blocks.\n",
+               h->nblks, h->nsegs, h->seg_blks);
+        val = E_SIZE;
+    } else if (seq[w] > 0) {
+        struct log_cp_hdr *h = (struct log_cp_hdr *)buf[w];
+        memcpy(l->map, buf[w] + l->bsize, l->nblks * sizeof(int));
+        memcpy(l->segseq, buf[w] + (1 + cp_map_blks(l)) * l->bsize,
+               l->nsegs * sizeof(long long));
+        l->cp_seq = h->seq;
+        l->next_seq = h->next_seg_seq;
+        val = roll_forward(l, h->next_seg_seq);
+    } else {
+        /* a new log: checkpoint both regions, so that region 0 (whose
+         * place doesn't depend on the geometry) always says what the
+         * log's geometry is
+         */
+        val = write_checkpoint(l);
+        if (val == SUCCESS)
+            val = write_checkpoint(l);
+    }
+
+    /* live counts follow from the map */
+    memset(l->live, 0, l->nsegs * sizeof(int));
+    for (int i = 0; i < l->nblks; i++)
+        if (l->map[i] >= 0)
+            l->live[phys_seg(l, l->map[i])]++;
+    l->nfree = 0;
+    for (int s = 0; s < l->nsegs; s++)
+        if (l->live[s] == 0)
+            l->nfree++;
+
+    free(buf[0]);
+    free(buf[1]);
+    return val;
+}
+
+/* create a log-structured device on 'vol', a parity volume whose full
+ * stripe is 'stripe' blocks (unit*(N-1) for raid4). A fixed fraction
+ * of the volume is held back so the cleaner always has room to work.
+ * An existing log with the same geometry is mounted; a log of another
+ * geometry (e.g. a different 'stripe') is refused, returning NULL.
+ * Otherwise the device starts out empty (all blocks read as zero).
+ */
+struct blkdev *logdev_create(struct blkdev *vol, int stripe)
+{
+    blkno_t vblks = blkdev_num_blocks(vol);
+    if (stripe < 1)
+        stripe = 1;
+
+    /* the map and the segment summaries hold int block numbers */
+    if (vblks > INT_MAX) {
+        printf("Error: volume too large for a log device.\n");
+        return NULL;
+    }
+
+    struct log_dev *l = calloc(1, sizeof(*l));
+    l->vol = vol;
+    l->bsize = blkdev_block_size(vol);
+    l->stripe = stripe;
+    l->seg_blks = ((LOG_MIN_SEG + stripe - 1) / stripe) * stripe;
+
+    /* summary: header plus one lba per data block */
+    l->sum_blks = 1;
+    while (1) {
+        l->seg_data = l->seg_blks - l->sum_blks;
+        int need = (sizeof(struct log_sum_hdr) + l->seg_data * sizeof(int)
+                    + l->bsize - 1) / l->bsize;
+        if (need <= l->sum_blks)
+            break;
+        l->sum_blks = need;
+    }
+
+    /* size the checkpoint for the largest possible map, then fit as
+     * many segments as remain.
+     */
+    l->nsegs = vblks / l->seg_blks;
+    l->nblks = (long long)l->nsegs * l->seg_data * (100 - LOG_OP_PCT) / 100;
+    l->cp_blks = 1 + cp_map_blks(l) + cp_seq_blks(l);
+    l->seg_start = ((2 * l->cp_blks + stripe - 1) / stripe) * stripe;
+    l->nsegs = (vblks - l->seg_start) / l->seg_blks;
+    l->nblks = (long long)l->nsegs * l->seg_data * (100 - LOG_OP_PCT) / 100;
+    if (l->nsegs < 4 || l->nblks < 1) {
+        printf("Error: volume too small for a log device.\n");
+        free(l);
+        return NULL;
+    }
+
+    l->map = malloc((size_t)l->nblks * sizeof(int));
+    l->live = malloc(l->nsegs * sizeof(int));
+    l->segseq = malloc(l->nsegs * sizeof(long long));
+    l->segbuf = malloc(l->seg_blks * l->bsize);
+    l->seglba = (int *)(l->segbuf + l->seg_data * l->bsize + sizeof(struct log_sum_hdr));
+
+    l->open_seg = -1;
+    if (log_mount(l) != SUCCESS) {
+        log_free(l);
+        return NULL;
+    }
+    open_segment(l, pick_free(l));
+
+    pthread_mutex_init(&l->lock, NULL);
+    pthread_cond_init(&l->wake, NULL);
+    pthread_create(&l->cleaner, NULL, cleaner_thread, l);
+
+    struct blkdev *dev = calloc(1, sizeof(*dev));
+    dev->private = l;
+    dev->ops = &log_ops;
+    return dev;
+}
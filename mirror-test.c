@@ -37,6 +37,15 @@ struct blkdev *  create_new_image(char * path, int blocks){
     return image_create(path);
 }
 
+int failures, failed_side = -1;
+
+void count_failures(void *arg, int event, int member, blkno_t mark){
+    if (event == RAID_EV_FAILED) {
+        failures++;
+        failed_side = member;
+    }
+}
+
 /* Write a buffer to a file for debugging purposes */
 void dump(char* buffer, int length, char* path){
     FILE * output = fopen(path, "w");
@@ -45,7 +54,7 @@ void dump(char* buffer, int length, char* path){
 }
 
 int main(){
-    struct blkdev* mirror_drives[3];
+    struct blkdev* mirror_drives[4];
     /* Create two images for the mirror */
     mirror_drives[0] = create_new_image("mirror1", 4);
     mirror_drives[1] = create_new_image("mirror2", 4);
@@ -169,6 +178,7 @@ int main(){
 
     mirror_drives[3] = create_new_image("mirror3", 4);
     mirror_replace(mirror, 0, mirror_drives[3]);
+    mirror_drives[0] = mirror_drives[3];
 
     bzero(read_buffer, BLOCK_SIZE);
     if (blkdev_read(mirror, 0, 1, read_buffer) != SUCCESS){
@@ -234,4 +244,46 @@ int main(){
     }
 
 
+    /* the same reads with hedging turned on */
+    struct blkdev *hedge_drives[2];
+    hedge_drives[0] = create_new_image("mirror1", 4);
+    hedge_drives[1] = create_new_image("mirror2", 4);
+    mirror = mirror_create(hedge_drives);
+    struct hedge_opts hopts = {.enable = 1, .min_us = 0};
+    mirror_set_hedge(mirror, &hopts);
+    write_data_char(write_buffer_A, BLOCK_SIZE, 'H');
+    for (int i = 0; i < 4; i++) {
+        if (blkdev_write(mirror, i, 1, write_buffer_A) != SUCCESS){
+            printf("Write failed!\n");
+            exit(0);
+        }
+    }
+    for (int i = 0; i < 4; i++) {
+        bzero(read_buffer, BLOCK_SIZE);
+        if (blkdev_read(mirror, i, 1, read_buffer) != SUCCESS ||
+            memcmp(write_buffer_A, read_buffer, BLOCK_SIZE) != 0){
+            printf("Hedged read doesn't match write!\n");
+            exit(0);
+        }
+    }
+
+    /* a side that fails under hedged reads is flagged, even though
+     * the other side answers every read
+     */
+    mirror_set_notify(mirror, count_failures, NULL);
+    image_fail(hedge_drives[0]);
+    long long hedged_before, hedged, won;
+    mirror_hedge_stats(mirror, &hedged_before, &won);
+    for (int i = 0; i < 200; i++) {
+        if (blkdev_read(mirror, i % 4, 1, read_buffer) != SUCCESS ||
+            memcmp(write_buffer_A, read_buffer, BLOCK_SIZE) != 0){
+            printf("Hedged read after failure doesn't match write!\n");
+            exit(0);
+        }
+    }
+    mirror_hedge_stats(mirror, &hedged, &won);
+    assert(failures == 1 && failed_side == 0);
+    assert(hedged - hedged_before < 200);
+    blkdev_close(mirror);
+    printf("Mirror hedged read passed\n");
 }
@@ -1,3 +1,3 @@
 #!/bin/sh
 
-gcc -g3 -o mirror-test mirror-test.c image.c homework.c
+gcc -g3 -o mirror-test mirror-test.c image.c homework.c journal.c -lpthread
@@ -0,0 +1,96 @@
+/*
+ * file:        nbd-server.c
+ * description: export a volume to NBD clients
+ *
+ *   nbd-server [volume options] [-S socket | -P port] [-e name]
+ *              [-t workers] [-q requests per client] [-O] [-v]
+ *
+ * Serves on a Unix socket, or a TCP port on 127.0.0.1, until
+ * interrupted; then closes the volume. -O exports it read-only. For
+ * example
+ *
+ *   nbd-server -l raid4 -R -S /tmp/raid4.sock &
+ *   nbd-client -unix /tmp/raid4.sock /dev/nbd0
+ *   fio --ioengine=nbd --uri='nbd+unix:///?socket=/tmp/raid4.sock' ...
+ */
+#include "blkdev.h"
+#include "nbd.h"
+#include "volspec.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+
+static struct nbd_server *server;
+
+static void on_signal(int sig)
+{
+	nbd_server_stop(server);
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: nbd-server " VOLSPEC_USAGE "\n"
+		"       [-S socket | -P port] [-e name] [-t workers] [-q requests per client]\n"
+		"       [-O] [-v]\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct volspec spec;
+	struct nbd_opts opts = {0};
+	int verbose = 0;
+	volspec_init(&spec, "nbd_disk");
+
+	int c;
+	while ((c = getopt(argc, argv, VOLSPEC_OPTS "S:P:e:t:q:Ov")) != -1) {
+		if (volspec_option(&spec, c, optarg))
+			continue;
+		switch (c) {
+		case 'S': opts.path = optarg; break;
+		case 'P': opts.port = atoi(optarg); break;
+		case 'e': opts.name = optarg; break;
+		case 't': opts.workers = atoi(optarg); break;
+		case 'q': opts.max_inflight = atoi(optarg); break;
+		case 'O': opts.read_only = 1; break;
+		case 'v': verbose = 1; break;
+		default: usage();
+		}
+	}
+	if (optind != argc || (opts.path == NULL && opts.port == 0))
+		usage();
+
+	struct blkdev *vol = volspec_build(&spec);
+	if (vol == NULL)
+		return 1;
+	opts.serialize = spec.serialize;
+	server = nbd_server_create(vol, &opts);
+	if (server == NULL) {
+		blkdev_close(vol);
+		return 1;
+	}
+
+	struct sigaction sa = {.sa_handler = on_signal};
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	if (opts.path != NULL)
+		printf("serving %s (%lld blocks of %d bytes) on %s\n", spec.level,
+		       blkdev_num_blocks(vol), blkdev_block_size(vol), opts.path);
+	else
+		printf("serving %s (%lld blocks of %d bytes) on 127.0.0.1:%d\n", spec.level,
+		       blkdev_num_blocks(vol), blkdev_block_size(vol), nbd_server_port(server));
+	fflush(stdout);
+
+	int val = nbd_server_run(server);
+	struct nbd_stats st;
+	nbd_server_stats(server, &st);
+	nbd_server_destroy(server);
+	printf("%lld clients, %lld requests (%lld errors), %lld bytes read, %lld written\n",
+	       st.clients, st.requests, st.errors, st.bytes_read, st.bytes_written);
+	if (verbose)
+		blkdev_stats_print(vol);
+	blkdev_close(vol);
+	return val == SUCCESS ? 0 : 1;
+}
@@ -0,0 +1,461 @@
+#include "blkdev.h"
+#include "nbd.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <endian.h>
+#include <unistd.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define DISK_BLKS 1024
+#define UNIT 4
+#define SOCK "nbd-test.sock"
+
+/* a bare-bones client, with blocking sockets */
+
+void send_all(int fd, const void *buf, size_t len){
+	assert(send(fd, buf, len, MSG_NOSIGNAL) == (ssize_t)len);
+}
+
+/* 0 at end of file */
+int recv_all(int fd, void *buf, size_t len){
+	for (size_t got = 0; got < len; ) {
+		ssize_t n = recv(fd, (char *)buf + got, len - got, 0);
+		if (n <= 0)
+			return 0;
+		got += n;
+	}
+	return 1;
+}
+
+uint64_t recv64(int fd){
+	uint64_t v;
+	assert(recv_all(fd, &v, 8));
+	return be64toh(v);
+}
+
+uint32_t recv32(int fd){
+	uint32_t v;
+	assert(recv_all(fd, &v, 4));
+	return be32toh(v);
+}
+
+uint16_t recv16(int fd){
+	uint16_t v;
+	assert(recv_all(fd, &v, 2));
+	return be16toh(v);
+}
+
+int connect_unix(void){
+	struct sockaddr_un sun = {.sun_family = AF_UNIX};
+	strcpy(sun.sun_path, SOCK);
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	assert(connect(fd, (struct sockaddr *)&sun, sizeof(sun)) == 0);
+	return fd;
+}
+
+/* read the greeting and send our flags */
+void greet(int fd){
+	assert(recv64(fd) == NBD_INIT_MAGIC);
+	assert(recv64(fd) == NBD_OPTS_MAGIC);
+	assert(recv16(fd) & NBD_FLAG_FIXED_NEWSTYLE);
+	uint32_t flags = htobe32(NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES);
+	send_all(fd, &flags, 4);
+}
+
+void send_option(int fd, uint32_t opt, const void *data, uint32_t len){
+	char hdr[16];
+	uint64_t magic = htobe64(NBD_OPTS_MAGIC);
+	uint32_t o = htobe32(opt), l = htobe32(len);
+	memcpy(hdr, &magic, 8);
+	memcpy(hdr + 8, &o, 4);
+	memcpy(hdr + 12, &l, 4);
+	send_all(fd, hdr, 16);
+	if (len > 0)
+		send_all(fd, data, len);
+}
+
+/* an option reply: returns its type, with up to 64 bytes of data in 'data' */
+uint32_t recv_reply(int fd, uint32_t opt, char *data, uint32_t *len){
+	assert(recv64(fd) == NBD_REP_MAGIC);
+	assert(recv32(fd) == opt);
+	uint32_t type = recv32(fd);
+	*len = recv32(fd);
+	assert(*len <= 64);
+	assert(recv_all(fd, data, *len));
+	return type;
+}
+
+/* NBD_OPT_GO (or _INFO) for 'name', asking for the block size.
+ * Returns the reply type that ended it; sets the size, flags and
+ * minimum block size.
+ */
+uint32_t go(int fd, int opt, char *name, uint64_t *size, uint16_t *flags, uint32_t *min_bs){
+	char req[64], data[64];
+	uint32_t nlen = strlen(name), n = htobe32(nlen), len;
+	uint16_t nreq = htobe16(1), bs = htobe16(NBD_INFO_BLOCK_SIZE);
+	memcpy(req, &n, 4);
+	memcpy(req + 4, name, nlen);
+	memcpy(req + 4 + nlen, &nreq, 2);
+	memcpy(req + 6 + nlen, &bs, 2);
+	send_option(fd, opt, req, 8 + nlen);
+	uint32_t type;
+	while ((type = recv_reply(fd, opt, data, &len)) == NBD_REP_INFO) {
+		uint16_t info;
+		memcpy(&info, data, 2);
+		if (be16toh(info) == NBD_INFO_EXPORT) {
+			memcpy(size, data + 2, 8);
+			*size = be64toh(*size);
+			memcpy(flags, data + 10, 2);
+			*flags = be16toh(*flags);
+		} else if (be16toh(info) == NBD_INFO_BLOCK_SIZE) {
+			memcpy(min_bs, data + 2, 4);
+			*min_bs = be32toh(*min_bs);
+		}
+	}
+	return type;
+}
+
+/* connect and get into transmission; returns the export size */
+int nbd_open(uint64_t *size){
+	int fd = connect_unix();
+	uint16_t flags;
+	uint32_t bs;
+	greet(fd);
+	assert(go(fd, NBD_OPT_GO, "", size, &flags, &bs) == NBD_REP_ACK);
+	return fd;
+}
+
+void send_cmd(int fd, int type, uint64_t handle, uint64_t off, uint32_t len, const void *data){
+	char req[NBD_REQUEST_SIZE];
+	uint32_t magic = htobe32(NBD_REQUEST_MAGIC), l = htobe32(len);
+	uint16_t flags = 0, t = htobe16(type);
+	uint64_t o = htobe64(off);
+	memcpy(req, &magic, 4);
+	memcpy(req + 4, &flags, 2);
+	memcpy(req + 6, &t, 2);
+	memcpy(req + 8, &handle, 8);
+	memcpy(req + 16, &o, 8);
+	memcpy(req + 24, &l, 4);
+	send_all(fd, req, NBD_REQUEST_SIZE);
+	if (type == NBD_CMD_WRITE)
+		send_all(fd, data, len);
+}
+
+/* a simple reply's header: returns its error, and the handle */
+uint32_t recv_simple(int fd, uint64_t *handle){
+	assert(recv32(fd) == NBD_REPLY_MAGIC);
+	uint32_t err = recv32(fd);
+	assert(recv_all(fd, handle, 8));
+	return err;
+}
+
+/* one request, waiting for its reply */
+uint32_t cmd(int fd, int type, uint64_t off, uint32_t len, void *buf){
+	uint64_t handle;
+	send_cmd(fd, type, 12345, off, len, buf);
+	uint32_t err = recv_simple(fd, &handle);
+	assert(handle == 12345);
+	if (err == 0 && type == NBD_CMD_READ)
+		assert(recv_all(fd, buf, len));
+	return err;
+}
+
+/* every block holds "seq:lba" */
+void fill_block(char *buf, int seq, blkno_t lba){
+	memset(buf, 0, BLOCK_SIZE);
+	sprintf(buf, "%d:%lld", seq, lba);
+}
+
+int check_block(char *buf, int seq, blkno_t lba){
+	char expect[BLOCK_SIZE];
+	fill_block(expect, seq, lba);
+	if (memcmp(buf, expect, BLOCK_SIZE) != 0) {
+		printf("Block %lld doesn't match: %s, expected %s\n", lba, buf, expect);
+		return 0;
+	}
+	return 1;
+}
+
+/* the server runs in a thread of its own */
+struct nbd_server *srv;
+pthread_t srv_thread;
+
+void *serve(void *arg){
+	assert(nbd_server_run(srv) == SUCCESS);
+	return NULL;
+}
+
+struct blkdev *start(struct blkdev *vol, struct nbd_opts *opts){
+	srv = nbd_server_create(vol, opts);
+	assert(srv != NULL);
+	pthread_create(&srv_thread, NULL, serve, NULL);
+	return vol;
+}
+
+void stop(void){
+	nbd_server_stop(srv);
+	pthread_join(srv_thread, NULL);
+	nbd_server_destroy(srv);
+}
+
+struct blkdev *new_raid4(struct blkdev **disks){
+	for (int i = 0; i < 4; i++)
+		disks[i] = ramdisk_create(DISK_BLKS);
+	return raid4_create(4, disks, UNIT);
+}
+
+void handshake_tests(void){
+	struct blkdev *disks[4];
+	struct blkdev *vol = new_raid4(disks);
+	struct nbd_opts opts = {.path = SOCK, .name = "vol"};
+	start(vol, &opts);
+	uint64_t size = 0;
+	uint16_t flags = 0;
+	uint32_t bs = 0, len;
+	char data[64];
+
+	int fd = connect_unix();
+	greet(fd);
+	send_option(fd, NBD_OPT_LIST, NULL, 0);
+	assert(recv_reply(fd, NBD_OPT_LIST, data, &len) == NBD_REP_SERVER);
+	assert(len == 7 && memcmp(data + 4, "vol", 3) == 0);
+	assert(recv_reply(fd, NBD_OPT_LIST, data, &len) == NBD_REP_ACK);
+	send_option(fd, 99, NULL, 0);
+	assert(recv_reply(fd, 99, data, &len) == NBD_REP_ERR_UNSUP);
+	send_option(fd, NBD_OPT_GO, "\0\0", 2);
+	assert(recv_reply(fd, NBD_OPT_GO, data, &len) == NBD_REP_ERR_INVALID);
+	assert(go(fd, NBD_OPT_GO, "other", &size, &flags, &bs) == NBD_REP_ERR_UNKNOWN);
+	assert(go(fd, NBD_OPT_INFO, "vol", &size, &flags, &bs) == NBD_REP_ACK);
+	assert(size == (uint64_t)blkdev_num_blocks(vol) * BLOCK_SIZE && bs == BLOCK_SIZE);
+	assert((flags & NBD_FLAG_SEND_FLUSH) && (flags & NBD_FLAG_SEND_FUA) &&
+	       (flags & NBD_FLAG_SEND_TRIM) && !(flags & NBD_FLAG_READ_ONLY));
+	size = 0;
+	assert(go(fd, NBD_OPT_GO, "vol", &size, &flags, &bs) == NBD_REP_ACK);
+	assert(size == (uint64_t)blkdev_num_blocks(vol) * BLOCK_SIZE);
+	char buf[BLOCK_SIZE];
+	assert(cmd(fd, NBD_CMD_READ, 0, BLOCK_SIZE, buf) == 0);
+	close(fd);
+
+	/* the old way in: the size comes straight back */
+	fd = connect_unix();
+	greet(fd);
+	send_option(fd, NBD_OPT_EXPORT_NAME, "vol", 3);
+	assert(recv64(fd) == (uint64_t)blkdev_num_blocks(vol) * BLOCK_SIZE);
+	assert(recv16(fd) & NBD_FLAG_HAS_FLAGS);
+	assert(cmd(fd, NBD_CMD_READ, 0, BLOCK_SIZE, buf) == 0);
+	close(fd);
+
+	fd = connect_unix();
+	greet(fd);
+	send_option(fd, NBD_OPT_ABORT, NULL, 0);
+	assert(recv_reply(fd, NBD_OPT_ABORT, data, &len) == NBD_REP_ACK);
+	assert(recv_all(fd, data, 1) == 0);
+	close(fd);
+	stop();
+	blkdev_close(vol);
+	printf("handshake test passed\n");
+}
+
+/* many requests sent before any reply is read; replies come back in any order */
+void pipeline_tests(void){
+	struct blkdev *disks[4];
+	struct blkdev *vol = new_raid4(disks);
+	struct nbd_opts opts = {.path = SOCK, .max_inflight = 8};
+	start(vol, &opts);
+	uint64_t size, handle;
+	int fd = nbd_open(&size);
+	blkno_t nblks = size / BLOCK_SIZE;
+	char buf[4*BLOCK_SIZE];
+
+	for (blkno_t lba = 0; lba < nblks; lba += 4) {
+		for (int i = 0; i < 4; i++)
+			fill_block(&buf[i*BLOCK_SIZE], 1, lba + i);
+		send_cmd(fd, NBD_CMD_WRITE, lba, lba * BLOCK_SIZE, sizeof(buf), buf);
+	}
+	char seen[3*DISK_BLKS] = {0};
+	for (blkno_t lba = 0; lba < nblks; lba += 4) {
+		assert(recv_simple(fd, &handle) == 0);
+		assert(handle < (uint64_t)nblks && !seen[handle]);
+		seen[handle] = 1;
+	}
+
+	for (blkno_t lba = 0; lba < nblks; lba += 4)
+		send_cmd(fd, NBD_CMD_READ, lba, lba * BLOCK_SIZE, sizeof(buf), NULL);
+	for (blkno_t lba = 0; lba < nblks; lba += 4) {
+		assert(recv_simple(fd, &handle) == 0);
+		assert(recv_all(fd, buf, sizeof(buf)));
+		for (int i = 0; i < 4; i++)
+			assert(check_block(&buf[i*BLOCK_SIZE], 1, handle + i));
+	}
+	/* it's all on the volume */
+	assert(blkdev_read(vol, 77, 1, buf) == SUCCESS);
+	assert(check_block(buf, 1, 77));
+
+	/* a disconnect is answered after what came before it */
+	send_cmd(fd, NBD_CMD_READ, 1, 0, BLOCK_SIZE, NULL);
+	send_cmd(fd, NBD_CMD_DISC, 2, 0, 0, NULL);
+	assert(recv_simple(fd, &handle) == 0 && handle == 1);
+	assert(recv_all(fd, buf, BLOCK_SIZE));
+	assert(recv_all(fd, buf, 1) == 0);
+	close(fd);
+	stop();
+	blkdev_close(vol);
+	printf("pipelined requests test passed\n");
+}
+
+void command_tests(void){
+	struct blkdev *disks[4];
+	struct blkdev *vol = new_raid4(disks);
+	struct nbd_opts opts = {.path = SOCK};
+	start(vol, &opts);
+	uint64_t size;
+	int fd = nbd_open(&size);
+	char buf[8*BLOCK_SIZE], zeros[8*BLOCK_SIZE] = {0};
+
+	for (int i = 0; i < 8; i++)
+		fill_block(&buf[i*BLOCK_SIZE], 1, 40 + i);
+	assert(cmd(fd, NBD_CMD_WRITE, 40 * BLOCK_SIZE, sizeof(buf), buf) == 0);
+	assert(cmd(fd, NBD_CMD_FLUSH, 0, 0, NULL) == 0);
+	assert(cmd(fd, NBD_CMD_TRIM, 40 * BLOCK_SIZE, 4 * BLOCK_SIZE, NULL) == 0);
+	assert(cmd(fd, NBD_CMD_WRITE_ZEROES, 46 * BLOCK_SIZE, BLOCK_SIZE, NULL) == 0);
+	assert(cmd(fd, NBD_CMD_READ, 40 * BLOCK_SIZE, sizeof(buf), buf) == 0);
+	assert(memcmp(buf, zeros, 4 * BLOCK_SIZE) == 0);
+	assert(check_block(&buf[4*BLOCK_SIZE], 1, 44) && check_block(&buf[5*BLOCK_SIZE], 1, 45));
+	assert(memcmp(&buf[6*BLOCK_SIZE], zeros, BLOCK_SIZE) == 0);
+	assert(check_block(&buf[7*BLOCK_SIZE], 1, 47));
+
+	/* bad requests are answered, and the connection carries on */
+	assert(cmd(fd, NBD_CMD_READ, 100, BLOCK_SIZE, buf) == NBD_EINVAL);
+	assert(cmd(fd, NBD_CMD_READ, size - BLOCK_SIZE, 2 * BLOCK_SIZE, buf) == NBD_EINVAL);
+	assert(cmd(fd, NBD_CMD_WRITE, size, BLOCK_SIZE, buf) == NBD_ENOSPC);
+	assert(cmd(fd, 42, 0, 0, NULL) == NBD_EINVAL);
+	assert(cmd(fd, NBD_CMD_READ, size - BLOCK_SIZE, BLOCK_SIZE, buf) == 0);
+
+	/* and so are volume errors */
+	ramdisk_fail(disks[0]);
+	ramdisk_fail(disks[1]);
+	assert(cmd(fd, NBD_CMD_READ, 0, sizeof(buf), buf) == NBD_EIO);
+	assert(cmd(fd, NBD_CMD_FLUSH, 0, 0, NULL) == NBD_EIO);
+	struct nbd_stats st;
+	nbd_server_stats(srv, &st);
+	assert(st.clients == 1 && st.errors == 6);
+	assert(st.bytes_written == 8 * BLOCK_SIZE && st.bytes_read == 9 * BLOCK_SIZE);
+	close(fd);
+	stop();
+	blkdev_close(vol);
+
+	/* read-only */
+	vol = new_raid4(disks);
+	opts.read_only = 1;
+	start(vol, &opts);
+	fd = nbd_open(&size);
+	assert(cmd(fd, NBD_CMD_WRITE, 0, BLOCK_SIZE, buf) == NBD_EPERM);
+	assert(cmd(fd, NBD_CMD_TRIM, 0, BLOCK_SIZE, NULL) == NBD_EPERM);
+	assert(cmd(fd, NBD_CMD_READ, 0, BLOCK_SIZE, buf) == 0);
+	close(fd);
+	stop();
+	blkdev_close(vol);
+	printf("command test passed\n");
+}
+
+/* clients each writing and reading their own blocks, all at once */
+struct client {
+	int id;
+	int nclients;
+};
+
+void *client_thread(void *arg){
+	struct client *cl = arg;
+	uint64_t size, handle;
+	int fd = nbd_open(&size);
+	blkno_t nblks = size / BLOCK_SIZE;
+	char buf[BLOCK_SIZE];
+	for (int pass = 0; pass < 3; pass++) {
+		int n = 0;
+		for (blkno_t lba = cl->id; lba < nblks; lba += cl->nclients, n++) {
+			fill_block(buf, pass, lba);
+			send_cmd(fd, NBD_CMD_WRITE, lba, lba * BLOCK_SIZE, BLOCK_SIZE, buf);
+		}
+		while (n-- > 0)
+			assert(recv_simple(fd, &handle) == 0);
+	}
+	for (blkno_t lba = cl->id; lba < nblks; lba += cl->nclients) {
+		assert(cmd(fd, NBD_CMD_READ, lba * BLOCK_SIZE, BLOCK_SIZE, buf) == 0);
+		assert(check_block(buf, 2, lba));
+	}
+	close(fd);
+	return NULL;
+}
+
+void multi_client_test(void){
+	struct blkdev *disks[4];
+	struct blkdev *vol = new_raid4(disks);
+	struct nbd_opts opts = {.path = SOCK, .workers = 8, .max_inflight = 16};
+	start(vol, &opts);
+	struct client cl[8];
+	pthread_t t[8];
+	for (int i = 0; i < 8; i++) {
+		cl[i].id = i;
+		cl[i].nclients = 8;
+		pthread_create(&t[i], NULL, client_thread, &cl[i]);
+	}
+	for (int i = 0; i < 8; i++)
+		pthread_join(t[i], NULL);
+	struct nbd_stats st;
+	nbd_server_stats(srv, &st);
+	assert(st.clients == 8 && st.errors == 0);
+	stop();
+	char buf[BLOCK_SIZE];
+	for (blkno_t lba = 0; lba < blkdev_num_blocks(vol); lba += 37) {
+		assert(blkdev_read(vol, lba, 1, buf) == SUCCESS);
+		assert(check_block(buf, 2, lba));
+	}
+	blkdev_close(vol);
+	printf("multiple clients test passed\n");
+}
+
+/* TCP on the loopback, and stopping with a client connected */
+void tcp_test(void){
+	struct blkdev *disks[2] = {ramdisk_create(DISK_BLKS), ramdisk_create(DISK_BLKS)};
+	struct blkdev *vol = mirror_create(disks);
+	struct nbd_opts opts = {0};
+	start(vol, &opts);
+	assert(nbd_server_port(srv) > 0);
+	struct sockaddr_in sin = {.sin_family = AF_INET, .sin_port = htons(nbd_server_port(srv)),
+				  .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	assert(connect(fd, (struct sockaddr *)&sin, sizeof(sin)) == 0);
+	uint64_t size;
+	uint16_t flags;
+	uint32_t bs;
+	greet(fd);
+	assert(go(fd, NBD_OPT_GO, "", &size, &flags, &bs) == NBD_REP_ACK);
+	char buf[BLOCK_SIZE];
+	fill_block(buf, 1, 5);
+	assert(cmd(fd, NBD_CMD_WRITE, 5 * BLOCK_SIZE, BLOCK_SIZE, buf) == 0);
+	assert(cmd(fd, NBD_CMD_READ, 5 * BLOCK_SIZE, BLOCK_SIZE, buf) == 0);
+	assert(check_block(buf, 1, 5));
+	stop();
+	assert(recv_all(fd, buf, 1) == 0);
+	close(fd);
+	blkdev_close(vol);
+	printf("tcp test passed\n");
+}
+
+int main(){
+	handshake_tests();
+	pipeline_tests();
+	command_tests();
+	multi_client_test();
+	tcp_test();
+	assert(access(SOCK, F_OK) != 0);
+	printf("nbd tests passed.\n");
+	return 0;
+}
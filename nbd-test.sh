@@ -0,0 +1,3 @@
+#!/bin/sh
+
+gcc -g3 -o nbd-test nbd-test.c image.c homework.c journal.c nbd.c ramdisk.c -lpthread -lm
@@ -0,0 +1,797 @@
+/*
+ * file:        nbd.c
+ * description: NBD server - exports a volume to standard NBD clients
+ *              (nbd-client, qemu, fio's nbd engine) over a Unix or
+ *              loopback TCP socket
+ *
+ * One thread runs an epoll loop that does all the socket I/O: it
+ * accepts clients, does the handshake, and parses requests onto a
+ * queue for a pool of worker threads, which issue them to the volume.
+ * A client may have up to max_inflight requests queued or in progress
+ * (it isn't read from while it has that many), and replies go back in
+ * the order they complete, matched up by their handles. Workers hand
+ * replies back through a list and an eventfd, so a socket is only ever
+ * touched by the loop. Only the fixed newstyle handshake and simple
+ * replies are supported.
+ */
+
+#define _GNU_SOURCE             /* accept4 */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <endian.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "nbd.h"
+
+#define NBD_MAX_OPTION 4096     /* longest option data accepted */
+#define NBD_IN_BUF     65536    /* initial input buffer per client */
+#define NBD_IOV        64       /* replies per sendmsg */
+
+enum { ST_CLIENT_FLAGS, ST_OPTIONS, ST_TRANSMIT };
+
+/* bytes queued to send */
+struct nbd_buf {
+    struct nbd_buf *next;
+    size_t len, off;
+    char data[];
+};
+
+struct nbd_conn {
+    struct nbd_server *srv;
+    int fd;
+    int state;
+    int no_zeroes;
+    char *in;
+    size_t in_len, in_cap;
+    struct nbd_buf *out, *out_tail;
+    int events;                 /* registered with epoll, or -1 if not */
+    int closing;                /* no more requests: close once answered */
+    int dead;                   /* the socket failed: drop the replies */
+    int closed;                 /* to be freed after this batch of events */
+    struct nbd_conn *prev, *next;   /* all clients */
+
+    /* under srv->lock */
+    int inflight;
+    struct nbd_buf *done, *done_tail;   /* replies from the workers */
+    int ready;                  /* on srv->ready */
+    struct nbd_conn *next_ready;
+};
+
+struct nbd_req {
+    struct nbd_req *next;
+    struct nbd_conn *conn;
+    int type;
+    int fua;                    /* NBD_CMD_FLAG_FUA */
+    char handle[8];
+    blkno_t lba;
+    int nblks;
+    char *data;                 /* write payload */
+};
+
+struct nbd_server {
+    struct blkdev *vol;
+    struct nbd_opts opts;
+    blkno_t nblks;
+    int bsize;
+    int listen_fd, epoll_fd, wake_fd;
+    int port;
+    int stop;
+    struct nbd_conn *conns;
+    struct nbd_conn *zombies;   /* closed during the current batch */
+    pthread_t *workers;
+    pthread_mutex_t vol_lock;   /* with opts.serialize */
+
+    pthread_mutex_t lock;       /* protects the fields below */
+    pthread_cond_t cond;
+    struct nbd_req *queue, *queue_tail;
+    struct nbd_conn *ready;     /* clients with replies from the workers */
+    int quit;
+    struct nbd_stats st;
+};
+
+static void put16(char *p, uint16_t v) { v = htobe16(v); memcpy(p, &v, 2); }
+static void put32(char *p, uint32_t v) { v = htobe32(v); memcpy(p, &v, 4); }
+static void put64(char *p, uint64_t v) { v = htobe64(v); memcpy(p, &v, 8); }
+static uint16_t get16(const char *p) { uint16_t v; memcpy(&v, p, 2); return be16toh(v); }
+static uint32_t get32(const char *p) { uint32_t v; memcpy(&v, p, 4); return be32toh(v); }
+static uint64_t get64(const char *p) { uint64_t v; memcpy(&v, p, 8); return be64toh(v); }
+
+static struct nbd_buf *buf_new(size_t len)
+{
+    struct nbd_buf *b = malloc(sizeof(*b) + len);
+    b->next = NULL;
+    b->len = len;
+    b->off = 0;
+    return b;
+}
+
+static void buf_free_list(struct nbd_buf *b)
+{
+    while (b != NULL) {
+        struct nbd_buf *next = b->next;
+        free(b);
+        b = next;
+    }
+}
+
+static void conn_send(struct nbd_conn *c, struct nbd_buf *b)
+{
+    if (c->dead) {
+        free(b);
+        return;
+    }
+    if (c->out_tail != NULL)
+        c->out_tail->next = b;
+    else
+        c->out = b;
+    c->out_tail = b;
+}
+
+static struct nbd_buf *simple_reply(const char *handle, int error, size_t datalen)
+{
+    struct nbd_buf *b = buf_new(NBD_REPLY_SIZE + datalen);
+    put32(b->data, NBD_REPLY_MAGIC);
+    put32(b->data + 4, error);
+    memcpy(b->data + 8, handle, 8);
+    return b;
+}
+
+/* wake the event loop */
+static void wake(struct nbd_server *s)
+{
+    uint64_t one = 1;
+    ssize_t n = write(s->wake_fd, &one, sizeof(one));
+    (void)n;                    /* only fails if it is already due to wake */
+}
+
+static uint16_t xmit_flags(struct nbd_server *s)
+{
+    uint16_t f = NBD_FLAG_HAS_FLAGS | NBD_FLAG_SEND_FLUSH | NBD_FLAG_SEND_FUA |
+        NBD_FLAG_SEND_TRIM | NBD_FLAG_SEND_WRITE_ZEROES | NBD_FLAG_CAN_MULTI_CONN;
+    if (s->opts.read_only)
+        f |= NBD_FLAG_READ_ONLY;
+    return f;
+}
+
+/********** handshake ***************/
+
+static void opt_reply(struct nbd_conn *c, uint32_t opt, uint32_t type, const char *data, int len)
+{
+    struct nbd_buf *b = buf_new(20 + len);
+    put64(b->data, NBD_REP_MAGIC);
+    put32(b->data + 8, opt);
+    put32(b->data + 12, type);
+    put32(b->data + 16, len);
+    if (len > 0)
+        memcpy(b->data + 20, data, len);
+    conn_send(c, b);
+}
+
+/* the empty name is the default export */
+static int name_ok(struct nbd_server *s, const char *name, uint32_t len)
+{
+    return len == 0 || (len == strlen(s->opts.name) && memcmp(name, s->opts.name, len) == 0);
+}
+
+static void handle_option(struct nbd_conn *c, uint32_t opt, const char *p, uint32_t len)
+{
+    struct nbd_server *s = c->srv;
+    uint64_t size = (uint64_t)s->nblks * s->bsize;
+    char info[14];
+
+    switch (opt) {
+    case NBD_OPT_EXPORT_NAME: {
+        if (!name_ok(s, p, len)) {
+            c->closing = 1;         /* there's no way to say no but hanging up */
+            return;
+        }
+        struct nbd_buf *b = buf_new(c->no_zeroes ? 10 : 134);
+        memset(b->data, 0, b->len);
+        put64(b->data, size);
+        put16(b->data + 8, xmit_flags(s));
+        conn_send(c, b);
+        c->state = ST_TRANSMIT;
+        return;
+    }
+    case NBD_OPT_ABORT:
+        opt_reply(c, opt, NBD_REP_ACK, NULL, 0);
+        c->closing = 1;
+        return;
+    case NBD_OPT_LIST: {
+        int n = strlen(s->opts.name);
+        char rep[4 + n];
+        put32(rep, n);
+        memcpy(rep + 4, s->opts.name, n);
+        opt_reply(c, opt, NBD_REP_SERVER, rep, 4 + n);
+        opt_reply(c, opt, NBD_REP_ACK, NULL, 0);
+        return;
+    }
+    case NBD_OPT_INFO:
+    case NBD_OPT_GO: {
+        /* name length, name, number of info requests, requests */
+        uint32_t nlen = len >= 6 ? get32(p) : 0;
+        if (len < 6 || nlen > len - 6 || 6 + nlen + 2 * get16(p + 4 + nlen) != len) {
+            opt_reply(c, opt, NBD_REP_ERR_INVALID, NULL, 0);
+            return;
+        }
+        if (!name_ok(s, p + 4, nlen)) {
+            opt_reply(c, opt, NBD_REP_ERR_UNKNOWN, NULL, 0);
+            return;
+        }
+        put16(info, NBD_INFO_EXPORT);
+        put64(info + 2, size);
+        put16(info + 10, xmit_flags(s));
+        opt_reply(c, opt, NBD_REP_INFO, info, 12);
+        for (int i = 0; i < get16(p + 4 + nlen); i++) {
+            if (get16(p + 6 + nlen + 2 * i) != NBD_INFO_BLOCK_SIZE)
+                continue;
+            put16(info, NBD_INFO_BLOCK_SIZE);
+            put32(info + 2, s->bsize);
+            put32(info + 6, s->bsize > 4096 ? s->bsize : 4096);
+            put32(info + 10, NBD_MAX_REQUEST);
+            opt_reply(c, opt, NBD_REP_INFO, info, 14);
+        }
+        opt_reply(c, opt, NBD_REP_ACK, NULL, 0);
+        if (opt == NBD_OPT_GO)
+            c->state = ST_TRANSMIT;
+        return;
+    }
+    default:
+        opt_reply(c, opt, NBD_REP_ERR_UNSUP, NULL, 0);
+    }
+}
+
+/********** requests ***************/
+
+/* 0, or the error to answer a request with without issuing it */
+static int check_request(struct nbd_server *s, int type, uint64_t off, uint32_t len)
+{
+    uint64_t size = (uint64_t)s->nblks * s->bsize;
+    switch (type) {
+    case NBD_CMD_READ:
+    case NBD_CMD_WRITE:
+    case NBD_CMD_TRIM:
+    case NBD_CMD_WRITE_ZEROES:
+        if (type != NBD_CMD_READ && s->opts.read_only)
+            return NBD_EPERM;
+        if (off % s->bsize != 0 || len % s->bsize != 0 || len > NBD_MAX_REQUEST)
+            return NBD_EINVAL;
+        if (off > size || len > size - off)
+            return type == NBD_CMD_READ ? NBD_EINVAL : NBD_ENOSPC;
+        return 0;
+    case NBD_CMD_FLUSH:
+        return 0;
+    default:
+        return NBD_EINVAL;
+    }
+}
+
+static int conn_busy(struct nbd_conn *c)
+{
+    pthread_mutex_lock(&c->srv->lock);
+    int busy = c->inflight >= c->srv->opts.max_inflight;
+    pthread_mutex_unlock(&c->srv->lock);
+    return busy;
+}
+
+/* act on what has arrived from a client, as far as it goes */
+static void conn_parse(struct nbd_conn *c)
+{
+    struct nbd_server *s = c->srv;
+    size_t pos = 0;
+
+    while (!c->closing && !c->dead) {
+        char *p = c->in + pos;
+        size_t avail = c->in_len - pos;
+        if (c->state == ST_CLIENT_FLAGS) {
+            if (avail < 4)
+                break;
+            c->no_zeroes = (get32(p) & NBD_FLAG_NO_ZEROES) != 0;
+            c->state = ST_OPTIONS;
+            pos += 4;
+            continue;
+        }
+        if (c->state == ST_OPTIONS) {
+            if (avail < 16)
+                break;
+            uint32_t len = get32(p + 12);
+            if (get64(p) != NBD_OPTS_MAGIC || len > NBD_MAX_OPTION) {
+                c->dead = 1;
+                break;
+            }
+            if (avail < 16 + len)
+                break;
+            handle_option(c, get32(p + 8), p + 16, len);
+            pos += 16 + len;
+            continue;
+        }
+
+        if (avail < NBD_REQUEST_SIZE || conn_busy(c))
+            break;
+        int type = get16(p + 6);
+        uint64_t off = get64(p + 16);
+        uint32_t len = get32(p + 24);
+        if (get32(p) != NBD_REQUEST_MAGIC ||
+            (type == NBD_CMD_WRITE && len > NBD_MAX_REQUEST)) {
+            c->dead = 1;
+            break;
+        }
+        size_t need = NBD_REQUEST_SIZE + (type == NBD_CMD_WRITE ? len : 0);
+        if (avail < need)
+            break;
+        pos += need;
+        if (type == NBD_CMD_DISC) {
+            c->closing = 1;
+            break;
+        }
+
+        int err = check_request(s, type, off, len);
+        if (err != 0) {
+            conn_send(c, simple_reply(p + 8, err, 0));
+            pthread_mutex_lock(&s->lock);
+            s->st.requests++;
+            s->st.errors++;
+            pthread_mutex_unlock(&s->lock);
+            continue;
+        }
+        struct nbd_req *r = calloc(1, sizeof(*r));
+        r->conn = c;
+        r->type = type;
+        r->fua = (get16(p + 4) & NBD_CMD_FLAG_FUA) != 0;
+        memcpy(r->handle, p + 8, 8);
+        r->lba = off / s->bsize;
+        r->nblks = len / s->bsize;
+        if (type == NBD_CMD_WRITE) {
+            r->data = malloc(len);
+            memcpy(r->data, p + NBD_REQUEST_SIZE, len);
+        }
+        pthread_mutex_lock(&s->lock);
+        c->inflight++;
+        s->st.requests++;
+        if (s->queue_tail != NULL)
+            s->queue_tail->next = r;
+        else
+            s->queue = r;
+        s->queue_tail = r;
+        pthread_cond_signal(&s->cond);
+        pthread_mutex_unlock(&s->lock);
+    }
+    memmove(c->in, c->in + pos, c->in_len - pos);
+    c->in_len -= pos;
+}
+
+static int nbd_error(int val)
+{
+    switch (val) {
+    case SUCCESS:
+        return 0;
+    case E_BADADDR:
+        return NBD_EINVAL;
+    default:
+        return NBD_EIO;
+    }
+}
+
+/* A write is answered once the volume has it, and a flush once every
+ * write answered before it is durable. Flushes from many clients at
+ * once cost the members one sync (see image_flush); multi-connection
+ * clients rely on that, since a flush on one connection covers them all.
+ */
+static void *nbd_worker(void *arg)
+{
+    struct nbd_server *s = arg;
+    pthread_mutex_lock(&s->lock);
+    while (1) {
+        while (s->queue == NULL && !s->quit)
+            pthread_cond_wait(&s->cond, &s->lock);
+        struct nbd_req *r = s->queue;
+        if (r == NULL)
+            break;
+        s->queue = r->next;
+        if (s->queue == NULL)
+            s->queue_tail = NULL;
+        pthread_mutex_unlock(&s->lock);
+
+        size_t bytes = (size_t)r->nblks * s->bsize;
+        struct nbd_buf *b = simple_reply(r->handle, 0, r->type == NBD_CMD_READ ? bytes : 0);
+        int val = SUCCESS;
+        if (s->opts.serialize)
+            pthread_mutex_lock(&s->vol_lock);
+        if (r->nblks > 0) {
+            if (r->type == NBD_CMD_READ)
+                val = blkdev_read(s->vol, r->lba, r->nblks, b->data + NBD_REPLY_SIZE);
+            else if (r->type == NBD_CMD_WRITE && r->fua)
+                val = blkdev_write_fua(s->vol, r->lba, r->nblks, r->data);
+            else if (r->type == NBD_CMD_WRITE)
+                val = blkdev_write(s->vol, r->lba, r->nblks, r->data);
+            else if (r->type != NBD_CMD_FLUSH) {
+                val = blkdev_discard(s->vol, r->lba, r->nblks);
+                if (val == SUCCESS && r->fua)
+                    val = blkdev_flush(s->vol);
+            }
+        }
+        if (r->type == NBD_CMD_FLUSH)
+            val = blkdev_flush(s->vol);
+        if (s->opts.serialize)
+            pthread_mutex_unlock(&s->vol_lock);
+        int err = nbd_error(val);
+        if (err != 0) {
+            put32(b->data + 4, err);
+            b->len = NBD_REPLY_SIZE;        /* no data after an error */
+        }
+
+        pthread_mutex_lock(&s->lock);
+        if (err != 0)
+            s->st.errors++;
+        else if (r->type == NBD_CMD_READ)
+            s->st.bytes_read += bytes;
+        else if (r->type == NBD_CMD_WRITE)
+            s->st.bytes_written += bytes;
+        struct nbd_conn *c = r->conn;
+        if (c->done_tail != NULL)
+            c->done_tail->next = b;
+        else
+            c->done = b;
+        c->done_tail = b;
+        c->inflight--;
+        if (!c->ready) {
+            c->ready = 1;
+            c->next_ready = s->ready;
+            if (s->ready == NULL)
+                wake(s);
+            s->ready = c;
+        }
+        free(r->data);
+        free(r);
+    }
+    pthread_mutex_unlock(&s->lock);
+    return NULL;
+}
+
+/********** event loop ***************/
+
+static void conn_read(struct nbd_conn *c)
+{
+    if (c->in_len == c->in_cap) {
+        c->in_cap *= 2;
+        c->in = realloc(c->in, c->in_cap);
+    }
+    ssize_t n = read(c->fd, c->in + c->in_len, c->in_cap - c->in_len);
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+        c->dead = 1;
+        return;
+    }
+    if (n > 0)
+        c->in_len += n;
+    conn_parse(c);
+}
+
+static void conn_flush(struct nbd_conn *c)
+{
+    while (c->out != NULL && !c->dead) {
+        struct iovec iov[NBD_IOV];
+        int n = 0;
+        for (struct nbd_buf *b = c->out; b != NULL && n < NBD_IOV; b = b->next) {
+            iov[n].iov_base = b->data + b->off;
+            iov[n++].iov_len = b->len - b->off;
+        }
+        struct msghdr msg = {.msg_iov = iov, .msg_iovlen = n};
+        ssize_t sent = sendmsg(c->fd, &msg, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR)
+            continue;
+        if (sent < 0) {
+            if (errno != EAGAIN)
+                c->dead = 1;
+            return;
+        }
+        while (sent > 0) {
+            struct nbd_buf *b = c->out;
+            size_t left = b->len - b->off;
+            if ((size_t)sent < left) {
+                b->off += sent;
+                break;
+            }
+            sent -= left;
+            c->out = b->next;
+            free(b);
+        }
+        if (c->out == NULL)
+            c->out_tail = NULL;
+    }
+}
+
+static void conn_close(struct nbd_conn *c)
+{
+    struct nbd_server *s = c->srv;
+    if (c->events >= 0)
+        epoll_ctl(s->epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    if (c->prev != NULL)
+        c->prev->next = c->next;
+    else
+        s->conns = c->next;
+    if (c->next != NULL)
+        c->next->prev = c->prev;
+    c->closed = 1;
+    c->next = s->zombies;
+    s->zombies = c;
+}
+
+static void conn_free(struct nbd_conn *c)
+{
+    buf_free_list(c->out);
+    buf_free_list(c->done);
+    free(c->in);
+    free(c);
+}
+
+/* take a client's replies from the workers, read any requests it was
+ * too busy for, send what it can, and watch for what's next - or
+ * close it once nothing is left to do
+ */
+static void conn_service(struct nbd_conn *c)
+{
+    struct nbd_server *s = c->srv;
+    if (c->closed)
+        return;
+
+    pthread_mutex_lock(&s->lock);
+    struct nbd_buf *done = c->done;
+    c->done = c->done_tail = NULL;
+    pthread_mutex_unlock(&s->lock);
+    while (done != NULL) {
+        struct nbd_buf *next = done->next;
+        done->next = NULL;
+        conn_send(c, done);
+        done = next;
+    }
+    if (c->state == ST_TRANSMIT)
+        conn_parse(c);
+    conn_flush(c);
+
+    pthread_mutex_lock(&s->lock);
+    int idle = c->inflight == 0 && !c->ready;
+    int busy = c->inflight >= s->opts.max_inflight;
+    pthread_mutex_unlock(&s->lock);
+    if ((c->dead || (c->closing && c->out == NULL)) && idle) {
+        conn_close(c);
+        return;
+    }
+    if (c->dead) {
+        /* wait for the workers without hearing about the socket */
+        if (c->events >= 0)
+            epoll_ctl(s->epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+        c->events = -1;
+        return;
+    }
+    int ev = (c->closing || busy ? 0 : EPOLLIN) | (c->out != NULL ? EPOLLOUT : 0);
+    if (ev != c->events) {
+        struct epoll_event e = {.events = ev, .data.ptr = c};
+        epoll_ctl(s->epoll_fd, EPOLL_CTL_MOD, c->fd, &e);
+        c->events = ev;
+    }
+}
+
+static void nbd_accept(struct nbd_server *s)
+{
+    int fd;
+    while ((fd = accept4(s->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        if (s->opts.path == NULL) {
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        }
+        struct nbd_conn *c = calloc(1, sizeof(*c));
+        c->srv = s;
+        c->fd = fd;
+        c->in_cap = NBD_IN_BUF;
+        c->in = malloc(c->in_cap);
+        c->next = s->conns;
+        if (s->conns != NULL)
+            s->conns->prev = c;
+        s->conns = c;
+
+        struct nbd_buf *b = buf_new(18);
+        put64(b->data, NBD_INIT_MAGIC);
+        put64(b->data + 8, NBD_OPTS_MAGIC);
+        put16(b->data + 16, NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES);
+        conn_send(c, b);
+        c->events = EPOLLIN;
+        struct epoll_event e = {.events = EPOLLIN, .data.ptr = c};
+        epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, fd, &e);
+        pthread_mutex_lock(&s->lock);
+        s->st.clients++;
+        pthread_mutex_unlock(&s->lock);
+        conn_service(c);
+    }
+}
+
+static void nbd_wake(struct nbd_server *s)
+{
+    uint64_t v;
+    ssize_t n = read(s->wake_fd, &v, sizeof(v));
+    (void)n;
+    pthread_mutex_lock(&s->lock);
+    struct nbd_conn *c = s->ready;
+    s->ready = NULL;
+    pthread_mutex_unlock(&s->lock);
+    while (c != NULL) {
+        pthread_mutex_lock(&s->lock);
+        struct nbd_conn *next = c->next_ready;
+        c->ready = 0;
+        pthread_mutex_unlock(&s->lock);
+        conn_service(c);
+        c = next;
+    }
+}
+
+int nbd_server_run(struct nbd_server *s)
+{
+    struct epoll_event evs[64];
+    while (!__atomic_load_n(&s->stop, __ATOMIC_ACQUIRE)) {
+        int n = epoll_wait(s->epoll_fd, evs, 64, -1);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            printf("Error: epoll_wait: %s.\n", strerror(errno));
+            return E_UNAVAIL;
+        }
+        for (int i = 0; i < n; i++) {
+            void *p = evs[i].data.ptr;
+            if (p == s) {
+                nbd_accept(s);
+            } else if (p == &s->wake_fd) {
+                nbd_wake(s);
+            } else {
+                struct nbd_conn *c = p;
+                if (!c->closed && (evs[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+                    conn_read(c);
+                conn_service(c);
+            }
+        }
+        while (s->zombies != NULL) {
+            struct nbd_conn *c = s->zombies;
+            s->zombies = c->next;
+            conn_free(c);
+        }
+    }
+    return SUCCESS;
+}
+
+void nbd_server_stop(struct nbd_server *s)
+{
+    __atomic_store_n(&s->stop, 1, __ATOMIC_RELEASE);
+    wake(s);
+}
+
+int nbd_server_port(struct nbd_server *s)
+{
+    return s->port;
+}
+
+void nbd_server_stats(struct nbd_server *s, struct nbd_stats *st)
+{
+    pthread_mutex_lock(&s->lock);
+    *st = s->st;
+    pthread_mutex_unlock(&s->lock);
+}
+
+/********** startup ***************/
+
+static int nbd_listen(struct nbd_server *s)
+{
+    int fd;
+    if (s->opts.path != NULL) {
+        struct sockaddr_un sun = {.sun_family = AF_UNIX};
+        if (strlen(s->opts.path) >= sizeof(sun.sun_path)) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        strcpy(sun.sun_path, s->opts.path);
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        unlink(s->opts.path);       /* left by a server that died */
+        if (fd < 0 || bind(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0)
+            goto fail;
+    } else {
+        struct sockaddr_in sin = {.sin_family = AF_INET, .sin_port = htons(s->opts.port),
+                                  .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+        socklen_t len = sizeof(sin);
+        int one = 1;
+        fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0 || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0 ||
+            bind(fd, (struct sockaddr *)&sin, sizeof(sin)) < 0 ||
+            getsockname(fd, (struct sockaddr *)&sin, &len) < 0)
+            goto fail;
+        s->port = ntohs(sin.sin_port);
+    }
+    if (listen(fd, 64) < 0)
+        goto fail;
+    return fd;
+
+fail:
+    if (fd >= 0)
+        close(fd);
+    return -1;
+}
+
+struct nbd_server *nbd_server_create(struct blkdev *vol, struct nbd_opts *opts)
+{
+    struct nbd_server *s = calloc(1, sizeof(*s));
+    s->vol = vol;
+    s->opts = *opts;
+    if (s->opts.name == NULL)
+        s->opts.name = "";
+    if (s->opts.workers <= 0)
+        s->opts.workers = 4;
+    if (s->opts.max_inflight <= 0)
+        s->opts.max_inflight = 64;
+    s->nblks = blkdev_num_blocks(vol);
+    s->bsize = blkdev_block_size(vol);
+
+    s->listen_fd = nbd_listen(s);
+    if (s->listen_fd < 0) {
+        printf("Error: can't listen on %s: %s.\n",
+               s->opts.path ? s->opts.path : "127.0.0.1", strerror(errno));
+        free(s);
+        return NULL;
+    }
+    s->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    s->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    struct epoll_event e = {.events = EPOLLIN, .data.ptr = s};
+    epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, s->listen_fd, &e);
+    e.data.ptr = &s->wake_fd;
+    epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, s->wake_fd, &e);
+
+    pthread_mutex_init(&s->vol_lock, NULL);
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->cond, NULL);
+    s->workers = calloc(s->opts.workers, sizeof(pthread_t));
+    for (int i = 0; i < s->opts.workers; i++)
+        pthread_create(&s->workers[i], NULL, nbd_worker, s);
+    return s;
+}
+
+/* the workers finish what is queued first, so no reply is left to a
+ * client that is gone
+ */
+void nbd_server_destroy(struct nbd_server *s)
+{
+    pthread_mutex_lock(&s->lock);
+    s->quit = 1;
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+    for (int i = 0; i < s->opts.workers; i++)
+        pthread_join(s->workers[i], NULL);
+
+    while (s->conns != NULL) {
+        struct nbd_conn *c = s->conns;
+        s->conns = c->next;
+        close(c->fd);
+        conn_free(c);
+    }
+    while (s->zombies != NULL) {
+        struct nbd_conn *c = s->zombies;
+        s->zombies = c->next;
+        conn_free(c);
+    }
+    close(s->listen_fd);
+    close(s->epoll_fd);
+    close(s->wake_fd);
+    if (s->opts.path != NULL)
+        unlink(s->opts.path);
+    pthread_mutex_destroy(&s->vol_lock);
+    pthread_mutex_destroy(&s->lock);
+    pthread_cond_destroy(&s->cond);
+    free(s->workers);
+    free(s);
+}
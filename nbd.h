@@ -0,0 +1,97 @@
+/*
+ * file:        nbd.h
+ * description: NBD protocol constants, and a server exporting a
+ *              volume over a socket (see nbd.c)
+ */
+#ifndef __NBD_H__
+#define __NBD_H__
+
+#include "blkdev.h"
+
+/* handshake (newstyle only). Everything on the wire is big-endian. */
+#define NBD_INIT_MAGIC      0x4e42444d41474943ULL   /* "NBDMAGIC" */
+#define NBD_OPTS_MAGIC      0x49484156454f5054ULL   /* "IHAVEOPT" */
+#define NBD_REP_MAGIC       0x3e889045565a9ULL
+#define NBD_FLAG_FIXED_NEWSTYLE 1
+#define NBD_FLAG_NO_ZEROES      2
+
+#define NBD_OPT_EXPORT_NAME 1
+#define NBD_OPT_ABORT       2
+#define NBD_OPT_LIST        3
+#define NBD_OPT_INFO        6
+#define NBD_OPT_GO          7
+
+#define NBD_REP_ACK         1
+#define NBD_REP_SERVER      2
+#define NBD_REP_INFO        3
+#define NBD_REP_ERR_UNSUP   0x80000001u
+#define NBD_REP_ERR_INVALID 0x80000003u
+#define NBD_REP_ERR_UNKNOWN 0x80000006u
+
+#define NBD_INFO_EXPORT     0
+#define NBD_INFO_BLOCK_SIZE 3
+
+/* transmission */
+#define NBD_FLAG_HAS_FLAGS         (1 << 0)
+#define NBD_FLAG_READ_ONLY         (1 << 1)
+#define NBD_FLAG_SEND_FLUSH        (1 << 2)
+#define NBD_FLAG_SEND_FUA          (1 << 3)
+#define NBD_FLAG_SEND_TRIM         (1 << 5)
+#define NBD_FLAG_SEND_WRITE_ZEROES (1 << 6)
+#define NBD_FLAG_CAN_MULTI_CONN    (1 << 8)
+
+#define NBD_REQUEST_MAGIC   0x25609513
+#define NBD_REPLY_MAGIC     0x67446698
+#define NBD_REQUEST_SIZE    28
+#define NBD_REPLY_SIZE      16
+
+#define NBD_CMD_READ        0
+#define NBD_CMD_WRITE       1
+#define NBD_CMD_DISC        2
+#define NBD_CMD_FLUSH       3
+#define NBD_CMD_TRIM        4
+#define NBD_CMD_WRITE_ZEROES 6
+
+#define NBD_CMD_FLAG_FUA    (1 << 0)    /* the write is durable when answered */
+
+#define NBD_EPERM   1
+#define NBD_EIO     5
+#define NBD_EINVAL  22
+#define NBD_ENOSPC  28
+
+#define NBD_MAX_REQUEST (32 << 20)  /* bytes of one read or write */
+
+/* Fields left at 0 take the default shown */
+struct nbd_opts {
+    char *path;                 /* Unix socket, or NULL for TCP on 127.0.0.1 */
+    int port;                   /* TCP port (0: any free one) */
+    char *name;                 /* export name ("") */
+    int workers;                /* threads issuing requests to the volume (4) */
+    int max_inflight;           /* requests per client read ahead of replies (64) */
+    int serialize;              /* one request at a time, for volumes that aren't thread safe */
+    int read_only;
+};
+
+struct nbd_stats {
+    long long clients;          /* connections accepted */
+    long long requests;
+    long long errors;           /* requests answered with an error */
+    long long bytes_read;
+    long long bytes_written;
+};
+
+struct nbd_server;
+
+/* Listen for clients of 'vol'; NULL if the socket can't be set up */
+extern struct nbd_server *nbd_server_create(struct blkdev *vol, struct nbd_opts *opts);
+/* the TCP port listened on, or 0 for a Unix socket */
+extern int nbd_server_port(struct nbd_server *);
+/* Serve clients until nbd_server_stop */
+extern int nbd_server_run(struct nbd_server *);
+/* Make nbd_server_run return; safe from any thread or a signal handler */
+extern void nbd_server_stop(struct nbd_server *);
+extern void nbd_server_stats(struct nbd_server *, struct nbd_stats *);
+/* Close the socket (removing a Unix one); the volume is left open */
+extern void nbd_server_destroy(struct nbd_server *);
+
+#endif
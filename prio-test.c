@@ -0,0 +1,152 @@
+#include "blkdev.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+#include <pthread.h>
+#include <time.h>
+
+long long now_ms(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+struct fg_load {
+	struct blkdev *dev;
+	int stop;
+	long long ops;
+};
+
+/* foreground reads, one block at a time, until told to stop */
+void *fg_thread(void *arg){
+	struct fg_load *f = arg;
+	char buf[BLOCK_SIZE];
+	unsigned int seed = 1;
+	int n = blkdev_num_blocks(f->dev);
+	while (!__atomic_load_n(&f->stop, __ATOMIC_RELAXED)) {
+		assert(blkdev_read(f->dev, rand_r(&seed) % n, 1, buf) == SUCCESS);
+		f->ops++;
+	}
+	return NULL;
+}
+
+/* time to read 'kb' KB from 'dev' in 'prio' class, 4KB at a time */
+long long timed_read(struct blkdev *dev, int prio, int kb){
+	char buf[8*BLOCK_SIZE];
+	int old = blkdev_set_prio(prio);
+	long long t = now_ms();
+	for (int i = 0; i < kb / 4; i++)
+		assert(blkdev_read(dev, (i * 8) % 1024, 8, buf) == SUCCESS);
+	blkdev_set_prio(old);
+	return now_ms() - t;
+}
+
+struct replace_arg {
+	struct blkdev *vol;
+	int disk;
+	struct blkdev *newdisk;
+	int result;
+};
+
+void *replace_thread(void *arg){
+	struct replace_arg *r = arg;
+	r->result = raid4_replace(r->vol, r->disk, r->newdisk);
+	return NULL;
+}
+
+int main(){
+	/* background requests are held to min_kbps under foreground load,
+	 * and run at full speed on an idle disk.
+	 */
+	struct blkdev *ram = ramdisk_create(1024);
+	struct blkdev_prio_opts po = {.min_kbps = 1000, .max_kbps = 0, .idle_ms = 20};
+	blkdev_set_sched(ram, &po);
+	assert(blkdev_get_prio() == BLKDEV_PRIO_FG);
+	assert(timed_read(ram, BLKDEV_PRIO_BG, 200) < 50);
+
+	struct fg_load f = {ram};
+	pthread_t fg;
+	pthread_create(&fg, NULL, fg_thread, &f);
+	usleep(10000);
+	long long ms = timed_read(ram, BLKDEV_PRIO_BG, 200);
+	assert(ms >= 120 && ms < 1000);         /* 200KB at 1MB/s, less a 50ms burst */
+	assert(timed_read(ram, BLKDEV_PRIO_FG, 200) < 50);
+
+	/* the knob can be turned at run time */
+	po.min_kbps = 100000;
+	blkdev_set_sched(ram, &po);
+	assert(timed_read(ram, BLKDEV_PRIO_BG, 200) < 50);
+	__atomic_store_n(&f.stop, 1, __ATOMIC_RELAXED);
+	pthread_join(fg, NULL);
+	blkdev_close(ram);
+	printf("priority scheduler test passed\n");
+
+	/* a raid4 rebuild runs alongside foreground I/O */
+	struct blkdev *drives[5];
+	for (int j = 0; j < 5; j++)
+		drives[j] = ramdisk_create(1024);
+	struct blkdev *raid4 = raid4_create(5, drives, 8);
+	int nblks = blkdev_num_blocks(raid4);
+	char *data = malloc(nblks * BLOCK_SIZE), *check = malloc(nblks * BLOCK_SIZE);
+	for (int i = 0; i < nblks; i++)
+		memset(data + i*BLOCK_SIZE, 'a' + i % 26, BLOCK_SIZE);
+	assert(blkdev_write(raid4, 0, nblks, data) == SUCCESS);
+	struct blkdev_prio_opts rpo = {.min_kbps = 2000, .max_kbps = 0, .idle_ms = 5};
+	blkdev_set_sched(raid4, &rpo);
+
+	ramdisk_fail(drives[2]);
+	struct blkdev *old = drives[2];
+	struct replace_arg ra = {raid4, 2, ramdisk_create(1024)};
+	pthread_t rt;
+	long long t = now_ms();
+	pthread_create(&rt, NULL, replace_thread, &ra);
+
+	/* foreground writes and reads while it runs */
+	unsigned int seed = 7;
+	char buf[16*BLOCK_SIZE];
+	for (int k = 0; k < 400; k++) {
+		int len = rand_r(&seed) % 16 + 1;
+		int lba = rand_r(&seed) % (nblks - len + 1);
+		if (k % 2) {
+			memset(buf, 'A' + k % 26, len*BLOCK_SIZE);
+			memcpy(data + lba*BLOCK_SIZE, buf, len*BLOCK_SIZE);
+			assert(blkdev_write(raid4, lba, len, buf) == SUCCESS);
+		} else {
+			assert(blkdev_read(raid4, lba, len, buf) == SUCCESS);
+			assert(memcmp(buf, data + lba*BLOCK_SIZE, len*BLOCK_SIZE) == 0);
+		}
+	}
+	pthread_join(rt, NULL);
+	assert(ra.result == SUCCESS);
+	assert(now_ms() - t < 5000);
+	blkdev_close(old);
+
+	/* the new disk is complete: lose another one and read it all */
+	ramdisk_fail(drives[0]);
+	assert(blkdev_read(raid4, 0, nblks, check) == SUCCESS);
+	assert(memcmp(check, data, nblks * BLOCK_SIZE) == 0);
+	blkdev_close(raid4);
+	printf("raid4 online rebuild test passed\n");
+
+	/* the same for a mirror */
+	struct blkdev *sides[2] = {ramdisk_create(512), ramdisk_create(512)};
+	struct blkdev *mirror = mirror_create(sides);
+	assert(blkdev_write(mirror, 0, 512, data) == SUCCESS);
+	blkdev_set_sched(mirror, &rpo);
+	ramdisk_fail(sides[1]);
+	old = sides[1];
+	assert(blkdev_read(mirror, 0, 1, buf) == SUCCESS);
+	assert(mirror_replace(mirror, 1, ramdisk_create(512)) == SUCCESS);
+	blkdev_close(old);
+	ramdisk_fail(sides[0]);
+	assert(blkdev_read(mirror, 0, 512, check) == SUCCESS);
+	assert(memcmp(check, data, 512 * BLOCK_SIZE) == 0);
+	blkdev_close(mirror);
+	printf("mirror rebuild test passed\n");
+
+	free(data);
+	free(check);
+	printf("priority tests passed.\n");
+}
@@ -0,0 +1,325 @@
+/*
+ * file:        raid-bench.c
+ * description: fio-style benchmark for the RAID volumes
+ *
+ * Builds a volume over image files and runs a timed workload against
+ * it from several threads, then reports IOPS, bandwidth and latency
+ * percentiles for reads and writes.
+ *
+ *   raid-bench [volume options] [-w seq|rand|shared] [-m read %]
+ *              [-b blocks per op] [-q queue depth] [-t threads]
+ *              [-T seconds] [-N ops] [-D failed disk] [-S seed]
+ *              [-o text|json] [-v] [-x trace file]
+ *
+ * The volume options are those of VOLSPEC_USAGE in volspec.h (see
+ * volspec.c for what they build).
+ *
+ * The library calls are synchronous, so a queue depth of q on t
+ * threads is run as t*q workers each with one request outstanding.
+ * Sequential workers each stream through their own part of the volume;
+ * with -w shared they all take the next op from one sequential stream.
+ * -v adds the per-device statistics of the whole tree to the text report;
+ * -x records the run for trace-replay.
+ */
+#include "blkdev.h"
+#include "volspec.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+struct bench_opts {
+	struct volspec vol;
+	int random;
+	int shared;                     /* one sequential stream for all */
+	int read_pct;
+	int bs;
+	int qd;
+	int threads;
+	int seconds;
+	long long max_ops;
+	int fail_disk;
+	unsigned int seed;
+	int json;
+	int verbose;
+	char *trace;
+};
+
+struct lat_list {
+	long long *ns;
+	long long n;
+	long long size;
+};
+
+struct worker {
+	pthread_t thread;
+	struct blkdev *vol;
+	struct bench_opts *o;
+	int id;
+	int nworkers;
+	unsigned int seed;
+	struct lat_list lat[2];         /* 0 = read, 1 = write */
+	long long errors;
+};
+
+static pthread_mutex_t vol_lock = PTHREAD_MUTEX_INITIALIZER;
+static long long deadline;
+static long long ops_issued;
+static long long shared_next;
+
+static long long now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void lat_add(struct lat_list *l, long long ns)
+{
+	if (l->n == l->size) {
+		l->size = l->size ? 2 * l->size : 4096;
+		l->ns = realloc(l->ns, l->size * sizeof(long long));
+	}
+	l->ns[l->n++] = ns;
+}
+
+static int cmp_ll(const void *a, const void *b)
+{
+	long long x = *(const long long *)a, y = *(const long long *)b;
+	return (x > y) - (x < y);
+}
+
+static void *worker_thread(void *arg)
+{
+	struct worker *w = arg;
+	struct bench_opts *o = w->o;
+	blkno_t nblks = blkdev_num_blocks(w->vol);
+	blkno_t span = nblks / o->bs;           /* op slots in the volume */
+	char *buf = malloc((size_t)o->bs * o->vol.block_size);
+	memset(buf, 0xa5 ^ w->id, (size_t)o->bs * o->vol.block_size);
+
+	/* sequential workers each stream through their own part */
+	blkno_t next = span * w->id / w->nworkers;
+
+	while (now_ns() < deadline) {
+		if (o->max_ops > 0 &&
+		    __atomic_fetch_add(&ops_issued, 1, __ATOMIC_RELAXED) >= o->max_ops)
+			break;
+		blkno_t slot;
+		if (o->random) {
+			/* rand_r gives 31 bits; a big volume needs more */
+			slot = ((blkno_t)rand_r(&w->seed) << 31 | rand_r(&w->seed)) % span;
+		} else if (o->shared) {
+			slot = __atomic_fetch_add(&shared_next, 1, __ATOMIC_RELAXED) % span;
+		} else {
+			slot = next;
+			next = (next + 1) % span;
+		}
+		int is_write = (int)(rand_r(&w->seed) % 100) >= o->read_pct;
+
+		long long t0 = now_ns();
+		if (o->vol.serialize)
+			pthread_mutex_lock(&vol_lock);
+		int val = is_write ?
+			blkdev_write(w->vol, slot * o->bs, o->bs, buf) :
+			blkdev_read(w->vol, slot * o->bs, o->bs, buf);
+		if (o->vol.serialize)
+			pthread_mutex_unlock(&vol_lock);
+		long long t1 = now_ns();
+
+		if (val != SUCCESS)
+			w->errors++;
+		else
+			lat_add(&w->lat[is_write], t1 - t0);
+	}
+	free(buf);
+	return NULL;
+}
+
+struct summary {
+	long long ops;
+	double iops;
+	double mbps;
+	long long p50, p90, p99, p999, max;     /* ns */
+};
+
+static void summarize(struct worker *w, int nworkers, int kind,
+		      struct bench_opts *o, double secs, struct summary *s)
+{
+	long long n = 0;
+	for (int i = 0; i < nworkers; i++)
+		n += w[i].lat[kind].n;
+	memset(s, 0, sizeof(*s));
+	s->ops = n;
+	if (n == 0)
+		return;
+
+	long long *all = malloc(n * sizeof(long long));
+	long long k = 0;
+	for (int i = 0; i < nworkers; i++) {
+		memcpy(all + k, w[i].lat[kind].ns, w[i].lat[kind].n * sizeof(long long));
+		k += w[i].lat[kind].n;
+	}
+	qsort(all, n, sizeof(long long), cmp_ll);
+	s->iops = n / secs;
+	s->mbps = s->iops * o->bs * o->vol.block_size / 1e6;
+	s->p50 = all[n * 50 / 100];
+	s->p90 = all[n * 90 / 100];
+	s->p99 = all[n * 99 / 100];
+	s->p999 = all[n * 999 / 1000];
+	s->max = all[n - 1];
+	free(all);
+}
+
+static void print_text(char *name, struct summary *s)
+{
+	if (s->ops == 0)
+		return;
+	printf("%-6s ops %lld  iops %.0f  bw %.2f MB/s\n", name, s->ops, s->iops, s->mbps);
+	printf("       lat (us) p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+	       s->p50 / 1e3, s->p90 / 1e3, s->p99 / 1e3, s->p999 / 1e3, s->max / 1e3);
+}
+
+static void print_json(char *name, struct summary *s, int last)
+{
+	printf("  \"%s\": {\"ops\": %lld, \"iops\": %.1f, \"bw_mbps\": %.3f, "
+	       "\"lat_us\": {\"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, "
+	       "\"p99.9\": %.1f, \"max\": %.1f}}%s\n",
+	       name, s->ops, s->iops, s->mbps, s->p50 / 1e3, s->p90 / 1e3,
+	       s->p99 / 1e3, s->p999 / 1e3, s->max / 1e3, last ? "" : ",");
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: raid-bench " VOLSPEC_USAGE "\n"
+		"       [-w seq|rand|shared] [-m read %%] [-b blocks per op] [-q queue depth]\n"
+		"       [-t threads] [-T seconds] [-N ops] [-D failed disk] [-S seed]\n"
+		"       [-o text|json] [-v] [-x trace file]\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct bench_opts o = {
+		.random = 1, .read_pct = 70, .bs = 8, .qd = 1, .threads = 1,
+		.seconds = 5, .fail_disk = -1, .seed = 1,
+	};
+	volspec_init(&o.vol, "bench_disk");
+	int c;
+	while ((c = getopt(argc, argv, VOLSPEC_OPTS "w:m:b:q:t:T:N:D:S:o:vx:")) != -1) {
+		if (volspec_option(&o.vol, c, optarg))
+			continue;
+		switch (c) {
+		case 'w':
+			o.random = strcmp(optarg, "rand") == 0;
+			o.shared = strcmp(optarg, "shared") == 0;
+			break;
+		case 'm': o.read_pct = atoi(optarg); break;
+		case 'b': o.bs = atoi(optarg); break;
+		case 'q': o.qd = atoi(optarg); break;
+		case 't': o.threads = atoi(optarg); break;
+		case 'T': o.seconds = atoi(optarg); break;
+		case 'N': o.max_ops = atoll(optarg); break;
+		case 'D': o.fail_disk = atoi(optarg); break;
+		case 'S': o.seed = strtoul(optarg, NULL, 0); break;
+		case 'o': o.json = strcmp(optarg, "json") == 0; break;
+		case 'v': o.verbose = 1; break;
+		case 'x': o.trace = optarg; break;
+		default: usage();
+		}
+	}
+	if (o.bs < 1 || o.qd < 1 || o.threads < 1 || o.read_pct < 0 || o.read_pct > 100)
+		usage();
+
+	struct blkdev *vol = volspec_build(&o.vol);
+	if (vol == NULL)
+		return 1;
+	blkno_t nblks = blkdev_num_blocks(vol);
+	if (nblks < o.bs) {
+		printf("Error: volume smaller than one request.\n");
+		return 1;
+	}
+
+	/* fail the member up front, and let one read notice it before
+	 * the workers start, so the switch to degraded mode is not part
+	 * of the measurement.
+	 */
+	if (o.fail_disk >= 0) {
+		if (o.fail_disk >= o.vol.ndisks) {
+			printf("Error: no disk %d.\n", o.fail_disk);
+			return 1;
+		}
+		volspec_fail(&o.vol, o.fail_disk);
+		char *buf = malloc(o.vol.block_size);
+		for (int b = 0; b < nblks && b < o.vol.unit * o.vol.ndisks; b++)
+			blkdev_read(vol, b, 1, buf);
+		free(buf);
+	}
+
+	if (o.trace != NULL) {
+		vol = trace_create(vol, o.trace);
+		if (vol == NULL)
+			return 1;
+	}
+
+	int nworkers = o.threads * o.qd;
+	struct worker *w = calloc(nworkers, sizeof(*w));
+	deadline = now_ns() + o.seconds * 1000000000LL;
+	long long start = now_ns();
+	for (int i = 0; i < nworkers; i++) {
+		w[i].vol = vol;
+		w[i].o = &o;
+		w[i].id = i;
+		w[i].nworkers = nworkers;
+		w[i].seed = o.seed * 7919 + i;
+		pthread_create(&w[i].thread, NULL, worker_thread, &w[i]);
+	}
+	long long errors = 0;
+	for (int i = 0; i < nworkers; i++) {
+		pthread_join(w[i].thread, NULL);
+		errors += w[i].errors;
+	}
+	double secs = (now_ns() - start) / 1e9;
+
+	struct summary rd, wr;
+	summarize(w, nworkers, 0, &o, secs, &rd);
+	summarize(w, nworkers, 1, &o, secs, &wr);
+
+	if (o.json) {
+		printf("{\n  \"level\": \"%s\", \"disks\": %d, \"disk_blocks\": %lld, "
+		       "\"unit\": %d, \"block_size\": %d, \"volume_blocks\": %lld,\n", o.vol.level,
+		       o.vol.ndisks, o.vol.disk_blocks, o.vol.unit, o.vol.block_size, nblks);
+		printf("  \"workload\": \"%s\", \"read_pct\": %d, \"bs\": %d, "
+		       "\"qd\": %d, \"threads\": %d, \"failed_disk\": %d, "
+		       "\"seed\": %u,\n", o.random ? "rand" : o.shared ? "shared" : "seq", o.read_pct,
+		       o.bs, o.qd, o.threads, o.fail_disk, o.seed);
+		printf("  \"seconds\": %.3f, \"errors\": %lld,\n", secs, errors);
+		print_json("read", &rd, 0);
+		print_json("write", &wr, 1);
+		printf("}\n");
+	} else {
+		printf("%s: %d disks x %lld %d-byte blocks, unit %d, %lld block volume%s\n",
+		       o.vol.level, o.vol.ndisks, o.vol.disk_blocks, o.vol.block_size, o.vol.unit, nblks,
+		       o.fail_disk >= 0 ? " (degraded)" : "");
+		printf("%s, %d%% read, bs %d, qd %d, %d threads, %.2f s, %lld errors\n",
+		       o.random ? "random" : o.shared ? "shared sequential" : "sequential",
+		       o.read_pct, o.bs,
+		       o.qd, o.threads, secs, errors);
+		print_text("read", &rd);
+		print_text("write", &wr);
+		if (o.verbose) {
+			printf("\n");
+			blkdev_stats_print(vol);
+		}
+	}
+
+	for (int i = 0; i < nworkers; i++) {
+		free(w[i].lat[0].ns);
+		free(w[i].lat[1].ns);
+	}
+	free(w);
+	blkdev_close(vol);
+	return 0;
+}
@@ -0,0 +1,3 @@
+#!/bin/sh
+
+gcc -g3 -O2 -o raid-bench raid-bench.c image.c homework.c journal.c cache.c logdev.c trace.c ramdisk.c elevator.c integrity.c compress.c volspec.c -lpthread -lm
@@ -0,0 +1,130 @@
+/*
+ * file:        raid-stress.c
+ * description: stress a volume from many threads while failing members
+ *
+ *   raid-stress [volume options] [-t threads] [-T seconds] [-N ops]
+ *               [-m read %] [-b max blocks per op] [-H hot blocks]
+ *               [-F ms:disk]... [-S seed] [-v]
+ *
+ * Each thread issues random reads and writes of 1 to -b blocks, all in
+ * the first -H blocks of the volume so that they overlap, and every
+ * block read is checked against the reference model in stress.c. Each
+ * -F fails a member that many milliseconds into the run. Once the run
+ * is over the whole volume is read back and checked. Reports the
+ * sustained request rate (and the slowest second) with the result;
+ * exits non-zero if a block held data it shouldn't, or a request
+ * failed while the volume had members enough to serve it. For example
+ *
+ *   raid-stress -l raid4 -n 5 -R -t 16 -T 10 -H 4096 -F 3000:2
+ */
+#include "blkdev.h"
+#include "stress.h"
+#include "volspec.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: raid-stress " VOLSPEC_USAGE "\n"
+		"       [-t threads] [-T seconds] [-N ops] [-m read %%] [-b max blocks per op]\n"
+		"       [-H hot blocks] [-F ms:disk]... [-S seed] [-v]\n");
+	exit(1);
+}
+
+static void fail_member(void *arg, int i)
+{
+	struct volspec *spec = arg;
+	printf("failing disk %d\n", i);
+	fflush(stdout);
+	volspec_fail(spec, i);
+}
+
+static void print_result(const char *what, struct stress_result *r)
+{
+	printf("%s: %lld reads (%lld blocks), %lld writes (%lld blocks), %lld blocks checked\n",
+	       what, r->ops[BLKDEV_READ], r->blocks[BLKDEV_READ],
+	       r->ops[BLKDEV_WRITE], r->blocks[BLKDEV_WRITE], r->checked);
+	printf("%s: %lld bad blocks", what, r->bad_blocks);
+	if (r->bad_blocks > 0)
+		printf(" (first at %lld)", r->first_bad);
+	printf(", %lld errors, %lld requests failed after the volume did\n",
+	       r->errors, r->failed_ops);
+}
+
+int main(int argc, char **argv)
+{
+	struct volspec spec;
+	struct stress_opts opts = {0};
+	int verbose = 0;
+	volspec_init(&spec, "stress_disk");
+
+	int c;
+	while ((c = getopt(argc, argv, VOLSPEC_OPTS "t:T:N:m:b:H:F:S:v")) != -1) {
+		if (volspec_option(&spec, c, optarg))
+			continue;
+		switch (c) {
+		case 't': opts.threads = atoi(optarg); break;
+		case 'T': opts.seconds = atoi(optarg); break;
+		case 'N': opts.max_ops = atoll(optarg); break;
+		case 'm': opts.read_pct = atoi(optarg); break;
+		case 'b': opts.max_blocks = atoi(optarg); break;
+		case 'H': opts.hot_blocks = atoll(optarg); break;
+		case 'S': opts.seed = atoi(optarg); break;
+		case 'v': verbose = 1; break;
+		case 'F':
+			if (opts.nfaults == STRESS_MAX_FAULTS ||
+			    sscanf(optarg, "%d:%d", &opts.faults[opts.nfaults].ms,
+				   &opts.faults[opts.nfaults].member) != 2)
+				usage();
+			opts.nfaults++;
+			break;
+		default: usage();
+		}
+	}
+	if (optind != argc || opts.read_pct < 0 || opts.read_pct > 100)
+		usage();
+
+	struct blkdev *vol = volspec_build(&spec);
+	if (vol == NULL)
+		return 1;
+	for (int i = 0; i < opts.nfaults; i++) {
+		if (opts.faults[i].member < 0 || opts.faults[i].member >= spec.ndisks) {
+			printf("Error: no disk %d.\n", opts.faults[i].member);
+			blkdev_close(vol);
+			return 1;
+		}
+	}
+	/* without a rebuild, every level but raid0 survives one failure */
+	opts.tolerate = strcmp(spec.level, "raid0") == 0 ? 0 : 1;
+	opts.serialize = spec.serialize;
+	opts.fail = fail_member;
+	opts.fail_arg = &spec;
+
+	struct stress *s = stress_create(vol, &opts);
+	if (s == NULL) {
+		blkdev_close(vol);
+		return 1;
+	}
+	printf("%s: %d disks x %lld %d-byte blocks, unit %d, %lld block volume\n",
+	       spec.level, spec.ndisks, spec.disk_blocks, spec.block_size, spec.unit,
+	       blkdev_num_blocks(vol));
+	fflush(stdout);
+
+	struct stress_result r;
+	int val = stress_run(s, &r);
+	printf("%.2f s, %d threads: %.0f ops/s, slowest second %.0f ops/s, %.1f MB/s\n",
+	       r.seconds, opts.threads > 0 ? opts.threads : 8, r.ops_per_sec, r.min_ops_per_sec,
+	       (r.blocks[BLKDEV_READ] + r.blocks[BLKDEV_WRITE]) * (double)blkdev_block_size(vol) / r.seconds / 1e6);
+	print_result("run", &r);
+	int vval = stress_verify(s, &r);
+	print_result("total", &r);
+	if (verbose) {
+		printf("\n");
+		blkdev_stats_print(vol);
+	}
+	stress_destroy(s);
+	blkdev_close(vol);
+	return val == SUCCESS && vval == SUCCESS ? 0 : 1;
+}
@@ -1,3 +1,3 @@
 #!/bin/sh
 
-gcc -g3 -o raid0-test raid0-test.c image.c homework.c
\ No newline at end of file
+gcc -g3 -o raid0-test raid0-test.c image.c homework.c journal.c -lpthread
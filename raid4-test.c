@@ -4,6 +4,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <assert.h>
+#include <pthread.h>
 #include <string.h>
 
 void write1(struct blkdev* dev,int addr,int len,int seq,int *array){
@@ -79,6 +80,109 @@ void dump(char* buffer, int length, char* path){
     fclose(output);
 }
 
+void scrub_wait(struct raid4_scrub *sc, struct raid4_scrub_status *st){
+	while (1) {
+		raid4_scrub_status(sc, st);
+		if (!st->running)
+			break;
+		usleep(1000);
+	}
+}
+
+int failed_member = -1;
+
+void fail_event(void *arg, int event, int member, blkno_t mark){
+	if (event == RAID_EV_FAILED)
+		failed_member = member;
+}
+
+/* a member that answers reads slowly, for the hedged read test */
+struct slow_dev {
+	struct blkdev *dev;
+	int delay_us;
+};
+
+blkno_t slow_num_blocks(struct blkdev *dev){
+	struct slow_dev *s = dev->private;
+	return blkdev_num_blocks(s->dev);
+}
+
+int slow_read(struct blkdev *dev, blkno_t first_blk, int num_blks, void *buf){
+	struct slow_dev *s = dev->private;
+	usleep(s->delay_us);
+	return blkdev_read(s->dev, first_blk, num_blks, buf);
+}
+
+int slow_write(struct blkdev *dev, blkno_t first_blk, int num_blks, void *buf){
+	struct slow_dev *s = dev->private;
+	return blkdev_write(s->dev, first_blk, num_blks, buf);
+}
+
+void slow_close(struct blkdev *dev){
+	struct slow_dev *s = dev->private;
+	blkdev_close(s->dev);
+	free(s);
+	free(dev);
+}
+
+struct blkdev_ops slow_ops = {
+	.num_blocks = slow_num_blocks,
+	.read = slow_read,
+	.write = slow_write,
+	.close = slow_close,
+	.type = "slow"
+};
+
+struct blkdev *slow_create(struct blkdev *disk, int delay_us){
+	struct blkdev *dev = calloc(1, sizeof(*dev));
+	struct slow_dev *s = malloc(sizeof(*s));
+	s->dev = disk;
+	s->delay_us = delay_us;
+	dev->private = s;
+	dev->ops = &slow_ops;
+	return dev;
+}
+
+struct stats_walk {
+	int ndevs;
+	int maxdepth;
+	long long member_reads;
+};
+
+struct writer_arg {
+	struct blkdev *dev;
+	int id;
+	int nblks;
+};
+
+/* small writes that straddle strips and rows, so concurrent writers
+ * race on the same parity blocks
+ */
+void *writer_thread(void *arg){
+	struct writer_arg *w = arg;
+	unsigned int seed = w->id;
+	char buf[6*BLOCK_SIZE];
+	write_data_char(buf, sizeof(buf), 'a' + w->id);
+	for (int k = 0; k < 400; k++) {
+		int len = rand_r(&seed) % 6 + 1;
+		int addr = rand_r(&seed) % (w->nblks - len + 1);
+		assert(blkdev_write(w->dev, addr, len, buf) == SUCCESS);
+		assert(blkdev_read(w->dev, addr, len, buf) == SUCCESS);
+	}
+	return NULL;
+}
+
+void count_stats(struct blkdev *dev, int depth, struct blkdev_iostats *st, void *arg){
+	struct stats_walk *w = arg;
+	w->ndevs++;
+	if (depth > w->maxdepth)
+		w->maxdepth = depth;
+	if (depth > 0)
+		w->member_reads += st->ops[BLKDEV_READ];
+	assert(blkdev_stats_percentile(st, BLKDEV_READ, 50) <=
+	       blkdev_stats_percentile(st, BLKDEV_READ, 99));
+}
+
 int main(){
 	int strip_size[4] ={2,4,7,32};
 	int num_disk[4] = {3, 4, 5, 6};
@@ -117,7 +221,7 @@ int main(){
 	struct blkdev* raid4_drives[4];
 	struct blkdev* raid4_new;
 	raid4_new = create_new_image("raid4_new", 16);
-	printf("%d\n", blkdev_num_blocks(raid4_new));
+	printf("%lld\n", blkdev_num_blocks(raid4_new));
 	for (int j = 0; j < 4; j++){
 			char raid_name[8];
 			sprintf(raid_name, "raid4_%d", j);
@@ -163,5 +267,214 @@ int main(){
    	assert (val == E_UNAVAIL);
 
     dump(buf_read, 24*BLOCK_SIZE, "raid4_read_test");
+
+	/* parity journal: a row written just before a "crash" (the volume
+	 * is never closed) gets its parity recomputed on the next start.
+	 */
+	struct blkdev* jr_drives[4];
+	for (int j = 0; j < 4; j++){
+		char raid_name[16];
+		sprintf(raid_name, "raid4_j%d", j);
+		jr_drives[j] = create_new_image(raid_name, 16);
+	}
+	raid4 = raid4_create(4, jr_drives, 4);
+	val = raid4_set_journal(raid4, create_new_image("raid4_journal", 8));
+	assert(val == SUCCESS);
+	write_data_char(buf, 24*BLOCK_SIZE, 'J');
+	val = blkdev_write(raid4, 12, 2, buf);
+	assert(val == SUCCESS);
+
+	/* the crash tore the parity write for row 1 */
+	char garbage[4*BLOCK_SIZE];
+	write_data_char(garbage, 4*BLOCK_SIZE, 'X');
+	struct blkdev *par = image_create("raid4_j3");
+	blkdev_write(par, 4, 4, garbage);
+	blkdev_close(par);
+
+	for (int j = 0; j < 4; j++){
+		char raid_name[16];
+		sprintf(raid_name, "raid4_j%d", j);
+		jr_drives[j] = image_create(raid_name);
+	}
+	raid4 = raid4_create(4, jr_drives, 4);
+	val = raid4_set_journal(raid4, image_create("raid4_journal"));
+	assert(val == SUCCESS);
+
+	/* reconstructing the row from parity gives back the data */
+	image_fail(jr_drives[0]);
+	val = blkdev_read(raid4, 12, 2, buf_read);
+	assert(val == SUCCESS);
+	assert(memcmp(buf, buf_read, 2*BLOCK_SIZE) == 0);
+	blkdev_close(raid4);
+
+	/* the journal of one geometry isn't taken over by another */
+	for (int j = 0; j < 4; j++){
+		char raid_name[16];
+		sprintf(raid_name, "raid4_j%d", j);
+		jr_drives[j] = image_create(raid_name);
+	}
+	raid4 = raid4_create(4, jr_drives, 2);
+	struct blkdev *jdev = image_create("raid4_journal");
+	assert(raid4_set_journal(raid4, jdev) != SUCCESS);
+	blkdev_close(jdev);
+	blkdev_close(raid4);
+
+	/* scrub: 5 disks x 64 blocks, unit 4 -> 16 rows */
+	struct blkdev* sc_drives[5];
+	for (int j = 0; j < 5; j++){
+		char raid_name[16];
+		sprintf(raid_name, "raid4_s%d", j);
+		sc_drives[j] = create_new_image(raid_name, 64);
+	}
+	raid4 = raid4_create(5, sc_drives, 4);
+	char big[64*BLOCK_SIZE];
+	for (int i = 0; i < 64*BLOCK_SIZE; i++)
+		big[i] = rand();
+	for (int k = 0; k < 4; k++) {
+		val = blkdev_write(raid4, k*64, 64, big);
+		assert(val == SUCCESS);
+	}
+
+	/* damage the parity of rows 2 and 12 behind the volume's back */
+	write_data_char(garbage, BLOCK_SIZE, 'X');
+	blkdev_write(sc_drives[4], 2*4+1, 1, garbage);
+	blkdev_write(sc_drives[4], 12*4, 1, garbage);
+
+	struct raid4_scrub_opts opts = {.rows_per_chunk = 3, .checkpoint = "raid4_scrub_cp"};
+	struct raid4_scrub_status st;
+	struct raid4_scrub *sc = raid4_scrub_start(raid4, &opts);
+	scrub_wait(sc, &st);
+	assert(st.rows_done == 16 && st.nrows == 16 && st.mismatches == 2);
+	assert(raid4_scrub_stop(sc, 1) == SUCCESS);
+
+	/* resume from a checkpoint half way through: only row 12 is seen */
+	FILE *cp = fopen("raid4_scrub_cp", "w");
+	fprintf(cp, "16 8\n");
+	fclose(cp);
+	sc = raid4_scrub_start(raid4, &opts);
+	scrub_wait(sc, &st);
+	assert(st.rows_done == 16 && st.mismatches == 1);
+	assert(raid4_scrub_stop(sc, 1) == SUCCESS);
+
+	/* a capped scrub with repair fixes both rows */
+	opts.repair = 1;
+	opts.max_kbps = 4096;
+	sc = raid4_scrub_start(raid4, &opts);
+	scrub_wait(sc, &st);
+	assert(st.mismatches == 2 && st.repaired == 2);
+	assert(raid4_scrub_stop(sc, 1) == SUCCESS);
+	opts.repair = 0;
+	sc = raid4_scrub_start(raid4, &opts);
+	scrub_wait(sc, &st);
+	assert(st.mismatches == 0 && st.rows_done == 16);
+	assert(raid4_scrub_stop(sc, 1) == SUCCESS);
+
+	/* a member the scrub finds dead is failed in the volume */
+	raid4_set_notify(raid4, fail_event, NULL);
+	image_fail(sc_drives[3]);
+	sc = raid4_scrub_start(raid4, &opts);
+	scrub_wait(sc, &st);
+	assert(st.error == E_UNAVAIL && failed_member == 3);
+	raid4_scrub_stop(sc, 1);
+	char scheck[64*BLOCK_SIZE];
+	assert(blkdev_read(raid4, 0, 64, scheck) == SUCCESS);
+	assert(memcmp(scheck, big, sizeof(scheck)) == 0);
+	blkdev_close(raid4);
+
+	/* closing the volume stops a scrub still running on it */
+	for (int j = 0; j < 5; j++) {
+		char raid_name[16];
+		sprintf(raid_name, "raid4_s%d", j);
+		sc_drives[j] = image_create(raid_name);
+	}
+	raid4 = raid4_create(5, sc_drives, 4);
+	struct raid4_scrub_opts slow = {.rows_per_chunk = 1, .max_kbps = 200};
+	sc = raid4_scrub_start(raid4, &slow);
+	assert(raid4_scrub_start(raid4, &slow) == NULL);	/* one at a time */
+	usleep(20000);
+	blkdev_close(raid4);
+	raid4_scrub_status(sc, &st);
+	assert(!st.running && st.rows_done < 16);
+	assert(raid4_scrub_stop(sc, 0) == SUCCESS);
+
+	/* statistics of the volume and its members */
+	for (int j = 0; j < 5; j++) {
+		char raid_name[16];
+		sprintf(raid_name, "raid4_s%d", j);
+		sc_drives[j] = image_create(raid_name);
+	}
+	raid4 = raid4_create(5, sc_drives, 4);
+	char sbuf[8*BLOCK_SIZE];
+	for (int k = 0; k < 10; k++)
+		assert(blkdev_read(raid4, k*8, 8, sbuf) == SUCCESS);
+	assert(blkdev_write(raid4, 72, 8, sbuf) == SUCCESS);	/* rewrite the last read */
+	assert(blkdev_read(raid4, 10000, 1, sbuf) != SUCCESS);
+	assert(raid4->stats.ops[BLKDEV_READ] == 10 && raid4->stats.blocks[BLKDEV_READ] == 80);
+	assert(raid4->stats.ops[BLKDEV_WRITE] == 1 && raid4->stats.errors[BLKDEV_READ] == 1);
+	struct stats_walk walk = {0};
+	blkdev_stats(raid4, count_stats, &walk);
+	assert(walk.ndevs == 6 && walk.maxdepth == 1 && walk.member_reads >= 10);
+	blkdev_stats_reset(raid4);
+	assert(raid4->stats.ops[BLKDEV_READ] == 0 && sc_drives[0]->stats.ops[BLKDEV_READ] == 0);
+	blkdev_close(raid4);
+	printf("raid4 stats test passed\n");
+
+	/* hedged reads: with one member slow, its strips are rebuilt from
+	 * parity instead of waiting for it.
+	 */
+	for (int j = 0; j < 5; j++) {
+		char raid_name[16];
+		sprintf(raid_name, "raid4_s%d", j);
+		sc_drives[j] = image_create(raid_name);
+	}
+	sc_drives[1] = slow_create(sc_drives[1], 100000);
+	raid4 = raid4_create(5, sc_drives, 4);
+	struct hedge_opts hopts = {.enable = 1, .min_us = 2000};
+	raid4_set_hedge(raid4, &hopts);
+	char check[64*BLOCK_SIZE];
+	for (int k = 0; k < 4; k++) {
+		assert(blkdev_read(raid4, k*64, 64, check) == SUCCESS);
+		assert(memcmp(check, big, sizeof(check)) == 0);
+	}
+	long long hedged, won;
+	raid4_hedge_stats(raid4, &hedged, &won);
+	assert(hedged > 0 && won > 0);
+
+	/* a member that fails while the reconstruction answers for it
+	 * is still flagged
+	 */
+	raid4_set_notify(raid4, fail_event, NULL);
+	image_fail(sc_drives[2]);
+	for (int k = 0; k < 4; k++) {
+		assert(blkdev_read(raid4, k*64, 64, check) == SUCCESS);
+		assert(memcmp(check, big, sizeof(check)) == 0);
+	}
+	assert(failed_member == 2);
+	blkdev_close(raid4);
+	printf("raid4 hedged read test passed\n");
+
+	/* concurrent writers must leave every row's parity consistent */
+	for (int j = 0; j < 5; j++) {
+		char raid_name[16];
+		sprintf(raid_name, "raid4_s%d", j);
+		sc_drives[j] = image_create(raid_name);
+	}
+	raid4 = raid4_create(5, sc_drives, 4);
+	pthread_t threads[4];
+	struct writer_arg wargs[4];
+	for (int k = 0; k < 4; k++) {
+		wargs[k] = (struct writer_arg){raid4, k, blkdev_num_blocks(raid4)};
+		pthread_create(&threads[k], NULL, writer_thread, &wargs[k]);
+	}
+	for (int k = 0; k < 4; k++)
+		pthread_join(threads[k], NULL);
+	struct raid4_scrub_opts copts = {.rows_per_chunk = 4};
+	sc = raid4_scrub_start(raid4, &copts);
+	scrub_wait(sc, &st);
+	assert(st.rows_done == 16 && st.mismatches == 0);
+	assert(raid4_scrub_stop(sc, 1) == SUCCESS);
+	blkdev_close(raid4);
+	printf("raid4 concurrent write test passed\n");
+
 	printf("raid4 tests passed.\n");
 }
\ No newline at end of file
@@ -0,0 +1,83 @@
+#include "blkdev.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+#include <time.h>
+
+long long now_us(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+int main(){
+	char buf[4*BLOCK_SIZE], rbuf[4*BLOCK_SIZE];
+
+	/* same contract as an image */
+	struct blkdev *ram = ramdisk_create(64);
+	assert(ram != NULL && blkdev_num_blocks(ram) == 64);
+	assert(blkdev_read(ram, 10, 4, rbuf) == SUCCESS);
+	for (int i = 0; i < 4*BLOCK_SIZE; i++)
+		assert(rbuf[i] == 0);
+	memset(buf, 'R', sizeof(buf));
+	assert(blkdev_write(ram, 60, 4, buf) == SUCCESS);
+	assert(blkdev_read(ram, 60, 4, rbuf) == SUCCESS);
+	assert(memcmp(buf, rbuf, sizeof(buf)) == 0);
+	assert(blkdev_read(ram, 62, 4, rbuf) == E_BADADDR);
+	assert(blkdev_write(ram, -1, 1, buf) == E_BADADDR);
+	ramdisk_fail(ram);
+	assert(blkdev_read(ram, 0, 1, rbuf) == E_UNAVAIL);
+	assert(blkdev_write(ram, 0, 1, buf) == E_UNAVAIL);
+	blkdev_close(ram);
+	printf("ramdisk read/write test passed\n");
+
+	/* a raid4 on RAM disks survives a member failure */
+	struct blkdev *drives[5];
+	for (int j = 0; j < 5; j++)
+		drives[j] = ramdisk_create(32);
+	struct blkdev *raid4 = raid4_create(5, drives, 4);
+	for (int k = 0; k < 32; k++) {
+		memset(buf, 'a' + k % 26, sizeof(buf));
+		assert(blkdev_write(raid4, k*4, 4, buf) == SUCCESS);
+	}
+	ramdisk_fail(drives[2]);
+	for (int k = 0; k < 32; k++) {
+		memset(buf, 'a' + k % 26, sizeof(buf));
+		assert(blkdev_read(raid4, k*4, 4, rbuf) == SUCCESS);
+		assert(memcmp(buf, rbuf, sizeof(buf)) == 0);
+	}
+	blkdev_close(raid4);
+	printf("ramdisk raid4 test passed\n");
+
+	/* service time models */
+	ram = ramdisk_create(64);
+	struct ramdisk_model m = {.dist = RAMDISK_FIXED, .lat_us = 2000};
+	ramdisk_set_model(ram, &m);
+	long long t = now_us();
+	for (int i = 0; i < 5; i++)
+		assert(blkdev_read(ram, 0, 1, rbuf) == SUCCESS);
+	assert(now_us() - t >= 5 * 2000);
+
+	/* 1 MB/s: 4 blocks take about 2ms each */
+	struct ramdisk_model bw = {.mbps = 1};
+	ramdisk_set_model(ram, &bw);
+	t = now_us();
+	for (int i = 0; i < 5; i++)
+		assert(blkdev_write(ram, 0, 4, buf) == SUCCESS);
+	assert(now_us() - t >= 5 * 2048);
+
+	struct ramdisk_model ex = {.dist = RAMDISK_EXP, .lat_us = 100, .tail_pct = 100, .tail_us = 1000, .seed = 7};
+	ramdisk_set_model(ram, &ex);
+	t = now_us();
+	assert(blkdev_read(ram, 0, 1, rbuf) == SUCCESS);
+	assert(now_us() - t >= 1000);
+
+	ramdisk_set_model(ram, NULL);
+	assert(blkdev_read(ram, 0, 1, rbuf) == SUCCESS);
+	blkdev_close(ram);
+	printf("ramdisk model test passed\n");
+
+	printf("ramdisk tests passed.\n");
+}
@@ -0,0 +1,3 @@
+#!/bin/sh
+
+gcc -g3 -o ramdisk-test ramdisk-test.c image.c homework.c journal.c ramdisk.c -lpthread -lm
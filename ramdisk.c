@@ -0,0 +1,372 @@
+/*
+ * file:        ramdisk.c
+ * description: in-memory block device, with optional latency and
+ *              bandwidth models for simulating real (and slow) disks
+ *
+ * The blocks live in anonymous memory, from huge pages when the
+ * system has them reserved (MAP_HUGETLB) and otherwise from ordinary
+ * pages with a transparent huge page hint.
+ *
+ * A model adds a service time to each request: a fixed or random
+ * access latency, an occasional slow 'tail' request, and a transfer
+ * time from the bandwidth. Transfers share the device, so concurrent
+ * requests queue behind each other the way they would on one disk.
+ *
+ * Like the sectors of a real disk, each block is read or written
+ * whole: a request holds the locks of the stripes it covers while it
+ * copies, so overlapping requests never see (or leave) half of one.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include "blkdev.h"
+
+#define RAMDISK_HUGE (2 * 1024 * 1024)
+#define RAM_STRIPES 64
+#define RAM_STRIPE_BYTES 4096
+
+struct ramdisk_dev {
+    char *mem;
+    size_t maplen;
+    int bsize;                  /* bytes per block */
+    blkno_t nblks;
+    int failed;
+    int huge;                   /* backed by MAP_HUGETLB pages */
+    struct ramdisk_model model;
+    unsigned int seed;
+    long long busy_until;       /* end of the last queued transfer */
+    pthread_mutex_t lock;       /* model state */
+    pthread_rwlock_t stripe[RAM_STRIPES]; /* RAM_STRIPE_BYTES each, round robin */
+};
+
+static long long ram_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* sleeps overshoot by the timer slack (50us by default), so sleep
+ * until shortly before 't' and yield the rest of the way.
+ */
+#define RAM_SLACK_NS 60000
+
+static void ram_sleep_until(long long t)
+{
+    long long now;
+    while ((now = ram_now()) < t) {
+        if (t - now > RAM_SLACK_NS) {
+            long long wake = t - RAM_SLACK_NS;
+            struct timespec ts = {wake / 1000000000LL, wake % 1000000000LL};
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+        } else {
+            sched_yield();
+        }
+    }
+}
+
+/* uniform in [0,1) */
+static double ram_rand(struct ramdisk_dev *rd)
+{
+    return rand_r(&rd->seed) / ((double)RAND_MAX + 1);
+}
+
+/* access latency of one request, in ns. Called with the lock held. */
+static long long ram_latency(struct ramdisk_dev *rd)
+{
+    struct ramdisk_model *m = &rd->model;
+    double us = 0;
+    switch (m->dist) {
+    case RAMDISK_FIXED:
+        us = m->lat_us;
+        break;
+    case RAMDISK_UNIFORM:
+        us = m->lat_us + (2 * ram_rand(rd) - 1) * m->jitter_us;
+        break;
+    case RAMDISK_EXP:
+        us = -log(1 - ram_rand(rd)) * m->lat_us;
+        break;
+    }
+    if (m->tail_pct > 0 && ram_rand(rd) * 100 < m->tail_pct)
+        us += m->tail_us;
+    return us > 0 ? (long long)(us * 1000) : 0;
+}
+
+/* wait out the modelled service time of a request of 'len' blocks */
+static void ram_delay(struct ramdisk_dev *rd, blkno_t len)
+{
+    if (rd->model.dist == RAMDISK_NONE && rd->model.mbps == 0)
+        return;
+    long long start = ram_now();
+    pthread_mutex_lock(&rd->lock);
+    long long done = start + ram_latency(rd);
+    if (rd->model.mbps > 0) {
+        long long xfer = (long long)len * rd->bsize * 1000LL / rd->model.mbps;
+        if (rd->busy_until > done)
+            done = rd->busy_until;
+        done += xfer;
+        rd->busy_until = done;
+    }
+    pthread_mutex_unlock(&rd->lock);
+    ram_sleep_until(done);
+}
+
+/* the stripes covering a request, as a bit mask */
+static uint64_t ram_stripes(struct ramdisk_dev *rd, blkno_t first_blk, blkno_t num_blks)
+{
+    if (num_blks <= 0)
+        return 0;
+    size_t lo = (size_t)first_blk * rd->bsize / RAM_STRIPE_BYTES;
+    size_t hi = ((size_t)(first_blk + num_blks) * rd->bsize - 1) / RAM_STRIPE_BYTES;
+    if (hi - lo >= RAM_STRIPES - 1)
+        return ~0ULL;
+    uint64_t mask = 0;
+    for (size_t i = lo; i <= hi; i++)
+        mask |= 1ULL << (i % RAM_STRIPES);
+    return mask;
+}
+
+/* always in stripe order, so requests can't deadlock */
+static void ram_lock(struct ramdisk_dev *rd, uint64_t mask, int write)
+{
+    for (int i = 0; i < RAM_STRIPES; i++) {
+        if (mask & (1ULL << i)) {
+            if (write)
+                pthread_rwlock_wrlock(&rd->stripe[i]);
+            else
+                pthread_rwlock_rdlock(&rd->stripe[i]);
+        }
+    }
+}
+
+static void ram_unlock(struct ramdisk_dev *rd, uint64_t mask)
+{
+    for (int i = 0; i < RAM_STRIPES; i++)
+        if (mask & (1ULL << i))
+            pthread_rwlock_unlock(&rd->stripe[i]);
+}
+
+static blkno_t ram_num_blocks(struct blkdev *dev)
+{
+    struct ramdisk_dev *rd = dev->private;
+    return rd->nblks;
+}
+
+static int ram_block_size(struct blkdev *dev)
+{
+    struct ramdisk_dev *rd = dev->private;
+    return rd->bsize;
+}
+
+static int ram_read(struct blkdev *dev, blkno_t first_blk, int num_blks, void *buf)
+{
+    struct ramdisk_dev *rd = dev->private;
+    if (__atomic_load_n(&rd->failed, __ATOMIC_ACQUIRE))
+        return E_UNAVAIL;
+    if (first_blk < 0 || num_blks < 0 || first_blk > rd->nblks - num_blks)
+        return E_BADADDR;
+    ram_delay(rd, num_blks);
+    uint64_t mask = ram_stripes(rd, first_blk, num_blks);
+    ram_lock(rd, mask, 0);
+    memcpy(buf, rd->mem + (size_t)first_blk * rd->bsize, (size_t)num_blks * rd->bsize);
+    ram_unlock(rd, mask);
+    return SUCCESS;
+}
+
+static int ram_write(struct blkdev *dev, blkno_t first_blk, int num_blks, void *buf)
+{
+    struct ramdisk_dev *rd = dev->private;
+    if (__atomic_load_n(&rd->failed, __ATOMIC_ACQUIRE))
+        return E_UNAVAIL;
+    if (first_blk < 0 || num_blks < 0 || first_blk > rd->nblks - num_blks)
+        return E_BADADDR;
+    ram_delay(rd, num_blks);
+    uint64_t mask = ram_stripes(rd, first_blk, num_blks);
+    ram_lock(rd, mask, 1);
+    memcpy(rd->mem + (size_t)first_blk * rd->bsize, buf, (size_t)num_blks * rd->bsize);
+    ram_unlock(rd, mask);
+    return SUCCESS;
+}
+
+/* give whole pages back (they read as zeros afterwards) and zero the
+ * partial pages at either end. Discards take no service time.
+ */
+static int ram_discard(struct blkdev *dev, blkno_t first_blk, blkno_t num_blks)
+{
+    struct ramdisk_dev *rd = dev->private;
+    if (__atomic_load_n(&rd->failed, __ATOMIC_ACQUIRE))
+        return E_UNAVAIL;
+    if (first_blk < 0 || num_blks < 0 || first_blk > rd->nblks - num_blks)
+        return E_BADADDR;
+    size_t pg = rd->huge ? RAMDISK_HUGE : (size_t)sysconf(_SC_PAGESIZE);
+    size_t start = (size_t)first_blk * rd->bsize, end = start + (size_t)num_blks * rd->bsize;
+    size_t lo = (start + pg - 1) / pg * pg, hi = end / pg * pg;
+    uint64_t mask = ram_stripes(rd, first_blk, num_blks);
+    ram_lock(rd, mask, 1);
+    if (lo < hi && madvise(rd->mem + lo, hi - lo, MADV_DONTNEED) == 0) {
+        memset(rd->mem + start, 0, lo - start);
+        memset(rd->mem + hi, 0, end - hi);
+    } else {
+        memset(rd->mem + start, 0, end - start);
+    }
+    ram_unlock(rd, mask);
+    return SUCCESS;
+}
+
+/* straight from one RAM disk to the other. Both disks' models apply;
+ * the two disks are locked in address order.
+ */
+static int ram_copy(struct blkdev *dev, blkno_t first_blk, struct blkdev *src,
+                    blkno_t src_blk, blkno_t num_blks)
+{
+    struct ramdisk_dev *rd = dev->private, *srd = src->private;
+    if (__atomic_load_n(&rd->failed, __ATOMIC_ACQUIRE) ||
+        __atomic_load_n(&srd->failed, __ATOMIC_ACQUIRE))
+        return E_UNAVAIL;
+    if (first_blk < 0 || num_blks < 0 || first_blk > rd->nblks - num_blks ||
+        src_blk < 0 || src_blk > srd->nblks - num_blks)
+        return E_BADADDR;
+    if (rd->bsize != srd->bsize)
+        return E_SIZE;
+    ram_delay(srd, num_blks);
+    ram_delay(rd, num_blks);
+    uint64_t dmask = ram_stripes(rd, first_blk, num_blks);
+    uint64_t smask = ram_stripes(srd, src_blk, num_blks);
+    if (rd == srd) {
+        ram_lock(rd, dmask | smask, 1);
+    } else if (rd < srd) {
+        ram_lock(rd, dmask, 1);
+        ram_lock(srd, smask, 0);
+    } else {
+        ram_lock(srd, smask, 0);
+        ram_lock(rd, dmask, 1);
+    }
+    memmove(rd->mem + (size_t)first_blk * rd->bsize, srd->mem + (size_t)src_blk * rd->bsize,
+            (size_t)num_blks * rd->bsize);
+    ram_unlock(rd, dmask);
+    if (rd != srd)
+        ram_unlock(srd, smask);
+    return SUCCESS;
+}
+
+/* memory is as durable as it gets: only a failed disk can't flush */
+static int ram_flush(struct blkdev *dev)
+{
+    struct ramdisk_dev *rd = dev->private;
+    if (__atomic_load_n(&rd->failed, __ATOMIC_ACQUIRE))
+        return E_UNAVAIL;
+    return SUCCESS;
+}
+
+static void ram_close(struct blkdev *dev)
+{
+    struct ramdisk_dev *rd = dev->private;
+    munmap(rd->mem, rd->maplen);
+    pthread_mutex_destroy(&rd->lock);
+    for (int i = 0; i < RAM_STRIPES; i++)
+        pthread_rwlock_destroy(&rd->stripe[i]);
+    free(rd);
+    dev->private = NULL;
+    free(dev);
+}
+
+struct blkdev_ops ramdisk_ops = {
+    .num_blocks = ram_num_blocks,
+    .read = ram_read,
+    .write = ram_write,
+    .close = ram_close,
+    .type = "ramdisk",
+    .discard = ram_discard,
+    .copy = ram_copy,
+    .block_size = ram_block_size,
+    .flush = ram_flush
+};
+
+/* create a zero-filled RAM disk of 'nblocks' blocks of 'block_size' bytes */
+struct blkdev *ramdisk_create_bs(blkno_t nblocks, int block_size)
+{
+    if (nblocks < 1) {
+        printf("Error: ramdisk must have at least 1 block.\n");
+        return NULL;
+    }
+    if (!blkdev_block_size_ok(block_size)) {
+        printf("Error: bad block size %d.\n", block_size);
+        return NULL;
+    }
+    if (nblocks > (blkno_t)(SIZE_MAX / block_size)) {
+        printf("Error: can't allocate %lld block ramdisk.\n", nblocks);
+        return NULL;
+    }
+    size_t len = (size_t)nblocks * block_size;
+    size_t hlen = (len + RAMDISK_HUGE - 1) / RAMDISK_HUGE * RAMDISK_HUGE;
+    int huge = 1;
+
+    char *mem = mmap(NULL, hlen, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (mem == MAP_FAILED) {
+        huge = 0;
+        hlen = len;
+        mem = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) {
+            printf("Error: can't allocate %lld block ramdisk.\n", nblocks);
+            return NULL;
+        }
+#ifdef MADV_HUGEPAGE
+        madvise(mem, len, MADV_HUGEPAGE);
+#endif
+    }
+
+    struct blkdev *dev = calloc(1, sizeof(*dev));
+    struct ramdisk_dev *rd = calloc(1, sizeof(*rd));
+    rd->mem = mem;
+    rd->maplen = hlen;
+    rd->bsize = block_size;
+    rd->nblks = nblocks;
+    rd->huge = huge;
+    rd->seed = 1;
+    pthread_mutex_init(&rd->lock, NULL);
+    for (int i = 0; i < RAM_STRIPES; i++)
+        pthread_rwlock_init(&rd->stripe[i], NULL);
+    dev->private = rd;
+    dev->ops = &ramdisk_ops;
+    return dev;
+}
+
+struct blkdev *ramdisk_create(blkno_t nblocks)
+{
+    return ramdisk_create_bs(nblocks, BLOCK_SIZE);
+}
+
+/* force a RAM disk into failure, like image_fail */
+void ramdisk_fail(struct blkdev *dev)
+{
+    struct ramdisk_dev *rd = dev->private;
+    __atomic_store_n(&rd->failed, 1, __ATOMIC_RELEASE);
+}
+
+/* set (or with NULL, clear) the service time model of a RAM disk.
+ * Set it while the disk is idle.
+ */
+void ramdisk_set_model(struct blkdev *dev, struct ramdisk_model *m)
+{
+    struct ramdisk_dev *rd = dev->private;
+    pthread_mutex_lock(&rd->lock);
+    if (m != NULL) {
+        rd->model = *m;
+        rd->seed = m->seed;
+    } else {
+        memset(&rd->model, 0, sizeof(rd->model));
+    }
+    rd->busy_until = 0;
+    pthread_mutex_unlock(&rd->lock);
+}
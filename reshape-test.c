@@ -0,0 +1,343 @@
+#include "blkdev.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+#include <pthread.h>
+
+#define UNIT 4
+
+/* blocks hold "seq:lba"; seq 0 is a block of zeros */
+void fill_block(char *buf, int seq, blkno_t lba){
+	memset(buf, 0, BLOCK_SIZE);
+	if (seq != 0)
+		sprintf(buf, "%d:%lld", seq, lba);
+}
+
+void write_all(struct blkdev *vol, int seq){
+	char buf[16*BLOCK_SIZE];
+	blkno_t n = blkdev_num_blocks(vol);
+	for (blkno_t lba = 0; lba < n; lba += 16) {
+		int len = n - lba < 16 ? n - lba : 16;
+		for (int i = 0; i < len; i++)
+			fill_block(&buf[i*BLOCK_SIZE], seq, lba + i);
+		if (blkdev_write(vol, lba, len, buf) != SUCCESS) {
+			printf("Write at %lld failed!\n", lba);
+			exit(1);
+		}
+	}
+}
+
+/* blocks first..first+n-1 hold seqs[] */
+void verify(struct blkdev *vol, blkno_t first, blkno_t n, int *seqs){
+	char buf[16*BLOCK_SIZE], expect[BLOCK_SIZE];
+	for (blkno_t lba = first; lba < first + n; lba += 16) {
+		int len = first + n - lba < 16 ? first + n - lba : 16;
+		if (blkdev_read(vol, lba, len, buf) != SUCCESS) {
+			printf("Read at %lld failed!\n", lba);
+			exit(1);
+		}
+		for (int i = 0; i < len; i++) {
+			fill_block(expect, seqs[lba + i - first], lba + i);
+			if (memcmp(&buf[i*BLOCK_SIZE], expect, BLOCK_SIZE) != 0) {
+				printf("Block %lld doesn't match: %s, expected %s\n",
+				       lba + i, &buf[i*BLOCK_SIZE], expect);
+				exit(1);
+			}
+		}
+	}
+}
+
+/* foreground traffic while a reshape runs: writes of a new seq and
+ * reads checked against what was written, over the old volume size
+ */
+struct traffic {
+	struct blkdev *vol;
+	blkno_t nblks;
+	int *seqs;
+	int stop;
+	long ops;
+};
+
+void *traffic_thread(void *arg){
+	struct traffic *t = arg;
+	char buf[8*BLOCK_SIZE], expect[BLOCK_SIZE];
+	unsigned int seed = 1;
+	while (!__atomic_load_n(&t->stop, __ATOMIC_ACQUIRE)) {
+		int len = 1 + rand_r(&seed) % 8;
+		blkno_t lba = rand_r(&seed) % (t->nblks - len);
+		if (rand_r(&seed) % 2) {
+			int seq = 2 + rand_r(&seed) % 1000;
+			for (int i = 0; i < len; i++) {
+				fill_block(&buf[i*BLOCK_SIZE], seq, lba + i);
+				t->seqs[lba + i] = seq;
+			}
+			assert(blkdev_write(t->vol, lba, len, buf) == SUCCESS);
+		} else {
+			assert(blkdev_read(t->vol, lba, len, buf) == SUCCESS);
+			for (int i = 0; i < len; i++) {
+				fill_block(expect, t->seqs[lba + i], lba + i);
+				if (memcmp(&buf[i*BLOCK_SIZE], expect, BLOCK_SIZE) != 0) {
+					printf("Block %lld doesn't match during reshape\n", lba + i);
+					exit(1);
+				}
+			}
+		}
+		__atomic_add_fetch(&t->ops, 1, __ATOMIC_RELEASE);
+	}
+	return NULL;
+}
+
+struct blkdev **ramdisks(int n, blkno_t nblks){
+	struct blkdev **d = calloc(n, sizeof(*d));
+	for (int i = 0; i < n; i++)
+		d[i] = ramdisk_create(nblks);
+	return d;
+}
+
+/* grow a volume on 'from' disks to 'to' with traffic running */
+void grow(int raid4, int from, int to, blkno_t dblks){
+	struct blkdev **disks = ramdisks(to, dblks);
+	int dfrom = raid4 ? from - 1 : from, dto = raid4 ? to - 1 : to;
+	struct blkdev *vol = raid4 ? raid4_create(from, disks, UNIT) : raid0_create(from, disks, UNIT);
+	blkno_t old = blkdev_num_blocks(vol);
+	assert(old == dblks * dfrom);
+	write_all(vol, 1);
+
+	struct traffic t = {vol, old, malloc(old * sizeof(int)), 0, 0};
+	for (blkno_t i = 0; i < old; i++)
+		t.seqs[i] = 1;
+	pthread_t th;
+	pthread_create(&th, NULL, traffic_thread, &t);
+	while (__atomic_load_n(&t.ops, __ATOMIC_ACQUIRE) < 100)
+		usleep(100);
+	int val = raid4 ? raid4_reshape(vol, to, disks) : raid0_reshape(vol, to, disks);
+	__atomic_store_n(&t.stop, 1, __ATOMIC_RELEASE);
+	pthread_join(th, NULL);
+	assert(val == SUCCESS);
+
+	/* the old data in the new layout, and new space that reads as zeros */
+	assert(blkdev_num_blocks(vol) == dblks * dto);
+	verify(vol, 0, old, t.seqs);
+	int *zeros = calloc(dblks * dto - old, sizeof(int));
+	verify(vol, old, dblks * dto - old, zeros);
+	free(zeros);
+
+	/* the whole volume is usable, and raid4 parity is right: lose a disk */
+	write_all(vol, 3);
+	int *threes = malloc(dblks * dto * sizeof(int));
+	for (blkno_t i = 0; i < dblks * dto; i++)
+		threes[i] = 3;
+	if (raid4) {
+		ramdisk_fail(disks[1]);
+		verify(vol, 0, dblks * dto, threes);
+		ramdisk_fail(disks[0]);
+		char buf[BLOCK_SIZE];
+		assert(blkdev_read(vol, 0, 1, buf) == E_UNAVAIL);
+	} else {
+		verify(vol, 0, dblks * dto, threes);
+	}
+	printf("%s %d -> %d disks: about %ld foreground ops during reshape\n",
+	       raid4 ? "raid4" : "raid0", from, to, t.ops - 100);
+	blkdev_close(vol);
+	free(threes);
+	free(t.seqs);
+	free(disks);
+}
+
+void bad_reshape_tests(void){
+	struct blkdev **disks = ramdisks(6, 256);
+	struct blkdev *vol = raid4_create(3, disks, UNIT);
+	struct blkdev *other[4] = {disks[0], disks[1], disks[3], disks[4]};
+	struct blkdev *small = ramdisk_create(128);
+	struct blkdev *withsmall[4] = {disks[0], disks[1], disks[2], small};
+	assert(raid4_reshape(vol, 3, disks) == E_SIZE);        /* no new disk */
+	assert(raid4_reshape(vol, 2, disks) == E_SIZE);        /* shrinking */
+	assert(raid4_reshape(vol, 4, other) == E_SIZE);        /* not the same disks */
+	assert(raid4_reshape(vol, 4, withsmall) == E_SIZE);    /* too small */
+	assert(blkdev_num_blocks(vol) == 512);
+	blkdev_close(small);
+
+	/* not while degraded */
+	char buf[BLOCK_SIZE];
+	ramdisk_fail(disks[1]);
+	assert(blkdev_read(vol, UNIT, 1, buf) == SUCCESS);
+	assert(raid4_reshape(vol, 4, disks) == E_UNAVAIL);
+
+	/* a volume with too few rows for the backup area */
+	struct blkdev **tiny = ramdisks(3, 8);
+	struct blkdev *t0 = raid0_create(2, tiny, UNIT);
+	assert(raid0_reshape(t0, 3, tiny) == E_SIZE);
+	blkdev_close(t0);
+	blkdev_close(tiny[2]);
+	free(tiny);
+
+	/* nothing to continue */
+	for (int i = 3; i < 6; i++)
+		blkdev_close(disks[i]);
+	blkdev_close(vol);
+	free(disks);
+	printf("bad reshape test passed\n");
+}
+
+/********** crash and resume, with superblocks ***************/
+
+/* Disks that stop taking writes after a given number, all at once, as
+ * if the power had gone: later writes are dropped.
+ */
+int writes_left;
+
+struct blkdev *crash_wrap(struct blkdev *d);
+
+blkno_t crash_num_blocks(struct blkdev *dev){
+	return blkdev_num_blocks(dev->private);
+}
+
+int crash_block_size(struct blkdev *dev){
+	return blkdev_block_size(dev->private);
+}
+
+int crash_read(struct blkdev *dev, blkno_t first, int n, void *buf){
+	return blkdev_read(dev->private, first, n, buf);
+}
+
+int crash_write(struct blkdev *dev, blkno_t first, int n, void *buf){
+	if (__atomic_sub_fetch(&writes_left, 1, __ATOMIC_ACQ_REL) < 0)
+		return SUCCESS;
+	return blkdev_write(dev->private, first, n, buf);
+}
+
+int crash_discard(struct blkdev *dev, blkno_t first, blkno_t n){
+	if (__atomic_sub_fetch(&writes_left, 1, __ATOMIC_ACQ_REL) < 0)
+		return SUCCESS;
+	return blkdev_discard(dev->private, first, n);
+}
+
+void crash_close(struct blkdev *dev){
+	blkdev_close(dev->private);
+	free(dev);
+}
+
+struct blkdev_ops crash_ops = {
+	.num_blocks = crash_num_blocks,
+	.read = crash_read,
+	.write = crash_write,
+	.close = crash_close,
+	.type = "crash",
+	.discard = crash_discard,
+	.block_size = crash_block_size
+};
+
+struct blkdev *crash_wrap(struct blkdev *d){
+	struct blkdev *dev = calloc(1, sizeof(*dev));
+	dev->private = d;
+	dev->ops = &crash_ops;
+	return dev;
+}
+
+#define SB_DATA 64
+char *sb_names[] = {"reshape-d0", "reshape-d1", "reshape-d2", "reshape-d3", "reshape-d4"};
+
+struct blkdev *new_image(char *path){
+	FILE *fp = fopen(path, "w");
+	assert(fp != NULL);
+	assert(ftruncate(fileno(fp), (long)(SB_DATA + 1) * BLOCK_SIZE) == 0);
+	fclose(fp);
+	return image_create(path);
+}
+
+struct blkdev *assemble(int n, struct raid_info *info){
+	struct blkdev *cands[5];
+	for (int i = 0; i < n; i++)
+		cands[i] = crash_wrap(image_create(sb_names[i]));
+	memset(info, 0, sizeof(*info));
+	struct blkdev *vol = raid_assemble(cands, n, info);
+	assert(vol != NULL);
+	for (int i = 0; i < n; i++) {
+		int used = 0;
+		for (int j = 0; j < info->ndisks; j++)
+			used |= info->members[j] == cands[i];
+		if (!used)
+			blkdev_close(cands[i]);
+	}
+	return vol;
+}
+
+/* grow a 4-disk raid4 (or raid0) to 5, with the power going after
+ * 'crash_at' writes (-1 for never). Returns the writes the reshape took.
+ */
+int crash_reshape(int level, int crash_at){
+	struct blkdev *disks[5];
+	struct raid_info info;
+	for (int i = 0; i < 5; i++)
+		disks[i] = new_image(sb_names[i]);
+	assert(raid_format(level, 4, disks, UNIT) == SUCCESS);
+	for (int i = 0; i < 5; i++)
+		blkdev_close(disks[i]);
+
+	__atomic_store_n(&writes_left, 1 << 30, __ATOMIC_RELEASE);
+	struct blkdev *vol = assemble(4, &info);
+	blkno_t old = blkdev_num_blocks(vol);
+	write_all(vol, 1);
+	struct blkdev *extra = crash_wrap(image_create(sb_names[4]));
+	__atomic_store_n(&writes_left, crash_at < 0 ? 1 << 30 : crash_at, __ATOMIC_RELEASE);
+	assert(raid_reshape(vol, 1, &extra) == SUCCESS);
+	int used = (1 << 30) - __atomic_load_n(&writes_left, __ATOMIC_ACQUIRE);
+	blkdev_close(vol);
+
+	/* after a crash the volume comes back in the middle of the
+	 * reshape, or before or after it, and finishes it
+	 */
+	__atomic_store_n(&writes_left, 1 << 30, __ATOMIC_RELEASE);
+	vol = assemble(5, &info);
+	assert(info.reshape_from == 0 || info.reshape_from == 4);
+	if (info.reshape_from != 0)
+		assert(raid_reshape(vol, 0, NULL) == SUCCESS);
+	else
+		assert(raid_reshape(vol, 0, NULL) == E_SIZE);
+	int data = level == RAID_RAID4 ? 3 : 4;
+	blkno_t nblks = blkdev_num_blocks(vol);
+	if (info.ndisks == 4) {
+		/* the crash came before the reshape started */
+		assert(nblks == old);
+		assert(raid_reshape(vol, 1, (struct blkdev *[]){crash_wrap(image_create(sb_names[4]))}) == SUCCESS);
+		nblks = blkdev_num_blocks(vol);
+	}
+	assert(nblks == old / data * (data + 1));
+	int *seqs = calloc(nblks, sizeof(int));
+	for (blkno_t i = 0; i < old; i++)
+		seqs[i] = 1;
+	verify(vol, 0, nblks, seqs);
+	free(seqs);
+	blkdev_close(vol);
+
+	/* and is assembled clean with 5 members from now on */
+	vol = assemble(5, &info);
+	assert(info.ndisks == 5 && info.reshape_from == 0 && !info.dirty);
+	blkdev_close(vol);
+	return crash_at < 0 ? used : 0;
+}
+
+void crash_tests(int level){
+	int total = crash_reshape(level, -1);
+	for (int k = 0; k <= total; k++)
+		crash_reshape(level, k);
+	printf("%s crash during reshape test passed (%d crash points)\n",
+	       level == RAID_RAID4 ? "raid4" : "raid0", total + 1);
+}
+
+int main(){
+	bad_reshape_tests();
+	grow(0, 2, 3, 512);
+	grow(0, 3, 7, 512);
+	grow(1, 3, 4, 512);
+	grow(1, 4, 5, 1024);
+	grow(1, 3, 6, 512);
+	crash_tests(RAID_RAID4);
+	crash_tests(RAID_RAID0);
+	for (int i = 0; i < 5; i++)
+		unlink(sb_names[i]);
+	printf("reshape tests passed.\n");
+	return 0;
+}
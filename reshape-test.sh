@@ -0,0 +1,3 @@
+#!/bin/sh
+
+gcc -g3 -o reshape-test reshape-test.c image.c homework.c journal.c superblock.c ramdisk.c -lpthread -lm
@@ -0,0 +1,266 @@
+#include "blkdev.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+#include <time.h>
+
+#define DISK_BLKS 1024
+#define UNIT 4
+
+/* every block holds "seq:lba" */
+void write_pattern(struct blkdev *vol, int seq){
+	char buf[32*BLOCK_SIZE];
+	blkno_t n = blkdev_num_blocks(vol);
+	for (blkno_t lba = 0; lba < n; lba += 32) {
+		int len = n - lba < 32 ? n - lba : 32;
+		memset(buf, 0, sizeof(buf));
+		for (int i = 0; i < len; i++)
+			sprintf(&buf[i*BLOCK_SIZE], "%d:%lld", seq, lba + i);
+		if (blkdev_write(vol, lba, len, buf) != SUCCESS) {
+			printf("Write at %lld failed!\n", lba);
+			exit(1);
+		}
+	}
+}
+
+void verify_pattern(struct blkdev *vol, int seq){
+	char buf[32*BLOCK_SIZE], expect[32];
+	blkno_t n = blkdev_num_blocks(vol);
+	for (blkno_t lba = 0; lba < n; lba += 32) {
+		int len = n - lba < 32 ? n - lba : 32;
+		if (blkdev_read(vol, lba, len, buf) != SUCCESS) {
+			printf("Read at %lld failed!\n", lba);
+			exit(1);
+		}
+		for (int i = 0; i < len; i++) {
+			sprintf(expect, "%d:%lld", seq, lba + i);
+			if (strcmp(&buf[i*BLOCK_SIZE], expect) != 0) {
+				printf("Block %lld doesn't match: %s, expected %s\n",
+				       lba + i, &buf[i*BLOCK_SIZE], expect);
+				exit(1);
+			}
+		}
+	}
+}
+
+void pool_tests(void){
+	struct spare_pool *pool = spare_pool_create();
+	assert(spare_pool_count(pool) == 0);
+	int i, val = SUCCESS;
+	for (i = 0; val == SUCCESS; i++) {
+		struct blkdev *d = ramdisk_create(8);
+		val = spare_pool_add(pool, d);
+		if (val != SUCCESS)
+			blkdev_close(d);
+	}
+	assert(val == E_SIZE && spare_pool_count(pool) == i - 1);
+	spare_pool_destroy(pool);
+	printf("spare pool test passed\n");
+}
+
+/* a spare of the wrong size is passed over, and a side lost while the
+ * pool is empty is rebuilt once it is given one
+ */
+void mirror_tests(void){
+	struct spare_pool *pool = spare_pool_create();
+	struct blkdev *disks[2] = {ramdisk_create(DISK_BLKS), ramdisk_create(DISK_BLKS)};
+	struct blkdev *vol = mirror_create(disks);
+	spare_pool_add(pool, ramdisk_create(DISK_BLKS / 2));
+	spare_pool_add(pool, ramdisk_create(DISK_BLKS));
+	mirror_set_spares(vol, pool);
+	write_pattern(vol, 1);
+
+	ramdisk_fail(disks[0]);
+	write_pattern(vol, 2);
+	assert(mirror_spare_wait(vol) == SUCCESS);
+	assert(spare_pool_count(pool) == 1);
+	ramdisk_fail(disks[1]);
+	verify_pattern(vol, 2);
+	write_pattern(vol, 3);
+	assert(mirror_spare_wait(vol) == SUCCESS);
+	assert(spare_pool_count(pool) == 1);     /* nothing fits */
+
+	struct spare_pool *other = spare_pool_create();
+	spare_pool_add(other, ramdisk_create(DISK_BLKS));
+	mirror_set_spares(vol, other);
+	assert(mirror_spare_wait(vol) == SUCCESS);
+	assert(spare_pool_count(other) == 0);
+	verify_pattern(vol, 3);
+	blkdev_close(vol);
+	spare_pool_destroy(other);
+	spare_pool_destroy(pool);
+	printf("mirror spare test passed\n");
+}
+
+/* a spare that fails during the rebuild is given up for the next one */
+void raid4_tests(void){
+	struct spare_pool *pool = spare_pool_create();
+	struct blkdev *disks[4];
+	for (int i = 0; i < 4; i++)
+		disks[i] = ramdisk_create(DISK_BLKS);
+	struct blkdev *vol = raid4_create(4, disks, UNIT);
+	struct blkdev *bad = ramdisk_create(DISK_BLKS);
+	ramdisk_fail(bad);
+	spare_pool_add(pool, bad);
+	spare_pool_add(pool, ramdisk_create(2 * DISK_BLKS));
+	raid4_set_spares(vol, pool);
+	write_pattern(vol, 1);
+
+	ramdisk_fail(disks[2]);
+	write_pattern(vol, 2);
+	assert(raid4_spare_wait(vol) == SUCCESS);
+	assert(spare_pool_count(pool) == 0);
+	ramdisk_fail(disks[0]);
+	verify_pattern(vol, 2);
+	blkdev_close(vol);
+	spare_pool_destroy(pool);
+	printf("raid4 spare test passed\n");
+}
+
+/* one pool for two volumes */
+void shared_pool_test(void){
+	struct spare_pool *pool = spare_pool_create();
+	struct blkdev *m[2] = {ramdisk_create(DISK_BLKS), ramdisk_create(DISK_BLKS)};
+	struct blkdev *r[3];
+	for (int i = 0; i < 3; i++)
+		r[i] = ramdisk_create(DISK_BLKS);
+	struct blkdev *mvol = mirror_create(m), *rvol = raid4_create(3, r, UNIT);
+	for (int i = 0; i < 3; i++)
+		spare_pool_add(pool, ramdisk_create(DISK_BLKS));
+	mirror_set_spares(mvol, pool);
+	raid4_set_spares(rvol, pool);
+	write_pattern(mvol, 1);
+	write_pattern(rvol, 1);
+
+	ramdisk_fail(m[1]);
+	ramdisk_fail(r[0]);
+	write_pattern(mvol, 2);
+	write_pattern(rvol, 2);
+	assert(mirror_spare_wait(mvol) == SUCCESS);
+	assert(raid4_spare_wait(rvol) == SUCCESS);
+	assert(spare_pool_count(pool) == 1);
+	ramdisk_fail(r[1]);
+	verify_pattern(rvol, 2);
+	assert(raid4_spare_wait(rvol) == SUCCESS);
+	assert(spare_pool_count(pool) == 0);
+	ramdisk_fail(r[2]);
+	verify_pattern(rvol, 2);
+	ramdisk_fail(m[0]);
+	verify_pattern(mvol, 2);
+	blkdev_close(mvol);
+	blkdev_close(rvol);
+	spare_pool_destroy(pool);
+	printf("shared spare pool test passed\n");
+}
+
+/* closing the volume stops a rebuild, however far it got */
+void close_test(void){
+	struct spare_pool *pool = spare_pool_create();
+	struct blkdev *disks[3];
+	for (int i = 0; i < 3; i++)
+		disks[i] = ramdisk_create(8 * DISK_BLKS);
+	struct blkdev *vol = raid4_create(3, disks, UNIT);
+	write_pattern(vol, 1);
+	struct blkdev_prio_opts po = {.min_kbps = 1000, .max_kbps = 1000};
+	blkdev_set_sched(vol, &po);
+	struct blkdev *spare = ramdisk_create(8 * DISK_BLKS);
+	spare_pool_add(pool, spare);
+	raid4_set_spares(vol, pool);
+
+	ramdisk_fail(disks[1]);
+	char buf[BLOCK_SIZE];
+	for (blkno_t lba = 0; lba < 2 * UNIT; lba++)
+		assert(blkdev_read(vol, lba, 1, buf) == SUCCESS);
+	assert(spare_pool_count(pool) == 0);
+	while (__atomic_load_n(&spare->stats.blocks[BLKDEV_WRITE], __ATOMIC_RELAXED) == 0)
+		usleep(1000);
+	struct timespec t0, t1;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	blkdev_close(vol);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	assert(secs < 2.0);
+	spare_pool_destroy(pool);
+	printf("close during rebuild test passed\n");
+}
+
+/* an assembled volume: the spare gets a superblock, and is found as a
+ * member next time
+ */
+char *names[] = {"spare-disk0", "spare-disk1", "spare-disk2", "spare-disk3"};
+
+struct blkdev *new_image(char *path){
+	FILE *fp = fopen(path, "w");
+	assert(fp != NULL);
+	assert(ftruncate(fileno(fp), (long)(DISK_BLKS + 1) * BLOCK_SIZE) == 0);
+	fclose(fp);
+	return image_create(path);
+}
+
+struct blkdev *assemble(int *order, int n, struct raid_info *info){
+	struct blkdev *cands[4];
+	for (int i = 0; i < n; i++)
+		cands[i] = image_create(names[order[i]]);
+	memset(info, 0, sizeof(*info));
+	struct blkdev *vol = raid_assemble(cands, n, info);
+	assert(vol != NULL);
+	return vol;
+}
+
+void superblock_test(void){
+	struct blkdev *disks[4];
+	struct raid_info info;
+	for (int i = 0; i < 4; i++)
+		disks[i] = new_image(names[i]);
+	assert(raid_format(RAID_RAID4, 3, disks, UNIT) == SUCCESS);
+	for (int i = 0; i < 3; i++)
+		blkdev_close(disks[i]);
+
+	int order[] = {0, 1, 2};
+	struct blkdev *vol = assemble(order, 3, &info);
+	assert(info.failed == -1);
+	struct spare_pool *pool = spare_pool_create();
+	spare_pool_add(pool, disks[3]);
+	assert(raid_set_spares(vol, pool) == SUCCESS);
+	write_pattern(vol, 1);
+	image_fail(info.members[1]);
+	write_pattern(vol, 2);
+	assert(raid4_spare_wait(vol) == SUCCESS);
+	assert(spare_pool_count(pool) == 0);
+	blkdev_close(vol);
+	spare_pool_destroy(pool);
+
+	int order2[] = {3, 0, 2};
+	vol = assemble(order2, 3, &info);
+	assert(info.failed == -1);
+	verify_pattern(vol, 2);
+	blkdev_close(vol);
+
+	/* only mirror and raid4 volumes rebuild */
+	for (int i = 0; i < 2; i++)
+		disks[i] = new_image(names[i]);
+	assert(raid_format(RAID_RAID0, 2, disks, UNIT) == SUCCESS);
+	for (int i = 0; i < 2; i++)
+		blkdev_close(disks[i]);
+	vol = assemble(order, 2, &info);
+	pool = spare_pool_create();
+	assert(raid_set_spares(vol, pool) == E_UNAVAIL);
+	blkdev_close(vol);
+	spare_pool_destroy(pool);
+	for (int i = 0; i < 4; i++)
+		unlink(names[i]);
+	printf("assembled volume spare test passed\n");
+}
+
+int main(){
+	pool_tests();
+	mirror_tests();
+	raid4_tests();
+	shared_pool_test();
+	close_test();
+	superblock_test();
+	printf("spare tests passed.\n");
+	return 0;
+}
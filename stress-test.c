@@ -0,0 +1,127 @@
+#include "blkdev.h"
+#include "stress.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+
+#define DISK_BLKS 2048
+#define UNIT 4
+#define HOT 512
+
+struct blkdev *disks[9];
+char *names[] = {"stress-img0", "stress-img1", "stress-img2", "stress-img3", "stress-img4",
+		 "stress-img5", "stress-img6", "stress-img7", "stress-img8"};
+
+struct blkdev *new_image(char *path, int nblks){
+	FILE *fp = fopen(path, "w");
+	assert(fp != NULL);
+	assert(ftruncate(fileno(fp), (long)nblks * BLOCK_SIZE) == 0);
+	fclose(fp);
+	return image_create(path);
+}
+
+void new_disks(int n){
+	for (int i = 0; i < n; i++)
+		disks[i] = new_image(names[i], DISK_BLKS);
+}
+
+void fail_disk(void *arg, int i){
+	image_fail(disks[i]);
+}
+
+/* one second of 8 threads, failing disk 'fail' (if >= 0) part way in */
+int stress(struct blkdev *vol, int tolerate, int fail, struct stress_result *r){
+	struct stress_opts opts = {.threads = 8, .seconds = 1, .max_blocks = 8,
+				   .hot_blocks = HOT, .seed = 1, .tolerate = tolerate,
+				   .fail = fail_disk};
+	if (fail >= 0) {
+		opts.nfaults = 1;
+		opts.faults[0].ms = 300;
+		opts.faults[0].member = fail;
+	}
+	struct stress *s = stress_create(vol, &opts);
+	assert(s != NULL);
+	int val = stress_run(s, r);
+	printf("%lld reads, %lld writes, %.0f ops/s (slowest second %.0f)\n",
+	       r->ops[BLKDEV_READ], r->ops[BLKDEV_WRITE], r->ops_per_sec, r->min_ops_per_sec);
+	assert(r->ops[BLKDEV_READ] > 0 && r->ops[BLKDEV_WRITE] > 0);
+	assert(r->faults == (fail >= 0));
+	if (val == SUCCESS)
+		val = stress_verify(s, r);
+	assert(r->checked >= blkdev_num_blocks(vol));
+	stress_destroy(s);
+	return val;
+}
+
+void raid_tests(void){
+	struct stress_result r;
+
+	new_disks(2);
+	struct blkdev *vol = mirror_create(disks);
+	assert(stress(vol, 1, 0, &r) == SUCCESS && r.bad_blocks == 0 && r.errors == 0);
+	blkdev_close(vol);
+	printf("mirror stress test passed\n");
+
+	new_disks(5);
+	vol = raid4_create(5, disks, UNIT);
+	assert(stress(vol, 1, 2, &r) == SUCCESS && r.bad_blocks == 0 && r.errors == 0);
+	blkdev_close(vol);
+	printf("raid4 stress test passed\n");
+
+	new_disks(9);
+	vol = draid_create(9, disks, 4, UNIT);
+	assert(stress(vol, 1, 6, &r) == SUCCESS && r.bad_blocks == 0 && r.errors == 0);
+	blkdev_close(vol);
+	printf("draid stress test passed\n");
+
+	/* raid0 can't lose a disk: its requests fail from then on, as expected */
+	new_disks(3);
+	vol = raid0_create(3, disks, UNIT);
+	assert(stress(vol, 0, 1, &r) == SUCCESS && r.bad_blocks == 0 && r.errors == 0);
+	assert(r.failed_ops > 0);
+	blkdev_close(vol);
+	printf("raid0 stress test passed\n");
+}
+
+/* the model notices a block overwritten behind its back, and a block
+ * put back to an older version
+ */
+void model_tests(void){
+	struct stress_result r;
+	struct blkdev *img = new_image("stress-img", DISK_BLKS);
+	struct stress_opts opts = {.threads = 4, .max_ops = 5000, .max_blocks = 4,
+				   .hot_blocks = 16, .seed = 2};
+	struct stress *s = stress_create(img, &opts);
+	assert(stress_run(s, &r) == SUCCESS && r.bad_blocks == 0);
+	assert(r.ops[BLKDEV_READ] + r.ops[BLKDEV_WRITE] == 5000);
+
+	char old[BLOCK_SIZE], junk[BLOCK_SIZE];
+	assert(blkdev_read(img, 5, 1, old) == SUCCESS);
+	assert(stress_run(s, &r) == SUCCESS && r.bad_blocks == 0);
+	assert(stress_verify(s, &r) == SUCCESS);
+
+	assert(blkdev_write(img, 5, 1, old) == SUCCESS);
+	assert(stress_verify(s, &r) == E_CORRUPT);
+	assert(r.bad_blocks == 1 && r.first_bad == 5);
+
+	memset(junk, 0x5a, sizeof(junk));
+	assert(blkdev_write(img, 100, 1, junk) == SUCCESS);     /* never written: anything goes */
+	assert(blkdev_write(img, 9, 1, junk) == SUCCESS);
+	assert(stress_verify(s, &r) == E_CORRUPT);
+	assert(r.bad_blocks == 3);
+	stress_destroy(s);
+	blkdev_close(img);
+	printf("model test passed\n");
+}
+
+int main(){
+	raid_tests();
+	model_tests();
+	for (int i = 0; i < 9; i++)
+		unlink(names[i]);
+	unlink("stress-img");
+	printf("stress tests passed\n");
+	return 0;
+}
@@ -0,0 +1,3 @@
+#!/bin/sh
+
+gcc -g3 -o stress-test stress-test.c stress.c image.c homework.c journal.c -lpthread -lm
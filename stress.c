@@ -0,0 +1,385 @@
+/*
+ * file:        stress.c
+ * description: stress test - many threads issuing random, overlapping
+ *              reads and writes to a volume while members are failed,
+ *              with every block read checked against a reference model
+ *
+ * Every write gets a tag from a global clock when it starts, and
+ * another clock value when it completes; each block it writes holds
+ * the tag, the block number and a pattern derived from both. Writes
+ * to the same blocks may run concurrently, so the model can't say
+ * which one a block holds - only which ones it may hold. For each
+ * block it keeps the tag of the latest write known to have completed
+ * (the largest start tag among completed writes). A read that saw
+ * 'done' for a block before it started may return write x if x is
+ * that write or a later one, or if x had not completed when that
+ * write started; otherwise x was overwritten before the read began.
+ * Blocks the run has never written may hold anything, but only until
+ * a write to them completes.
+ *
+ * The model is updated with atomics only, so checking it costs the
+ * workers nothing but cache traffic. Completion times live in a ring
+ * indexed by tag, which only forgets a write after STRESS_RING more
+ * have started.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include "stress.h"
+
+#define STRESS_RING   (1 << 20)     /* writes whose completion is remembered */
+#define STRESS_NEVER  LLONG_MAX     /* completion of a write in flight, or that failed */
+#define STRESS_POLL_MS 10
+#define STRESS_VERIFY_BLKS 64
+
+struct stress {
+    struct blkdev *vol;
+    struct stress_opts opts;
+    blkno_t nblks;
+    blkno_t span;               /* blocks the workload uses */
+    int bsize;
+    uint64_t run_id;            /* marks blocks written by this run */
+    pthread_mutex_t vol_lock;   /* with opts.serialize */
+
+    /* the model, all accessed atomically */
+    long long clock;
+    long long *done;            /* per block: latest start tag of a completed write */
+    long long *ring_tag;        /* per write, by tag % STRESS_RING */
+    long long *ring_end;
+
+    int faults;                 /* injected so far */
+    long long issued;           /* requests started, for max_ops */
+    long long completed;        /* ... and done successfully */
+    int running;                /* workers that haven't finished */
+    int stop;
+    blkno_t first_bad;
+
+    pthread_mutex_t lock;       /* protects 'res' */
+    struct stress_result res;
+};
+
+struct stress_worker {
+    struct stress *s;
+    pthread_t thread;
+    unsigned int seed;
+    char *buf;
+    struct stress_result res;
+};
+
+static long long stress_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static uint64_t pattern(uint64_t tag, uint64_t lba, int i)
+{
+    uint64_t x = tag * 0x9e3779b97f4a7c15ULL ^ lba * 0xc2b2ae3d27d4eb4fULL ^ (uint64_t)i;
+    return x ^ (x >> 29);
+}
+
+static void fill_block(struct stress *s, char *buf, long long tag, blkno_t lba)
+{
+    uint64_t *w = (uint64_t *)buf;
+    w[0] = s->run_id;
+    w[1] = tag;
+    w[2] = lba;
+    for (int i = 3; i < s->bsize / 8; i++)
+        w[i] = pattern(tag, lba, i);
+}
+
+/* when write 'tag' completed: STRESS_NEVER if it hasn't (or failed),
+ * -1 if the ring no longer has it
+ */
+static long long write_end(struct stress *s, long long tag)
+{
+    int slot = tag & (STRESS_RING - 1);
+    long long t1 = __atomic_load_n(&s->ring_tag[slot], __ATOMIC_ACQUIRE);
+    long long end = __atomic_load_n(&s->ring_end[slot], __ATOMIC_ACQUIRE);
+    long long t2 = __atomic_load_n(&s->ring_tag[slot], __ATOMIC_ACQUIRE);
+    return t1 == tag && t2 == tag ? end : -1;
+}
+
+/* may block 'lba' hold 'buf', for a read that started when the latest
+ * completed write to it was 'done' and finished before tag 'now'?
+ * 'done' is -1 for blocks the workload never writes.
+ */
+static int check_block(struct stress *s, char *buf, blkno_t lba, long long done, long long now)
+{
+    uint64_t *w = (uint64_t *)buf;
+    if (w[0] != s->run_id)
+        return done <= 0;       /* what was there before the run */
+    long long tag = w[1];
+    if (done < 0 || w[2] != (uint64_t)lba || tag < 1 || tag > now)
+        return 0;
+    for (int i = 3; i < s->bsize / 8; i++) {
+        if (w[i] != pattern(tag, lba, i))
+            return 0;
+    }
+    return tag >= done || write_end(s, tag) > done;
+}
+
+static long long model_done(struct stress *s, blkno_t lba)
+{
+    if (lba >= s->span)
+        return -1;
+    return __atomic_load_n(&s->done[lba], __ATOMIC_ACQUIRE);
+}
+
+static void bad_block(struct stress *s, struct stress_result *r, blkno_t lba)
+{
+    blkno_t none = -1;
+    r->bad_blocks++;
+    __atomic_compare_exchange_n(&s->first_bad, &none, lba, 0,
+                                __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+/* an error is expected once more members have failed than the volume
+ * survives; a failure is counted before it is injected
+ */
+static void io_error(struct stress *s, struct stress_result *r, int val)
+{
+    if (val != E_CORRUPT && __atomic_load_n(&s->faults, __ATOMIC_ACQUIRE) > s->opts.tolerate)
+        r->failed_ops++;
+    else
+        r->errors++;
+}
+
+static int do_io(struct stress *s, int dir, blkno_t lba, int n, char *buf)
+{
+    if (s->opts.serialize)
+        pthread_mutex_lock(&s->vol_lock);
+    int val = dir == BLKDEV_READ ? blkdev_read(s->vol, lba, n, buf) :
+        blkdev_write(s->vol, lba, n, buf);
+    if (s->opts.serialize)
+        pthread_mutex_unlock(&s->vol_lock);
+    return val;
+}
+
+static int stress_read(struct stress *s, struct stress_result *r, blkno_t lba, int n, char *buf)
+{
+    long long done[n];
+    for (int i = 0; i < n; i++)
+        done[i] = model_done(s, lba + i);
+    int val = do_io(s, BLKDEV_READ, lba, n, buf);
+    if (val != SUCCESS) {
+        io_error(s, r, val);
+        return val;
+    }
+    long long now = __atomic_load_n(&s->clock, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < n; i++) {
+        if (!check_block(s, buf + (size_t)i * s->bsize, lba + i, done[i], now))
+            bad_block(s, r, lba + i);
+    }
+    r->ops[BLKDEV_READ]++;
+    r->blocks[BLKDEV_READ] += n;
+    r->checked += n;
+    return SUCCESS;
+}
+
+static int stress_write(struct stress *s, struct stress_result *r, blkno_t lba, int n, char *buf)
+{
+    long long tag = __atomic_add_fetch(&s->clock, 1, __ATOMIC_ACQ_REL);
+    int slot = tag & (STRESS_RING - 1);
+    __atomic_store_n(&s->ring_end[slot], STRESS_NEVER, __ATOMIC_RELEASE);
+    __atomic_store_n(&s->ring_tag[slot], tag, __ATOMIC_RELEASE);
+    for (int i = 0; i < n; i++)
+        fill_block(s, buf + (size_t)i * s->bsize, tag, lba + i);
+
+    int val = do_io(s, BLKDEV_WRITE, lba, n, buf);
+    if (val != SUCCESS) {
+        io_error(s, r, val);    /* it may or may not have landed: never done */
+        return val;
+    }
+    long long end = __atomic_add_fetch(&s->clock, 1, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&s->ring_end[slot], end, __ATOMIC_RELEASE);
+    for (int i = 0; i < n; i++) {
+        long long *d = &s->done[lba + i];
+        long long old = __atomic_load_n(d, __ATOMIC_RELAXED);
+        while (old < tag && !__atomic_compare_exchange_n(d, &old, tag, 1,
+                                                         __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+    }
+    r->ops[BLKDEV_WRITE]++;
+    r->blocks[BLKDEV_WRITE] += n;
+    return SUCCESS;
+}
+
+static void add_result(struct stress_result *to, struct stress_result *r)
+{
+    for (int dir = BLKDEV_READ; dir <= BLKDEV_WRITE; dir++) {
+        to->ops[dir] += r->ops[dir];
+        to->blocks[dir] += r->blocks[dir];
+    }
+    to->checked += r->checked;
+    to->bad_blocks += r->bad_blocks;
+    to->errors += r->errors;
+    to->failed_ops += r->failed_ops;
+}
+
+static void *stress_worker(void *arg)
+{
+    struct stress_worker *w = arg;
+    struct stress *s = w->s;
+    while (!__atomic_load_n(&s->stop, __ATOMIC_ACQUIRE)) {
+        if (s->opts.max_ops > 0 &&
+            __atomic_fetch_add(&s->issued, 1, __ATOMIC_RELAXED) >= s->opts.max_ops)
+            break;
+        int n = 1 + rand_r(&w->seed) % s->opts.max_blocks;
+        blkno_t lba = ((blkno_t)rand_r(&w->seed) << 31 | rand_r(&w->seed)) % (s->span - n + 1);
+        int val = rand_r(&w->seed) % 100 < s->opts.read_pct ?
+            stress_read(s, &w->res, lba, n, w->buf) :
+            stress_write(s, &w->res, lba, n, w->buf);
+        if (val == SUCCESS)
+            __atomic_fetch_add(&s->completed, 1, __ATOMIC_RELAXED);
+    }
+    __atomic_fetch_sub(&s->running, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+struct stress *stress_create(struct blkdev *vol, struct stress_opts *opts)
+{
+    struct stress *s = calloc(1, sizeof(*s));
+    s->vol = vol;
+    s->opts = *opts;
+    s->nblks = blkdev_num_blocks(vol);
+    s->bsize = blkdev_block_size(vol);
+    if (s->opts.threads <= 0)
+        s->opts.threads = 8;
+    if (s->opts.seconds <= 0 && s->opts.max_ops <= 0)
+        s->opts.seconds = 5;
+    if (s->opts.read_pct <= 0)
+        s->opts.read_pct = 50;
+    if (s->opts.max_blocks <= 0)
+        s->opts.max_blocks = 16;
+    s->span = s->opts.hot_blocks > 0 && s->opts.hot_blocks < s->nblks ?
+        s->opts.hot_blocks : s->nblks;
+    if (s->opts.max_blocks > s->span)
+        s->opts.max_blocks = s->span;
+    if (s->opts.nfaults > STRESS_MAX_FAULTS || (s->opts.nfaults > 0 && s->opts.fail == NULL)) {
+        printf("Error: bad fault schedule.\n");
+        free(s);
+        return NULL;
+    }
+
+    pthread_mutex_init(&s->vol_lock, NULL);
+    pthread_mutex_init(&s->lock, NULL);
+    s->done = calloc(s->span, sizeof(long long));
+    s->ring_tag = calloc(STRESS_RING, sizeof(long long));
+    s->ring_end = calloc(STRESS_RING, sizeof(long long));
+    if (s->done == NULL || s->ring_tag == NULL || s->ring_end == NULL) {
+        printf("Error: can't allocate a model of %lld blocks.\n", s->span);
+        stress_destroy(s);
+        return NULL;
+    }
+    s->run_id = (uint64_t)stress_now() * 0x9e3779b97f4a7c15ULL ^ s->opts.seed ^ 0x5354524553530000ULL;
+    s->first_bad = -1;
+    s->res.first_bad = -1;
+    return s;
+}
+
+/* The calling thread injects the faults and takes a sample of the
+ * requests done successfully every second, for the slowest interval.
+ */
+int stress_run(struct stress *s, struct stress_result *res)
+{
+    int nw = s->opts.threads;
+    struct stress_worker *w = calloc(nw, sizeof(*w));
+    long long bad0 = s->res.bad_blocks, err0 = s->res.errors;
+
+    long long start = stress_now();
+    __atomic_store_n(&s->stop, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&s->issued, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&s->completed, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&s->running, nw, __ATOMIC_RELEASE);
+    for (int i = 0; i < nw; i++) {
+        w[i].s = s;
+        w[i].seed = s->opts.seed * 7919 + i + 1;
+        w[i].buf = malloc((size_t)s->opts.max_blocks * s->bsize);
+        pthread_create(&w[i].thread, NULL, stress_worker, &w[i]);
+    }
+
+    int next_fault = 0;
+    long long sample_at = start + 1000000000LL, sample_ops = 0;
+    double min_rate = -1;
+    while (1) {
+        usleep(STRESS_POLL_MS * 1000);
+        long long now = stress_now(), ms = (now - start) / 1000000;
+        for (int i = 0; i < s->opts.nfaults; i++) {
+            if (i >= next_fault && s->opts.faults[i].ms <= ms) {
+                __atomic_fetch_add(&s->faults, 1, __ATOMIC_ACQ_REL);
+                s->opts.fail(s->opts.fail_arg, s->opts.faults[i].member);
+                next_fault = i + 1;
+            }
+        }
+        long long ops = __atomic_load_n(&s->completed, __ATOMIC_RELAXED);
+        if (now >= sample_at) {
+            double rate = (ops - sample_ops) * 1e9 / (now - sample_at + 1000000000LL);
+            if (min_rate < 0 || rate < min_rate)
+                min_rate = rate;
+            sample_ops = ops;
+            sample_at = now + 1000000000LL;
+        }
+        if ((s->opts.seconds > 0 && ms >= s->opts.seconds * 1000LL) ||
+            __atomic_load_n(&s->running, __ATOMIC_ACQUIRE) == 0)
+            break;
+    }
+    __atomic_store_n(&s->stop, 1, __ATOMIC_RELEASE);
+    for (int i = 0; i < nw; i++) {
+        pthread_join(w[i].thread, NULL);
+        free(w[i].buf);
+    }
+    double secs = (stress_now() - start) / 1e9;
+
+    pthread_mutex_lock(&s->lock);
+    for (int i = 0; i < nw; i++)
+        add_result(&s->res, &w[i].res);
+    long long total = 0;
+    for (int i = 0; i < nw; i++)
+        total += w[i].res.ops[BLKDEV_READ] + w[i].res.ops[BLKDEV_WRITE];
+    s->res.faults = __atomic_load_n(&s->faults, __ATOMIC_ACQUIRE);
+    s->res.seconds += secs;
+    s->res.ops_per_sec = total / secs;
+    s->res.min_ops_per_sec = min_rate < 0 ? s->res.ops_per_sec : min_rate;
+    s->res.first_bad = __atomic_load_n(&s->first_bad, __ATOMIC_RELAXED);
+    int val = s->res.bad_blocks > bad0 ? E_CORRUPT : s->res.errors > err0 ? E_UNAVAIL : SUCCESS;
+    *res = s->res;
+    pthread_mutex_unlock(&s->lock);
+    free(w);
+    return val;
+}
+
+int stress_verify(struct stress *s, struct stress_result *res)
+{
+    struct stress_result r = {0};
+    char *buf = malloc((size_t)STRESS_VERIFY_BLKS * s->bsize);
+    for (blkno_t lba = 0; lba < s->nblks; lba += STRESS_VERIFY_BLKS) {
+        int n = s->nblks - lba < STRESS_VERIFY_BLKS ? s->nblks - lba : STRESS_VERIFY_BLKS;
+        stress_read(s, &r, lba, n, buf);
+    }
+    free(buf);
+
+    pthread_mutex_lock(&s->lock);
+    add_result(&s->res, &r);
+    s->res.first_bad = __atomic_load_n(&s->first_bad, __ATOMIC_RELAXED);
+    *res = s->res;
+    pthread_mutex_unlock(&s->lock);
+    return r.bad_blocks > 0 ? E_CORRUPT : r.errors > 0 ? E_UNAVAIL : SUCCESS;
+}
+
+void stress_destroy(struct stress *s)
+{
+    pthread_mutex_destroy(&s->vol_lock);
+    pthread_mutex_destroy(&s->lock);
+    free(s->done);
+    free(s->ring_tag);
+    free(s->ring_end);
+    free(s);
+}
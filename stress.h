@@ -0,0 +1,67 @@
+/*
+ * file:        stress.h
+ * description: multi-threaded stress test of a volume against a
+ *              reference model, with member failures injected on a
+ *              schedule (see stress.c)
+ */
+#ifndef __STRESS_H__
+#define __STRESS_H__
+
+#include "blkdev.h"
+
+#define STRESS_MAX_FAULTS 16
+
+/* fail member 'member' of the volume under test */
+typedef void (*stress_fail_fn)(void *arg, int member);
+
+/* Fields left at 0 take the default shown */
+struct stress_opts {
+    int threads;                /* each with one request outstanding (8) */
+    int seconds;                /* run time (5) */
+    long long max_ops;          /* stop after this many requests (0: no limit) */
+    int read_pct;               /* percent of requests that are reads (0: 50) */
+    int max_blocks;             /* largest request (16) */
+    blkno_t hot_blocks;         /* requests fall in the first hot_blocks
+                                 * blocks, so they overlap (the whole volume) */
+    unsigned int seed;
+    int serialize;              /* one request at a time, for volumes that aren't thread safe */
+    int tolerate;               /* member failures the volume survives */
+    int nfaults;                /* failures to inject: fail member faults[i].member */
+    struct {                    /* faults[i].ms into the run */
+        int ms;
+        int member;
+    } faults[STRESS_MAX_FAULTS];
+    stress_fail_fn fail;
+    void *fail_arg;
+};
+
+struct stress_result {
+    long long ops[2];           /* indexed by BLKDEV_READ / BLKDEV_WRITE */
+    long long blocks[2];
+    long long checked;          /* blocks read back and checked */
+    long long bad_blocks;       /* blocks holding data the model rules out */
+    blkno_t first_bad;          /* ... the first of them found, or -1 */
+    long long errors;           /* requests failing while the volume should work */
+    long long failed_ops;       /* ... and once it no longer should */
+    int faults;                 /* failures injected */
+    double seconds;
+    double ops_per_sec;
+    double min_ops_per_sec;     /* slowest one-second interval */
+};
+
+struct stress;
+
+/* Stress 'vol'; the volume is left to the caller */
+extern struct stress *stress_create(struct blkdev *vol, struct stress_opts *opts);
+/* Run the workload and the fault schedule. SUCCESS if every block
+ * read was one the model allows and no request failed unexpectedly,
+ * E_CORRUPT or E_UNAVAIL otherwise.
+ */
+extern int stress_run(struct stress *, struct stress_result *);
+/* Read the whole volume back and check it, adding to the result as
+ * stress_run does. Run it with nothing else using the volume.
+ */
+extern int stress_verify(struct stress *, struct stress_result *);
+extern void stress_destroy(struct stress *);
+
+#endif
@@ -0,0 +1,274 @@
+#include "blkdev.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include <signal.h>
+
+extern int image_devs_open;
+
+#define DATA_BLKS 8192
+#define UNIT 4
+
+char *raid4_names[] = {"sb-disk0", "sb-disk1", "sb-disk2", "sb-disk3", "sb-disk4", "sb-disk5"};
+char *mirror_names[] = {"sb-mirror0", "sb-mirror1", "sb-mirror2"};
+char *raid0_names[] = {"sb-raid0-0", "sb-raid0-1"};
+
+/* an image with room for the data and a superblock */
+struct blkdev *new_image(char *path){
+	FILE *fp = fopen(path, "w");
+	assert(fp != NULL);
+	assert(ftruncate(fileno(fp), (long)(DATA_BLKS + 1) * BLOCK_SIZE) == 0);
+	fclose(fp);
+	return image_create(path);
+}
+
+void open_images(struct blkdev **out, char **names, int *order, int n){
+	for (int i = 0; i < n; i++) {
+		out[i] = image_create(names[order[i]]);
+		assert(out[i] != NULL);
+	}
+}
+
+/* every block holds "seq:lba" */
+void write_pattern(struct blkdev *vol, int seq){
+	char buf[64*BLOCK_SIZE];
+	int n = blkdev_num_blocks(vol);
+	for (int lba = 0; lba < n; lba += 64) {
+		int len = n - lba < 64 ? n - lba : 64;
+		for (int i = 0; i < len; i++)
+			sprintf(&buf[i*BLOCK_SIZE], "%d:%d", seq, lba + i);
+		if (blkdev_write(vol, lba, len, buf) != SUCCESS) {
+			printf("Write failed!\n");
+			exit(1);
+		}
+	}
+}
+
+void verify_pattern(struct blkdev *vol, int seq){
+	char buf[64*BLOCK_SIZE], expect[32];
+	int n = blkdev_num_blocks(vol);
+	for (int lba = 0; lba < n; lba += 64) {
+		int len = n - lba < 64 ? n - lba : 64;
+		if (blkdev_read(vol, lba, len, buf) != SUCCESS) {
+			printf("Read failed!\n");
+			exit(1);
+		}
+		for (int i = 0; i < len; i++) {
+			sprintf(expect, "%d:%d", seq, lba + i);
+			if (strcmp(&buf[i*BLOCK_SIZE], expect) != 0) {
+				printf("Block %d doesn't match: %s, expected %s\n",
+				       lba + i, &buf[i*BLOCK_SIZE], expect);
+				exit(1);
+			}
+		}
+	}
+}
+
+struct blkdev *assemble(struct blkdev **cands, int n, struct raid_info *info){
+	memset(info, 0, sizeof(*info));
+	return raid_assemble(cands, n, info);
+}
+
+struct blkdev *crash_vol, *crash_disk;
+
+void *rebuild_thread(void *arg){
+	raid_replace(crash_vol, 2, crash_disk);
+	return NULL;
+}
+
+/* rebuild member 2 onto sb-disk5 in the background, and 'crash' once
+ * it is about half done
+ */
+void crash_during_rebuild(void){
+	struct blkdev *cands[5];
+	int order[] = {0, 1, 3, 4, 2};
+	struct raid_info info;
+	open_images(cands, raid4_names, order, 5);
+	struct blkdev *vol = assemble(cands, 5, &info);
+	assert(vol != NULL && info.failed == 2);
+	blkdev_close(cands[4]);
+
+	struct blkdev_prio_opts po = {.min_kbps = 4000, .max_kbps = 4000};
+	blkdev_set_sched(vol, &po);
+	struct blkdev *newdisk = new_image(raid4_names[5]);
+	pid_t pid = fork();
+	if (pid == 0) {
+		pthread_t t;
+		crash_vol = vol;
+		crash_disk = newdisk;
+		pthread_create(&t, NULL, rebuild_thread, NULL);
+		while (__atomic_load_n(&newdisk->stats.blocks[BLKDEV_WRITE], __ATOMIC_RELAXED)
+		       < DATA_BLKS / 2)
+			usleep(1000);
+		kill(getpid(), SIGKILL);
+	}
+	int status;
+	waitpid(pid, &status, 0);
+	assert(WIFSIGNALED(status));
+	/* our copy of the volume never saw the rebuild; drop it unwritten */
+	for (int i = 0; i < 4; i++)
+		image_fail(info.members[i == 2 ? 4 : i]);
+	blkdev_close(newdisk);
+	blkdev_close(vol);
+}
+
+void raid4_tests(void){
+	struct blkdev *disks[5], *cands[6];
+	struct raid_info info;
+	for (int i = 0; i < 5; i++)
+		disks[i] = new_image(raid4_names[i]);
+	assert(raid_format(RAID_RAID4, 5, disks, UNIT) == SUCCESS);
+	for (int i = 0; i < 5; i++)
+		blkdev_close(disks[i]);
+
+	/* members may be found in any order */
+	int order1[] = {3, 0, 4, 1, 2};
+	open_images(cands, raid4_names, order1, 5);
+	struct blkdev *vol = assemble(cands, 5, &info);
+	assert(vol != NULL);
+	assert(info.level == RAID_RAID4 && info.ndisks == 5 && info.unit == UNIT);
+	assert(info.failed == -1 && !info.dirty);
+	for (int i = 0; i < 5; i++)
+		assert(info.members[order1[i]] == cands[i]);
+	assert(blkdev_num_blocks(vol) == 4 * DATA_BLKS);
+	write_pattern(vol, 1);
+	blkdev_close(vol);
+	assert(image_devs_open == 0);
+
+	/* member 2 fails, and misses the next round of writes */
+	int order2[] = {4, 3, 2, 1, 0};
+	open_images(cands, raid4_names, order2, 5);
+	vol = assemble(cands, 5, &info);
+	assert(vol != NULL && info.failed == -1 && !info.dirty);
+	verify_pattern(vol, 1);
+	image_fail(info.members[2]);
+	write_pattern(vol, 2);
+	verify_pattern(vol, 2);
+	blkdev_close(vol);
+
+	/* ... so it is stale, and left out */
+	int order3[] = {0, 1, 2, 3, 4};
+	open_images(cands, raid4_names, order3, 5);
+	vol = assemble(cands, 5, &info);
+	assert(vol != NULL && info.failed == 2 && info.members[2] == NULL);
+	blkdev_close(cands[2]);
+	verify_pattern(vol, 2);
+	blkdev_close(vol);
+	assert(image_devs_open == 0);
+
+	crash_during_rebuild();
+	assert(image_devs_open == 0);
+
+	/* the rebuild picks up where it stopped; the stale disk is still ignored */
+	int order4[] = {5, 2, 0, 1, 3, 4};
+	open_images(cands, raid4_names, order4, 6);
+	vol = assemble(cands, 6, &info);
+	assert(vol != NULL && info.failed == 2 && info.members[2] == cands[0]);
+	assert(info.dirty);
+	assert(info.rebuilt > 0 && info.rebuilt < DATA_BLKS);
+	printf("rebuild resumes at %lld of %d\n", info.rebuilt, DATA_BLKS);
+	blkdev_close(cands[1]);
+	verify_pattern(vol, 2);
+	long long before = cands[0]->stats.blocks[BLKDEV_WRITE];
+	assert(raid_replace(vol, 2, NULL) == SUCCESS);
+	assert(cands[0]->stats.blocks[BLKDEV_WRITE] - before < DATA_BLKS - info.rebuilt + 100);
+	verify_pattern(vol, 2);
+	blkdev_close(vol);
+
+	/* whole again; read through parity to check the rebuilt member */
+	int order5[] = {5, 4, 3, 1, 0};
+	open_images(cands, raid4_names, order5, 5);
+	vol = assemble(cands, 5, &info);
+	assert(vol != NULL && info.failed == -1 && !info.dirty);
+	image_fail(info.members[0]);
+	verify_pattern(vol, 2);
+	blkdev_close(vol);
+	assert(image_devs_open == 0);
+	printf("raid4 assembly test passed\n");
+}
+
+void mirror_tests(void){
+	struct blkdev *disks[2], *cands[2];
+	struct raid_info info;
+	for (int i = 0; i < 2; i++)
+		disks[i] = new_image(mirror_names[i]);
+	assert(raid_format(RAID_MIRROR, 2, disks, 0) == SUCCESS);
+	for (int i = 0; i < 2; i++)
+		blkdev_close(disks[i]);
+
+	int order1[] = {1, 0};
+	open_images(cands, mirror_names, order1, 2);
+	struct blkdev *vol = assemble(cands, 2, &info);
+	assert(vol != NULL && info.level == RAID_MIRROR && info.failed == -1);
+	assert(info.members[0] == cands[1] && info.members[1] == cands[0]);
+	write_pattern(vol, 1);
+	image_fail(info.members[1]);
+	write_pattern(vol, 2);
+	blkdev_close(vol);
+
+	int order2[] = {0, 1};
+	open_images(cands, mirror_names, order2, 2);
+	vol = assemble(cands, 2, &info);
+	assert(vol != NULL && info.failed == 1 && info.members[1] == NULL);
+	blkdev_close(cands[1]);
+	verify_pattern(vol, 2);
+	assert(raid_replace(vol, 1, new_image(mirror_names[2])) == SUCCESS);
+	blkdev_close(vol);
+
+	int order3[] = {2, 0};
+	open_images(cands, mirror_names, order3, 2);
+	vol = assemble(cands, 2, &info);
+	assert(vol != NULL && info.failed == -1 && !info.dirty);
+	image_fail(info.members[0]);
+	verify_pattern(vol, 2);
+	blkdev_close(vol);
+	assert(image_devs_open == 0);
+	printf("mirror assembly test passed\n");
+}
+
+void raid0_tests(void){
+	struct blkdev *disks[2], *cands[2];
+	struct raid_info info;
+	for (int i = 0; i < 2; i++)
+		disks[i] = new_image(raid0_names[i]);
+	assert(raid_format(RAID_RAID0, 2, disks, UNIT) == SUCCESS);
+	for (int i = 0; i < 2; i++)
+		blkdev_close(disks[i]);
+
+	int order[] = {1, 0};
+	open_images(cands, raid0_names, order, 2);
+	struct blkdev *vol = assemble(cands, 2, &info);
+	assert(vol != NULL && info.level == RAID_RAID0 && info.failed == -1);
+	write_pattern(vol, 1);
+	image_fail(info.members[0]);
+	char buf[BLOCK_SIZE];
+	assert(blkdev_read(vol, 0, 1, buf) == E_UNAVAIL);
+	blkdev_close(vol);
+
+	/* a stale raid0 member cannot be used */
+	open_images(cands, raid0_names, order, 2);
+	assert(assemble(cands, 2, &info) == NULL);
+	blkdev_close(cands[0]);
+	blkdev_close(cands[1]);
+	assert(image_devs_open == 0);
+	printf("raid0 assembly test passed\n");
+}
+
+int main(){
+	raid4_tests();
+	mirror_tests();
+	raid0_tests();
+
+	for (int i = 0; i < 6; i++)
+		unlink(raid4_names[i]);
+	for (int i = 0; i < 3; i++)
+		unlink(mirror_names[i]);
+	for (int i = 0; i < 2; i++)
+		unlink(raid0_names[i]);
+	printf("superblock test passed\n");
+	return 0;
+}
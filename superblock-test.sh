@@ -0,0 +1,3 @@
+#!/bin/sh
+
+gcc -g3 -o superblock-test superblock-test.c image.c homework.c journal.c superblock.c -lpthread
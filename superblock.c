@@ -0,0 +1,650 @@
+/*
+ * file:        superblock.c
+ * description: on-disk superblocks for RAID members, and assembling a
+ *              volume from them
+ *
+ * The last block of every member holds a superblock: the array's
+ * uuid and geometry, the member's role (its index in the array), and
+ * the volume's state - which member is missing or being rebuilt and
+ * how far, and whether it was closed cleanly. Each change of state
+ * bumps a generation number and is written to every member still in
+ * service, so a member that dropped out is left behind with an older
+ * generation and can be told apart from the current ones.
+ *
+ * A reshape (raid_reshape) records where it has got to after every
+ * chunk, before going on, so that it can pick up from there; the
+ * superblock also says whether the next row is in the reshape's backup
+ * area (see homework.c).
+ *
+ * The RAID code sees each member through a thin 'member' device that
+ * hides the superblock and tells us (raid_notify_fn) when its state
+ * changes. Assembly reads one block per candidate, puts each current
+ * member at its role, and creates the volume directly in that state.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include "blkdev.h"
+
+#define SB_MAGIC   0x52414453   /* "SDAR" */
+#define SB_VERSION 4
+
+/* rebuild progress is written at most this often */
+#define SB_CHECKPOINT_MS 200
+
+struct raid_sb {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t uuid;
+    uint64_t generation;
+    int64_t data_blocks;        /* blocks of each member in the volume */
+    int64_t rebuilt;            /* 'failed' rebuilt up to this block */
+    int64_t reshape_pos;        /* volume blocks moved by a reshape */
+    int32_t level;
+    int32_t ndisks;
+    int32_t unit;
+    int32_t role;               /* this member's index */
+    int32_t failed;             /* member missing or rebuilding, or -1 */
+    int32_t rebuilding;         /* 'failed' is a replacement */
+    int32_t vol_failed;         /* more members lost than the level allows */
+    int32_t clean;              /* closed since the last write */
+    int32_t block_size;         /* bytes per block of every member */
+    int32_t prev_ndisks;        /* members before the reshape, or 0 */
+    int32_t reshape_backup;     /* the row at reshape_pos is in the backup area */
+    uint32_t csum;              /* FNV-1a of the above, with csum = 0 */
+};
+
+/* one assembled (or formatted) volume. 'members' is the array handed
+ * to the RAID code; raid4 and raid0 keep using it, so it lives until
+ * the last member device is closed.
+ */
+struct sb_vol {
+    struct raid_sb sb;
+    struct blkdev *members[RAID_MAX_MEMBERS];
+    int refs;                   /* open member devices */
+    long long last_update;      /* ms, when sb_update last ran */
+    pthread_mutex_t lock;
+};
+
+struct member {
+    struct blkdev *dev;         /* NULL for a member that is missing */
+    blkno_t sb_blk;
+    blkno_t nblks;
+    struct sb_vol *sv;
+};
+
+static long long sb_now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static uint32_t sb_csum(struct raid_sb *sb)
+{
+    struct raid_sb tmp = *sb;
+    tmp.csum = 0;
+    uint32_t h = 2166136261u;
+    unsigned char *p = (unsigned char *)&tmp;
+    for (size_t i = 0; i < sizeof(tmp); i++)
+        h = (h ^ p[i]) * 16777619u;
+    return h;
+}
+
+static int sb_read(struct blkdev *dev, struct raid_sb *sb)
+{
+    int bsize = blkdev_block_size(dev);
+    char *buf = malloc(bsize);
+    blkno_t nblks = blkdev_num_blocks(dev);
+    if (nblks < 2 || blkdev_read(dev, nblks - 1, 1, buf) != SUCCESS) {
+        free(buf);
+        return E_UNAVAIL;
+    }
+    memcpy(sb, buf, sizeof(*sb));
+    free(buf);
+    if (sb->magic != SB_MAGIC || sb->version != SB_VERSION || sb->csum != sb_csum(sb) ||
+        sb->ndisks < 1 || sb->ndisks > RAID_MAX_MEMBERS ||
+        sb->role < 0 || sb->role >= sb->ndisks || sb->data_blocks > nblks - 1 ||
+        sb->block_size != bsize)
+        return E_BADADDR;
+    return SUCCESS;
+}
+
+static int sb_write(struct blkdev *dev, blkno_t blk, struct raid_sb *sb, int role)
+{
+    char *buf = calloc(1, blkdev_block_size(dev));
+    struct raid_sb *out = (struct raid_sb *)buf;
+    *out = *sb;
+    out->role = role;
+    out->csum = sb_csum(out);
+    int val = blkdev_write(dev, blk, 1, buf);
+    free(buf);
+    return val;
+}
+
+/* a new generation of the superblock goes to every member in service.
+ * A failed member is skipped, so it keeps the generation it failed at,
+ * unless it is a replacement being rebuilt. Errors are left to the
+ * RAID code to find on its next request. Called with sv->lock held.
+ */
+static void sb_update(struct sb_vol *sv)
+{
+    sv->last_update = sb_now_ms();
+    sv->sb.generation++;
+    /* new members first, so a reshape is never recorded on the old
+     * members without them
+     */
+    for (int i = sv->sb.ndisks - 1; i >= 0; i--) {
+        struct member *m = sv->members[i]->private;
+        if (m->dev == NULL || (i == sv->sb.failed && !sv->sb.rebuilding))
+            continue;
+        sb_write(m->dev, m->sb_blk, &sv->sb, i);
+    }
+}
+
+/* raid_notify_fn for an assembled volume */
+static void sb_event(void *arg, int event, int member, blkno_t mark)
+{
+    struct sb_vol *sv = arg;
+    pthread_mutex_lock(&sv->lock);
+    struct raid_sb *sb = &sv->sb;
+    switch (event) {
+    case RAID_EV_FAILED:
+        if (member < 0 || (sb->failed >= 0 && sb->failed != member)) {
+            sb->vol_failed = 1;
+        } else {
+            sb->failed = member;
+            sb->rebuilding = sb->rebuilt = 0;
+        }
+        break;
+    case RAID_EV_REBUILD:
+        if (sb->failed == member && sb->rebuilding &&
+            sb_now_ms() - sv->last_update < SB_CHECKPOINT_MS) {
+            sb->rebuilt = mark;         /* next time */
+            pthread_mutex_unlock(&sv->lock);
+            return;
+        }
+        sb->failed = member;
+        sb->rebuilding = 1;
+        sb->rebuilt = mark;
+        break;
+    case RAID_EV_REBUILT:
+        sb->failed = -1;
+        sb->rebuilding = sb->rebuilt = 0;
+        break;
+    case RAID_EV_CLOSE:
+        sb->clean = 1;
+        break;
+    case RAID_EV_RESHAPE:
+        if (sb->prev_ndisks == 0) {
+            sb->prev_ndisks = sb->ndisks;
+            sb->ndisks = member;
+        }
+        sb->reshape_pos = mark;
+        sb->reshape_backup = 0;
+        break;
+    case RAID_EV_RESHAPE_BACKUP:
+        sb->reshape_pos = mark;
+        sb->reshape_backup = 1;
+        break;
+    case RAID_EV_RESHAPED:
+        sb->prev_ndisks = 0;
+        sb->reshape_pos = 0;
+        break;
+    }
+    sb_update(sv);
+    pthread_mutex_unlock(&sv->lock);
+}
+
+/********** MEMBER DEVICES ***************/
+
+static blkno_t member_num_blocks(struct blkdev *dev)
+{
+    struct member *m = dev->private;
+    return m->nblks;
+}
+
+/* the array's block size, which a missing member has too */
+static int member_block_size(struct blkdev *dev)
+{
+    struct member *m = dev->private;
+    return m->sv->sb.block_size;
+}
+
+static int member_read(struct blkdev *dev, blkno_t first_blk, int num_blks, void *buf)
+{
+    struct member *m = dev->private;
+    if (first_blk < 0 || num_blks < 0 || first_blk > m->nblks - num_blks)
+        return E_BADADDR;
+    if (m->dev == NULL)
+        return E_UNAVAIL;
+    return blkdev_read(m->dev, first_blk, num_blks, buf);
+}
+
+static int member_write(struct blkdev *dev, blkno_t first_blk, int num_blks, void *buf)
+{
+    struct member *m = dev->private;
+    if (first_blk < 0 || num_blks < 0 || first_blk > m->nblks - num_blks)
+        return E_BADADDR;
+    if (m->dev == NULL)
+        return E_UNAVAIL;
+    return blkdev_write(m->dev, first_blk, num_blks, buf);
+}
+
+static int member_discard(struct blkdev *dev, blkno_t first_blk, blkno_t num_blks)
+{
+    struct member *m = dev->private;
+    if (first_blk < 0 || num_blks < 0 || first_blk > m->nblks - num_blks)
+        return E_BADADDR;
+    if (m->dev == NULL)
+        return E_UNAVAIL;
+    return blkdev_discard(m->dev, first_blk, num_blks);
+}
+
+static blkno_t member_next_data(struct blkdev *dev, blkno_t first_blk)
+{
+    struct member *m = dev->private;
+    if (m->dev == NULL)
+        return first_blk;
+    blkno_t next = blkdev_next_data(m->dev, first_blk);
+    return next < m->nblks ? next : m->nblks;
+}
+
+/* between the disks underneath, so they can copy directly */
+static int member_copy(struct blkdev *dev, blkno_t first_blk, struct blkdev *src,
+                       blkno_t src_blk, blkno_t num_blks)
+{
+    struct member *m = dev->private, *sm = src->private;
+    if (first_blk < 0 || num_blks < 0 || first_blk > m->nblks - num_blks ||
+        src_blk < 0 || src_blk > sm->nblks - num_blks)
+        return E_BADADDR;
+    if (m->dev == NULL || sm->dev == NULL)
+        return E_UNAVAIL;
+    return blkdev_copy(m->dev, first_blk, sm->dev, src_blk, num_blks);
+}
+
+/* the last member closed takes the volume's state with it */
+static void member_close(struct blkdev *dev)
+{
+    struct member *m = dev->private;
+    struct sb_vol *sv = m->sv;
+    if (m->dev != NULL)
+        blkdev_close(m->dev);
+    free(m);
+    dev->private = NULL;
+    free(dev);
+
+    pthread_mutex_lock(&sv->lock);
+    int last = --sv->refs == 0;
+    pthread_mutex_unlock(&sv->lock);
+    if (last) {
+        pthread_mutex_destroy(&sv->lock);
+        free(sv);
+    }
+}
+
+static int member_members(struct blkdev *dev, struct blkdev **out, int max)
+{
+    struct member *m = dev->private;
+    if (m->dev == NULL || max < 1)
+        return 0;
+    out[0] = m->dev;
+    return 1;
+}
+
+static struct blkdev_ops member_ops = {
+    .num_blocks = member_num_blocks,
+    .read = member_read,
+    .write = member_write,
+    .close = member_close,
+    .members = member_members,
+    .type = "member",
+    .discard = member_discard,
+    .next_data = member_next_data,
+    .copy = member_copy,
+    .block_size = member_block_size
+};
+
+static struct blkdev *member_open(struct sb_vol *sv, struct blkdev *disk)
+{
+    struct blkdev *dev = calloc(1, sizeof(*dev));
+    struct member *m = malloc(sizeof(*m));
+    m->dev = disk;
+    m->sb_blk = disk != NULL ? blkdev_num_blocks(disk) - 1 : 0;
+    m->nblks = sv->sb.data_blocks;
+    m->sv = sv;
+    pthread_mutex_lock(&sv->lock);
+    sv->refs++;
+    pthread_mutex_unlock(&sv->lock);
+    dev->private = m;
+    dev->ops = &member_ops;
+    return dev;
+}
+
+/* drop a member device, leaving the disk under it open */
+static void member_release(struct blkdev *dev)
+{
+    struct member *m = dev->private;
+    m->dev = NULL;
+    blkdev_close(dev);
+}
+
+/* the volume state behind an assembled volume, found through its members */
+static struct sb_vol *sb_vol_of(struct blkdev *vol)
+{
+    struct blkdev *out[RAID_MAX_MEMBERS + 1];
+    int n = vol->ops->members ? vol->ops->members(vol, out, RAID_MAX_MEMBERS + 1) : 0;
+    for (int i = 0; i < n; i++) {
+        if (out[i]->ops == &member_ops)
+            return ((struct member *)out[i]->private)->sv;
+    }
+    return NULL;
+}
+
+/********** FORMAT / ASSEMBLE ***************/
+
+static uint64_t new_uuid(void)
+{
+    uint64_t uuid = 0;
+    int fd = open("/dev/urandom", O_RDONLY);
+    if (fd >= 0) {
+        if (read(fd, &uuid, sizeof(uuid)) != sizeof(uuid))
+            uuid = 0;
+        close(fd);
+    }
+    if (uuid == 0) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        uuid = ((uint64_t)ts.tv_sec << 32) ^ ts.tv_nsec ^ ((uint64_t)getpid() << 16);
+    }
+    return uuid | 1;
+}
+
+static int geometry_ok(int level, int n, int unit)
+{
+    if (level == RAID_MIRROR)
+        return n == 2;
+    if (level == RAID_RAID0 || level == RAID_RAID4)
+        return n >= 2 && n <= RAID_MAX_MEMBERS && unit >= 1;
+    return 0;
+}
+
+/* write superblocks for a new array onto 'disks'. The volume uses all
+ * but the last block of the smallest disk; as with the create
+ * functions, the data on the disks is assumed to be consistent.
+ */
+int raid_format(int level, int n, struct blkdev **disks, int unit)
+{
+    if (!geometry_ok(level, n, unit)) {
+        printf("Error: bad volume geometry.\n");
+        return E_SIZE;
+    }
+    int bsize = blkdev_common_block_size(disks, n);
+    if (bsize == 0) {
+        printf("Error: disks block size not same.\n");
+        return E_SIZE;
+    }
+    struct raid_sb sb;
+    memset(&sb, 0, sizeof(sb));
+    sb.magic = SB_MAGIC;
+    sb.version = SB_VERSION;
+    sb.uuid = new_uuid();
+    sb.generation = 1;
+    sb.level = level;
+    sb.ndisks = n;
+    sb.unit = level == RAID_MIRROR ? 1 : unit;
+    sb.failed = -1;
+    sb.clean = 1;
+    sb.block_size = bsize;
+    sb.data_blocks = blkdev_num_blocks(disks[0]) - 1;
+    for (int i = 1; i < n; i++) {
+        if (blkdev_num_blocks(disks[i]) - 1 < sb.data_blocks)
+            sb.data_blocks = blkdev_num_blocks(disks[i]) - 1;
+    }
+    if (sb.data_blocks < 1)
+        return E_SIZE;
+
+    for (int i = 0; i < n; i++) {
+        if (sb_write(disks[i], blkdev_num_blocks(disks[i]) - 1, &sb, i) != SUCCESS)
+            return E_UNAVAIL;
+    }
+    return SUCCESS;
+}
+
+/* whether a member's superblock is current. A crash while a new
+ * generation was being written can leave some members one behind;
+ * they are still current unless that generation is the one that
+ * dropped them.
+ */
+static int sb_current(struct raid_sb *sb, struct raid_sb *newest)
+{
+    if (sb->generation == newest->generation)
+        return 1;
+    return sb->generation + 1 == newest->generation && sb->role != newest->failed;
+}
+
+/* bring up the array with the newest superblock among 'cands' (or the
+ * one with uuid info->uuid, if that is set). Reads one block from each
+ * candidate; the volume comes up degraded if one member is missing or
+ * stale, or part way through a rebuild that raid_replace(vol, i, NULL)
+ * will finish.
+ */
+struct blkdev *raid_assemble(struct blkdev **cands, int n, struct raid_info *info)
+{
+    struct raid_sb *sbs = malloc((n > 0 ? n : 1) * sizeof(*sbs));
+    int newest = -1;
+    for (int i = 0; i < n; i++) {
+        if (sb_read(cands[i], &sbs[i]) != SUCCESS ||
+            (info->uuid != 0 && sbs[i].uuid != info->uuid)) {
+            sbs[i].magic = 0;
+            continue;
+        }
+        if (newest < 0 || sbs[i].generation > sbs[newest].generation)
+            newest = i;
+    }
+    if (newest < 0) {
+        printf("Error: no RAID superblock found.\n");
+        free(sbs);
+        return NULL;
+    }
+
+    /* a member one generation behind the start of a reshape still has
+     * the old number of members
+     */
+    struct raid_sb sb = sbs[newest];
+    struct blkdev *by_role[RAID_MAX_MEMBERS] = {NULL};
+    for (int i = 0; i < n; i++) {
+        struct raid_sb *s = &sbs[i];
+        if (s->magic != SB_MAGIC || s->uuid != sb.uuid ||
+            (s->ndisks != sb.ndisks && s->ndisks != sb.prev_ndisks) ||
+            by_role[s->role] != NULL || !sb_current(s, &sb))
+            continue;
+        by_role[s->role] = cands[i];
+    }
+    free(sbs);
+
+    int failed = -1, down = 0;
+    blkno_t rebuilt = 0;
+    for (int i = 0; i < sb.ndisks; i++) {
+        if (by_role[i] == NULL) {
+            failed = i;
+            down++;
+        }
+    }
+    if (sb.failed >= 0 && by_role[sb.failed] != NULL) {
+        failed = sb.failed;
+        rebuilt = sb.rebuilt;
+        down++;
+    }
+    if (!geometry_ok(sb.level, sb.ndisks, sb.unit) || sb.vol_failed ||
+        (sb.prev_ndisks != 0 && (sb.prev_ndisks >= sb.ndisks || sb.level == RAID_MIRROR)) ||
+        down > (sb.level == RAID_RAID0 ? 0 : 1)) {
+        printf("Error: too many members missing.\n");
+        return NULL;
+    }
+
+    struct sb_vol *sv = calloc(1, sizeof(*sv));
+    pthread_mutex_init(&sv->lock, NULL);
+    sv->sb = sb;
+    for (int i = 0; i < sb.ndisks; i++)
+        sv->members[i] = member_open(sv, by_role[i]);
+
+    struct blkdev *vol;
+    if (sb.level == RAID_MIRROR)
+        vol = mirror_create(sv->members);
+    else if (sb.level == RAID_RAID0)
+        vol = raid0_create(sb.ndisks, sv->members, sb.unit);
+    else
+        vol = raid4_create(sb.ndisks, sv->members, sb.unit);
+    if (vol == NULL) {
+        for (int i = 0; i < sb.ndisks; i++)
+            member_release(sv->members[i]);
+        return NULL;
+    }
+
+    if (sb.level == RAID_MIRROR) {
+        if (failed >= 0)
+            mirror_set_failed(vol, failed, rebuilt);
+        mirror_set_notify(vol, sb_event, sv);
+    } else if (sb.level == RAID_RAID0) {
+        if (sb.prev_ndisks != 0)
+            raid0_set_reshape(vol, sb.prev_ndisks, sb.reshape_pos, sb.reshape_backup);
+        raid0_set_notify(vol, sb_event, sv);
+    } else {
+        if (failed >= 0)
+            raid4_set_failed(vol, failed, rebuilt);
+        if (sb.prev_ndisks != 0)
+            raid4_set_reshape(vol, sb.prev_ndisks, sb.reshape_pos, sb.reshape_backup);
+        raid4_set_notify(vol, sb_event, sv);
+    }
+
+    /* in use until closed again */
+    pthread_mutex_lock(&sv->lock);
+    sv->sb.failed = failed;
+    sv->sb.rebuilding = failed >= 0 && by_role[failed] != NULL;
+    sv->sb.rebuilt = rebuilt;
+    sv->sb.clean = 0;
+    sb_update(sv);
+    pthread_mutex_unlock(&sv->lock);
+
+    info->level = sb.level;
+    info->ndisks = sb.ndisks;
+    info->unit = sb.unit;
+    info->block_size = sb.block_size;
+    info->uuid = sb.uuid;
+    info->generation = sv->sb.generation;
+    info->failed = failed;
+    info->rebuilt = rebuilt;
+    info->dirty = !sb.clean;
+    info->reshape_from = sb.prev_ndisks;
+    info->reshape_pos = sb.reshape_pos;
+    memset(info->members, 0, sizeof(info->members));
+    memcpy(info->members, by_role, sb.ndisks * sizeof(by_role[0]));
+    return vol;
+}
+
+/* the new disk gets a superblock with the first REBUILD event, and is
+ * current from then on.
+ */
+int raid_replace(struct blkdev *vol, int i, struct blkdev *newdisk)
+{
+    struct sb_vol *sv = sb_vol_of(vol);
+    if (sv == NULL || i < 0 || i >= sv->sb.ndisks)
+        return E_UNAVAIL;
+    struct blkdev *old = sv->members[i], *m = old;
+    if (newdisk != NULL) {
+        if (blkdev_num_blocks(newdisk) - 1 < sv->sb.data_blocks ||
+            blkdev_block_size(newdisk) != sv->sb.block_size)
+            return E_SIZE;
+        m = member_open(sv, newdisk);
+    } else if (((struct member *)old->private)->dev == NULL) {
+        return E_UNAVAIL;
+    }
+
+    int val = E_UNAVAIL;
+    if (sv->sb.level == RAID_MIRROR) {
+        /* the mirror keeps its own array; superblocks go to ours */
+        pthread_mutex_lock(&sv->lock);
+        sv->members[i] = m;
+        pthread_mutex_unlock(&sv->lock);
+        val = mirror_replace(vol, i, m);
+    } else if (sv->sb.level == RAID_RAID4) {
+        val = raid4_replace(vol, i, m);
+    }
+    if (m != old)
+        member_release(sv->members[i] == m ? old : m);
+    return val;
+}
+
+/* raid_replace_fn for hot spares: the member's disk is closed once the
+ * spare has taken its place
+ */
+static int sb_spare_replace(struct blkdev *vol, int i, struct blkdev *newdisk)
+{
+    struct sb_vol *sv = sb_vol_of(vol);
+    if (sv == NULL)
+        return E_SIZE;
+    struct blkdev *old = ((struct member *)sv->members[i]->private)->dev;
+    int val = raid_replace(vol, i, newdisk);
+    pthread_mutex_lock(&sv->lock);
+    int taken = ((struct member *)sv->members[i]->private)->dev == newdisk;
+    pthread_mutex_unlock(&sv->lock);
+    if (!taken)
+        return E_SIZE;
+    if (old != NULL && old != newdisk)
+        blkdev_close(old);
+    return val;
+}
+
+int raid_set_spares(struct blkdev *vol, struct spare_pool *pool)
+{
+    struct sb_vol *sv = sb_vol_of(vol);
+    if (sv == NULL || (sv->sb.level != RAID_MIRROR && sv->sb.level != RAID_RAID4))
+        return E_UNAVAIL;
+    if (sv->sb.level == RAID_MIRROR)
+        mirror_set_spares_fn(vol, pool, sb_spare_replace, sv->sb.data_blocks + 1);
+    else
+        raid4_set_spares_fn(vol, pool, sb_spare_replace, sv->sb.data_blocks + 1);
+    return SUCCESS;
+}
+
+/* the new disks are opened as members straight away, but only get
+ * superblocks - and a role in the volume - when the reshape starts.
+ */
+int raid_reshape(struct blkdev *vol, int n, struct blkdev **newdisks)
+{
+    struct sb_vol *sv = sb_vol_of(vol);
+    if (sv == NULL || (sv->sb.level != RAID_RAID0 && sv->sb.level != RAID_RAID4))
+        return E_UNAVAIL;
+    int nd = sv->sb.ndisks;
+    if (n < 0 || nd + n > RAID_MAX_MEMBERS || (n == 0) != (sv->sb.prev_ndisks != 0))
+        return E_SIZE;
+    for (int i = 0; i < n; i++) {
+        if (blkdev_num_blocks(newdisks[i]) - 1 < sv->sb.data_blocks ||
+            blkdev_block_size(newdisks[i]) != sv->sb.block_size)
+            return E_SIZE;
+    }
+    for (int i = 0; i < n; i++)
+        sv->members[nd + i] = member_open(sv, newdisks[i]);
+
+    int val;
+    if (sv->sb.level == RAID_RAID0)
+        val = raid0_reshape(vol, nd + n, sv->members);
+    else
+        val = raid4_reshape(vol, nd + n, sv->members);
+
+    pthread_mutex_lock(&sv->lock);
+    int started = sv->sb.ndisks == nd + n;
+    pthread_mutex_unlock(&sv->lock);
+    for (int i = 0; i < n && !started; i++) {
+        member_release(sv->members[nd + i]);
+        sv->members[nd + i] = NULL;
+    }
+    return val;
+}
@@ -0,0 +1,254 @@
+/*
+ * file:        trace-replay.c
+ * description: replay a trace recorded by trace_create against a volume
+ *
+ *   trace-replay [volume options] [-f] [-t workers] [-o text|json] [-v] trace
+ *
+ * Requests are issued in their original order, at their original
+ * offsets from the start of the trace, by a pool of worker threads (so
+ * up to 'workers' requests overlap, as they did when recorded). With -f
+ * each worker issues its next request as soon as the last completes.
+ * Requests beyond the end of a smaller volume are wrapped around it.
+ * The report compares replayed latencies with the recorded ones.
+ */
+#include "blkdev.h"
+#include "trace.h"
+#include "volspec.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+struct replay {
+	struct blkdev *vol;
+	struct volspec *spec;
+	struct trace_rec *recs;
+	int nrecs;
+	blkno_t nblks;
+	int bsize;
+	int fast;
+	int maxlen;
+	long long start;
+	int next;                       /* next record to issue */
+	long long *lat;                 /* replayed latency, per record */
+	int *result;
+	int wrapped;
+	pthread_mutex_t vol_lock;
+};
+
+static long long now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void sleep_until(long long t)
+{
+	struct timespec ts = {t / 1000000000LL, t % 1000000000LL};
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0)
+		;
+}
+
+static void *replay_thread(void *arg)
+{
+	struct replay *r = arg;
+	char *buf = malloc((size_t)r->maxlen * r->bsize);
+	memset(buf, 0x5a, (size_t)r->maxlen * r->bsize);
+
+	while (1) {
+		int i = __atomic_fetch_add(&r->next, 1, __ATOMIC_RELAXED);
+		if (i >= r->nrecs)
+			break;
+		struct trace_rec *rec = &r->recs[i];
+		if (rec->len < 1 || rec->len > r->nblks) {
+			r->result[i] = E_BADADDR;
+			continue;
+		}
+		blkno_t lba = rec->lba;
+		if (lba < 0 || lba + rec->len > r->nblks) {
+			lba = (lba < 0 ? -lba : lba) % (r->nblks - rec->len + 1);
+			__atomic_fetch_add(&r->wrapped, 1, __ATOMIC_RELAXED);
+		}
+		if (!r->fast)
+			sleep_until(r->start + rec->ts);
+
+		long long t0 = now_ns();
+		if (r->spec->serialize)
+			pthread_mutex_lock(&r->vol_lock);
+		if (rec->op == TRACE_DISCARD)
+			r->result[i] = blkdev_discard(r->vol, lba, rec->len);
+		else
+			r->result[i] = rec->op == BLKDEV_WRITE ?
+				blkdev_write(r->vol, lba, rec->len, buf) :
+				blkdev_read(r->vol, lba, rec->len, buf);
+		if (r->spec->serialize)
+			pthread_mutex_unlock(&r->vol_lock);
+		r->lat[i] = now_ns() - t0;
+	}
+	free(buf);
+	return NULL;
+}
+
+static int cmp_ll(const void *a, const void *b)
+{
+	long long x = *(const long long *)a, y = *(const long long *)b;
+	return (x > y) - (x < y);
+}
+
+struct lat_summary {
+	long long ops, errors;
+	long long p50, p99, max;
+};
+
+/* latencies of successful ops of one direction; 'replayed' picks
+ * the new latencies, otherwise the recorded ones
+ */
+static void summarize(struct replay *r, int op, int replayed, struct lat_summary *s)
+{
+	long long *v = malloc((r->nrecs + 1) * sizeof(long long));
+	memset(s, 0, sizeof(*s));
+	for (int i = 0; i < r->nrecs; i++) {
+		if (r->recs[i].op != op)
+			continue;
+		int res = replayed ? r->result[i] : r->recs[i].result;
+		if (res != SUCCESS) {
+			s->errors++;
+			continue;
+		}
+		v[s->ops++] = replayed ? r->lat[i] : r->recs[i].lat;
+	}
+	if (s->ops > 0) {
+		qsort(v, s->ops, sizeof(long long), cmp_ll);
+		s->p50 = v[s->ops * 50 / 100];
+		s->p99 = v[s->ops * 99 / 100];
+		s->max = v[s->ops - 1];
+	}
+	free(v);
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: trace-replay " VOLSPEC_USAGE "\n"
+		"       [-f] [-t workers] [-o text|json] [-v] trace\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct volspec spec;
+	struct replay r = {0};
+	int workers = 16, json = 0, verbose = 0;
+	volspec_init(&spec, "replay_disk");
+	spec.block_size = 0;            /* the trace's, unless given */
+
+	int c;
+	while ((c = getopt(argc, argv, VOLSPEC_OPTS "ft:o:v")) != -1) {
+		if (volspec_option(&spec, c, optarg))
+			continue;
+		switch (c) {
+		case 'f': r.fast = 1; break;
+		case 't': workers = atoi(optarg); break;
+		case 'o': json = strcmp(optarg, "json") == 0; break;
+		case 'v': verbose = 1; break;
+		default: usage();
+		}
+	}
+	if (optind != argc - 1 || workers < 1)
+		usage();
+
+	blkno_t trace_nblks;
+	int trace_bsize;
+	r.recs = trace_load(argv[optind], &r.nrecs, &trace_nblks, &trace_bsize);
+	if (r.recs == NULL)
+		return 1;
+	/* LBAs and lengths are in the traced device's blocks */
+	if (spec.block_size == 0)
+		spec.block_size = trace_bsize;
+	if (spec.block_size != trace_bsize) {
+		printf("Error: trace has %d-byte blocks, not %d.\n", trace_bsize, spec.block_size);
+		return 1;
+	}
+	r.vol = volspec_build(&spec);
+	if (r.vol == NULL)
+		return 1;
+	r.spec = &spec;
+	r.nblks = blkdev_num_blocks(r.vol);
+	r.bsize = blkdev_block_size(r.vol);
+	r.lat = calloc(r.nrecs + 1, sizeof(long long));
+	r.result = calloc(r.nrecs + 1, sizeof(int));
+	r.maxlen = 1;
+	for (int i = 0; i < r.nrecs; i++) {
+		if (r.recs[i].op != TRACE_DISCARD && r.recs[i].len > r.maxlen &&
+		    r.recs[i].len <= r.nblks)
+			r.maxlen = r.recs[i].len;
+	}
+	pthread_mutex_init(&r.vol_lock, NULL);
+
+	pthread_t threads[workers];
+	r.start = now_ns();
+	for (int i = 0; i < workers; i++)
+		pthread_create(&threads[i], NULL, replay_thread, &r);
+	for (int i = 0; i < workers; i++)
+		pthread_join(threads[i], NULL);
+	double secs = (now_ns() - r.start) / 1e9;
+	double orig_secs = r.nrecs ?
+		(r.recs[r.nrecs - 1].ts + r.recs[r.nrecs - 1].lat) / 1e9 : 0;
+
+	struct lat_summary s[2][2];     /* [op][recorded, replayed] */
+	for (int op = BLKDEV_READ; op <= BLKDEV_WRITE; op++) {
+		summarize(&r, op, 0, &s[op][0]);
+		summarize(&r, op, 1, &s[op][1]);
+	}
+
+	char *names[2] = {"read", "write"};
+	if (json) {
+		printf("{\n  \"trace\": \"%s\", \"records\": %d, \"trace_blocks\": %lld,\n",
+		       argv[optind], r.nrecs, trace_nblks);
+		printf("  \"level\": \"%s\", \"disks\": %d, \"unit\": %d, "
+		       "\"volume_blocks\": %lld, \"fast\": %d, \"workers\": %d,\n",
+		       spec.level, spec.ndisks, spec.unit, r.nblks, r.fast, workers);
+		printf("  \"seconds\": %.3f, \"recorded_seconds\": %.3f, \"wrapped\": %d",
+		       secs, orig_secs, r.wrapped);
+		for (int op = BLKDEV_READ; op <= BLKDEV_WRITE; op++) {
+			printf(",\n  \"%s\": {", names[op]);
+			for (int k = 0; k < 2; k++)
+				printf("%s\"%s\": {\"ops\": %lld, \"errors\": %lld, \"p50_us\": %.1f, "
+				       "\"p99_us\": %.1f, \"max_us\": %.1f}", k ? ", " : "",
+				       k ? "replayed" : "recorded", s[op][k].ops, s[op][k].errors,
+				       s[op][k].p50 / 1e3, s[op][k].p99 / 1e3, s[op][k].max / 1e3);
+			printf("}");
+		}
+		printf("\n}\n");
+	} else {
+		printf("%s: %d records (%lld block device), %.2f s recorded\n",
+		       argv[optind], r.nrecs, trace_nblks, orig_secs);
+		printf("%s: %d disks x %lld blocks, unit %d, %lld block volume\n",
+		       spec.level, spec.ndisks, spec.disk_blocks, spec.unit, r.nblks);
+		printf("replayed %s with %d workers in %.2f s (%.0f iops), %d wrapped\n",
+		       r.fast ? "as fast as possible" : "with recorded timing",
+		       workers, secs, secs > 0 ? r.nrecs / secs : 0, r.wrapped);
+		for (int op = BLKDEV_READ; op <= BLKDEV_WRITE; op++) {
+			for (int k = 0; k < 2; k++) {
+				if (s[op][0].ops + s[op][0].errors == 0)
+					continue;
+				printf("%-6s %-8s ops %lld  errors %lld  lat (us) p50 %.1f  p99 %.1f  max %.1f\n",
+				       k ? "" : names[op], k ? "replayed" : "recorded",
+				       s[op][k].ops, s[op][k].errors, s[op][k].p50 / 1e3,
+				       s[op][k].p99 / 1e3, s[op][k].max / 1e3);
+			}
+		}
+		if (verbose) {
+			printf("\n");
+			blkdev_stats_print(r.vol);
+		}
+	}
+
+	blkdev_close(r.vol);
+	free(r.recs);
+	free(r.lat);
+	free(r.result);
+	return 0;
+}
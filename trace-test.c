@@ -0,0 +1,71 @@
+#include "blkdev.h"
+#include "trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+
+struct blkdev *  create_new_image(char * path, int blocks){
+    if (blocks < 1){
+        printf("create_new_image: error - blocks must be at least 1: %d\n", blocks);
+        return NULL;
+    }
+    FILE * image = fopen(path, "w");
+    fseek(image, blocks * BLOCK_SIZE - 1, SEEK_SET);
+    char c = 0;
+    fwrite(&c, 1, 1, image);
+    fclose(image);
+
+    return image_create(path);
+}
+
+#define NOPS 10000
+
+int main(){
+	struct blkdev *drives[4];
+	char name[16];
+	for (int j = 0; j < 4; j++){
+		sprintf(name, "trace_r4_%d", j);
+		drives[j] = create_new_image(name, 32);
+	}
+	struct blkdev *raid4 = raid4_create(4, drives, 4);
+	struct blkdev *dev = trace_create(raid4, "trace_out");
+	assert(dev != NULL);
+	assert(blkdev_num_blocks(dev) == 96);
+
+	/* more requests than one trace buffer holds */
+	int lba[NOPS], len[NOPS], op[NOPS];
+	char buf[8*BLOCK_SIZE];
+	memset(buf, 'T', sizeof(buf));
+	srand(5600);
+	for (int i = 0; i < NOPS; i++) {
+		len[i] = rand() % 8 + 1;
+		lba[i] = rand() % (96 - len[i] + 1);
+		op[i] = rand() % 3 == 0 ? BLKDEV_WRITE : BLKDEV_READ;
+		int val = op[i] == BLKDEV_WRITE ?
+			blkdev_write(dev, lba[i], len[i], buf) :
+			blkdev_read(dev, lba[i], len[i], buf);
+		assert(val == SUCCESS);
+	}
+	/* a failed request is recorded with its error */
+	assert(blkdev_read(dev, 95, 2, buf) == E_BADADDR);
+	blkdev_close(dev);
+
+	int nrecs, bsize;
+	blkno_t nblks;
+	struct trace_rec *recs = trace_load("trace_out", &nrecs, &nblks, &bsize);
+	assert(recs != NULL);
+	assert(nrecs == NOPS + 1 && nblks == 96 && bsize == BLOCK_SIZE);
+	for (int i = 0; i < NOPS; i++) {
+		assert(recs[i].lba == lba[i] && recs[i].len == len[i]);
+		assert(recs[i].op == op[i] && recs[i].result == SUCCESS);
+		if (i > 0)
+			assert(recs[i].ts >= recs[i-1].ts + recs[i-1].lat);
+	}
+	assert(recs[NOPS].lba == 95 && recs[NOPS].result == E_BADADDR);
+	free(recs);
+	printf("trace record test passed\n");
+
+	printf("trace tests passed.\n");
+}
@@ -0,0 +1,3 @@
+#!/bin/sh
+
+gcc -g3 -o trace-test trace-test.c image.c homework.c journal.c trace.c -lpthread
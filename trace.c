@@ -0,0 +1,262 @@
+/*
+ * file:        trace.c
+ * description: tracing blkdev wrapper - records every read and write
+ *              of the device underneath it to a trace file
+ *
+ * Records go into one of two in-memory buffers; when a buffer fills
+ * it is handed to a writer thread and the other buffer takes over, so
+ * the traced request only pays for a timestamp and a short critical
+ * section. Requests are only held up if the writer falls a whole
+ * buffer behind; records are never dropped.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include "trace.h"
+
+#define TRACE_BUF_RECS 4096
+
+struct trace_dev {
+    struct blkdev *dev;
+    FILE *fp;
+    long long start;
+    struct trace_rec *buf[2];
+    int cur;                    /* buffer being filled */
+    int n;                      /* records in buf[cur] */
+    int full;                   /* records in buf[1-cur] to write, or 0 */
+    int stop;
+    int error;
+    pthread_t writer;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+static long long trace_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void *trace_writer(void *arg)
+{
+    struct trace_dev *t = arg;
+    pthread_mutex_lock(&t->lock);
+    while (1) {
+        while (t->full == 0 && !t->stop)
+            pthread_cond_wait(&t->cond, &t->lock);
+        if (t->full == 0)
+            break;
+        struct trace_rec *b = t->buf[1 - t->cur];
+        int n = t->full;
+        pthread_mutex_unlock(&t->lock);
+        int ok = fwrite(b, sizeof(*b), n, t->fp) == (size_t)n;
+        pthread_mutex_lock(&t->lock);
+        if (!ok)
+            t->error = 1;
+        t->full = 0;
+        pthread_cond_broadcast(&t->cond);
+    }
+    pthread_mutex_unlock(&t->lock);
+    return NULL;
+}
+
+static void trace_add(struct trace_dev *t, int op, blkno_t lba, blkno_t len,
+                      int val, long long start)
+{
+    long long lat = trace_now() - start;
+    pthread_mutex_lock(&t->lock);
+    if (t->n == TRACE_BUF_RECS) {
+        while (t->full != 0)
+            pthread_cond_wait(&t->cond, &t->lock);
+        t->full = t->n;
+        t->cur = 1 - t->cur;
+        t->n = 0;
+        pthread_cond_broadcast(&t->cond);
+    }
+    struct trace_rec *r = &t->buf[t->cur][t->n++];
+    r->ts = start - t->start;
+    r->lat = lat > 0xffffffffLL ? 0xffffffffu : (unsigned int)lat;
+    r->lba = lba;
+    r->len = len;
+    r->op = op;
+    r->result = val;
+    r->pad = 0;
+    pthread_mutex_unlock(&t->lock);
+}
+
+static blkno_t trace_num_blocks(struct blkdev *dev)
+{
+    struct trace_dev *t = dev->private;
+    return blkdev_num_blocks(t->dev);
+}
+
+static int trace_block_size(struct blkdev *dev)
+{
+    struct trace_dev *t = dev->private;
+    return blkdev_block_size(t->dev);
+}
+
+static int trace_read(struct blkdev *dev, blkno_t first_blk, int num_blks, void *buf)
+{
+    struct trace_dev *t = dev->private;
+    long long start = trace_now();
+    int val = blkdev_read(t->dev, first_blk, num_blks, buf);
+    trace_add(t, BLKDEV_READ, first_blk, num_blks, val, start);
+    return val;
+}
+
+static int trace_write(struct blkdev *dev, blkno_t first_blk, int num_blks, void *buf)
+{
+    struct trace_dev *t = dev->private;
+    long long start = trace_now();
+    int val = blkdev_write(t->dev, first_blk, num_blks, buf);
+    trace_add(t, BLKDEV_WRITE, first_blk, num_blks, val, start);
+    return val;
+}
+
+static int trace_discard(struct blkdev *dev, blkno_t first_blk, blkno_t num_blks)
+{
+    struct trace_dev *t = dev->private;
+    long long start = trace_now();
+    int val = blkdev_discard(t->dev, first_blk, num_blks);
+    trace_add(t, TRACE_DISCARD, first_blk, num_blks, val, start);
+    return val;
+}
+
+static blkno_t trace_next_data(struct blkdev *dev, blkno_t first_blk)
+{
+    struct trace_dev *t = dev->private;
+    return blkdev_next_data(t->dev, first_blk);
+}
+
+/* write out everything recorded, then close the trace file and the
+ * device underneath.
+ */
+static void trace_close(struct blkdev *dev)
+{
+    struct trace_dev *t = dev->private;
+    pthread_mutex_lock(&t->lock);
+    while (t->full != 0)
+        pthread_cond_wait(&t->cond, &t->lock);
+    if (t->n > 0) {
+        t->full = t->n;
+        t->cur = 1 - t->cur;
+        t->n = 0;
+    }
+    t->stop = 1;
+    pthread_cond_broadcast(&t->cond);
+    pthread_mutex_unlock(&t->lock);
+    pthread_join(t->writer, NULL);
+
+    if (fclose(t->fp) != 0 || t->error)
+        fprintf(stderr, "trace: error writing trace file\n");
+    blkdev_close(t->dev);
+    pthread_mutex_destroy(&t->lock);
+    pthread_cond_destroy(&t->cond);
+    free(t->buf[0]);
+    free(t->buf[1]);
+    free(t);
+    dev->private = NULL;
+    free(dev);
+}
+
+static int trace_members(struct blkdev *dev, struct blkdev **out, int max)
+{
+    struct trace_dev *t = dev->private;
+    if (max < 1)
+        return 0;
+    out[0] = t->dev;
+    return 1;
+}
+
+struct blkdev_ops trace_ops = {
+    .num_blocks = trace_num_blocks,
+    .read = trace_read,
+    .write = trace_write,
+    .close = trace_close,
+    .members = trace_members,
+    .type = "trace",
+    .discard = trace_discard,
+    .next_data = trace_next_data,
+    .block_size = trace_block_size
+};
+
+/* trace all requests to 'dev' into the file 'path' (replacing it).
+ * Closing the trace device closes 'dev' too.
+ */
+struct blkdev *trace_create(struct blkdev *dev, char *path)
+{
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL) {
+        printf("Error: can't create trace file %s.\n", path);
+        return NULL;
+    }
+    struct trace_header h = {
+        .magic = TRACE_MAGIC,
+        .version = TRACE_VERSION,
+        .nblks = blkdev_num_blocks(dev),
+        .block_size = blkdev_block_size(dev),
+        .rec_size = sizeof(struct trace_rec),
+    };
+    if (fwrite(&h, sizeof(h), 1, fp) != 1) {
+        printf("Error: can't write trace file %s.\n", path);
+        fclose(fp);
+        return NULL;
+    }
+
+    struct blkdev *tdev = calloc(1, sizeof(*tdev));
+    struct trace_dev *t = calloc(1, sizeof(*t));
+    t->dev = dev;
+    t->fp = fp;
+    t->buf[0] = malloc(TRACE_BUF_RECS * sizeof(struct trace_rec));
+    t->buf[1] = malloc(TRACE_BUF_RECS * sizeof(struct trace_rec));
+    pthread_mutex_init(&t->lock, NULL);
+    pthread_cond_init(&t->cond, NULL);
+    t->start = trace_now();
+    pthread_create(&t->writer, NULL, trace_writer, t);
+
+    tdev->private = t;
+    tdev->ops = &trace_ops;
+    return tdev;
+}
+
+static int cmp_ts(const void *a, const void *b)
+{
+    const struct trace_rec *x = a, *y = b;
+    return (x->ts > y->ts) - (x->ts < y->ts);
+}
+
+struct trace_rec *trace_load(char *path, int *nrecs, blkno_t *nblks, int *block_size)
+{
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        printf("Error: can't open trace file %s.\n", path);
+        return NULL;
+    }
+    struct trace_header h;
+    if (fread(&h, sizeof(h), 1, fp) != 1 || h.magic != TRACE_MAGIC ||
+        h.version != TRACE_VERSION || h.rec_size != sizeof(struct trace_rec)) {
+        printf("Error: %s is not a trace file.\n", path);
+        fclose(fp);
+        return NULL;
+    }
+
+    int size = 1024, n = 0;
+    struct trace_rec *recs = malloc(size * sizeof(*recs));
+    while (fread(&recs[n], sizeof(*recs), 1, fp) == 1) {
+        if (++n == size) {
+            size *= 2;
+            recs = realloc(recs, size * sizeof(*recs));
+        }
+    }
+    fclose(fp);
+    qsort(recs, n, sizeof(*recs), cmp_ts);
+    *nrecs = n;
+    *nblks = h.nblks;
+    *block_size = h.block_size;
+    return recs;
+}
@@ -0,0 +1,40 @@
+/*
+ * file:        trace.h
+ * description: on-disk format of blkdev I/O traces (see trace.c)
+ */
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include "blkdev.h"
+
+#define TRACE_MAGIC    0x42545243
+#define TRACE_VERSION  3        /* 2: 64-bit block numbers, 3: block size */
+
+struct trace_header {
+    int magic;
+    int version;
+    int rec_size;               /* sizeof(struct trace_rec) */
+    int block_size;             /* of the traced device */
+    long long nblks;            /* size of the traced device */
+};
+
+#define TRACE_DISCARD  2
+
+/* one request. The file holds them in completion order. */
+struct trace_rec {
+    long long ts;               /* ns since the trace started */
+    long long lba;
+    long long len;
+    unsigned int lat;           /* ns, saturating */
+    signed char op;             /* BLKDEV_READ, BLKDEV_WRITE or TRACE_DISCARD */
+    signed char result;         /* SUCCESS or an error code */
+    short pad;
+};
+
+/* Read a whole trace file. Returns a malloc'd array of '*nrecs'
+ * records, sorted into issue order, and sets '*nblks' and '*block_size'
+ * to the traced device's size and block size, or returns NULL on error.
+ */
+extern struct trace_rec *trace_load(char *path, int *nrecs, blkno_t *nblks, int *block_size);
+
+#endif
@@ -0,0 +1,186 @@
+/*
+ * file:        volspec.c
+ * description: build a volume over image files from command-line options
+ *
+ * cache and logdev stack on a raid4 volume of the given disks. With
+ * -R the members are RAM disks, optionally with a service time model
+ * (-M) and one slow member (-Z). -E puts a request queue (elevator.c)
+ * in front of the volume; a volume that is not thread safe gets a
+ * single dispatcher, and callers no longer need to serialize. With -C
+ * every member keeps a checksum of each block (integrity.c), so the
+ * volume repairs blocks that come back corrupt. -z stores the volume
+ * compressed (compress.c) in chunks of the given number of blocks.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "volspec.h"
+
+void volspec_init(struct volspec *v, char *prefix)
+{
+	memset(v, 0, sizeof(*v));
+	v->level = "raid4";
+	v->ndisks = 5;
+	v->disk_blocks = 8192;
+	v->unit = 16;
+	v->width = 4;
+	v->block_size = BLOCK_SIZE;
+	v->prefix = prefix;
+	v->slow_disk = -1;
+}
+
+/* "dist,lat_us[,jitter_us[,mbps]]" */
+static int parse_model(struct ramdisk_model *m, char *arg)
+{
+	char dist[16];
+	int n = sscanf(arg, "%15[a-z],%d,%d,%d", dist, &m->lat_us, &m->jitter_us, &m->mbps);
+	if (n < 2)
+		return 0;
+	if (strcmp(dist, "fixed") == 0)
+		m->dist = RAMDISK_FIXED;
+	else if (strcmp(dist, "uniform") == 0)
+		m->dist = RAMDISK_UNIFORM;
+	else if (strcmp(dist, "exp") == 0)
+		m->dist = RAMDISK_EXP;
+	else
+		return 0;
+	return 1;
+}
+
+int volspec_option(struct volspec *v, int c, char *arg)
+{
+	switch (c) {
+	case 'l': v->level = arg; break;
+	case 'n': v->ndisks = atoi(arg); break;
+	case 's': v->disk_blocks = atoll(arg); break;
+	case 'u': v->unit = atoi(arg); break;
+	case 'B': v->block_size = atoi(arg); break;
+	case 'W': v->width = atoi(arg); break;
+	case 'p': v->prefix = arg; break;
+	case 'r': v->reuse = 1; break;
+	case 'R': v->ram = 1; break;
+	case 'C': v->checksum = 1; break;
+	case 'z': v->compress = atoi(arg); break;
+	case 'M':
+		if (!parse_model(&v->model, arg)) {
+			fprintf(stderr, "bad model %s\n", arg);
+			exit(1);
+		}
+		break;
+	case 'E': v->elevator = atoi(arg); break;
+	case 'Z':
+		if (sscanf(arg, "%d,%d", &v->slow_disk, &v->slow_us) != 2) {
+			fprintf(stderr, "bad slow disk %s\n", arg);
+			exit(1);
+		}
+		break;
+	default: return 0;
+	}
+	return 1;
+}
+
+struct blkdev *create_new_image(char *path, blkno_t blocks, int block_size)
+{
+	FILE *image = fopen(path, "w");
+	if (image == NULL) {
+		perror(path);
+		return NULL;
+	}
+	fseek(image, (long)blocks * block_size - 1, SEEK_SET);
+	char c = 0;
+	fwrite(&c, 1, 1, image);
+	fclose(image);
+	return image_create_bs(path, block_size);
+}
+
+/* a member device: a RAM disk with the volume's model, or an image.
+ * 'i' is the member index, or -1 for the cache device.
+ */
+static struct blkdev *open_member(struct volspec *v, char *name, blkno_t blocks, int i)
+{
+	if (!v->ram)
+		return v->reuse ? image_create_bs(name, v->block_size) :
+			create_new_image(name, blocks, v->block_size);
+
+	struct blkdev *d = ramdisk_create_bs(blocks, v->block_size);
+	if (d == NULL || i < 0)         /* the cache device stays fast */
+		return d;
+	struct ramdisk_model m = v->model;
+	m.seed = 5600 + i;
+	if (i == v->slow_disk) {
+		if (m.dist == RAMDISK_NONE)
+			m.dist = RAMDISK_FIXED;
+		m.lat_us += v->slow_us;
+	}
+	ramdisk_set_model(d, &m);
+	return d;
+}
+
+void volspec_fail(struct volspec *v, int i)
+{
+	if (v->ram)
+		ramdisk_fail(v->disks[i]);
+	else
+		image_fail(v->disks[i]);
+}
+
+static struct blkdev *build_volume(struct volspec *v)
+{
+	char name[256];
+	if (strcmp(v->level, "mirror") == 0)
+		v->ndisks = 2;
+	if (v->ndisks < 2 || v->ndisks > VOLSPEC_MAX_DISKS ||
+	    v->disk_blocks < 1 || v->unit < 1 || !blkdev_block_size_ok(v->block_size)) {
+		printf("Error: bad volume geometry.\n");
+		return NULL;
+	}
+
+	for (int i = 0; i < v->ndisks; i++) {
+		snprintf(name, sizeof(name), "%s%d", v->prefix, i);
+		v->disks[i] = open_member(v, name, v->disk_blocks, i);
+		if (v->disks[i] == NULL)
+			return NULL;
+		v->members[i] = v->checksum ? integrity_create(v->disks[i]) : v->disks[i];
+		if (v->members[i] == NULL)
+			return NULL;
+	}
+
+	if (strcmp(v->level, "mirror") == 0)
+		return mirror_create(v->members);
+	if (strcmp(v->level, "raid0") == 0)
+		return raid0_create(v->ndisks, v->members, v->unit);
+	if (strcmp(v->level, "draid") == 0)
+		return draid_create(v->ndisks, v->members, v->width, v->unit);
+
+	struct blkdev *raid4 = raid4_create(v->ndisks, v->members, v->unit);
+	if (raid4 == NULL || strcmp(v->level, "raid4") == 0)
+		return raid4;
+
+	int stripe = v->unit * (v->ndisks - 1);
+	if (strcmp(v->level, "cache") == 0) {
+		snprintf(name, sizeof(name), "%sssd", v->prefix);
+		blkno_t ssd_blocks = blkdev_num_blocks(raid4) / 8 + 2;
+		struct blkdev *ssd = open_member(v, name, ssd_blocks, -1);
+		if (ssd == NULL)
+			return NULL;
+		v->serialize = 1;
+		return cache_create(ssd, raid4, stripe);
+	}
+	if (strcmp(v->level, "logdev") == 0)
+		return logdev_create(raid4, stripe);
+
+	printf("Error: unknown level %s.\n", v->level);
+	return NULL;
+}
+
+struct blkdev *volspec_build(struct volspec *v)
+{
+	struct blkdev *vol = build_volume(v);
+	if (vol != NULL && v->compress > 0)
+		vol = compress_create(vol, v->compress);
+	if (vol == NULL || v->elevator <= 0)
+		return vol;
+	struct elevator_opts eo = {.nr_dispatch = v->serialize ? 1 : v->elevator};
+	v->serialize = 0;
+	return elevator_create(vol, &eo);
+}
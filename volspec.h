@@ -0,0 +1,53 @@
+/*
+ * file:        volspec.h
+ * description: build a volume over image files from command-line options,
+ *              shared by the benchmark and replay tools
+ */
+#ifndef __VOLSPEC_H__
+#define __VOLSPEC_H__
+
+#include "blkdev.h"
+
+#define VOLSPEC_MAX_DISKS 64
+
+/* getopt letters handled by volspec_option */
+#define VOLSPEC_OPTS "l:n:s:u:p:rRM:Z:E:B:W:Cz:"
+#define VOLSPEC_USAGE "[-l mirror|raid0|raid4|draid|cache|logdev] [-n disks]\n" \
+	"       [-s blocks per disk] [-u unit] [-B block size] [-W draid width]\n" \
+	"       [-p image prefix] [-r] [-C] [-z compress chunk]\n" \
+	"       [-R] [-M fixed|uniform|exp,lat_us[,jitter_us[,mbps]]] [-Z disk,lat_us]\n" \
+	"       [-E dispatchers]"
+
+struct volspec {
+	char *level;
+	int ndisks;
+	blkno_t disk_blocks;
+	int unit;
+	int width;                      /* draid stripe width */
+	int block_size;                 /* bytes per block of every member */
+	char *prefix;
+	int reuse;                      /* open existing images */
+	int ram;                        /* RAM disks instead of images */
+	struct ramdisk_model model;     /* for every RAM disk member */
+	int slow_disk;                  /* member with extra latency, or -1 */
+	int slow_us;
+	int elevator;                   /* request queue dispatchers, or 0 */
+	int serialize;                  /* set if the volume is not thread safe */
+	int checksum;                   /* members checksum their blocks */
+	int compress;                   /* compressed chunk size in blocks, or 0 */
+	struct blkdev *disks[VOLSPEC_MAX_DISKS];
+	struct blkdev *members[VOLSPEC_MAX_DISKS];  /* what the volume is built on */
+};
+
+/* defaults: raid4 of 5 disks x 8192 blocks, unit 16 (draid width 4) */
+extern void volspec_init(struct volspec *v, char *prefix);
+/* handle one option; returns 0 if 'c' is not a volspec option */
+extern int volspec_option(struct volspec *v, int c, char *arg);
+/* create (or open) the images and build the volume, or return NULL */
+extern struct blkdev *volspec_build(struct volspec *v);
+/* fail member 'i' of a built volume */
+extern void volspec_fail(struct volspec *v, int i);
+/* create a zero-filled image file of 'blocks' blocks and open it */
+extern struct blkdev *create_new_image(char *path, blkno_t blocks, int block_size);
+
+#endif